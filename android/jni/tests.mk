@@ -54,3 +54,21 @@ LOCAL_STATIC_LIBRARIES += testlib
 LOCAL_MODULE:= stress
 
 include $(BUILD_EXECUTABLE)
+
+
+# benchmark
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+  $(LIBUSB_ROOT_REL)/tests/benchmark.c
+
+LOCAL_C_INCLUDES += \
+  $(LIBUSB_ROOT_ABS)
+
+LOCAL_SHARED_LIBRARIES += libusb1.0
+LOCAL_STATIC_LIBRARIES += testlib
+
+LOCAL_MODULE:= benchmark
+
+include $(BUILD_EXECUTABLE)
@@ -25,6 +25,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
 
 #include "libusb.h"
 #include "ezusb.h"
@@ -49,6 +54,24 @@ extern void logerror(const char *format, ...)
 
 int verbose = 1;
 
+/* wall clock in seconds, to report upload throughput */
+static double ezusb_time(void)
+{
+#if defined(_WIN32)
+	/* GetTickCount() only has a resolution of 10 to 16 ms */
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
 /*
  * return true if [addr,addr+len] includes external RAM
  * for Anchorchips EZ-USB or Cypress EZ-USB FX
@@ -119,29 +142,6 @@ static bool fx2lp_is_external(uint32_t addr, size_t len)
 #define RW_INTERNAL     0xA0	/* hardware implements this one */
 #define RW_MEMORY       0xA3
 
-/*
- * Issues the specified vendor-specific write request.
- */
-static int ezusb_write(libusb_device_handle *device, const char *label,
-	uint8_t opcode, uint32_t addr, const unsigned char *data, size_t len)
-{
-	int status;
-
-	if (verbose > 1)
-		logerror("%s, addr 0x%08x len %4u (0x%04x)\n", label, addr, (unsigned)len, (unsigned)len);
-	status = libusb_control_transfer(device,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-		opcode, addr & 0xFFFF, addr >> 16,
-		(unsigned char*)data, (uint16_t)len, 1000);
-	if (status != len) {
-		if (status < 0)
-			logerror("%s: %s\n", label, libusb_error_name(status));
-		else
-			logerror("%s ==> %d\n", label, status);
-	}
-	return (status < 0) ? -EIO : 0;
-}
-
 /*
  * Issues the specified vendor-specific read request.
  */
@@ -494,20 +494,93 @@ typedef enum {
 	skip_external		/* second phase, second-stage loader */
 } ram_mode;
 
+/*
+ * Segments are not written one request at a time: ram_poke() merges the
+ * contiguous ones into requests of up to RAM_WRITE_MAX bytes and queues them,
+ * and ram_flush() hands the queue to libusb_control_write_vec(). That one
+ * keeps several requests in flight, so the device does not sit idle while
+ * each round-trip completes.
+ */
+#define RAM_WRITE_MAX		4096
+#define RAM_WRITE_QUEUE		32
+
 struct ram_poke_context {
 	libusb_device_handle *device;
 	ram_mode mode;
 	size_t total, count;
+	/* queued requests, request i uses data + i * RAM_WRITE_MAX */
+	struct libusb_control_write writes[RAM_WRITE_QUEUE];
+	unsigned char *data;
+	int queued;
+	/* requests performed and time spent performing them */
+	size_t requests;
+	double elapsed;
 };
 
 #define RETRY_LIMIT 5
 
+/* address of the first byte after a queued request */
+static uint32_t ram_write_end(const struct libusb_control_write *write)
+{
+	return (((uint32_t)write->wIndex << 16) | write->wValue) + write->wLength;
+}
+
+static int ram_flush(struct ram_poke_context *ctx)
+{
+	const struct libusb_control_write *write;
+	double start;
+	unsigned retry = 0;
+	int first = 0, completed, i, rc = 0;
+
+	if (ctx->queued == 0)
+		return 0;
+
+	if (verbose > 1) {
+		for (i = 0; i < ctx->queued; i++) {
+			write = &ctx->writes[i];
+			logerror("%s, addr 0x%08x len %4u (0x%04x)\n",
+				(write->bRequest == RW_MEMORY) ? "write external" : "write on-chip",
+				((uint32_t)write->wIndex << 16) | write->wValue,
+				write->wLength, write->wLength);
+		}
+	}
+
+	/* Retry this till we get a real error. Control messages are not
+	 * NAKed (just dropped) so time out means is a real problem.
+	 */
+	start = ezusb_time();
+	while (first < ctx->queued) {
+		rc = libusb_control_write_vec(ctx->device, ctx->writes + first,
+			ctx->queued - first, &completed, 1000);
+		first += completed;
+		if ((rc != LIBUSB_ERROR_TIMEOUT) || (retry++ >= RETRY_LIMIT))
+			break;
+	}
+	ctx->elapsed += ezusb_time() - start;
+	ctx->requests += first;
+
+	if (rc < 0) {
+		write = &ctx->writes[first];
+		logerror("%s, addr 0x%08x: %s\n",
+			(write->bRequest == RW_MEMORY) ? "write external" : "write on-chip",
+			((uint32_t)write->wIndex << 16) | write->wValue, libusb_error_name(rc));
+	} else if (verbose > 1) {
+		logerror("... %u requests, %u bytes written so far\n",
+			(unsigned)ctx->requests, (unsigned)ctx->total);
+	}
+
+	ctx->queued = 0;
+	return (rc < 0) ? -EIO : 0;
+}
+
 static int ram_poke(void *context, uint32_t addr, bool external,
 	const unsigned char *data, size_t len)
 {
 	struct ram_poke_context *ctx = (struct ram_poke_context*)context;
+	struct libusb_control_write *write;
+	uint8_t opcode = external ? RW_MEMORY : RW_INTERNAL;
+	size_t chunk;
 	int rc;
-	unsigned retry = 0;
 
 	switch (ctx->mode) {
 	case internal_only:		/* CPU should be stopped */
@@ -544,19 +617,70 @@ static int ram_poke(void *context, uint32_t addr, bool external,
 	ctx->total += len;
 	ctx->count++;
 
-	/* Retry this till we get a real error. Control messages are not
-	 * NAKed (just dropped) so time out means is a real problem.
-	 */
-	while ((rc = ezusb_write(ctx->device,
-		external ? "write external" : "write on-chip",
-		external ? RW_MEMORY : RW_INTERNAL,
-		addr, data, len)) < 0
-		&& retry < RETRY_LIMIT) {
-		if (rc != LIBUSB_ERROR_TIMEOUT)
-			break;
-		retry += 1;
+	while (len > 0) {
+		write = (ctx->queued != 0) ? &ctx->writes[ctx->queued - 1] : NULL;
+		if ((write == NULL) || (write->bRequest != opcode)
+			|| (ram_write_end(write) != addr) || (write->wLength == RAM_WRITE_MAX)) {
+			/* start a new request */
+			if (ctx->queued == RAM_WRITE_QUEUE) {
+				rc = ram_flush(ctx);
+				if (rc < 0)
+					return rc;
+			}
+			write = &ctx->writes[ctx->queued];
+			write->bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+			write->bRequest = opcode;
+			write->wValue = addr & 0xFFFF;
+			write->wIndex = addr >> 16;
+			write->data = ctx->data + ctx->queued * RAM_WRITE_MAX;
+			write->wLength = 0;
+			ctx->queued++;
+		}
+		chunk = RAM_WRITE_MAX - write->wLength;
+		if (chunk > len)
+			chunk = len;
+		memcpy(ctx->data + (write - ctx->writes) * RAM_WRITE_MAX + write->wLength,
+			data, chunk);
+		write->wLength += (uint16_t)chunk;
+		addr += (uint32_t)chunk;
+		data += chunk;
+		len -= chunk;
 	}
-	return rc;
+	return 0;
+}
+
+/*
+ * Write an FX3 image section with 4K requests, at most RAM_WRITE_QUEUE of
+ * them to a libusb_control_write_vec() call.
+ */
+static int fx3_write_section(libusb_device_handle *device, uint32_t addr,
+	const unsigned char *data, uint32_t len, double *elapsed)
+{
+	struct libusb_control_write writes[RAM_WRITE_QUEUE];
+	double start = ezusb_time();
+	int i, rc = 0;
+
+	while ((len > 0) && (rc == 0)) {
+		for (i = 0; (i < RAM_WRITE_QUEUE) && (len > 0); i++) {
+			writes[i].bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+			writes[i].bRequest = RW_INTERNAL;
+			writes[i].wValue = addr & 0xFFFF;
+			writes[i].wIndex = addr >> 16;
+			writes[i].data = data;
+			writes[i].wLength = (len > RAM_WRITE_MAX) ? RAM_WRITE_MAX : (uint16_t)len;
+			if (verbose > 1)
+				logerror("write firmware, addr 0x%08x len %4u (0x%04x)\n", addr,
+					writes[i].wLength, writes[i].wLength);
+			addr += writes[i].wLength;
+			data += writes[i].wLength;
+			len -= writes[i].wLength;
+		}
+		rc = libusb_control_write_vec(device, writes, i, NULL, 1000);
+		if (rc < 0)
+			logerror("write firmware: %s\n", libusb_error_name(rc));
+	}
+	*elapsed += ezusb_time() - start;
+	return (rc < 0) ? -EIO : 0;
 }
 
 /*
@@ -568,6 +692,8 @@ static int fx3_load_ram(libusb_device_handle *device, const char *path)
 	uint32_t dCheckSum, dExpectedCheckSum, dAddress, i, dLen, dLength;
 	uint32_t* dImageBuf;
 	unsigned char *bBuf, hBuf[4], blBuf[4], rBuf[4096];
+	uint32_t total = 0;
+	double elapsed = 0;
 	FILE *image;
 	int ret = 0;
 
@@ -655,12 +781,20 @@ static int fx3_load_ram(libusb_device_handle *device, const char *path)
 		dLength <<= 2; // convert to Byte length
 		bBuf = (unsigned char*) dImageBuf;
 
+		// write the whole section with pipelined 4K requests, then read it back
+		if (fx3_write_section(device, dAddress, bBuf, dLength, &elapsed) < 0) {
+			logerror("write error\n");
+			free(dImageBuf);
+			ret = -5;
+			goto exit;
+		}
+		total += dLength;
+
 		while (dLength > 0) {
 			dLen = 4096; // 4K max
 			if (dLen > dLength)
 				dLen = dLength;
-			if ((ezusb_write(device, "write firmware", RW_INTERNAL, dAddress, bBuf, dLen) < 0) ||
-				(ezusb_read(device, "read firmware", RW_INTERNAL, dAddress, rBuf, dLen) < 0)) {
+			if (ezusb_read(device, "read firmware", RW_INTERNAL, dAddress, rBuf, dLen) < 0) {
 				logerror("R/W error\n");
 				free(dImageBuf);
 				ret = -5;
@@ -683,6 +817,9 @@ static int fx3_load_ram(libusb_device_handle *device, const char *path)
 		free(dImageBuf);
 	}
 
+	if (verbose && (elapsed > 0))
+		logerror("... WROTE: %u bytes in %.3f s, %.1f KB/s\n", total, elapsed, total / elapsed / 1024);
+
 	// read pre-computed checksum data
 	if ((fread(&dExpectedCheckSum, sizeof(uint32_t), 1, image) != 1) ||
 		(dCheckSum != dExpectedCheckSum)) {
@@ -728,9 +865,17 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 	if (fx_type == FX_TYPE_FX3)
 		return fx3_load_ram(device, path);
 
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.data = malloc(RAM_WRITE_QUEUE * RAM_WRITE_MAX);
+	if (ctx.data == NULL) {
+		logerror("unable to allocate the request buffers\n");
+		return -1;
+	}
+
 	image = fopen(path, "rb");
 	if (image == NULL) {
 		logerror("%s: unable to open for input.\n", path);
+		free(ctx.data);
 		return -2;
 	} else if (verbose > 1)
 		logerror("open firmware image %s for RAM upload\n", path);
@@ -786,6 +931,8 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 	ctx.device = device;
 	ctx.total = ctx.count = 0;
 	status = parse[img_type](image, &ctx, is_external, ram_poke);
+	if (status >= 0)
+		status = ram_flush(&ctx);
 	if (status < 0) {
 		logerror("unable to upload %s\n", path);
 		ret = status;
@@ -809,6 +956,8 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 		if (verbose)
 			logerror("2nd stage: write on-chip memory\n");
 		status = parse_ihex(image, &ctx, is_external, ram_poke);
+		if (status >= 0)
+			status = ram_flush(&ctx);
 		if (status < 0) {
 			logerror("unable to completely upload %s\n", path);
 			ret = status;
@@ -819,6 +968,10 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 	if (verbose && (ctx.count != 0)) {
 		logerror("... WROTE: %d bytes, %d segments, avg %d\n",
 			(int)ctx.total, (int)ctx.count, (int)(ctx.total/ctx.count));
+		logerror("... %d requests in %.3f s", (int)ctx.requests, ctx.elapsed);
+		if (ctx.elapsed > 0)
+			logerror(", %.1f KB/s", ctx.total / ctx.elapsed / 1024);
+		logerror("\n");
 	}
 
 	/* if required, reset the CPU so it runs what we just uploaded */
@@ -827,5 +980,6 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 
 exit:
 	fclose(image);
+	free(ctx.data);
 	return ret;
 }
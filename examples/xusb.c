@@ -30,6 +30,8 @@
 #define msleep(msecs) Sleep(msecs)
 #else
 #include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
 #define msleep(msecs) usleep(1000*msecs)
 #endif
 
@@ -57,6 +59,13 @@ static bool binary_dump = false;
 static bool extra_info = false;
 static bool force_device_request = false;	// For WCID descriptor queries
 static const char* binary_name = NULL;
+// Mass Storage benchmark parameters (-m, -q, -t and -n options)
+static bool benchmark = false;
+static bool benchmark_random = false;
+static bool benchmark_write = false;
+static int benchmark_depth = 1;
+static int benchmark_count = 1000;
+static uint32_t benchmark_size = 65536;
 
 static int perr(char const *format, ...)
 {
@@ -450,6 +459,269 @@ static void get_sense(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t
 	get_mass_storage_status(handle, endpoint_in, expected_tag);
 }
 
+// Mass Storage benchmark. Each command of the queue has its CBW, data and CSW
+// stages submitted at once, so that with a depth above 1 the next commands are
+// already queued on the endpoints when one completes. Note that the Bulk-Only
+// Transport forbids sending a CBW before the previous CSW was read, and most
+// devices answer it with a phase error. Depths above 1 need a device with
+// UAS-like command queuing that tolerates it.
+struct benchmark_command {
+	struct libusb_transfer *transfer[3];	// CBW, data and CSW stages
+	struct command_block_wrapper cbw;
+	struct command_status_wrapper csw;
+	int pending;				// stages still in flight
+	uint64_t start;
+	uint32_t latency;
+};
+
+static struct {
+	libusb_device_handle *handle;
+	uint8_t lun;
+	uint32_t tag;
+	uint32_t blocks;			// blocks per command
+	uint32_t positions;			// commands that fit on the device
+	int submitted, completed, inflight;
+	bool failed;
+	uint32_t *latency;			// in microseconds, per completed command
+} bench;
+
+static uint64_t get_time_us(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / (double)freq.QuadPart * 1000000.0);
+#elif defined(CLOCK_MONOTONIC)
+	// unlike the time of day, not changed by clock adjustments
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void benchmark_fail(void)
+{
+	if (bench.failed)
+		return;
+	bench.failed = true;
+	// The remaining commands cannot complete in order anymore
+	libusb_cancel_all_transfers(bench.handle);
+}
+
+static int submit_benchmark_command(struct benchmark_command *cmd)
+{
+	uint32_t lba;
+	int i, r = 0;
+
+	if (benchmark_random) {
+		// rand() may only have 15 bits
+		lba = ((((uint32_t)rand() << 15) ^ (uint32_t)rand()) % bench.positions) * bench.blocks;
+	} else {
+		lba = ((uint32_t)bench.submitted % bench.positions) * bench.blocks;
+	}
+
+	memset(&cmd->cbw, 0, sizeof(cmd->cbw));
+	cmd->cbw.dCBWSignature[0] = 'U';
+	cmd->cbw.dCBWSignature[1] = 'S';
+	cmd->cbw.dCBWSignature[2] = 'B';
+	cmd->cbw.dCBWSignature[3] = 'C';
+	cmd->cbw.dCBWTag = bench.tag++;
+	cmd->cbw.dCBWDataTransferLength = benchmark_size;
+	cmd->cbw.bmCBWFlags = benchmark_write ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN;
+	cmd->cbw.bCBWLUN = bench.lun;
+	cmd->cbw.bCBWCBLength = 10;
+	cmd->cbw.CBWCB[0] = benchmark_write ? 0x2A : 0x28;	// Write(10) or Read(10)
+	cmd->cbw.CBWCB[2] = (uint8_t)(lba >> 24);
+	cmd->cbw.CBWCB[3] = (uint8_t)(lba >> 16);
+	cmd->cbw.CBWCB[4] = (uint8_t)(lba >> 8);
+	cmd->cbw.CBWCB[5] = (uint8_t)lba;
+	cmd->cbw.CBWCB[7] = (uint8_t)(bench.blocks >> 8);
+	cmd->cbw.CBWCB[8] = (uint8_t)bench.blocks;
+	memset(&cmd->csw, 0, sizeof(cmd->csw));
+
+	cmd->pending = 0;
+	cmd->start = get_time_us();
+	for (i = 0; i < 3; i++) {
+		r = libusb_submit_transfer(cmd->transfer[i]);
+		if (r < 0) {
+			perr("   benchmark: unable to submit command: %s\n", libusb_strerror((enum libusb_error)r));
+			benchmark_fail();
+			break;
+		}
+		cmd->pending++;
+	}
+	if (cmd->pending)
+		bench.inflight++;
+	bench.submitted++;
+	return r;
+}
+
+static void LIBUSB_CALL benchmark_cb(struct libusb_transfer *transfer)
+{
+	struct benchmark_command *cmd = (struct benchmark_command*)transfer->user_data;
+
+	if (transfer == cmd->transfer[2])
+		cmd->latency = (uint32_t)(get_time_us() - cmd->start);
+
+	if (bench.failed) {
+		// Only the first failure is reported
+	} else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		perr("   benchmark: command %08X failed with transfer status %d\n",
+			cmd->cbw.dCBWTag, transfer->status);
+		benchmark_fail();
+	} else if (transfer == cmd->transfer[1]) {
+		if (transfer->actual_length != transfer->length) {
+			perr("   benchmark: command %08X transferred %d bytes (expected %d)\n",
+				cmd->cbw.dCBWTag, transfer->actual_length, transfer->length);
+			benchmark_fail();
+		}
+	} else if (transfer == cmd->transfer[2]) {
+		if ((transfer->actual_length != 13) || (cmd->csw.dCSWTag != cmd->cbw.dCBWTag)
+		  || (cmd->csw.bCSWStatus != 0)) {
+			perr("   benchmark: command %08X failed (CSW tag %08X, status %02X)\n",
+				cmd->cbw.dCBWTag, cmd->csw.dCSWTag, cmd->csw.bCSWStatus);
+			benchmark_fail();
+		}
+	}
+
+	if (--cmd->pending > 0)
+		return;
+
+	bench.inflight--;
+	if (bench.failed)
+		return;
+	bench.latency[bench.completed++] = cmd->latency;
+	if (bench.submitted < benchmark_count)
+		submit_benchmark_command(cmd);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static uint32_t latency_percentile(double percent)
+{
+	return bench.latency[(int)((bench.completed - 1) * percent / 100.0)];
+}
+
+static int benchmark_mass_storage(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out,
+	uint8_t lun, uint32_t max_lba, uint32_t block_size)
+{
+	struct benchmark_command *cmd;
+	uint8_t data_endpoint = benchmark_write ? endpoint_out : endpoint_in;
+	uint64_t start, elapsed;
+	int i, j, r, nb_cmds;
+
+	printf("Benchmarking %s %s of %u bytes, queue depth %d:\n", benchmark_random ? "random" : "sequential",
+		benchmark_write ? "writes" : "reads", benchmark_size, benchmark_depth);
+	if ((block_size == 0) || (benchmark_size % block_size != 0)
+	  || (benchmark_size / block_size > 0xFFFF)) {
+		perr("   transfer size must be a multiple of the block size (%u bytes) and at most 65535 blocks\n",
+			block_size);
+		return -1;
+	}
+	if (benchmark_write)
+		printf("   WARNING: this overwrites the data of the device\n");
+
+	memset(&bench, 0, sizeof(bench));
+	bench.handle = handle;
+	bench.lun = lun;
+	bench.tag = 1;
+	bench.blocks = benchmark_size / block_size;
+	bench.positions = (uint32_t)(((uint64_t)max_lba + 1) / bench.blocks);
+	if (bench.positions == 0) {
+		perr("   transfer size exceeds the device size\n");
+		return -1;
+	}
+	bench.latency = (uint32_t*) calloc(benchmark_count, sizeof(uint32_t));
+	nb_cmds = (benchmark_depth < benchmark_count) ? benchmark_depth : benchmark_count;
+	cmd = (struct benchmark_command*) calloc(nb_cmds, sizeof(struct benchmark_command));
+	if ((bench.latency == NULL) || (cmd == NULL)) {
+		perr("   unable to allocate benchmark commands\n");
+		free(bench.latency);
+		free(cmd);
+		return -1;
+	}
+
+	r = 0;
+	for (i = 0; i < nb_cmds; i++) {
+		unsigned char *data = (unsigned char*) malloc(benchmark_size);
+		for (j = 0; j < 3; j++)
+			cmd[i].transfer[j] = libusb_alloc_transfer(0);
+		if ((data == NULL) || !cmd[i].transfer[0] || !cmd[i].transfer[1] || !cmd[i].transfer[2]) {
+			perr("   unable to allocate benchmark commands\n");
+			free(data);
+			nb_cmds = i + 1;
+			r = -1;
+			goto out;
+		}
+		if (benchmark_write)
+			memset(data, 0xA5, benchmark_size);
+		// Timeouts start at submission, and a command may wait for all the
+		// commands queued before it, so they are scaled by the queue depth.
+		// The transfer length of the CBW must always be exactly 31 bytes.
+		libusb_fill_bulk_transfer(cmd[i].transfer[0], handle, endpoint_out, (unsigned char*)&cmd[i].cbw,
+			31, benchmark_cb, &cmd[i], 1000 * nb_cmds);
+		libusb_fill_bulk_transfer(cmd[i].transfer[1], handle, data_endpoint, data,
+			(int)benchmark_size, benchmark_cb, &cmd[i], 5000 * nb_cmds);
+		libusb_fill_bulk_transfer(cmd[i].transfer[2], handle, endpoint_in, (unsigned char*)&cmd[i].csw,
+			13, benchmark_cb, &cmd[i], 5000 * nb_cmds);
+	}
+
+	// rand() is left unseeded, so that random runs are comparable
+	start = get_time_us();
+	for (i = 0; (i < nb_cmds) && !bench.failed; i++)
+		submit_benchmark_command(&cmd[i]);
+	while (bench.inflight > 0) {
+		r = libusb_handle_events(NULL);
+		if ((r < 0) && (r != LIBUSB_ERROR_INTERRUPTED)) {
+			perr("   benchmark: %s\n", libusb_strerror((enum libusb_error)r));
+			benchmark_fail();
+		}
+	}
+	elapsed = get_time_us() - start;
+
+	if (bench.failed) {
+		libusb_clear_halt(handle, endpoint_in);
+		libusb_clear_halt(handle, endpoint_out);
+		r = -1;
+	} else {
+		r = 0;
+	}
+	if (bench.completed > 0) {
+		if (elapsed == 0)
+			elapsed = 1;
+		qsort(bench.latency, bench.completed, sizeof(uint32_t), compare_latency);
+		printf("   %d commands in %.3f s: %.0f IOPS, %.2f MB/s\n", bench.completed, elapsed / 1000000.0,
+			bench.completed * 1000000.0 / elapsed, (double)bench.completed * benchmark_size / elapsed);
+		printf("   latency (us): min %u, p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+			bench.latency[0], latency_percentile(50), latency_percentile(90),
+			latency_percentile(99), latency_percentile(99.9), bench.latency[bench.completed - 1]);
+	}
+
+out:
+	for (i = 0; i < nb_cmds; i++) {
+		if (cmd[i].transfer[1])
+			free(cmd[i].transfer[1]->buffer);
+		for (j = 0; j < 3; j++)
+			libusb_free_transfer(cmd[i].transfer[j]);
+	}
+	free(cmd);
+	free(bench.latency);
+	return r;
+}
+
 // Mass Storage device to test bulk transfers (non destructive test)
 static int test_mass_storage(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out)
 {
@@ -547,6 +819,8 @@ static int test_mass_storage(libusb_device_handle *handle, uint8_t endpoint_in,
 	}
 	free(data);
 
+	if (benchmark)
+		return benchmark_mass_storage(handle, endpoint_in, endpoint_out, lun, max_lba, block_size);
 	return 0;
 }
 
@@ -1021,6 +1295,36 @@ int main(int argc, char** argv)
 					}
 					error_lang = argv[++j];
 					break;
+				case 'm':
+					if ((j+1 >= argc) || (argv[j+1][0] == '-') || (argv[j+1][0] == '/')) {
+						printf("   Option -m requires a seqread, randread, seqwrite or randwrite pattern\n");
+						return 1;
+					}
+					j++;
+					benchmark_random = (strncmp(argv[j], "rand", 4) == 0);
+					benchmark_write = (strcmp(argv[j] + (benchmark_random ? 4 : 3), "write") == 0);
+					if ((!benchmark_random && (strncmp(argv[j], "seq", 3) != 0))
+					  || (!benchmark_write && (strcmp(argv[j] + (benchmark_random ? 4 : 3), "read") != 0))) {
+						printf("   Unknown benchmark pattern '%s'\n", argv[j]);
+						return 1;
+					}
+					benchmark = true;
+					break;
+				case 'q':
+				case 't':
+				case 'n':
+					if ((j+1 >= argc) || (argv[j+1][0] == '-') || (argv[j+1][0] == '/')
+					  || (atoi(argv[j+1]) <= 0)) {
+						printf("   Option -%c requires a positive number\n", argv[j][1]);
+						return 1;
+					}
+					if (argv[j][1] == 'q')
+						benchmark_depth = atoi(argv[++j]);
+					else if (argv[j][1] == 't')
+						benchmark_size = (uint32_t)atoi(argv[++j]);
+					else
+						benchmark_count = atoi(argv[++j]);
+					break;
 				case 'j':
 					// OLIMEX ARM-USB-TINY JTAG, 2 channel composite device - 2 interfaces
 					if (!VID && !PID) {
@@ -1077,14 +1381,21 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if ((show_help) || (argc == 1) || (argc > 7)) {
-		printf("usage: %s [-h] [-d] [-i] [-k] [-b file] [-l lang] [-j] [-x] [-s] [-p] [-w] [vid:pid]\n", argv[0]);
+	if ((show_help) || (argc == 1)) {
+		printf("usage: %s [-h] [-d] [-i] [-k] [-b file] [-l lang] [-j] [-x] [-s] [-p] [-w]\n"
+			"       [-m pat] [-q num] [-t size] [-n num] [vid:pid]\n", argv[0]);
 		printf("   -h      : display usage\n");
 		printf("   -d      : enable debug output\n");
 		printf("   -i      : print topology and speed info\n");
 		printf("   -j      : test composite FTDI based JTAG device\n");
 		printf("   -k      : test Mass Storage device\n");
 		printf("   -b file : dump Mass Storage data to file 'file'\n");
+		printf("   -m pat  : benchmark Mass Storage device, pattern seqread, randread, seqwrite or\n");
+		printf("             randwrite (write patterns destroy the data of the device)\n");
+		printf("   -q num  : number of benchmark commands kept in flight (default 1), values\n");
+		printf("             above 1 need a device that queues commands beyond Bulk-Only\n");
+		printf("   -t size : benchmark transfer size in bytes (default 65536)\n");
+		printf("   -n num  : number of benchmark commands (default 1000)\n");
 		printf("   -p      : test Sony PS3 SixAxis controller\n");
 		printf("   -s      : test Microsoft Sidewinder Precision Pro (HID)\n");
 		printf("   -x      : test Microsoft XBox Controller Type S\n");
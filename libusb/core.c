@@ -33,6 +33,9 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#if defined(PLATFORM_POSIX)
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
 #endif
@@ -44,7 +47,9 @@
 #include "libusbi.h"
 #include "hotplug.h"
 
-#if defined(OS_LINUX)
+#if defined(OS_NULL)
+const struct usbi_os_backend * const usbi_backend = &null_backend;
+#elif defined(OS_LINUX)
 const struct usbi_os_backend * const usbi_backend = &linux_usbfs_backend;
 #elif defined(OS_DARWIN)
 const struct usbi_os_backend * const usbi_backend = &darwin_backend;
@@ -70,9 +75,17 @@ static int default_context_refcnt = 0;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
 static struct timeval timestamp_origin = { 0, 0 };
 
+/* LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY and LIBUSB_OPTION_WEAK_AUTHORITY set
+ * with a NULL context, for the contexts initialized afterwards. protected by
+ * default_context_lock */
+static int default_defer_device_discovery = 0;
+static int weak_authority = 0;
+
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
 
+int usbi_log_level_max = INT_MAX;
+
 /**
  * \mainpage libusb-1.0 API Reference
  *
@@ -654,6 +667,25 @@ static void discovered_devs_free(struct discovered_devs *discdevs)
 	free(discdevs);
 }
 
+/* convert discovered_devs into a NULL-terminated list, taking a reference
+ * to each device */
+static ssize_t discovered_devs_to_list(struct discovered_devs *discdevs,
+	libusb_device ***list)
+{
+	struct libusb_device **ret;
+	ssize_t i, len = discdevs->len;
+
+	ret = calloc(len + 1, sizeof(struct libusb_device *));
+	if (!ret)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < len; i++)
+		ret[i] = libusb_ref_device(discdevs->devices[i]);
+	ret[len] = NULL;
+	*list = ret;
+	return len;
+}
+
 /* Allocate a new device with a specific session ID. The returned device has
  * a reference count of 1. */
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
@@ -684,15 +716,167 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	return dev;
 }
 
+static unsigned int session_hash_fn(unsigned long session_id)
+{
+	/* Fibonacci hashing; session IDs are often small, dense integers */
+	return (unsigned int)((session_id * 2654435761UL) >> 8);
+}
+
+static unsigned int port_path_hash_fn(uint8_t bus_number,
+	const uint8_t *port_numbers, int num_ports)
+{
+	/* FNV-1a */
+	unsigned int h = 2166136261U;
+	int i;
+
+	h = (h ^ bus_number) * 16777619U;
+	for (i = 0; i < num_ports; i++)
+		h = (h ^ port_numbers[i]) * 16777619U;
+	return h;
+}
+
+static unsigned int device_port_path_hash(struct libusb_device *dev)
+{
+	uint8_t port_numbers[USBI_MAX_PORT_DEPTH];
+	int num_ports;
+
+	num_ports = libusb_get_port_numbers(dev, port_numbers, sizeof(port_numbers));
+	if (num_ports < 0)
+		num_ports = 0;
+	return port_path_hash_fn(dev->bus_number, port_numbers, num_ports);
+}
+
+/* hash the device into both indexes. usb_devs_lock must be held. */
+static void hash_device(struct libusb_context *ctx, struct libusb_device *dev)
+{
+	unsigned int mask = ctx->dev_hash_size - 1;
+
+	list_add(&dev->session_list,
+		&ctx->session_hash[session_hash_fn(dev->session_data) & mask]);
+	list_add(&dev->port_path_list,
+		&ctx->port_path_hash[device_port_path_hash(dev) & mask]);
+}
+
+/* double the size of the hash indexes and rehash the devices on usb_devs.
+ * Returns 0 if memory cannot be allocated, in which case the current tables
+ * are kept, which only makes the chains longer. usb_devs_lock must be held. */
+static int grow_device_hash(struct libusb_context *ctx)
+{
+	unsigned int i, new_size = ctx->dev_hash_size * 2;
+	struct list_head *session_hash, *port_path_hash;
+	struct libusb_device *dev;
+
+	session_hash = malloc(new_size * sizeof(*session_hash));
+	port_path_hash = malloc(new_size * sizeof(*port_path_hash));
+	if (!session_hash || !port_path_hash) {
+		free(session_hash);
+		free(port_path_hash);
+		return 0;
+	}
+
+	for (i = 0; i < new_size; i++) {
+		list_init(&session_hash[i]);
+		list_init(&port_path_hash[i]);
+	}
+
+	free(ctx->session_hash);
+	free(ctx->port_path_hash);
+	ctx->session_hash = session_hash;
+	ctx->port_path_hash = port_path_hash;
+	ctx->dev_hash_size = new_size;
+
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+		hash_device(ctx, dev);
+	return 1;
+}
+
+/* add a device to usb_devs and the hash indexes. usb_devs_lock must be held. */
+static void add_device_locked(struct libusb_context *ctx,
+	struct libusb_device *dev)
+{
+	list_add(&dev->list, &ctx->usb_devs);
+	/* growing rehashes every device on usb_devs, this one included */
+	if (++ctx->usb_devs_cnt <= ctx->dev_hash_size || !grow_device_hash(ctx))
+		hash_device(ctx, dev);
+}
+
+/* remove a device from usb_devs and the hash indexes. usb_devs_lock must be
+ * held. */
+static void remove_device_locked(struct libusb_context *ctx,
+	struct libusb_device *dev)
+{
+	list_del(&dev->list);
+	list_del(&dev->session_list);
+	list_del(&dev->port_path_list);
+	ctx->usb_devs_cnt--;
+}
+
+static int init_device_hash(struct libusb_context *ctx)
+{
+	unsigned int i;
+
+	ctx->session_hash = malloc(USBI_DEV_HASH_INIT_SIZE * sizeof(*ctx->session_hash));
+	ctx->port_path_hash = malloc(USBI_DEV_HASH_INIT_SIZE * sizeof(*ctx->port_path_hash));
+	if (!ctx->session_hash || !ctx->port_path_hash) {
+		free(ctx->session_hash);
+		free(ctx->port_path_hash);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < USBI_DEV_HASH_INIT_SIZE; i++) {
+		list_init(&ctx->session_hash[i]);
+		list_init(&ctx->port_path_hash[i]);
+	}
+	ctx->dev_hash_size = USBI_DEV_HASH_INIT_SIZE;
+	ctx->usb_devs_cnt = 0;
+	return 0;
+}
+
+/* bump the device list generation and record the change. Returns the device
+ * whose log entry was overwritten, which the caller must unref once
+ * usb_devs_lock has been released. usb_devs_lock must be held. */
+static struct libusb_device *log_device_change(struct libusb_context *ctx,
+	struct libusb_device *dev, int event)
+{
+	struct usbi_device_change *change;
+	struct libusb_device *old_dev;
+
+	ctx->devs_generation++;
+
+	/* without hotplug support devices are only disconnected once their
+	 * last reference is gone, so the log cannot hold references */
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return NULL;
+
+	change = &ctx->devs_changes[ctx->devs_generation & (USBI_DEVICE_CHANGE_LOG_SIZE - 1)];
+	old_dev = change->dev;
+	change->dev = libusb_ref_device(dev);
+	change->event = event;
+	return old_dev;
+}
+
+static void clear_device_changes(struct libusb_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < USBI_DEVICE_CHANGE_LOG_SIZE; i++) {
+		libusb_unref_device(ctx->devs_changes[i].dev);
+		ctx->devs_changes[i].dev = NULL;
+	}
+}
+
 void usbi_connect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct libusb_device *old_dev;
 
 	dev->attached = 1;
 
-	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
-	list_add(&dev->list, &dev->ctx->usb_devs);
-	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	add_device_locked(ctx, dev);
+	old_dev = log_device_change(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	libusb_unref_device(old_dev);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug message list is ready. This prevents an event from getting raised
@@ -705,14 +889,18 @@ void usbi_connect_device(struct libusb_device *dev)
 void usbi_disconnect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct libusb_device *old_dev;
 
 	usbi_mutex_lock(&dev->lock);
 	dev->attached = 0;
 	usbi_mutex_unlock(&dev->lock);
+	usbi_clear_string_cache(dev);
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_del(&dev->list);
+	remove_device_locked(ctx, dev);
+	old_dev = log_device_change(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	libusb_unref_device(old_dev);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug message list is ready. This prevents an event from getting raised
@@ -754,9 +942,11 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 {
 	struct libusb_device *dev;
 	struct libusb_device *ret = NULL;
+	struct list_head *bucket;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+	bucket = &ctx->session_hash[session_hash_fn(session_id) & (ctx->dev_hash_size - 1)];
+	list_for_each_entry(dev, bucket, session_list, struct libusb_device)
 		if (dev->session_data == session_id) {
 			ret = libusb_ref_device(dev);
 			break;
@@ -766,6 +956,43 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	return ret;
 }
 
+/* Returns a reference to the device on bus bus_number whose port path (as
+ * reported by libusb_get_port_numbers()) is port_numbers, or NULL. A
+ * num_ports of 0 looks up the root hub of the bus. This is only meaningful
+ * for backends that set up the device topology before the device is
+ * connected. */
+struct libusb_device *usbi_get_device_by_port_path(struct libusb_context *ctx,
+	uint8_t bus_number, const uint8_t *port_numbers, int num_ports)
+{
+	uint8_t dev_port_numbers[USBI_MAX_PORT_DEPTH];
+	struct libusb_device *dev;
+	struct libusb_device *ret = NULL;
+	struct list_head *bucket;
+	unsigned int h;
+
+	if (num_ports < 0 || num_ports > USBI_MAX_PORT_DEPTH)
+		return NULL;
+
+	h = port_path_hash_fn(bus_number, port_numbers, num_ports);
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	bucket = &ctx->port_path_hash[h & (ctx->dev_hash_size - 1)];
+	list_for_each_entry(dev, bucket, port_path_list, struct libusb_device) {
+		if (dev->bus_number != bus_number)
+			continue;
+		if (libusb_get_port_numbers(dev, dev_port_numbers,
+				sizeof(dev_port_numbers)) != num_ports)
+			continue;
+		if (num_ports && memcmp(dev_port_numbers, port_numbers, num_ports))
+			continue;
+		ret = libusb_ref_device(dev);
+		break;
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	return ret;
+}
+
 /** @ingroup dev
  * Returns a list of USB devices currently attached to the system. This is
  * your entry point into finding a USB device to operate.
@@ -789,60 +1016,105 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list)
 {
-	struct discovered_devs *discdevs = discovered_devs_alloc();
+	struct discovered_devs *discdevs, *old_discdevs;
 	struct libusb_device **ret;
+	unsigned long generation = 0;
 	int r = 0;
-	ssize_t i, len;
+	ssize_t len;
 	USBI_GET_CONTEXT(ctx);
 	usbi_dbg("");
 
-	if (!discdevs)
-		return LIBUSB_ERROR_NO_MEM;
+	/* such a context only knows its wrapped devices, which are never
+	 * listed */
+	if (ctx->weak_authority) {
+		discdevs = discovered_devs_alloc();
+		if (!discdevs)
+			return LIBUSB_ERROR_NO_MEM;
+		len = discovered_devs_to_list(discdevs, list);
+		discovered_devs_free(discdevs);
+		return len;
+	}
 
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
-		/* backend provides hotplug support */
+		/* backend provides hotplug support. usb_devs is complete, so
+		 * copy it straight into the returned list */
 		struct libusb_device *dev;
 
+		/* hotplug has kept the list of a deferred context up to date
+		 * for the devices arriving since, a scan adds the rest */
+		usbi_mutex_lock(&ctx->device_scan_lock);
+		if (ctx->device_scan_deferred) {
+			r = usbi_backend->scan_devices(ctx);
+			if (r < 0) {
+				usbi_mutex_unlock(&ctx->device_scan_lock);
+				return r;
+			}
+			ctx->device_scan_deferred = 0;
+		}
+		usbi_mutex_unlock(&ctx->device_scan_lock);
+
 		if (usbi_backend->hotplug_poll)
 			usbi_backend->hotplug_poll();
 
 		usbi_mutex_lock(&ctx->usb_devs_lock);
-		list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
-			discdevs = discovered_devs_append(discdevs, dev);
+		ret = malloc((ctx->usb_devs_cnt + 1) * sizeof(struct libusb_device *));
+		if (!ret) {
+			usbi_mutex_unlock(&ctx->usb_devs_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
 
-			if (!discdevs) {
-				r = LIBUSB_ERROR_NO_MEM;
-				break;
-			}
+		len = 0;
+		list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+			ret[len++] = libusb_ref_device(dev);
+		ret[len] = NULL;
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+		*list = ret;
+		return len;
+	}
+
+	/* backend does not provide hotplug support. if it can tell that nothing
+	 * changed since the last enumeration, hand out the previous result */
+	if (usbi_backend->get_device_list_generation)
+		generation = usbi_backend->get_device_list_generation();
+
+	if (generation) {
+		usbi_mutex_lock(&ctx->usb_devs_lock);
+		if (ctx->cached_discdevs &&
+				ctx->cached_discdevs_generation == generation) {
+			len = discovered_devs_to_list(ctx->cached_discdevs, list);
+			usbi_mutex_unlock(&ctx->usb_devs_lock);
+			return len;
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
-	} else {
-		/* backend does not provide hotplug support */
-		r = usbi_backend->get_device_list(ctx, &discdevs);
 	}
 
+	discdevs = discovered_devs_alloc();
+	if (!discdevs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = usbi_backend->get_device_list(ctx, &discdevs);
 	if (r < 0) {
-		len = r;
-		goto out;
+		discovered_devs_free(discdevs);
+		return r;
 	}
 
-	/* convert discovered_devs into a list */
-	len = discdevs->len;
-	ret = calloc(len + 1, sizeof(struct libusb_device *));
-	if (!ret) {
-		len = LIBUSB_ERROR_NO_MEM;
-		goto out;
+	len = discovered_devs_to_list(discdevs, list);
+	if (len < 0 || !generation) {
+		discovered_devs_free(discdevs);
+		return len;
 	}
 
-	ret[len] = NULL;
-	for (i = 0; i < len; i++) {
-		struct libusb_device *dev = discdevs->devices[i];
-		ret[i] = libusb_ref_device(dev);
-	}
-	*list = ret;
+	/* keep the result, along with the generation read before enumerating so
+	 * that a change which raced with enumeration forces another pass */
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	old_discdevs = ctx->cached_discdevs;
+	ctx->cached_discdevs = discdevs;
+	ctx->cached_discdevs_generation = generation;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
-out:
-	discovered_devs_free(discdevs);
+	if (old_discdevs)
+		discovered_devs_free(old_discdevs);
 	return len;
 }
 
@@ -869,6 +1141,144 @@ void API_EXPORTED libusb_free_device_list(libusb_device **list,
 	free(list);
 }
 
+/** \ingroup dev
+ * Returns the generation of the device list of a context. The generation
+ * changes every time a device is connected or disconnected, so comparing it
+ * with a previously returned value is a cheap way to find out whether
+ * libusb_get_device_list() would return something different.
+ *
+ * The generation is only meaningful on platforms with hotplug support (see
+ * \ref LIBUSB_CAP_HAS_HOTPLUG), elsewhere devices are discovered by
+ * libusb_get_device_list() itself.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the current device list generation
+ * \see libusb_get_device_list_changes()
+ */
+uint32_t API_EXPORTED libusb_get_device_list_generation(libusb_context *ctx)
+{
+	uint32_t generation;
+	USBI_GET_CONTEXT(ctx);
+
+	if (usbi_backend->hotplug_poll)
+		usbi_backend->hotplug_poll();
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	generation = ctx->devs_generation;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	return generation;
+}
+
+/** \ingroup dev
+ * Returns the devices that were connected or disconnected since a given
+ * device list generation, in the order the changes happened.
+ *
+ * The typical use is to take a generation with
+ * libusb_get_device_list_generation(), then a full list with
+ * libusb_get_device_list(), and from then on to poll this function. When
+ * nothing has changed it returns 0 without allocating memory. Changes that
+ * happened between taking the generation and the list are reported again, so
+ * the caller should tolerate arrivals of devices it already knows about.
+ *
+ * Only a limited number of changes are remembered, and changes are
+ * forgotten once they have been returned, so that departed devices are not
+ * kept allocated. If more changes have happened since <tt>*generation</tt>
+ * than are remembered, or some of them have already been returned to another
+ * caller, LIBUSB_ERROR_OVERFLOW is returned and the caller should start over
+ * with a full device list. Only one caller per context should poll for
+ * changes.
+ *
+ * This function requires hotplug support (see \ref LIBUSB_CAP_HAS_HOTPLUG).
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param generation the generation the caller is up to date with. On success
+ * it is updated to the current generation.
+ * \param changes output location for an array of changes. Each entry holds a
+ * reference to its device. Must be freed with
+ * libusb_free_device_list_changes(). Set to NULL if there are no changes.
+ * \returns the number of changes, 0 if the list is unchanged
+ * \returns LIBUSB_ERROR_OVERFLOW if the changes are no longer available
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if hotplug is not supported
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+ssize_t API_EXPORTED libusb_get_device_list_changes(libusb_context *ctx,
+	uint32_t *generation, struct libusb_device_list_change **changes)
+{
+	struct libusb_device_list_change *ret;
+	uint32_t count, i;
+	USBI_GET_CONTEXT(ctx);
+
+	*changes = NULL;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (usbi_backend->hotplug_poll)
+		usbi_backend->hotplug_poll();
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	count = ctx->devs_generation - *generation;
+	if (count == 0) {
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		return 0;
+	}
+	if (count > USBI_DEVICE_CHANGE_LOG_SIZE ||
+	    (int32_t)(ctx->devs_changes_taken - *generation) > 0) {
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+
+	ret = malloc(count * sizeof(*ret));
+	if (!ret) {
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* the log's references are handed over to the caller */
+	for (i = 0; i < count; i++) {
+		struct usbi_device_change *change = &ctx->devs_changes[
+			(*generation + 1 + i) & (USBI_DEVICE_CHANGE_LOG_SIZE - 1)];
+
+		ret[i].dev = change->dev;
+		ret[i].event = (libusb_hotplug_event) change->event;
+		change->dev = NULL;
+	}
+	*generation = ctx->devs_generation;
+	ctx->devs_changes_taken = ctx->devs_generation;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	*changes = ret;
+	return (ssize_t) count;
+}
+
+/** \ingroup dev
+ * Frees an array of changes obtained from libusb_get_device_list_changes()
+ * and releases the device references it holds. It is safe to call this
+ * function with a NULL changes parameter.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param changes the array to free
+ * \param count the number of changes, as returned by
+ * libusb_get_device_list_changes()
+ */
+void API_EXPORTED libusb_free_device_list_changes(
+	struct libusb_device_list_change *changes, ssize_t count)
+{
+	ssize_t i;
+
+	if (!changes)
+		return;
+
+	for (i = 0; i < count; i++)
+		libusb_unref_device(changes[i].dev);
+	free(changes);
+}
+
 /** \ingroup dev
  * Get the number of the bus that a device is connected to.
  * \param dev a device
@@ -981,10 +1391,72 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return dev->speed;
 }
 
-static const struct libusb_endpoint_descriptor *find_endpoint(
-	struct libusb_config_descriptor *config, unsigned char endpoint)
+/** \ingroup dev
+ * Get the NUMA node of the host controller that a device is connected to,
+ * for placing buffers and threads close to it, see libusb_dev_buffer_alloc()
+ * and \ref LIBUSB_OPTION_NUMA_NODE.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev a device
+ * \returns the node number on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the system has no NUMA node for the
+ * controller, as on systems with a single node
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not know the node
+ * (only Linux does)
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_device_numa_node(libusb_device *dev)
+{
+	if (!usbi_backend->get_numa_node)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return usbi_backend->get_numa_node(dev);
+}
+
+static void fill_endpoint_info(struct usbi_endpoint_info *info,
+	const struct libusb_endpoint_descriptor *ep)
+{
+	const unsigned char *extra = ep->extra;
+	int extra_length = ep->extra_length;
+
+	info->present = 1;
+	info->max_packet_size = ep->wMaxPacketSize;
+	info->type = ep->bmAttributes & 0x3;
+	info->interval = ep->bInterval;
+	info->mult = 1 + ((ep->wMaxPacketSize >> 11) & 3);
+	info->max_burst = 0;
+
+	/* look for a SuperSpeed endpoint companion in the extra descriptors */
+	while (extra_length >= 2 && extra[0] >= 2 && extra[0] <= extra_length) {
+		if (extra[1] == LIBUSB_DT_SS_ENDPOINT_COMPANION &&
+				extra[0] >= LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE) {
+			info->max_burst = extra[2];
+			break;
+		}
+		extra_length -= extra[0];
+		extra += extra[0];
+	}
+}
+
+static struct usbi_config_cache *build_config_cache(struct libusb_device *dev)
 {
-	int iface_idx;
+	struct usbi_config_cache *cache;
+	struct libusb_config_descriptor *config;
+	int iface_idx, r;
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		libusb_free_config_descriptor(config);
+		return NULL;
+	}
+	cache->refcnt = 1;
+	cache->config = config;
+
 	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
 		const struct libusb_interface *iface = &config->interface[iface_idx];
 		int altsetting_idx;
@@ -998,12 +1470,80 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
 			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
 				const struct libusb_endpoint_descriptor *ep =
 					&altsetting->endpoint[ep_idx];
-				if (ep->bEndpointAddress == endpoint)
-					return ep;
+				struct usbi_endpoint_info *info =
+					&cache->endpoints[USBI_EP_INDEX(ep->bEndpointAddress)];
+
+				/* the first altsetting declaring an endpoint wins */
+				if (!info->present)
+					fill_endpoint_info(info, ep);
 			}
 		}
 	}
-	return NULL;
+
+	return cache;
+}
+
+static void unref_config_cache(struct libusb_device *dev,
+	struct usbi_config_cache *cache)
+{
+	int refcnt;
+
+	if (!cache)
+		return;
+
+	usbi_mutex_lock(&dev->lock);
+	refcnt = --cache->refcnt;
+	usbi_mutex_unlock(&dev->lock);
+
+	if (refcnt == 0) {
+		libusb_free_config_descriptor(cache->config);
+		free(cache);
+	}
+}
+
+/* Returns a reference to the cached active configuration of the device,
+ * parsing it on first use. Release it with unref_config_cache(). */
+static struct usbi_config_cache *get_config_cache(struct libusb_device *dev)
+{
+	struct usbi_config_cache *cache, *new_cache;
+
+	usbi_mutex_lock(&dev->lock);
+	cache = dev->config_cache;
+	if (cache)
+		cache->refcnt++;
+	usbi_mutex_unlock(&dev->lock);
+	if (cache)
+		return cache;
+
+	new_cache = build_config_cache(dev);
+	if (!new_cache)
+		return NULL;
+
+	/* another thread may have raced us to it */
+	usbi_mutex_lock(&dev->lock);
+	if (!dev->config_cache) {
+		dev->config_cache = new_cache;
+		new_cache = NULL;
+	}
+	cache = dev->config_cache;
+	cache->refcnt++;
+	usbi_mutex_unlock(&dev->lock);
+
+	unref_config_cache(dev, new_cache);
+	return cache;
+}
+
+/* Drop the cached active configuration, e.g. because it has been changed */
+static void invalidate_config_cache(struct libusb_device *dev)
+{
+	struct usbi_config_cache *cache;
+
+	usbi_mutex_lock(&dev->lock);
+	cache = dev->config_cache;
+	dev->config_cache = NULL;
+	usbi_mutex_unlock(&dev->lock);
+
+	unref_config_cache(dev, cache);
 }
 
 /** \ingroup dev
@@ -1016,6 +1556,11 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
  * its contents. If you're dealing with isochronous transfers, you probably
  * want libusb_get_max_iso_packet_size() instead.
  *
+ * The active configuration is parsed on first use and cached with the device,
+ * so repeated calls do not allocate memory or issue I/O. The cache is dropped
+ * when the configuration is changed through libusb_set_configuration() and
+ * when the device is reset with libusb_reset_device().
+ *
  * \param dev a device
  * \param endpoint address of the endpoint in question
  * \returns the wMaxPacketSize value
@@ -1025,27 +1570,24 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
 int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
+	struct usbi_config_cache *cache;
+	const struct usbi_endpoint_info *info;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
+	cache = get_config_cache(dev);
+	if (!cache) {
 		usbi_err(DEVICE_CTX(dev),
 			"could not retrieve active config descriptor");
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
+	info = &cache->endpoints[USBI_EP_INDEX(endpoint)];
+	if (!info->present || (endpoint & 0x70))
 		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	r = ep->wMaxPacketSize;
+	else
+		r = info->max_packet_size;
 
-out:
-	libusb_free_config_descriptor(config);
+	unref_config_cache(dev, cache);
 	return r;
 }
 
@@ -1069,6 +1611,11 @@ out:
  *
  * Since v1.0.3.
  *
+ * The active configuration is parsed on first use and cached with the device,
+ * so repeated calls do not allocate memory or issue I/O. The cache is dropped
+ * when the configuration is changed through libusb_set_configuration() and
+ * when the device is reset with libusb_reset_device().
+ *
  * \param dev a device
  * \param endpoint address of the endpoint in question
  * \returns the maximum packet size which can be sent/received on this endpoint
@@ -1078,35 +1625,28 @@ out:
 int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
-	enum libusb_transfer_type ep_type;
-	uint16_t val;
+	struct usbi_config_cache *cache;
+	const struct usbi_endpoint_info *info;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
+	cache = get_config_cache(dev);
+	if (!cache) {
 		usbi_err(DEVICE_CTX(dev),
 			"could not retrieve active config descriptor");
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
+	info = &cache->endpoints[USBI_EP_INDEX(endpoint)];
+	if (!info->present || (endpoint & 0x70)) {
 		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
+	} else {
+		r = info->max_packet_size & 0x07ff;
+		if (info->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+				|| info->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+			r *= info->mult;
 	}
 
-	val = ep->wMaxPacketSize;
-	ep_type = (enum libusb_transfer_type) (ep->bmAttributes & 0x3);
-
-	r = val & 0x07ff;
-	if (ep_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
-			|| ep_type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
-		r *= (1 + ((val >> 11) & 3));
-
-out:
-	libusb_free_config_descriptor(config);
+	unref_config_cache(dev, cache);
 	return r;
 }
 
@@ -1148,16 +1688,111 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 		if (usbi_backend->destroy_device)
 			usbi_backend->destroy_device(dev);
 
+		unref_config_cache(dev, dev->config_cache);
+
 		if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 			/* backend does not support hotplug */
 			usbi_disconnect_device(dev);
 		}
+		usbi_clear_string_cache(dev);
 
 		usbi_mutex_destroy(&dev->lock);
 		free(dev);
 	}
 }
 
+/* a buffer of libusb_dev_buffer_alloc(), on the dev_buffers list of its
+ * handle. length is what was mapped, which is more than was asked for in
+ * a hugetlb mapping */
+struct usbi_dev_buffer {
+	struct list_head list;
+	void *buffer;
+	size_t length;
+};
+
+/* allocate a handle without a device, ready for the backend open */
+static int alloc_device_handle(struct libusb_context *ctx,
+	struct libusb_device_handle **handle)
+{
+	struct libusb_device_handle *_handle;
+	size_t priv_size = usbi_backend->device_handle_priv_size;
+	int r;
+
+	_handle = malloc(sizeof(*_handle) + priv_size);
+	if (!_handle)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = usbi_mutex_init(&_handle->lock, NULL);
+	if (r) {
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
+	r = usbi_mutex_init(&_handle->flying_transfers_lock, NULL);
+	if (r) {
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
+	r = usbi_cond_init(&_handle->cancel_pinned_cond, NULL);
+	if (r) {
+		usbi_mutex_destroy(&_handle->flying_transfers_lock);
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	_handle->dev = NULL;
+	_handle->auto_detach_kernel_driver = 0;
+	_handle->claimed_interfaces = 0;
+	_handle->endpoint_stats = NULL;
+	_handle->cancel_pinned = NULL;
+	memset(_handle->stream_tables, 0, sizeof(_handle->stream_tables));
+	_handle->executor = NULL;
+	_handle->executor_user_data = NULL;
+	_handle->batch_callback = NULL;
+	_handle->batch_user_data = NULL;
+	_handle->batch = NULL;
+	_handle->batch_len = 0;
+	_handle->batch_size = 0;
+	list_init(&_handle->batch_list);
+	list_init(&_handle->flying_transfers);
+	list_init(&_handle->dev_buffers);
+	memset(&_handle->os_priv, 0, priv_size);
+
+	/* must be set before the backend adds the handle's event sources */
+	_handle->shard = usbi_assign_event_shard(ctx);
+
+	/* the synchronous I/O functions fall back to libusb_alloc_transfer()
+	 * if this fails, so it is not fatal */
+	if (libusb_transfer_pool_create(0, SYNC_POOL_MAX_CACHED, &_handle->sync_pool) < 0)
+		_handle->sync_pool = NULL;
+
+	*handle = _handle;
+	return 0;
+}
+
+/* free a handle that the backend failed to open. handle->dev may be NULL */
+static void free_device_handle(struct libusb_context *ctx,
+	struct libusb_device_handle *handle)
+{
+	usbi_release_event_shard(ctx, handle);
+	libusb_unref_device(handle->dev);
+	libusb_transfer_pool_destroy(handle->sync_pool);
+	usbi_cond_destroy(&handle->cancel_pinned_cond);
+	usbi_mutex_destroy(&handle->flying_transfers_lock);
+	usbi_mutex_destroy(&handle->lock);
+	free(handle);
+}
+
+static void add_open_device_handle(struct libusb_context *ctx,
+	struct libusb_device_handle *handle)
+{
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	handle->callback_worker = ctx->next_callback_worker++;
+	list_add(&handle->list, &ctx->open_devs);
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+}
+
 /** \ingroup dev
  * Open a device and obtain a device handle. A handle allows you to perform
  * I/O on the device in question.
@@ -1182,7 +1817,6 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct libusb_device_handle *_handle;
-	size_t priv_size = usbi_backend->device_handle_priv_size;
 	int r;
 	usbi_dbg("open %d.%d", dev->bus_number, dev->device_address);
 
@@ -1190,38 +1824,85 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
 
-	_handle = malloc(sizeof(*_handle) + priv_size);
-	if (!_handle)
-		return LIBUSB_ERROR_NO_MEM;
-
-	r = usbi_mutex_init(&_handle->lock, NULL);
-	if (r) {
-		free(_handle);
-		return LIBUSB_ERROR_OTHER;
-	}
-
+	r = alloc_device_handle(ctx, &_handle);
+	if (r < 0)
+		return r;
 	_handle->dev = libusb_ref_device(dev);
-	_handle->auto_detach_kernel_driver = 0;
-	_handle->claimed_interfaces = 0;
-	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
 	if (r < 0) {
 		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
-		libusb_unref_device(dev);
-		usbi_mutex_destroy(&_handle->lock);
-		free(_handle);
+		free_device_handle(ctx, _handle);
 		return r;
 	}
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
-	list_add(&_handle->list, &ctx->open_devs);
-	usbi_mutex_unlock(&ctx->open_devs_lock);
+	add_open_device_handle(ctx, _handle);
 	*handle = _handle;
 
 	return 0;
 }
 
+/** \ingroup dev
+ * Wrap a platform-specific system device handle and obtain a libusb device
+ * handle for the underlying device, for hosts on which applications get
+ * access to devices from elsewhere instead of through enumeration, such as
+ * Android. The handle allows you to perform I/O on the device in question.
+ *
+ * On Linux, the system device handle must be a file descriptor of an usbfs
+ * node opened for reading and writing, as handed out by UsbManager on
+ * Android. Its descriptors are read through the file descriptor, neither
+ * sysfs nor the usbfs directories are accessed. Set
+ * \ref LIBUSB_OPTION_WEAK_AUTHORITY before libusb_init() where the process
+ * cannot enumerate devices at all.
+ *
+ * The device of the returned handle is not part of the list returned by
+ * libusb_get_device_list() and hotplug callbacks are not called for it.
+ * Its bus number is 0 when it cannot be determined.
+ *
+ * The system device handle must remain valid until libusb_close() is
+ * called. It is not closed by libusb_close().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param sys_dev the platform-specific system device handle
+ * \param dev_handle output location for the returned device handle pointer.
+ * Only populated when the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_ACCESS if the user has insufficient permissions
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the operation is not supported on
+ * this platform
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
+	libusb_device_handle **dev_handle)
+{
+	struct libusb_device_handle *_handle;
+	int r;
+	USBI_GET_CONTEXT(ctx);
+	usbi_dbg("wrap_sys_device %p", (void *)sys_dev);
+
+	if (!usbi_backend->wrap_sys_device)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = alloc_device_handle(ctx, &_handle);
+	if (r < 0)
+		return r;
+
+	r = usbi_backend->wrap_sys_device(ctx, _handle, sys_dev);
+	if (r < 0) {
+		usbi_dbg("wrap_sys_device %p returns %d", (void *)sys_dev, r);
+		free_device_handle(ctx, _handle);
+		return r;
+	}
+
+	add_open_device_handle(ctx, _handle);
+	*dev_handle = _handle;
+
+	return 0;
+}
+
 /** \ingroup dev
  * Convenience function for finding a device with a particular
  * <tt>idVendor</tt>/<tt>idProduct</tt> combination. This function is intended
@@ -1282,21 +1963,22 @@ static void do_close(struct libusb_context *ctx,
 
 	libusb_lock_events(ctx);
 
+	/* completions not delivered yet, when closed from a callback */
+	usbi_flush_transfer_batch(dev_handle);
+
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	list_for_each_entry_safe(itransfer, tmp, &ctx->flying_transfers, list, struct usbi_transfer) {
+	list_for_each_entry_safe(itransfer, tmp, &dev_handle->flying_transfers, handle_list, struct usbi_transfer) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		long flags = usbi_atomic_load(&itransfer->flags);
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
-		if (!(itransfer->flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
+		if (!(flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
 
-			if (itransfer->flags & USBI_TRANSFER_CANCELLING)
+			if (flags & USBI_TRANSFER_CANCELLING)
 				usbi_warn(ctx, "A cancellation for an in-flight transfer hasn't completed but closing the device handle");
 			else
 				usbi_err(ctx, "A cancellation hasn't even been scheduled on the transfer for which the device is closing");
@@ -1306,8 +1988,14 @@ static void do_close(struct libusb_context *ctx,
 		 * we don't accidentally use the device handle in the future
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
+		/* an expiring timeout would cancel the transfer through the
+		 * handle, and the heap must not keep it once it is freed */
+		if (usbi_remove_from_timeout_heap(itransfer) != 0)
+			usbi_warn(ctx, "failed to rearm timer for the next timeout");
+
 		usbi_mutex_lock(&itransfer->lock);
-		list_del(&itransfer->list);
+		list_del(&itransfer->handle_list);
+		usbi_count_transfers_in_flight(dev_handle, -1);
 		transfer->dev_handle = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 
@@ -1318,17 +2006,34 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg("Removed transfer %p from the in-flight list because device handle %p closed",
 			 transfer, dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	libusb_unlock_events(ctx);
 
+	usbi_destroy_stream_tables(dev_handle, NULL, 0);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend->close(dev_handle);
+
+	/* buffers the application did not free stay mapped */
+	if (!list_empty(&dev_handle->dev_buffers)) {
+		struct usbi_dev_buffer *dev_buffer, *next;
+
+		usbi_warn(ctx, "device buffers not freed before close");
+		list_for_each_entry_safe(dev_buffer, next, &dev_handle->dev_buffers, list, struct usbi_dev_buffer)
+			free(dev_buffer);
+	}
+
 	libusb_unref_device(dev_handle->dev);
+	libusb_transfer_pool_destroy(dev_handle->sync_pool);
+	usbi_cond_destroy(&dev_handle->cancel_pinned_cond);
+	usbi_mutex_destroy(&dev_handle->flying_transfers_lock);
 	usbi_mutex_destroy(&dev_handle->lock);
+	free(dev_handle->endpoint_stats);
+	free(dev_handle->batch);
 	free(dev_handle);
 }
 
@@ -1346,6 +2051,7 @@ static void do_close(struct libusb_context *ctx,
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
+	struct usbi_event_shard *shard;
 	int pending_events;
 
 	if (!dev_handle)
@@ -1354,6 +2060,14 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	ctx = HANDLE_CTX(dev_handle);
 
+	/* a handle assigned to an event shard also has to keep the shard's
+	 * thread away from it while it is closed */
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	shard = dev_handle->shard;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	if (shard)
+		usbi_pause_event_shard(shard);
+
 	/* Similarly to libusb_open(), we want to interrupt all event handlers
 	 * at this point. More importantly, we want to perform the actual close of
 	 * the device while holding the event handling lock (preventing any other
@@ -1379,13 +2093,18 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 	 * Clear the event pipe if there are no further pending events. */
 	usbi_mutex_lock(&ctx->event_data_lock);
 	ctx->device_close--;
-	pending_events = usbi_pending_events(ctx);
-	if (!pending_events)
-		usbi_clear_event(&ctx->event);
+	usbi_clear_event_if_idle(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
 	/* Release event handling lock and wake up event waiters */
 	libusb_unlock_events(ctx);
+
+	if (shard) {
+		usbi_resume_event_shard(shard);
+		usbi_mutex_lock(&ctx->open_devs_lock);
+		shard->handles--;
+		usbi_mutex_unlock(&ctx->open_devs_lock);
+	}
 }
 
 /** \ingroup dev
@@ -1502,8 +2221,12 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg("configuration %d", configuration);
-	return usbi_backend->set_configuration(dev, configuration);
+	r = usbi_backend->set_configuration(dev, configuration);
+	invalidate_config_cache(dev->dev);
+	return r;
 }
 
 /** \ingroup dev
@@ -1694,11 +2417,87 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 {
+	int r;
+
 	usbi_dbg("");
 	if (!dev->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	return usbi_backend->reset_device(dev);
+	r = usbi_backend->reset_device(dev);
+	/* the device may come back with different strings or another
+	 * configuration, e.g. after a firmware update */
+	usbi_clear_string_cache(dev->dev);
+	invalidate_config_cache(dev->dev);
+	return r;
+}
+
+/** \ingroup dev
+ * Set a policy of the pipe of an endpoint, see \ref libusb_pipe_policy. The
+ * endpoint must belong to a claimed interface and the policy applies until
+ * the interface is released.
+ *
+ * Pipe policies are only available on Windows, for interfaces using the
+ * WinUSB or libusbK driver.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \param policy the policy to set
+ * \param value the new value of the policy
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint is not on a claimed
+ * interface
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms or drivers without the
+ * policy, or if the policy is read-only
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_pipe_policy(libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_pipe_policy policy,
+	unsigned int value)
+{
+	usbi_dbg("endpoint %x policy %d value %u", endpoint, policy, value);
+	if (!dev_handle->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (!usbi_backend->set_pipe_policy ||
+	    policy == LIBUSB_PIPE_POLICY_MAX_TRANSFER_SIZE)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return usbi_backend->set_pipe_policy(dev_handle, endpoint, policy, value);
+}
+
+/** \ingroup dev
+ * Read a policy of the pipe of an endpoint, see \ref libusb_pipe_policy and
+ * libusb_set_pipe_policy().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \param policy the policy to read
+ * \param value output location for the value of the policy. Only populated
+ * if the function returns 0
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint is not on a claimed
+ * interface
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms or drivers without the
+ * policy
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_pipe_policy(libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_pipe_policy policy,
+	unsigned int *value)
+{
+	if (!dev_handle->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (!usbi_backend->get_pipe_policy)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return usbi_backend->get_pipe_policy(dev_handle, endpoint, policy, value);
 }
 
 /** \ingroup asyncio
@@ -1714,6 +2513,11 @@ int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
  * If libusb_alloc_streams() returns with a value of N, you may use stream ids
  * 1 to N.
  *
+ * libusb keeps a table of the transfers in flight on each allocated stream.
+ * Queue one transfer per stream with a single libusb_submit_transfers() call,
+ * cancel the transfers of a stream with libusb_cancel_stream_transfers() and
+ * count them with libusb_get_stream_transfer_count().
+ *
  * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
  *
  * \param dev a device handle
@@ -1725,16 +2529,22 @@ int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 int API_EXPORTED libusb_alloc_streams(libusb_device_handle *dev,
 	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
 {
+	int r;
+
 	usbi_dbg("streams %u eps %d", (unsigned) num_streams, num_endpoints);
 
 	if (!dev->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend->alloc_streams)
-		return usbi_backend->alloc_streams(dev, num_streams, endpoints,
-						   num_endpoints);
-	else
+	if (!usbi_backend->alloc_streams)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend->alloc_streams(dev, num_streams, endpoints,
+					num_endpoints);
+	if (r > 0)
+		usbi_create_stream_tables(dev, (uint32_t) r, endpoints,
+					  num_endpoints);
+	return r;
 }
 
 /** \ingroup asyncio
@@ -1752,16 +2562,228 @@ int API_EXPORTED libusb_alloc_streams(libusb_device_handle *dev,
 int API_EXPORTED libusb_free_streams(libusb_device_handle *dev,
 	unsigned char *endpoints, int num_endpoints)
 {
+	int r;
+
 	usbi_dbg("eps %d", num_endpoints);
 
 	if (!dev->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend->free_streams)
-		return usbi_backend->free_streams(dev, endpoints,
-						  num_endpoints);
-	else
+	if (!usbi_backend->free_streams)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend->free_streams(dev, endpoints, num_endpoints);
+	if (r == LIBUSB_SUCCESS)
+		usbi_destroy_stream_tables(dev, endpoints, num_endpoints);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Attempts to allocate a block of persistent DMA memory suitable for
+ * transfers against the given device. If successful, this memory can be
+ * used as the buffer of transfers on the device handle, and the data does
+ * not need to be copied between user and kernel space during I/O.
+ *
+ * On platforms without such support, regular memory is allocated instead.
+ * It can be used in exactly the same way, it only lacks the zero-copy
+ * benefit. If the platform does have support but the allocation fails, NULL
+ * is returned and the application may fall back to a regular buffer.
+ *
+ * On Darwin the memory is wired by the first claimed interface of the handle
+ * and isochronous transfers on that interface which use it skip the memory
+ * preparation of each submission. Claim the interface first and free the
+ * memory before releasing it.
+ *
+ * The memory must be released with libusb_dev_mem_free() before the device
+ * handle is closed. Do not free it while a transfer using it is in flight,
+ * and do not use it with LIBUSB_TRANSFER_FREE_BUFFER.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param length size of the desired data buffer
+ * \returns a pointer to the newly allocated memory, or NULL on failure
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handle,
+	size_t length)
+{
+	if (!usbi_backend->dev_mem_alloc)
+		return malloc(length);
+
+	if (!dev_handle->dev->attached)
+		return NULL;
+
+	return usbi_backend->dev_mem_alloc(dev_handle, length);
+}
+
+/** \ingroup asyncio
+ * Free device memory allocated with libusb_dev_mem_alloc().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle the device handle the memory was allocated for
+ * \param buffer pointer to the previously allocated memory
+ * \param length size of the previously allocated memory
+ * \returns LIBUSB_SUCCESS, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length)
+{
+	if (!usbi_backend->dev_mem_alloc) {
+		free(buffer);
+		return LIBUSB_SUCCESS;
+	}
+
+	return usbi_backend->dev_mem_free(dev_handle, buffer, length);
+}
+
+/** \ingroup asyncio
+ * Allocate a transfer buffer in memory close to the host controller of the
+ * device, on the NUMA node reported by libusb_get_device_numa_node(). With
+ * \ref LIBUSB_DEV_BUFFER_HUGE_PAGES, huge pages are used when the system
+ * has some reserved, and transparent huge pages are requested otherwise.
+ *
+ * Unlike libusb_dev_mem_alloc() this is ordinary memory that the kernel
+ * copies from or maps during I/O, but it is available for any size. The
+ * memory of libusb_dev_mem_alloc() is allocated by the kernel, on Linux
+ * already on the node of the controller.
+ *
+ * Where memory cannot be placed on a node, regular memory is allocated. The
+ * memory must be released with libusb_dev_buffer_free(), not with free(),
+ * so do not use it with LIBUSB_TRANSFER_FREE_BUFFER. Free it before the
+ * device handle is closed.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param length size of the desired data buffer
+ * \param flags a bitwise OR of \ref libusb_dev_buffer_flags values
+ * \returns a pointer to the newly allocated memory, or NULL on failure
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_buffer_alloc(
+	libusb_device_handle *dev_handle, size_t length, uint32_t flags)
+{
+#if defined(PLATFORM_POSIX)
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_dev_buffer *dev_buffer;
+	void *buffer = MAP_FAILED;
+	int node, r;
+
+	if (length == 0)
+		return NULL;
+
+	dev_buffer = malloc(sizeof(*dev_buffer));
+	if (!dev_buffer)
+		return NULL;
+
+#ifdef MAP_HUGETLB
+	if (flags & LIBUSB_DEV_BUFFER_HUGE_PAGES) {
+		size_t huge = usbi_huge_page_size();
+
+		/* hugetlb mappings are unmapped in whole huge pages, the
+		 * length is rounded up and recorded for
+		 * libusb_dev_buffer_free() */
+		if (huge) {
+			size_t huge_length = (length + huge - 1) / huge * huge;
+
+			buffer = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (buffer != MAP_FAILED)
+				length = huge_length;
+			else
+				usbi_dbg("no huge pages available, errno %d", errno);
+		}
+	}
+#endif
+	if (buffer == MAP_FAILED) {
+		buffer = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffer == MAP_FAILED) {
+			usbi_err(ctx, "buffer allocation failed errno %d", errno);
+			free(dev_buffer);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (flags & LIBUSB_DEV_BUFFER_HUGE_PAGES)
+			madvise(buffer, length, MADV_HUGEPAGE);
+#endif
+	}
+
+	/* the pages are only populated by the first access */
+	node = libusb_get_device_numa_node(dev_handle->dev);
+	if (node >= 0) {
+		r = usbi_bind_memory(buffer, length, node);
+		if (r < 0)
+			usbi_dbg("buffer not placed on node %d: %s", node,
+				libusb_error_name(r));
+	}
+
+	dev_buffer->buffer = buffer;
+	dev_buffer->length = length;
+	usbi_mutex_lock(&dev_handle->lock);
+	list_add(&dev_buffer->list, &dev_handle->dev_buffers);
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	return buffer;
+#else
+	UNUSED(dev_handle);
+	UNUSED(flags);
+	return malloc(length);
+#endif
+}
+
+/** \ingroup asyncio
+ * Free a buffer allocated with libusb_dev_buffer_alloc(). Do not free it
+ * while a transfer using it is in flight.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle the device handle the memory was allocated for
+ * \param buffer pointer to the previously allocated memory
+ * \param length size of the previously allocated memory
+ * \returns LIBUSB_SUCCESS, or a LIBUSB_ERROR code on failure
+ * \returns LIBUSB_ERROR_INVALID_PARAM if buffer was not allocated for
+ * dev_handle
+ */
+int API_EXPORTED libusb_dev_buffer_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length)
+{
+#if defined(PLATFORM_POSIX)
+	struct usbi_dev_buffer *dev_buffer, *found = NULL;
+	int r;
+
+	/* the mapping may be longer than length, see libusb_dev_buffer_alloc() */
+	UNUSED(length);
+	usbi_mutex_lock(&dev_handle->lock);
+	list_for_each_entry(dev_buffer, &dev_handle->dev_buffers, list, struct usbi_dev_buffer) {
+		if (dev_buffer->buffer == buffer) {
+			list_del(&dev_buffer->list);
+			found = dev_buffer;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+	if (!found) {
+		usbi_err(HANDLE_CTX(dev_handle), "buffer %p not allocated for this handle",
+			(void *)buffer);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	r = munmap(buffer, found->length);
+	free(found);
+	if (r != 0) {
+		usbi_err(HANDLE_CTX(dev_handle), "buffer free failed errno %d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(dev_handle);
+	UNUSED(length);
+	free(buffer);
+	return LIBUSB_SUCCESS;
+#endif
 }
 
 /** \ingroup dev
@@ -1926,6 +2948,130 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 	USBI_GET_CONTEXT(ctx);
 	if (!ctx->debug_fixed)
 		ctx->debug = level;
+	usbi_update_log_level_max();
+}
+
+/** \ingroup lib
+ * Set an option in the library.
+ *
+ * Use this function to configure a specific option within the library.
+ * Some options require one or more arguments to be provided. Consult each
+ * option's documentation for specific requirements.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param option which option to set
+ * \param ... any required arguments for the specified option
+ * \returns LIBUSB_SUCCESS on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the option or arguments are invalid
+ */
+int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
+	enum libusb_option option, ...)
+{
+	int r = LIBUSB_SUCCESS;
+	va_list ap;
+
+	va_start(ap, option);
+
+	/* with a NULL context, the default of the contexts initialized
+	 * afterwards, so that it works before libusb_init() */
+	if (option == LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY) {
+		int defer = va_arg(ap, int) != 0;
+
+		va_end(ap);
+		if (!ctx) {
+			usbi_mutex_static_lock(&default_context_lock);
+			default_defer_device_discovery = defer;
+			usbi_mutex_static_unlock(&default_context_lock);
+			return LIBUSB_SUCCESS;
+		}
+
+		/* a context can only stop deferring, by scanning now */
+		usbi_mutex_lock(&ctx->device_scan_lock);
+		if (!defer && ctx->device_scan_deferred) {
+			r = usbi_backend->scan_devices(ctx);
+			if (r >= 0)
+				ctx->device_scan_deferred = 0;
+		}
+		usbi_mutex_unlock(&ctx->device_scan_lock);
+		return r;
+	}
+	if (option == LIBUSB_OPTION_WEAK_AUTHORITY && !ctx) {
+		usbi_mutex_static_lock(&default_context_lock);
+		weak_authority = va_arg(ap, int) != 0;
+		usbi_mutex_static_unlock(&default_context_lock);
+		va_end(ap);
+		return LIBUSB_SUCCESS;
+	}
+
+	USBI_GET_CONTEXT(ctx);
+
+	switch (option) {
+	case LIBUSB_OPTION_LOG_LEVEL:
+		libusb_set_debug(ctx, va_arg(ap, int));
+		break;
+	case LIBUSB_OPTION_WEAK_AUTHORITY:
+		ctx->weak_authority = va_arg(ap, int) != 0;
+		break;
+	case LIBUSB_OPTION_EVENT_BUDGET:
+		ctx->event_budget = va_arg(ap, unsigned int);
+		break;
+	case LIBUSB_OPTION_ENDPOINT_QUEUE_DEPTH:
+		ctx->endpoint_queue_depth = va_arg(ap, unsigned int);
+		break;
+	case LIBUSB_OPTION_BUSY_POLL:
+		ctx->busy_poll_us = va_arg(ap, unsigned int);
+		break;
+	case LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS:
+		ctx->cache_string_descriptors = va_arg(ap, int) != 0;
+		break;
+	case LIBUSB_OPTION_NUMA_NODE: {
+		int node = va_arg(ap, int);
+
+		if (node < -1)
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		else
+			ctx->numa_node = node;
+		break;
+	}
+	case LIBUSB_OPTION_EVENT_THREAD:
+		if (va_arg(ap, int))
+			r = usbi_start_event_thread(ctx);
+		else
+			usbi_stop_event_thread(ctx);
+		break;
+	case LIBUSB_OPTION_COLLECT_STATS:
+		r = usbi_set_collect_stats(ctx, va_arg(ap, int));
+		break;
+	case LIBUSB_OPTION_EVENT_SHARDS: {
+		int count = va_arg(ap, int);
+
+		/* the cpus only follow a count that starts the shards */
+		if (count > 0)
+			r = usbi_start_event_shards(ctx, count,
+				va_arg(ap, const int *));
+		else if (count == 0)
+			r = usbi_stop_event_shards(ctx, 0);
+		else
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		break;
+	}
+	case LIBUSB_OPTION_CALLBACK_WORKERS: {
+		int count = va_arg(ap, int);
+
+		if (count)
+			r = usbi_start_callback_workers(ctx, count);
+		else
+			usbi_stop_callback_workers(ctx);
+		break;
+	}
+	default:
+		r = LIBUSB_ERROR_INVALID_PARAM;
+	}
+	va_end(ap);
+
+	return r;
 }
 
 /** \ingroup lib
@@ -1936,6 +3082,12 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
  * context will be created. If there was already a default context, it will
  * be reused (and nothing will be initialized/reinitialized).
  *
+ * If the LIBUSB_DEVICE_SNAPSHOT environment variable names a file written
+ * from libusb_export_device_snapshot(), backends that support it take device
+ * descriptors from the snapshot rather than reading them again. With
+ * \ref LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY set, devices are not scanned here
+ * at all. Probing the operating system is done once per process.
+ *
  * \param context Optional output location for context pointer.
  * Only valid on return code 0.
  * \returns 0 on success, or a LIBUSB_ERROR code on failure
@@ -1945,9 +3097,10 @@ int API_EXPORTED libusb_init(libusb_context **context)
 {
 	struct libusb_device *dev, *next;
 	char *dbg = getenv("LIBUSB_DEBUG");
+	char *snapshot = getenv("LIBUSB_DEVICE_SNAPSHOT");
 	struct libusb_context *ctx;
 	static int first_init = 1;
-	int r = 0;
+	int i, r = 0;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -1977,6 +3130,12 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		if (ctx->debug)
 			ctx->debug_fixed = 1;
 	}
+	r = init_device_hash(ctx);
+	if (r < 0) {
+		free(ctx);
+		goto err_unlock;
+	}
+	ctx->numa_node = -1;
 
 	/* default context should be initialized before calling usbi_dbg */
 	if (!usbi_default_context) {
@@ -1990,10 +3149,14 @@ int API_EXPORTED libusb_init(libusb_context **context)
 
 	usbi_mutex_init(&ctx->usb_devs_lock, NULL);
 	usbi_mutex_init(&ctx->open_devs_lock, NULL);
+	usbi_mutex_init(&ctx->device_scan_lock, NULL);
 	usbi_mutex_init(&ctx->hotplug_cbs_lock, NULL);
 	list_init(&ctx->usb_devs);
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
+	list_init(&ctx->hotplug_wildcard_cbs);
+	for (i = 0; i < (1 << USBI_HOTPLUG_CB_BUCKET_BITS); i++)
+		list_init(&ctx->hotplug_cb_buckets[i]);
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	if (first_init) {
@@ -2002,6 +3165,15 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	}
 	list_add (&ctx->list, &active_contexts_list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
+	usbi_update_log_level_max();
+
+	/* an unusable snapshot only means a full scan */
+	if (snapshot && *snapshot)
+		usbi_load_device_snapshot(ctx, snapshot);
+
+	ctx->weak_authority = weak_authority;
+	ctx->device_scan_deferred = default_defer_device_discovery &&
+		!weak_authority && usbi_backend->scan_devices != NULL;
 
 	if (usbi_backend->init) {
 		r = usbi_backend->init(ctx);
@@ -2032,14 +3204,20 @@ err_free_ctx:
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
+	usbi_update_log_level_max();
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
-		list_del(&dev->list);
+		remove_device_locked(ctx, dev);
 		libusb_unref_device(dev);
 	}
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	clear_device_changes(ctx);
 
+	free(ctx->snapshot);
+	free(ctx->session_hash);
+	free(ctx->port_path_hash);
+	usbi_mutex_destroy(&ctx->device_scan_lock);
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
@@ -2080,6 +3258,11 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
+	usbi_update_log_level_max();
+
+	usbi_stop_event_shards(ctx, 1);
+	usbi_stop_event_thread(ctx);
+	usbi_stop_callback_workers(ctx);
 
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbi_hotplug_deregister_all(ctx);
@@ -2098,10 +3281,17 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 		list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
-			list_del(&dev->list);
+			remove_device_locked(ctx, dev);
 			libusb_unref_device(dev);
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		clear_device_changes(ctx);
+	}
+
+	/* drop the references held by the cached device list */
+	if (ctx->cached_discdevs) {
+		discovered_devs_free(ctx->cached_discdevs);
+		ctx->cached_discdevs = NULL;
 	}
 
 	/* a few sanity checks. don't bother with locking because unless
@@ -2115,6 +3305,10 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	if (usbi_backend->exit)
 		usbi_backend->exit();
 
+	free(ctx->snapshot);
+	free(ctx->session_hash);
+	free(ctx->port_path_hash);
+	usbi_mutex_destroy(&ctx->device_scan_lock);
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
@@ -2234,6 +3428,38 @@ static void usbi_log_str(struct libusb_context *ctx,
 	UNUSED(level);
 }
 
+/* the level set by the LIBUSB_DEBUG environment variable, read once */
+static int get_env_log_level(void)
+{
+	static int env_level = -1;
+	char *dbg;
+
+	if (env_level < 0) {
+		dbg = getenv("LIBUSB_DEBUG");
+		env_level = dbg ? atoi(dbg) : 0;
+	}
+	return env_level;
+}
+
+/* recompute usbi_log_level_max after a context was added or removed, or
+ * its level changed */
+void usbi_update_log_level_max(void)
+{
+	struct libusb_context *ctx;
+	int level = get_env_log_level();
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	if (active_contexts_list.next) {
+		list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+			if (ctx->debug > level)
+				level = ctx->debug;
+		}
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	usbi_log_level_max = level;
+}
+
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args)
 {
@@ -2250,13 +3476,10 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	int ctx_level = 0;
 
 	USBI_GET_CONTEXT(ctx);
-	if (ctx) {
+	if (ctx)
 		ctx_level = ctx->debug;
-	} else {
-		char *dbg = getenv("LIBUSB_DEBUG");
-		if (dbg)
-			ctx_level = atoi(dbg);
-	}
+	else
+		ctx_level = get_env_log_level();
 	global_debug = (ctx_level == LIBUSB_LOG_LEVEL_DEBUG);
 	if (!ctx_level)
 		return;
@@ -23,6 +23,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -92,15 +93,89 @@ int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	return (int) (sp - source);
 }
 
-static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
+/* A parsed configuration descriptor is laid out in a single allocation, which
+ * is released with one free(). parse_configuration() runs twice over the raw
+ * descriptors: the first pass only counts the altsettings, endpoints and
+ * extra bytes that will be needed, the second carves them out of the arena.
+ * Each kind of object has its own region so that the structures a caller
+ * walks through sit next to each other in memory:
+ *
+ *   config | interfaces | altsettings | endpoints | extra descriptor bytes
+ */
+struct config_arena {
+	int sizing;
+
+	/* sizing pass: objects are parsed into scratch space and counted */
+	struct libusb_config_descriptor scratch_config;
+	struct libusb_interface scratch_interfaces[USB_MAXINTERFACES];
+	struct libusb_interface_descriptor scratch_altsetting;
+	struct libusb_endpoint_descriptor scratch_endpoints[USB_MAXENDPOINTS];
+	unsigned char scratch_extra[1];
+
+	/* number of objects counted (sizing pass) or left (layout pass) */
+	size_t num_altsettings;
+	size_t num_endpoints;
+	size_t extra_length;
+
+	/* layout pass: next free object in each region */
+	struct libusb_interface_descriptor *altsettings;
+	struct libusb_endpoint_descriptor *endpoints;
+	unsigned char *extra;
+};
+
+static struct libusb_interface_descriptor *arena_alloc_altsetting(
+	struct config_arena *arena)
+{
+	if (arena->sizing) {
+		arena->num_altsettings++;
+		return &arena->scratch_altsetting;
+	}
+	if (!arena->num_altsettings)
+		return NULL;
+	arena->num_altsettings--;
+	return arena->altsettings++;
+}
+
+static struct libusb_endpoint_descriptor *arena_alloc_endpoints(
+	struct config_arena *arena, size_t count)
 {
-	if (endpoint->extra)
-		free((unsigned char *) endpoint->extra);
+	struct libusb_endpoint_descriptor *endpoints;
+
+	if (arena->sizing) {
+		arena->num_endpoints += count;
+		endpoints = arena->scratch_endpoints;
+	} else {
+		if (arena->num_endpoints < count)
+			return NULL;
+		arena->num_endpoints -= count;
+		endpoints = arena->endpoints;
+		arena->endpoints += count;
+	}
+	memset(endpoints, 0, count * sizeof(*endpoints));
+	return endpoints;
+}
+
+static unsigned char *arena_copy_extra(struct config_arena *arena,
+	const unsigned char *src, size_t len)
+{
+	unsigned char *extra;
+
+	if (arena->sizing) {
+		arena->extra_length += len;
+		return arena->scratch_extra;
+	}
+	if (arena->extra_length < len)
+		return NULL;
+	arena->extra_length -= len;
+	extra = arena->extra;
+	arena->extra += len;
+	memcpy(extra, src, len);
+	return extra;
 }
 
 static int parse_endpoint(struct libusb_context *ctx,
-	struct libusb_endpoint_descriptor *endpoint, unsigned char *buffer,
-	int size, int host_endian)
+	struct config_arena *arena, struct libusb_endpoint_descriptor *endpoint,
+	unsigned char *buffer, int size, int host_endian)
 {
 	struct usb_descriptor_header header;
 	unsigned char *extra;
@@ -160,7 +235,8 @@ static int parse_endpoint(struct libusb_context *ctx,
 				(header.bDescriptorType == LIBUSB_DT_DEVICE))
 			break;
 
-		usbi_dbg("skipping descriptor %x", header.bDescriptorType);
+		if (!arena->sizing)
+			usbi_dbg("skipping descriptor %x", header.bDescriptorType);
 		buffer += header.bLength;
 		size -= header.bLength;
 		parsed += header.bLength;
@@ -175,45 +251,18 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 
-	extra = malloc(len);
+	extra = arena_copy_extra(arena, begin, len);
 	endpoint->extra = extra;
 	if (!extra) {
 		endpoint->extra_length = 0;
-		return LIBUSB_ERROR_NO_MEM;
+		return LIBUSB_ERROR_OTHER;
 	}
-
-	memcpy(extra, begin, len);
 	endpoint->extra_length = len;
 
 	return parsed;
 }
 
-static void clear_interface(struct libusb_interface *usb_interface)
-{
-	int i;
-	int j;
-
-	if (usb_interface->altsetting) {
-		for (i = 0; i < usb_interface->num_altsetting; i++) {
-			struct libusb_interface_descriptor *ifp =
-				(struct libusb_interface_descriptor *)
-				usb_interface->altsetting + i;
-			if (ifp->extra)
-				free((void *) ifp->extra);
-			if (ifp->endpoint) {
-				for (j = 0; j < ifp->bNumEndpoints; j++)
-					clear_endpoint((struct libusb_endpoint_descriptor *)
-						ifp->endpoint + j);
-				free((void *) ifp->endpoint);
-			}
-		}
-		free((void *) usb_interface->altsetting);
-		usb_interface->altsetting = NULL;
-	}
-
-}
-
-static int parse_interface(libusb_context *ctx,
+static int parse_interface(libusb_context *ctx, struct config_arena *arena,
 	struct libusb_interface *usb_interface, unsigned char *buffer, int size,
 	int host_endian)
 {
@@ -222,26 +271,21 @@ static int parse_interface(libusb_context *ctx,
 	int r;
 	int parsed = 0;
 	int interface_number = -1;
-	size_t tmp;
 	struct usb_descriptor_header header;
 	struct libusb_interface_descriptor *ifp;
 	unsigned char *begin;
 
+	usb_interface->altsetting = NULL;
 	usb_interface->num_altsetting = 0;
 
 	while (size >= INTERFACE_DESC_LENGTH) {
-		struct libusb_interface_descriptor *altsetting =
-			(struct libusb_interface_descriptor *) usb_interface->altsetting;
-		altsetting = usbi_reallocf(altsetting,
-			sizeof(struct libusb_interface_descriptor) *
-			(usb_interface->num_altsetting + 1));
-		if (!altsetting) {
-			r = LIBUSB_ERROR_NO_MEM;
-			goto err;
-		}
-		usb_interface->altsetting = altsetting;
+		/* altsettings of one interface are allocated back to back */
+		ifp = arena_alloc_altsetting(arena);
+		if (!ifp)
+			return LIBUSB_ERROR_OTHER;
+		if (!usb_interface->altsetting)
+			usb_interface->altsetting = ifp;
 
-		ifp = altsetting + usb_interface->num_altsetting;
 		usbi_parse_descriptor(buffer, "bbbbbbbbb", ifp, 0);
 		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
 			usbi_err(ctx, "unexpected descriptor %x (expected %x)",
@@ -251,8 +295,7 @@ static int parse_interface(libusb_context *ctx,
 		if (ifp->bLength < INTERFACE_DESC_LENGTH) {
 			usbi_err(ctx, "invalid interface bLength (%d)",
 				 ifp->bLength);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+			return LIBUSB_ERROR_IO;
 		}
 		if (ifp->bLength > size) {
 			usbi_warn(ctx, "short intf descriptor read %d/%d",
@@ -261,8 +304,7 @@ static int parse_interface(libusb_context *ctx,
 		}
 		if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
 			usbi_err(ctx, "too many endpoints (%d)", ifp->bNumEndpoints);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+			return LIBUSB_ERROR_IO;
 		}
 
 		usb_interface->num_altsetting++;
@@ -287,8 +329,7 @@ static int parse_interface(libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra intf desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra intf desc read %d/%d",
@@ -312,34 +353,28 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len) {
-			ifp->extra = malloc(len);
-			if (!ifp->extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
-			memcpy((unsigned char *) ifp->extra, begin, len);
+			ifp->extra = arena_copy_extra(arena, begin, len);
+			if (!ifp->extra)
+				return LIBUSB_ERROR_OTHER;
 			ifp->extra_length = len;
 		}
 
 		if (ifp->bNumEndpoints > 0) {
 			struct libusb_endpoint_descriptor *endpoint;
-			tmp = ifp->bNumEndpoints * sizeof(struct libusb_endpoint_descriptor);
-			endpoint = malloc(tmp);
+
+			endpoint = arena_alloc_endpoints(arena, ifp->bNumEndpoints);
 			ifp->endpoint = endpoint;
-			if (!endpoint) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			if (!endpoint)
+				return LIBUSB_ERROR_OTHER;
 
-			memset(endpoint, 0, tmp);
 			for (i = 0; i < ifp->bNumEndpoints; i++) {
-				r = parse_endpoint(ctx, endpoint + i, buffer, size,
-					host_endian);
+				r = parse_endpoint(ctx, arena, endpoint + i, buffer,
+					size, host_endian);
 				if (r < 0)
-					goto err;
+					return r;
 				if (r == 0) {
 					ifp->bNumEndpoints = (uint8_t)i;
-					break;;
+					break;
 				}
 
 				buffer += r;
@@ -357,67 +392,23 @@ static int parse_interface(libusb_context *ctx,
 	}
 
 	return parsed;
-err:
-	clear_interface(usb_interface);
-	return r;
 }
 
-static void clear_configuration(struct libusb_config_descriptor *config)
-{
-	if (config->interface) {
-		int i;
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface((struct libusb_interface *)
-				config->interface + i);
-		free((void *) config->interface);
-	}
-	if (config->extra)
-		free((void *) config->extra);
-}
-
-static int parse_configuration(struct libusb_context *ctx,
-	struct libusb_config_descriptor *config, unsigned char *buffer,
-	int size, int host_endian)
+/* One pass over the raw configuration descriptor. usb_interface must have
+ * room for bNumInterfaces entries; the header has already been validated. */
+static int parse_configuration_pass(struct libusb_context *ctx,
+	struct config_arena *arena, struct libusb_config_descriptor *config,
+	struct libusb_interface *usb_interface, unsigned char *buffer, int size,
+	int host_endian)
 {
 	int i;
 	int r;
-	size_t tmp;
 	struct usb_descriptor_header header;
-	struct libusb_interface *usb_interface;
-
-	if (size < LIBUSB_DT_CONFIG_SIZE) {
-		usbi_err(ctx, "short config descriptor read %d/%d",
-			 size, LIBUSB_DT_CONFIG_SIZE);
-		return LIBUSB_ERROR_IO;
-	}
 
 	usbi_parse_descriptor(buffer, "bbwbbbbb", config, host_endian);
-	if (config->bDescriptorType != LIBUSB_DT_CONFIG) {
-		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
-			 config->bDescriptorType, LIBUSB_DT_CONFIG);
-		return LIBUSB_ERROR_IO;
-	}
-	if (config->bLength < LIBUSB_DT_CONFIG_SIZE) {
-		usbi_err(ctx, "invalid config bLength (%d)", config->bLength);
-		return LIBUSB_ERROR_IO;
-	}
-	if (config->bLength > size) {
-		usbi_err(ctx, "short config descriptor read %d/%d",
-			 size, config->bLength);
-		return LIBUSB_ERROR_IO;
-	}
-	if (config->bNumInterfaces > USB_MAXINTERFACES) {
-		usbi_err(ctx, "too many interfaces (%d)", config->bNumInterfaces);
-		return LIBUSB_ERROR_IO;
-	}
 
-	tmp = config->bNumInterfaces * sizeof(struct libusb_interface);
-	usb_interface = malloc(tmp);
+	memset(usb_interface, 0, config->bNumInterfaces * sizeof(*usb_interface));
 	config->interface = usb_interface;
-	if (!config->interface)
-		return LIBUSB_ERROR_NO_MEM;
-
-	memset(usb_interface, 0, tmp);
 	buffer += config->bLength;
 	size -= config->bLength;
 
@@ -438,8 +429,7 @@ static int parse_configuration(struct libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra config desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra config desc read %d/%d",
@@ -455,7 +445,8 @@ static int parse_configuration(struct libusb_context *ctx,
 					(header.bDescriptorType == LIBUSB_DT_DEVICE))
 				break;
 
-			usbi_dbg("skipping descriptor 0x%x", header.bDescriptorType);
+			if (!arena->sizing)
+				usbi_dbg("skipping descriptor 0x%x", header.bDescriptorType);
 			buffer += header.bLength;
 			size -= header.bLength;
 		}
@@ -466,20 +457,17 @@ static int parse_configuration(struct libusb_context *ctx,
 		if (len) {
 			/* FIXME: We should realloc and append here */
 			if (!config->extra_length) {
-				config->extra = malloc(len);
-				if (!config->extra) {
-					r = LIBUSB_ERROR_NO_MEM;
-					goto err;
-				}
-
-				memcpy((unsigned char *) config->extra, begin, len);
+				config->extra = arena_copy_extra(arena, begin, len);
+				if (!config->extra)
+					return LIBUSB_ERROR_OTHER;
 				config->extra_length = len;
 			}
 		}
 
-		r = parse_interface(ctx, usb_interface + i, buffer, size, host_endian);
+		r = parse_interface(ctx, arena, usb_interface + i, buffer, size,
+			host_endian);
 		if (r < 0)
-			goto err;
+			return r;
 		if (r == 0) {
 			config->bNumInterfaces = (uint8_t)i;
 			break;
@@ -490,9 +478,96 @@ static int parse_configuration(struct libusb_context *ctx,
 	}
 
 	return size;
+}
 
-err:
-	clear_configuration(config);
+/* Parse a raw configuration descriptor into a newly allocated
+ * libusb_config_descriptor. Returns the number of bytes left over, or a
+ * LIBUSB_ERROR code. */
+static int parse_configuration(struct libusb_context *ctx,
+	struct libusb_config_descriptor **config, unsigned char *buffer,
+	int size, int host_endian)
+{
+	struct config_arena *arena;
+	struct libusb_config_descriptor *_config;
+	struct libusb_interface *usb_interface;
+	size_t num_interfaces, alloc_size;
+	unsigned char *p;
+	int r;
+
+	if (size < LIBUSB_DT_CONFIG_SIZE) {
+		usbi_err(ctx, "short config descriptor read %d/%d",
+			 size, LIBUSB_DT_CONFIG_SIZE);
+		return LIBUSB_ERROR_IO;
+	}
+
+	/* validate the header once, before either pass */
+	if (buffer[1] != LIBUSB_DT_CONFIG) {
+		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
+			 buffer[1], LIBUSB_DT_CONFIG);
+		return LIBUSB_ERROR_IO;
+	}
+	if (buffer[0] < LIBUSB_DT_CONFIG_SIZE) {
+		usbi_err(ctx, "invalid config bLength (%d)", buffer[0]);
+		return LIBUSB_ERROR_IO;
+	}
+	if (buffer[0] > size) {
+		usbi_err(ctx, "short config descriptor read %d/%d",
+			 size, buffer[0]);
+		return LIBUSB_ERROR_IO;
+	}
+	if (buffer[4] > USB_MAXINTERFACES) {
+		usbi_err(ctx, "too many interfaces (%d)", buffer[4]);
+		return LIBUSB_ERROR_IO;
+	}
+	num_interfaces = buffer[4];
+
+	/* the scratch space is too big for the stack */
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* pass one: size the tree */
+	arena->sizing = 1;
+	r = parse_configuration_pass(ctx, arena, &arena->scratch_config,
+		arena->scratch_interfaces, buffer, size, host_endian);
+	if (r < 0) {
+		free(arena);
+		return r;
+	}
+
+	/* pass two: lay it out in a single block. Every structure size is a
+	 * multiple of its alignment, so the regions need no padding. */
+	alloc_size = sizeof(*_config)
+		+ num_interfaces * sizeof(struct libusb_interface)
+		+ arena->num_altsettings * sizeof(struct libusb_interface_descriptor)
+		+ arena->num_endpoints * sizeof(struct libusb_endpoint_descriptor)
+		+ arena->extra_length;
+	p = malloc(alloc_size);
+	if (!p) {
+		free(arena);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_config = (struct libusb_config_descriptor *) p;
+	p += sizeof(*_config);
+	usb_interface = (struct libusb_interface *) p;
+	p += num_interfaces * sizeof(struct libusb_interface);
+	arena->altsettings = (struct libusb_interface_descriptor *) p;
+	p += arena->num_altsettings * sizeof(struct libusb_interface_descriptor);
+	arena->endpoints = (struct libusb_endpoint_descriptor *) p;
+	p += arena->num_endpoints * sizeof(struct libusb_endpoint_descriptor);
+	arena->extra = p;
+	arena->sizing = 0;
+
+	r = parse_configuration_pass(ctx, arena, _config, usb_interface,
+		buffer, size, host_endian);
+	free(arena);
+	if (r < 0) {
+		free(_config);
+		return r;
+	}
+
+	*config = _config;
 	return r;
 }
 
@@ -500,22 +575,16 @@ static int raw_desc_to_config(struct libusb_context *ctx,
 	unsigned char *buf, int size, int host_endian,
 	struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
 	int r;
-	
-	if (!_config)
-		return LIBUSB_ERROR_NO_MEM;
 
-	r = parse_configuration(ctx, _config, buf, size, host_endian);
+	r = parse_configuration(ctx, config, buf, size, host_endian);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
-	
-	*config = _config;
+
 	return LIBUSB_SUCCESS;
 }
 
@@ -740,13 +809,228 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 void API_EXPORTED libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config)
 {
-	if (!config)
-		return;
-
-	clear_configuration(config);
+	/* the whole descriptor tree lives in a single allocation */
 	free(config);
 }
 
+/* get a pointer to the raw descriptors of a configuration from the backend's
+ * descriptor cache */
+static int get_raw_config_descriptor_by_value(struct libusb_device *dev,
+	uint8_t bConfigurationValue, const unsigned char **buffer)
+{
+	unsigned char *buf;
+	int host_endian = 0;
+	int r;
+
+	r = usbi_backend->get_config_descriptor_by_value(dev,
+		bConfigurationValue, &buf, &host_endian);
+	if (r < 0)
+		return r;
+	if (host_endian)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (r < LIBUSB_DT_CONFIG_SIZE) {
+		usbi_err(dev->ctx, "short config descriptor %d/%d",
+			 r, LIBUSB_DT_CONFIG_SIZE);
+		return LIBUSB_ERROR_IO;
+	}
+
+	*buffer = buf;
+	return r;
+}
+
+/** \ingroup desc
+ * Get the raw descriptors of the currently active configuration, as sent by
+ * the device. This is a non-blocking function which does not involve any
+ * requests being sent to the device, and which does not allocate or copy
+ * anything: the returned buffer lives in the descriptor cache of the device.
+ * Walk it with libusb_next_descriptor() or libusb_find_descriptor().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev a device
+ * \param buffer output location for the raw configuration descriptor,
+ * followed by all its interface, endpoint and class-specific descriptors.
+ * Only valid if a length was returned, and for as long as you hold a
+ * reference to dev.
+ * \returns the length of the buffer in bytes on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the device is in unconfigured state
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not cache raw
+ * descriptors
+ * \returns another LIBUSB_ERROR code on error
+ * \see libusb_get_active_config_descriptor
+ */
+int API_EXPORTED libusb_get_raw_active_config_descriptor(libusb_device *dev,
+	const unsigned char **buffer)
+{
+	unsigned char tmp[LIBUSB_DT_CONFIG_SIZE];
+	int host_endian = 0;
+	int r;
+
+	if (!usbi_backend->get_config_descriptor_by_value)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend->get_active_config_descriptor(dev, tmp,
+		LIBUSB_DT_CONFIG_SIZE, &host_endian);
+	if (r < 0)
+		return r;
+	if (r < LIBUSB_DT_CONFIG_SIZE) {
+		usbi_err(dev->ctx, "short config descriptor read %d/%d",
+			 r, LIBUSB_DT_CONFIG_SIZE);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return get_raw_config_descriptor_by_value(dev, tmp[5], buffer);
+}
+
+/** \ingroup desc
+ * Get the raw descriptors of a configuration based on its index. Like
+ * libusb_get_raw_active_config_descriptor(), this does not perform any I/O
+ * nor allocate memory.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev a device
+ * \param config_index the index of the configuration you wish to retrieve
+ * \param buffer output location for the raw descriptors. Only valid if a
+ * length was returned, and for as long as you hold a reference to dev.
+ * \returns the length of the buffer in bytes on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the configuration does not exist
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not cache raw
+ * descriptors
+ * \returns another LIBUSB_ERROR code on error
+ * \see libusb_get_config_descriptor
+ */
+int API_EXPORTED libusb_get_raw_config_descriptor(libusb_device *dev,
+	uint8_t config_index, const unsigned char **buffer)
+{
+	unsigned char tmp[LIBUSB_DT_CONFIG_SIZE];
+	int host_endian = 0;
+	int r;
+
+	if (config_index >= dev->num_configurations)
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (!usbi_backend->get_config_descriptor_by_value)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend->get_config_descriptor(dev, config_index, tmp,
+		LIBUSB_DT_CONFIG_SIZE, &host_endian);
+	if (r < 0)
+		return r;
+	if (r < LIBUSB_DT_CONFIG_SIZE) {
+		usbi_err(dev->ctx, "short config descriptor read %d/%d",
+			 r, LIBUSB_DT_CONFIG_SIZE);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return get_raw_config_descriptor_by_value(dev, tmp[5], buffer);
+}
+
+/** \ingroup desc
+ * Step to the next descriptor of a raw descriptor buffer. The view describes
+ * the descriptor in place, along with the interface and endpoint it belongs
+ * to, so looking for a particular descriptor requires neither memory
+ * allocation nor copies.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param iter an iterator set up with libusb_init_descriptor_iterator()
+ * \param view output location for the descriptor. Only valid if 1 was
+ * returned.
+ * \returns 1 if a descriptor was found
+ * \returns 0 at the end of the buffer
+ * \returns LIBUSB_ERROR_IO if the buffer is malformed. In that case all
+ * further calls will fail in the same way.
+ */
+int API_EXPORTED libusb_next_descriptor(struct libusb_descriptor_iterator *iter,
+	struct libusb_descriptor_view *view)
+{
+	const unsigned char *desc;
+	int remaining = iter->length - iter->offset;
+	int min_length;
+
+	if (remaining <= 0)
+		return 0;
+	if (remaining < DESC_HEADER_LENGTH)
+		return LIBUSB_ERROR_IO;
+
+	desc = iter->buffer + iter->offset;
+	switch (desc[1]) {
+	case LIBUSB_DT_CONFIG:
+		min_length = CONFIG_DESC_LENGTH;
+		break;
+	case LIBUSB_DT_INTERFACE:
+		min_length = INTERFACE_DESC_LENGTH;
+		break;
+	case LIBUSB_DT_ENDPOINT:
+		min_length = ENDPOINT_DESC_LENGTH;
+		break;
+	case LIBUSB_DT_SS_ENDPOINT_COMPANION:
+		min_length = LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE;
+		break;
+	default:
+		min_length = DESC_HEADER_LENGTH;
+		break;
+	}
+
+	if (desc[0] < min_length || desc[0] > remaining) {
+		usbi_dbg("invalid descriptor length %d (type 0x%02x, %d bytes left)",
+			 desc[0], desc[1], remaining);
+		return LIBUSB_ERROR_IO;
+	}
+
+	switch (desc[1]) {
+	case LIBUSB_DT_CONFIG:
+		iter->interface_number = -1;
+		iter->altsetting = -1;
+		iter->endpoint_address = -1;
+		break;
+	case LIBUSB_DT_INTERFACE:
+		iter->interface_number = desc[2];
+		iter->altsetting = desc[3];
+		iter->endpoint_address = -1;
+		break;
+	case LIBUSB_DT_ENDPOINT:
+		iter->endpoint_address = desc[2];
+		break;
+	}
+
+	view->data = desc;
+	view->bLength = desc[0];
+	view->bDescriptorType = desc[1];
+	view->interface_number = iter->interface_number;
+	view->altsetting = iter->altsetting;
+	view->endpoint_address = iter->endpoint_address;
+
+	iter->offset += desc[0];
+	return 1;
+}
+
+/** \ingroup desc
+ * Step to the next descriptor of a given type. See libusb_next_descriptor().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param iter an iterator set up with libusb_init_descriptor_iterator()
+ * \param descriptor_type the bDescriptorType to look for, which may be a
+ * class-specific type
+ * \param view output location for the descriptor. Only valid if 1 was
+ * returned.
+ * \returns 1 if a descriptor was found
+ * \returns 0 if the end of the buffer was reached first
+ * \returns LIBUSB_ERROR_IO if the buffer is malformed
+ */
+int API_EXPORTED libusb_find_descriptor(struct libusb_descriptor_iterator *iter,
+	uint8_t descriptor_type, struct libusb_descriptor_view *view)
+{
+	int r;
+
+	do {
+		r = libusb_next_descriptor(iter, view);
+	} while (r == 1 && view->bDescriptorType != descriptor_type);
+
+	return r;
+}
+
 /** \ingroup desc
  * Get an endpoints superspeed endpoint companion descriptor (if any)
  *
@@ -1135,12 +1419,151 @@ void API_EXPORTED libusb_free_container_id_descriptor(
 	free(container_id);
 }
 
+/* Copy a cached string descriptor into data, which holds 255 bytes. Returns
+ * its length, or 0 if it is not cached */
+static int string_cache_lookup(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, unsigned char *data)
+{
+	struct usbi_string_cache_entry *entry;
+	int r = 0;
+
+	usbi_mutex_lock(&dev->lock);
+	for (entry = dev->string_cache; entry; entry = entry->next) {
+		if (entry->desc_index == desc_index && entry->langid == langid) {
+			memcpy(data, entry->data, entry->length);
+			r = entry->length;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	return r;
+}
+
+static void string_cache_store(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, const unsigned char *data, int length)
+{
+	struct usbi_string_cache_entry *entry;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return;
+	entry->desc_index = desc_index;
+	entry->langid = langid;
+	entry->length = (uint8_t)length;
+	memcpy(entry->data, data, length);
+
+	/* a racing lookup may have stored it first, the newer copy wins */
+	usbi_mutex_lock(&dev->lock);
+	entry->next = dev->string_cache;
+	dev->string_cache = entry;
+	usbi_mutex_unlock(&dev->lock);
+}
+
+/* Drop the cached string descriptors, e.g. because the device was reset or
+ * has gone away */
+void usbi_clear_string_cache(struct libusb_device *dev)
+{
+	struct usbi_string_cache_entry *entry, *next;
+
+	usbi_mutex_lock(&dev->lock);
+	entry = dev->string_cache;
+	dev->string_cache = NULL;
+	usbi_mutex_unlock(&dev->lock);
+
+	for (; entry; entry = next) {
+		next = entry->next;
+		free(entry);
+	}
+}
+
+/* Check a string descriptor of r bytes read from the device, and cache it if
+ * enabled. Returns r, or a LIBUSB_ERROR code if it is malformed */
+static int check_string_descriptor(struct libusb_device_handle *dev_handle,
+	uint8_t desc_index, uint16_t langid, const unsigned char *tbuf, int r)
+{
+	if (r < 2 || tbuf[1] != LIBUSB_DT_STRING || tbuf[0] > r)
+		return LIBUSB_ERROR_IO;
+
+	if (HANDLE_CTX(dev_handle)->cache_string_descriptors)
+		string_cache_store(dev_handle->dev, desc_index, langid, tbuf, r);
+	return r;
+}
+
+/* libusb_get_string_descriptor() into the 255 byte tbuf, served from the
+ * cache if possible */
+static int get_string_descriptor(struct libusb_device_handle *dev_handle,
+	uint8_t desc_index, uint16_t langid, unsigned char *tbuf)
+{
+	int r;
+
+	if (HANDLE_CTX(dev_handle)->cache_string_descriptors) {
+		r = string_cache_lookup(dev_handle->dev, desc_index, langid, tbuf);
+		if (r)
+			return r;
+	}
+
+	r = libusb_get_string_descriptor(dev_handle, desc_index, langid, tbuf,
+		255); /* Some devices choke on size > 255 */
+	if (r < 0)
+		return r;
+	return check_string_descriptor(dev_handle, desc_index, langid, tbuf, r);
+}
+
+/* the first language of the LANGID table, string descriptor 0 */
+static int get_first_langid(struct libusb_device_handle *dev_handle,
+	uint16_t *langid)
+{
+	unsigned char tbuf[255];
+	int r;
+
+	/* Asking for the zero'th index is special - it returns a string
+	 * descriptor that contains all the language IDs supported by the
+	 * device. Typically there aren't many - often only one. Language
+	 * IDs are 16 bit numbers, and they start at the third byte in the
+	 * descriptor. See USB 2.0 specification section 9.6.7 for more
+	 * information.
+	 */
+	r = get_string_descriptor(dev_handle, 0, 0, tbuf);
+	if (r < 0)
+		return r;
+
+	if (r < 4)
+		return LIBUSB_ERROR_IO;
+
+	*langid = tbuf[2] | (tbuf[3] << 8);
+	return 0;
+}
+
+static int string_descriptor_to_ascii(const unsigned char *tbuf,
+	unsigned char *data, int length)
+{
+	int si, di;
+
+	for (di = 0, si = 2; si < tbuf[0]; si += 2) {
+		if (di >= (length - 1))
+			break;
+
+		if ((tbuf[si] & 0x80) || (tbuf[si + 1])) /* non-ASCII */
+			data[di++] = '?';
+		else
+			data[di++] = tbuf[si];
+	}
+
+	data[di] = 0;
+	return di;
+}
+
 /** \ingroup desc
  * Retrieve a string descriptor in C style ASCII.
  *
  * Wrapper around libusb_get_string_descriptor(). Uses the first language
  * supported by the device.
  *
+ * With \ref LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS set on the context, the
+ * descriptors read are kept with the device, so that reading the same string
+ * again needs no requests to the device.
+ *
  * \param dev a device handle
  * \param desc_index the index of the descriptor to retrieve
  * \param data output buffer for ASCII string descriptor
@@ -1151,51 +1574,450 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length)
 {
 	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
-	int r, si, di;
 	uint16_t langid;
+	int r;
 
-	/* Asking for the zero'th index is special - it returns a string
-	 * descriptor that contains all the language IDs supported by the
-	 * device. Typically there aren't many - often only one. Language
-	 * IDs are 16 bit numbers, and they start at the third byte in the
-	 * descriptor. There's also no point in trying to read descriptor 0
-	 * with this function. See USB 2.0 specification section 9.6.7 for
-	 * more information.
-	 */
-
+	/* There's no point in trying to read descriptor 0 with this
+	 * function, it is the LANGID table. */
 	if (desc_index == 0)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
+	r = get_first_langid(dev, &langid);
 	if (r < 0)
 		return r;
 
-	if (r < 4)
-		return LIBUSB_ERROR_IO;
+	r = get_string_descriptor(dev, desc_index, langid, tbuf);
+	if (r < 0)
+		return r;
 
-	langid = tbuf[2] | (tbuf[3] << 8);
+	return string_descriptor_to_ascii(tbuf, data, length);
+}
 
-	r = libusb_get_string_descriptor(dev, desc_index, langid, tbuf,
-		sizeof(tbuf));
+/** \ingroup desc
+ * Retrieve several string descriptors in C style ASCII, as
+ * libusb_get_string_descriptor_ascii() does for one. The requests for the
+ * strings are pipelined, which saves most of the round-trips when reading
+ * e.g. the manufacturer, product and serial number strings of a device.
+ * Strings found in the cache of \ref LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS
+ * are not requested again.
+ *
+ * The strings are returned in data, string i at data + i * length.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param desc_indexes the indexes of the descriptors to retrieve
+ * \param num_indexes the number of indexes
+ * \param data output buffer for num_indexes strings of length bytes each
+ * \param length size of the buffer of each string
+ * \param results output array of num_indexes entries, receiving the number
+ * of bytes returned for each string or the LIBUSB_ERROR code of its failure,
+ * which is LIBUSB_ERROR_INVALID_PARAM for index 0
+ * \returns the number of strings retrieved
+ * \returns the LIBUSB_ERROR code of reading the LANGID table if that fails,
+ * or another LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_get_string_descriptors_ascii(
+	libusb_device_handle *dev_handle, const uint8_t *desc_indexes,
+	int num_indexes, unsigned char *data, int length, int *results)
+{
+	struct usbi_control_read *reads;
+	unsigned char *tbufs;
+	uint16_t langid;
+	int *slots;
+	int i, n = 0, count = 0, r;
+
+	if (num_indexes < 0 || length < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (num_indexes == 0)
+		return 0;
+
+	r = get_first_langid(dev_handle, &langid);
 	if (r < 0)
 		return r;
 
-	if (tbuf[1] != LIBUSB_DT_STRING)
+	reads = malloc(num_indexes * sizeof(*reads));
+	slots = malloc(num_indexes * sizeof(*slots));
+	tbufs = malloc(num_indexes * 255);
+	if (!reads || !slots || !tbufs) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	/* the strings that are not cached are requested together */
+	for (i = 0; i < num_indexes; i++) {
+		slots[i] = -1;
+		if (desc_indexes[i] == 0) {
+			results[i] = LIBUSB_ERROR_INVALID_PARAM;
+			continue;
+		}
+		if (dev_handle->dev->ctx->cache_string_descriptors) {
+			r = string_cache_lookup(dev_handle->dev, desc_indexes[i],
+				langid, tbufs + i * 255);
+			if (r) {
+				results[i] = string_descriptor_to_ascii(
+					tbufs + i * 255, data + i * length, length);
+				continue;
+			}
+		}
+		reads[n].bmRequestType = LIBUSB_ENDPOINT_IN;
+		reads[n].bRequest = LIBUSB_REQUEST_GET_DESCRIPTOR;
+		reads[n].wValue = (uint16_t)((LIBUSB_DT_STRING << 8) | desc_indexes[i]);
+		reads[n].wIndex = langid;
+		reads[n].data = tbufs + i * 255;
+		reads[n].wLength = 255;
+		slots[i] = n++;
+	}
+
+	r = usbi_control_read_vec(dev_handle, reads, n, 1000);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < num_indexes; i++) {
+		if (slots[i] >= 0) {
+			r = reads[slots[i]].result;
+			if (r >= 0)
+				r = check_string_descriptor(dev_handle,
+					desc_indexes[i], langid, tbufs + i * 255, r);
+			if (r >= 0)
+				r = string_descriptor_to_ascii(tbufs + i * 255,
+					data + i * length, length);
+			results[i] = r;
+		}
+		if (results[i] >= 0)
+			count++;
+	}
+	r = count;
+
+out:
+	free(tbufs);
+	free(slots);
+	free(reads);
+	return r;
+}
+
+/*
+ * Device snapshots
+ *
+ * A snapshot is a little-endian blob made of a header followed by one
+ * variable length record per device:
+ *
+ * header: magic (4), version (2), number of records (2), total length (4)
+ * record: record length (4), bus number, device address, speed, number of
+ *         ports, port numbers (USBI_MAX_PORT_DEPTH), flags, index of the
+ *         parent record (2), padding (2), snapshot stamp of the device (8),
+ *         followed by the device descriptor and each configuration
+ *         descriptor in turn, as read from the device
+ */
+#define SNAPSHOT_MAGIC			0x5353554cU	/* "LUSS" */
+#define SNAPSHOT_VERSION		2
+#define SNAPSHOT_HEADER_LENGTH		12
+#define SNAPSHOT_STAMP_OFFSET		(13 + USBI_MAX_PORT_DEPTH)
+#define SNAPSHOT_RECORD_LENGTH		(SNAPSHOT_STAMP_OFFSET + 8)
+#define SNAPSHOT_NO_PARENT		0xffff
+
+/* the backend provided the configuration descriptors in host byte order */
+#define SNAPSHOT_FLAG_HOST_ENDIAN	0x01
+
+static void snapshot_put16(unsigned char *p, uint16_t val)
+{
+	p[0] = (unsigned char)(val & 0xff);
+	p[1] = (unsigned char)(val >> 8);
+}
+
+static void snapshot_put32(unsigned char *p, uint32_t val)
+{
+	snapshot_put16(p, (uint16_t)(val & 0xffff));
+	snapshot_put16(p + 2, (uint16_t)(val >> 16));
+}
+
+static uint16_t snapshot_get16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t snapshot_get32(const unsigned char *p)
+{
+	return snapshot_get16(p) | ((uint32_t)snapshot_get16(p + 2) << 16);
+}
+
+static uint64_t snapshot_get64(const unsigned char *p)
+{
+	return snapshot_get32(p) | ((uint64_t)snapshot_get32(p + 4) << 32);
+}
+
+/* append the record for devs[idx] to the snapshot in *buf, which may be
+ * reallocated. On failure *buf may have been freed and set to NULL. */
+static int snapshot_append_device(struct libusb_device **devs, ssize_t num_devs,
+	ssize_t idx, unsigned char **buf, size_t *len)
+{
+	struct libusb_device *dev = devs[idx];
+	struct libusb_device_descriptor *desc = &dev->device_descriptor;
+	size_t start = *len;
+	unsigned char *rec, *p;
+	uint16_t parent = SNAPSHOT_NO_PARENT;
+	unsigned char flags = 0;
+	int host_endian = 0;
+	ssize_t i;
+	uint8_t c;
+	int r;
+
+	*buf = usbi_reallocf(*buf, start + SNAPSHOT_RECORD_LENGTH + DEVICE_DESC_LENGTH);
+	if (!*buf)
+		return LIBUSB_ERROR_NO_MEM;
+
+	rec = *buf + start;
+	memset(rec, 0, SNAPSHOT_RECORD_LENGTH);
+	rec[4] = dev->bus_number;
+	rec[5] = dev->device_address;
+	rec[6] = (unsigned char)dev->speed;
+	r = libusb_get_port_numbers(dev, rec + 8, USBI_MAX_PORT_DEPTH);
+	if (r < 0)
+		return r;
+	rec[7] = (unsigned char)r;
+
+	for (i = 0; i < num_devs; i++) {
+		if (devs[i] == dev->parent_dev) {
+			parent = (uint16_t)i;
+			break;
+		}
+	}
+
+	/* the cached device descriptor is in host byte order */
+	p = rec + SNAPSHOT_RECORD_LENGTH;
+	memcpy(p, desc, DEVICE_DESC_LENGTH);
+	snapshot_put16(p + 2, desc->bcdUSB);
+	snapshot_put16(p + 8, desc->idVendor);
+	snapshot_put16(p + 10, desc->idProduct);
+	snapshot_put16(p + 12, desc->bcdDevice);
+	*len = start + SNAPSHOT_RECORD_LENGTH + DEVICE_DESC_LENGTH;
+
+	for (c = 0; c < desc->bNumConfigurations; c++) {
+		struct libusb_config_descriptor _config;
+		unsigned char tmp[CONFIG_DESC_LENGTH];
+
+		r = usbi_backend->get_config_descriptor(dev, c, tmp, sizeof(tmp),
+			&host_endian);
+		if (r < 0)
+			return r;
+		if (r < CONFIG_DESC_LENGTH)
+			return LIBUSB_ERROR_IO;
+
+		usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+		*buf = usbi_reallocf(*buf, *len + _config.wTotalLength);
+		if (!*buf)
+			return LIBUSB_ERROR_NO_MEM;
+
+		r = usbi_backend->get_config_descriptor(dev, c, *buf + *len,
+			_config.wTotalLength, &host_endian);
+		if (r < 0)
+			return r;
+		if (host_endian)
+			flags |= SNAPSHOT_FLAG_HOST_ENDIAN;
+		*len += r;
+	}
+
+	rec = *buf + start;
+	snapshot_put32(rec, (uint32_t)(*len - start));
+	rec[8 + USBI_MAX_PORT_DEPTH] = flags;
+	snapshot_put16(rec + 9 + USBI_MAX_PORT_DEPTH, parent);
+	snapshot_put32(rec + SNAPSHOT_STAMP_OFFSET,
+		(uint32_t)(dev->snapshot_stamp & 0xffffffff));
+	snapshot_put32(rec + SNAPSHOT_STAMP_OFFSET + 4,
+		(uint32_t)(dev->snapshot_stamp >> 32));
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup dev
+ * Serialize the devices of a context into a binary snapshot.
+ *
+ * The snapshot records the bus number, address, speed and port path of each
+ * device, its position in the device tree and all of its configuration
+ * descriptors. Write it to a file and point the LIBUSB_DEVICE_SNAPSHOT
+ * environment variable at that file to let later calls to libusb_init() take
+ * descriptors from it instead of reading them again. This is only useful on
+ * systems where the attached hardware does not change: an entry is trusted
+ * as long as its bus number, device address and port path match and the
+ * device has not been enumerated again since, which the Linux backend tells
+ * from the modification time of the device's sysfs directory. Currently
+ * only the Linux and null backends make use of snapshots.
+ *
+ * This function enumerates devices as libusb_get_device_list() does, but
+ * otherwise does not perform any I/O with them.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param data output location for the snapshot. Must be freed with
+ * libusb_free_device_snapshot() after use.
+ * \param length output location for the length of the snapshot in bytes
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_OVERFLOW if there are too many devices
+ * \returns another LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_export_device_snapshot(libusb_context *ctx,
+	unsigned char **data, size_t *length)
+{
+	struct libusb_device **devs;
+	unsigned char *buf;
+	size_t len = SNAPSHOT_HEADER_LENGTH;
+	ssize_t num_devs, i;
+	int r = LIBUSB_SUCCESS;
+
+	USBI_GET_CONTEXT(ctx);
+
+	num_devs = libusb_get_device_list(ctx, &devs);
+	if (num_devs < 0)
+		return (int)num_devs;
+
+	if (num_devs > SNAPSHOT_NO_PARENT) {
+		libusb_free_device_list(devs, 1);
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+
+	buf = malloc(len);
+	if (!buf)
+		r = LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; r == LIBUSB_SUCCESS && i < num_devs; i++)
+		r = snapshot_append_device(devs, num_devs, i, &buf, &len);
+
+	libusb_free_device_list(devs, 1);
+	if (r < 0) {
+		free(buf);
+		return r;
+	}
+
+	snapshot_put32(buf, SNAPSHOT_MAGIC);
+	snapshot_put16(buf + 4, SNAPSHOT_VERSION);
+	snapshot_put16(buf + 6, (uint16_t)num_devs);
+	snapshot_put32(buf + 8, (uint32_t)len);
+
+	*data = buf;
+	*length = len;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup dev
+ * Free a snapshot obtained from libusb_export_device_snapshot().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param data the snapshot to free
+ */
+void API_EXPORTED libusb_free_device_snapshot(unsigned char *data)
+{
+	free(data);
+}
+
+/* check that the header is sane and that every record lies within the data */
+static int snapshot_is_valid(const unsigned char *data, size_t len)
+{
+	size_t offset = SNAPSHOT_HEADER_LENGTH;
+	uint32_t rec_len;
+	unsigned int i;
+
+	if (len < SNAPSHOT_HEADER_LENGTH ||
+	    snapshot_get32(data) != SNAPSHOT_MAGIC ||
+	    snapshot_get16(data + 4) != SNAPSHOT_VERSION ||
+	    snapshot_get32(data + 8) != len)
+		return 0;
+
+	for (i = 0; i < snapshot_get16(data + 6); i++) {
+		if (len - offset < SNAPSHOT_RECORD_LENGTH)
+			return 0;
+		rec_len = snapshot_get32(data + offset);
+		if (rec_len < SNAPSHOT_RECORD_LENGTH + DEVICE_DESC_LENGTH ||
+		    rec_len > len - offset ||
+		    data[offset + 7] > USBI_MAX_PORT_DEPTH)
+			return 0;
+		offset += rec_len;
+	}
+
+	return offset == len;
+}
+
+/* read and validate a snapshot written from libusb_export_device_snapshot().
+ * On success the snapshot is kept in the context until libusb_exit(). */
+int usbi_load_device_snapshot(struct libusb_context *ctx, const char *path)
+{
+	unsigned char *data;
+	FILE *f;
+	long size;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		usbi_warn(ctx, "could not open device snapshot %s", path);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) != 0 || size > 0x7fffffffL) {
+		fclose(f);
 		return LIBUSB_ERROR_IO;
+	}
 
-	if (tbuf[0] > r)
+	data = malloc(size ? (size_t)size : 1);
+	if (!data) {
+		fclose(f);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	if (fread(data, 1, (size_t)size, f) != (size_t)size) {
+		usbi_warn(ctx, "could not read device snapshot %s", path);
+		fclose(f);
+		free(data);
 		return LIBUSB_ERROR_IO;
+	}
+	fclose(f);
 
-	for (di = 0, si = 2; si < tbuf[0]; si += 2) {
-		if (di >= (length - 1))
-			break;
+	if (!snapshot_is_valid(data, (size_t)size)) {
+		usbi_warn(ctx, "ignoring invalid device snapshot %s", path);
+		free(data);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
 
-		if ((tbuf[si] & 0x80) || (tbuf[si + 1])) /* non-ASCII */
-			data[di++] = '?';
-		else
-			data[di++] = tbuf[si];
+	usbi_dbg("loaded %d devices from snapshot %s", snapshot_get16(data + 6), path);
+	ctx->snapshot = data;
+	ctx->snapshot_len = (size_t)size;
+	return LIBUSB_SUCCESS;
+}
+
+/* find the snapshot record for a device with the given snapshot stamp.
+ * Returns its descriptors, which are in bus byte order and laid out like the
+ * sysfs descriptors file, or NULL if there is no matching record. */
+const unsigned char *usbi_snapshot_find_device(struct libusb_context *ctx,
+	uint8_t bus_number, uint8_t device_address, const uint8_t *port_numbers,
+	int num_ports, uint64_t stamp, enum libusb_speed *speed, size_t *length)
+{
+	const unsigned char *rec;
+	size_t offset = SNAPSHOT_HEADER_LENGTH;
+	uint32_t rec_len;
+	unsigned int i;
+
+	if (!ctx->snapshot)
+		return NULL;
+
+	for (i = 0; i < snapshot_get16(ctx->snapshot + 6); i++, offset += rec_len) {
+		rec = ctx->snapshot + offset;
+		rec_len = snapshot_get32(rec);
+		if (rec[4] != bus_number || rec[5] != device_address ||
+		    rec[7] != num_ports ||
+		    (num_ports && memcmp(rec + 8, port_numbers, num_ports) != 0))
+			continue;
+
+		if (rec[8 + USBI_MAX_PORT_DEPTH] & SNAPSHOT_FLAG_HOST_ENDIAN)
+			return NULL;
+		if (snapshot_get64(rec + SNAPSHOT_STAMP_OFFSET) != stamp) {
+			usbi_dbg("snapshot of device %d.%d is stale",
+				bus_number, device_address);
+			return NULL;
+		}
+
+		*speed = (enum libusb_speed)rec[6];
+		*length = rec_len - SNAPSHOT_RECORD_LENGTH;
+		return rec + SNAPSHOT_RECORD_LENGTH;
 	}
 
-	data[di] = 0;
-	return di;
+	return NULL;
 }
@@ -147,16 +147,9 @@ int main (void) {
 \endcode
  */
 
-static int usbi_hotplug_match_cb (struct libusb_context *ctx,
-	struct libusb_device *dev, libusb_hotplug_event event,
-	struct libusb_hotplug_callback *hotplug_cb)
+static int usbi_hotplug_cb_matches (struct libusb_device *dev,
+	libusb_hotplug_event event, struct libusb_hotplug_callback *hotplug_cb)
 {
-	/* Handle lazy deregistration of callback */
-	if (hotplug_cb->needs_free) {
-		/* Free callback */
-		return 1;
-	}
-
 	if (!(hotplug_cb->events & event)) {
 		return 0;
 	}
@@ -176,27 +169,114 @@ static int usbi_hotplug_match_cb (struct libusb_context *ctx,
 		return 0;
 	}
 
+	return 1;
+}
+
+static int usbi_hotplug_match_cb (struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event,
+	struct libusb_hotplug_callback *hotplug_cb)
+{
+	/* Handle lazy deregistration of callback */
+	if (hotplug_cb->needs_free) {
+		/* Free callback */
+		return 1;
+	}
+
+	if (!usbi_hotplug_cb_matches (dev, event, hotplug_cb)) {
+		return 0;
+	}
+
 	return hotplug_cb->cb (ctx, dev, event, hotplug_cb->user_data);
 }
 
-void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
-	libusb_hotplug_event event)
+/* index of the bucket holding callbacks for a vendor and product ID, either
+ * of which may be LIBUSB_HOTPLUG_MATCH_ANY */
+static unsigned int usbi_hotplug_cb_bucket (int vendor_id, int product_id)
+{
+	uint32_t key = ((uint32_t)vendor_id << 16) ^ (uint32_t)product_id;
+
+	return (key * 2654435761u) >> (32 - USBI_HOTPLUG_CB_BUCKET_BITS);
+}
+
+static struct list_head *usbi_hotplug_cb_index (struct libusb_context *ctx,
+	struct libusb_hotplug_callback *hotplug_cb)
+{
+	if (LIBUSB_HOTPLUG_MATCH_ANY == hotplug_cb->vendor_id) {
+		return &ctx->hotplug_wildcard_cbs;
+	}
+
+	return &ctx->hotplug_cb_buckets[usbi_hotplug_cb_bucket (
+		hotplug_cb->vendor_id, hotplug_cb->product_id)];
+}
+
+/* hotplug_cbs_lock must be held */
+static void usbi_hotplug_free_cb (struct libusb_hotplug_callback *hotplug_cb)
+{
+	list_del(&hotplug_cb->list);
+	list_del(&hotplug_cb->bucket_list);
+	free(hotplug_cb);
+}
+
+/* call the matching callbacks of one index list. hotplug_cbs_lock must be
+ * held, and is only dropped around the callbacks that actually match */
+static void usbi_hotplug_match_list (struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event,
+	struct list_head *cbs)
 {
 	struct libusb_hotplug_callback *hotplug_cb, *next;
 	int ret;
 
-	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+	list_for_each_entry_safe(hotplug_cb, next, cbs, bucket_list, struct libusb_hotplug_callback) {
+		if (hotplug_cb->needs_free) {
+			usbi_hotplug_free_cb (hotplug_cb);
+			continue;
+		}
+
+		if (!usbi_hotplug_cb_matches (dev, event, hotplug_cb)) {
+			continue;
+		}
 
-	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
 		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
-		ret = usbi_hotplug_match_cb (ctx, dev, event, hotplug_cb);
+		ret = hotplug_cb->cb (ctx, dev, event, hotplug_cb->user_data);
 		usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 
 		if (ret) {
-			list_del(&hotplug_cb->list);
-			free(hotplug_cb);
+			usbi_hotplug_free_cb (hotplug_cb);
 		}
 	}
+}
+
+void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
+	libusb_hotplug_event event)
+{
+	struct libusb_hotplug_callback *hotplug_cb, *next;
+	unsigned int bucket, any_bucket;
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+
+	if (!dev) {
+		/* a callback was deregistered: free the marked callbacks */
+		list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
+			if (hotplug_cb->needs_free) {
+				usbi_hotplug_free_cb (hotplug_cb);
+			}
+		}
+		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+		return;
+	}
+
+	/* only look at the callbacks for this vendor and product, for any
+	 * product of this vendor, and those without a vendor */
+	bucket = usbi_hotplug_cb_bucket (dev->device_descriptor.idVendor,
+		dev->device_descriptor.idProduct);
+	any_bucket = usbi_hotplug_cb_bucket (dev->device_descriptor.idVendor,
+		LIBUSB_HOTPLUG_MATCH_ANY);
+
+	usbi_hotplug_match_list (ctx, dev, event, &ctx->hotplug_cb_buckets[bucket]);
+	if (any_bucket != bucket) {
+		usbi_hotplug_match_list (ctx, dev, event, &ctx->hotplug_cb_buckets[any_bucket]);
+	}
+	usbi_hotplug_match_list (ctx, dev, event, &ctx->hotplug_wildcard_cbs);
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 
@@ -207,19 +287,29 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	libusb_hotplug_event event)
 {
 	int pending_events;
-	libusb_hotplug_message *message = calloc(1, sizeof(*message));
+	libusb_hotplug_message *message = NULL;
 
-	if (!message) {
-		usbi_err(ctx, "error allocating hotplug message");
-		return;
+	/* Take the event data lock, reusing a processed message if there is
+	 * one, and add this message to the list.
+	 * Only signal an event if there are no prior pending events. */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (!list_empty(&ctx->free_hotplug_msgs)) {
+		message = list_first_entry(&ctx->free_hotplug_msgs, libusb_hotplug_message, list);
+		list_del(&message->list);
+		ctx->free_hotplug_msgs_cnt--;
+	} else {
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		message = malloc(sizeof(*message));
+		if (!message) {
+			usbi_err(ctx, "error allocating hotplug message");
+			return;
+		}
+		usbi_mutex_lock(&ctx->event_data_lock);
 	}
 
 	message->event = event;
 	message->device = dev;
 
-	/* Take the event data lock and add this message to the list.
-	 * Only signal an event if there are no prior pending events. */
-	usbi_mutex_lock(&ctx->event_data_lock);
 	pending_events = usbi_pending_events(ctx);
 	list_add_tail(&message->list, &ctx->hotplug_msgs);
 	if (!pending_events)
@@ -273,6 +363,7 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	new_callback->handle = handle_id++;
 
 	list_add(&new_callback->list, &ctx->hotplug_cbs);
+	list_add(&new_callback->bucket_list, usbi_hotplug_cb_index (ctx, new_callback));
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 
@@ -321,8 +412,10 @@ void API_EXPORTED libusb_hotplug_deregister_callback (struct libusb_context *ctx
 	list_for_each_entry(hotplug_cb, &ctx->hotplug_cbs, list,
 			    struct libusb_hotplug_callback) {
 		if (handle == hotplug_cb->handle) {
-			/* Mark this callback for deregistration */
+			/* Mark this callback for deregistration. handles are
+			 * unique within a context */
 			hotplug_cb->needs_free = 1;
+			break;
 		}
 	}
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
@@ -336,8 +429,7 @@ void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
 	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list,
 				 struct libusb_hotplug_callback) {
-		list_del(&hotplug_cb->list);
-		free(hotplug_cb);
+		usbi_hotplug_free_cb (hotplug_cb);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
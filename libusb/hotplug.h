@@ -64,6 +64,10 @@ struct libusb_hotplug_callback {
 
 	/** List this callback is registered in (ctx->hotplug_cbs) */
 	struct list_head list;
+
+	/** List this callback is indexed in for matching (an entry of
+	 * ctx->hotplug_cb_buckets, or ctx->hotplug_wildcard_cbs) */
+	struct list_head bucket_list;
 };
 
 typedef struct libusb_hotplug_callback libusb_hotplug_callback;
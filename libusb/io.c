@@ -23,6 +23,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -500,6 +501,9 @@ if (r == 0 && actual_length == sizeof(data)) {
  * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
  *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusb to automatically free the
  *   transfer after the transfer callback returns.
+ * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_TIMEOUT_US
+ *   "LIBUSB_TRANSFER_TIMEOUT_US" makes the timeout of the transfer a number of
+ *   microseconds, for deadlines shorter than a millisecond.
  *
  * \section asyncevent Event handling
  *
@@ -1111,6 +1115,24 @@ printf("completed!\n");
  * give up the events lock if instructed.
  */
 
+/* Free the event sources that have been removed since the last time the
+ * event data was built. The event handling thread must not be holding any
+ * references to them. */
+static void free_event_sources(struct list_head *sources)
+{
+	struct usbi_event_source *event_source, *tmp;
+
+	list_for_each_entry_safe(event_source, tmp, sources, list, struct usbi_event_source) {
+		list_del(&event_source->list);
+		free(event_source);
+	}
+}
+
+static void usbi_free_removed_event_sources(struct libusb_context *ctx)
+{
+	free_event_sources(&ctx->removed_event_sources);
+}
+
 int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
@@ -1120,10 +1142,13 @@ int usbi_io_init(struct libusb_context *ctx)
 	usbi_mutex_init(&ctx->event_waiters_lock, NULL);
 	usbi_cond_init(&ctx->event_waiters_cond, NULL);
 	usbi_mutex_init(&ctx->event_data_lock, NULL);
-	list_init(&ctx->flying_transfers);
+	usbi_mutex_init(&ctx->callback_workers_lock, NULL);
+	list_init(&ctx->sync_waiters);
 	list_init(&ctx->event_sources);
+	list_init(&ctx->removed_event_sources);
+	list_init(&ctx->batch_handles);
 	list_init(&ctx->hotplug_msgs);
-	list_init(&ctx->completed_transfers);
+	list_init(&ctx->free_hotplug_msgs);
 
 	r = usbi_create_event(&ctx->event);
 	if (r < 0) {
@@ -1131,14 +1156,14 @@ int usbi_io_init(struct libusb_context *ctx)
 		goto err;
 	}
 
-	r = usbi_add_event_source(ctx, USBI_EVENT_GET_SOURCE(ctx->event), USBI_EVENT_MASK);
+	r = usbi_add_event_source(ctx, USBI_EVENT_GET_SOURCE(ctx->event), USBI_EVENT_MASK, NULL);
 	if (r < 0)
 		goto err_destroy_event;
 
 	ctx->timer = usbi_create_timer();
 	if (ctx->timer != USBI_INVALID_TIMER) {
 		usbi_dbg("using system timer for timeouts");
-		r = usbi_add_event_source(ctx, ctx->timer, USBI_EVENT_MASK);
+		r = usbi_add_event_source(ctx, ctx->timer, USBI_EVENT_MASK, NULL);
 		if (r < 0)
 			goto err_destroy_timer;
 	}
@@ -1150,17 +1175,525 @@ err_destroy_timer:
 	usbi_remove_event_source(ctx, USBI_EVENT_GET_SOURCE(ctx->event));
 err_destroy_event:
 	usbi_destroy_event(&ctx->event);
+	usbi_free_removed_event_sources(ctx);
 err:
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
+	usbi_mutex_destroy(&ctx->callback_workers_lock);
 	return r;
 }
 
+/* pin a thread of the context to the CPUs of LIBUSB_OPTION_NUMA_NODE */
+static void pin_to_numa_node(struct libusb_context *ctx, const char *name)
+{
+#if defined(PLATFORM_POSIX)
+	int node = ctx->numa_node;
+	int r;
+
+	if (node < 0)
+		return;
+
+	r = usbi_thread_set_node_affinity(node);
+	if (r < 0)
+		usbi_warn(ctx, "failed to pin %s to node %d: %s", name, node,
+			libusb_error_name(r));
+#else
+	if (ctx->numa_node >= 0)
+		usbi_warn(ctx, "cannot pin %s to node %d on this platform", name,
+			ctx->numa_node);
+#endif
+}
+
+static usbi_thread_ret_t USBI_THREAD_CALL event_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	int r;
+
+	pin_to_numa_node(ctx, "event thread");
+	usbi_dbg("event thread running");
+
+	while (!ctx->event_thread_stop) {
+		struct timeval tv = { 60, 0 };
+
+		r = libusb_handle_events_timeout_completed(ctx, &tv,
+			&ctx->event_thread_stop);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_warn(ctx, "event handling failed: %s", libusb_error_name(r));
+	}
+
+	usbi_dbg("event thread exiting");
+	return 0;
+}
+
+int usbi_start_event_thread(struct libusb_context *ctx)
+{
+	if (ctx->event_thread_running)
+		return 0;
+
+	ctx->event_thread_stop = 0;
+	if (usbi_thread_create(&ctx->event_thread, event_thread_main, ctx) != 0) {
+		usbi_err(ctx, "failed to create event thread");
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	ctx->event_thread_running = 1;
+	return 0;
+}
+
+void usbi_stop_event_thread(struct libusb_context *ctx)
+{
+	int pending_events;
+
+	if (!ctx->event_thread_running)
+		return;
+
+	/* ask the thread to stop, signalling the event if needed so that it
+	 * returns from event handling */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	pending_events = usbi_pending_events(ctx);
+	ctx->event_thread_stop = 1;
+	if (!pending_events)
+		usbi_signal_event(&ctx->event);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	usbi_thread_join(ctx->event_thread);
+	ctx->event_thread_running = 0;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	ctx->event_thread_stop = 0;
+	usbi_clear_event_if_idle(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+#if defined(PLATFORM_POSIX)
+static usbi_thread_ret_t USBI_THREAD_CALL event_shard_main(void *arg)
+{
+	struct usbi_event_shard *shard = arg;
+	struct libusb_context *ctx = shard->ctx;
+	int triggered = 0;
+	int r;
+
+	if (shard->cpu >= 0) {
+		r = usbi_thread_set_affinity(shard->cpu);
+		if (r < 0)
+			usbi_warn(ctx, "failed to pin event shard to cpu %d: %s",
+				shard->cpu, libusb_error_name(r));
+	} else {
+		pin_to_numa_node(ctx, "event shard");
+	}
+	usbi_dbg("event shard running");
+
+	usbi_mutex_lock(&shard->lock);
+	shard->tid = usbi_get_tid();
+	for (;;) {
+		struct usbi_event_source **ready;
+		struct timeval tv = { 60, 0 };
+		unsigned int cnt;
+		int i, nready;
+
+		/* keep away from the handles while one of them is being closed */
+		while (shard->close_pending && !shard->stop)
+			usbi_cond_wait(&shard->cond, &shard->lock);
+		if (shard->stop)
+			break;
+
+		if (shard->event_sources_modified) {
+			r = usbi_alloc_shard_event_data(shard);
+			if (r < 0) {
+				usbi_err(ctx, "failed to allocate event shard data: %d", r);
+				break;
+			}
+			shard->event_sources_modified = 0;
+		}
+		free_event_sources(&shard->removed_event_sources);
+
+		shard->busy = 1;
+		while (!list_empty(&shard->completed_transfers)) {
+			struct usbi_transfer *itransfer =
+				list_first_entry(&shard->completed_transfers, struct usbi_transfer, completed_list);
+
+			list_del(&itransfer->completed_list);
+			usbi_mutex_unlock(&shard->lock);
+			r = usbi_backend->handle_transfer_completion(itransfer);
+			if (r)
+				usbi_err(ctx, "backend handle_transfer_completion failed with error %d", r);
+			usbi_mutex_lock(&shard->lock);
+		}
+
+		if (triggered && !usbi_shard_pending_events(shard)) {
+			usbi_clear_event(&shard->event);
+			triggered = 0;
+		}
+		cnt = shard->event_sources_cnt;
+		usbi_mutex_unlock(&shard->lock);
+
+		nready = usbi_wait_for_shard_events(shard, cnt, &tv, &ready);
+		if (nready < 0 && nready != LIBUSB_ERROR_INTERRUPTED)
+			usbi_warn(ctx, "event shard wait failed: %s", libusb_error_name(nready));
+
+		/* the shard's own event only asks for another pass */
+		for (i = 0; i < nready; i++) {
+			if (ready[i]->pollfd.fd == USBI_EVENT_GET_SOURCE(shard->event)) {
+				triggered = 1;
+				ready[i] = ready[--nready];
+				break;
+			}
+		}
+
+		if (nready > 0) {
+			r = usbi_backend->handle_events(ctx, ready, (unsigned int)nready, nready);
+			if (r)
+				usbi_err(ctx, "backend handle_events failed with error %d", r);
+		}
+		usbi_flush_transfer_batches(&shard->batch_handles);
+
+		usbi_mutex_lock(&shard->lock);
+		shard->busy = 0;
+		if (shard->close_pending)
+			usbi_cond_broadcast(&shard->cond);
+	}
+	shard->busy = 0;
+	usbi_cond_broadcast(&shard->cond);
+	usbi_mutex_unlock(&shard->lock);
+
+	usbi_dbg("event shard exiting");
+	return 0;
+}
+
+static int init_event_shard(struct libusb_context *ctx,
+	struct usbi_event_shard *shard, int cpu)
+{
+	struct usbi_event_source *event_source;
+	int r;
+
+	shard->ctx = ctx;
+	shard->cpu = cpu;
+	list_init(&shard->event_sources);
+	list_init(&shard->removed_event_sources);
+	list_init(&shard->completed_transfers);
+	list_init(&shard->batch_handles);
+
+	r = usbi_create_event(&shard->event);
+	if (r < 0)
+		return r;
+
+	event_source = calloc(1, sizeof(*event_source));
+	if (!event_source) {
+		usbi_destroy_event(&shard->event);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	event_source->pollfd.fd = USBI_EVENT_GET_SOURCE(shard->event);
+	event_source->pollfd.events = USBI_EVENT_MASK;
+	list_add_tail(&event_source->list, &shard->event_sources);
+	shard->event_sources_cnt = 1;
+	shard->event_sources_modified = 1;
+
+	usbi_mutex_init(&shard->lock, NULL);
+	usbi_cond_init(&shard->cond, NULL);
+	if (usbi_thread_create(&shard->thread, event_shard_main, shard) != 0) {
+		usbi_err(ctx, "failed to create event shard thread");
+		usbi_cond_destroy(&shard->cond);
+		usbi_mutex_destroy(&shard->lock);
+		free_event_sources(&shard->event_sources);
+		usbi_destroy_event(&shard->event);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+static void destroy_event_shard(struct usbi_event_shard *shard)
+{
+	usbi_mutex_lock(&shard->lock);
+	if (!usbi_shard_pending_events(shard))
+		usbi_signal_event(&shard->event);
+	shard->stop = 1;
+	usbi_mutex_unlock(&shard->lock);
+	usbi_thread_join(shard->thread);
+
+	if (!list_empty(&shard->completed_transfers))
+		usbi_warn(shard->ctx, "event shard stopped with completions pending");
+	usbi_free_shard_event_data(shard);
+	free_event_sources(&shard->event_sources);
+	free_event_sources(&shard->removed_event_sources);
+	free(shard->batch_spare);
+	usbi_cond_destroy(&shard->cond);
+	usbi_mutex_destroy(&shard->lock);
+	usbi_destroy_event(&shard->event);
+}
+#endif
+
+int usbi_start_event_shards(struct libusb_context *ctx, int count,
+	const int *cpus)
+{
+#if defined(PLATFORM_POSIX)
+	struct usbi_event_shard *shards;
+	int i, r;
+
+	if (count <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (ctx->num_shards)
+		return LIBUSB_ERROR_BUSY;
+
+	/* the context's own event loop still has to run for timeouts and
+	 * hotplug, and lets synchronous I/O sleep on its transfer */
+	r = usbi_start_event_thread(ctx);
+	if (r < 0)
+		return r;
+
+	shards = calloc((size_t)count, sizeof(*shards));
+	if (!shards)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < count; i++) {
+		r = init_event_shard(ctx, &shards[i], cpus ? cpus[i] : -1);
+		if (r < 0) {
+			while (i > 0)
+				destroy_event_shard(&shards[--i]);
+			free(shards);
+			return r;
+		}
+	}
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	ctx->shards = shards;
+	ctx->num_shards = (unsigned int)count;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	usbi_dbg("started %d event shards", count);
+	return 0;
+#else
+	UNUSED(ctx);
+	UNUSED(count);
+	UNUSED(cpus);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* stop the event shards. unless force is set, this fails while handles that
+ * are assigned to a shard are open. forced, such handles are left without
+ * event handling */
+int usbi_stop_event_shards(struct libusb_context *ctx, int force)
+{
+#if defined(PLATFORM_POSIX)
+	struct libusb_device_handle *handle;
+	struct usbi_event_shard *shards;
+	unsigned int i, n;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	shards = ctx->shards;
+	n = ctx->num_shards;
+	for (i = 0; i < n && !force; i++) {
+		if (shards[i].handles) {
+			usbi_mutex_unlock(&ctx->open_devs_lock);
+			return LIBUSB_ERROR_BUSY;
+		}
+	}
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle)
+		handle->shard = NULL;
+	ctx->shards = NULL;
+	ctx->num_shards = 0;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	for (i = 0; i < n; i++)
+		destroy_event_shard(&shards[i]);
+	free(shards);
+#else
+	UNUSED(ctx);
+	UNUSED(force);
+#endif
+	return 0;
+}
+
+/* pick the shard with the fewest handles for a handle being opened */
+struct usbi_event_shard *usbi_assign_event_shard(struct libusb_context *ctx)
+{
+	struct usbi_event_shard *shard = NULL;
+	unsigned int i;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	for (i = 0; i < ctx->num_shards; i++) {
+		if (!shard || ctx->shards[i].handles < shard->handles)
+			shard = &ctx->shards[i];
+	}
+	if (shard)
+		shard->handles++;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	return shard;
+}
+
+void usbi_release_event_shard(struct libusb_context *ctx,
+	struct libusb_device_handle *handle)
+{
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if (handle->shard)
+		handle->shard->handles--;
+	handle->shard = NULL;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+}
+
+/* keep the shard thread away from its handles until
+ * usbi_resume_event_shard(), so that one of them can be closed */
+void usbi_pause_event_shard(struct usbi_event_shard *shard)
+{
+	usbi_mutex_lock(&shard->lock);
+	if (!usbi_shard_pending_events(shard))
+		usbi_signal_event(&shard->event);
+	shard->close_pending++;
+	while (shard->busy && shard->tid != usbi_get_tid())
+		usbi_cond_wait(&shard->cond, &shard->lock);
+	usbi_mutex_unlock(&shard->lock);
+}
+
+void usbi_resume_event_shard(struct usbi_event_shard *shard)
+{
+	usbi_mutex_lock(&shard->lock);
+	if (--shard->close_pending == 0)
+		usbi_cond_broadcast(&shard->cond);
+	usbi_mutex_unlock(&shard->lock);
+}
+
+/* wake the threads waiting in libusb_handle_events_completed() or
+ * libusb_wait_for_event() after callbacks ran outside of event handling,
+ * which may have set the flag one of them waits for. The event handler is
+ * woken through the event, the other threads through event_waiters_cond */
+static void wake_event_waiters(struct libusb_context *ctx)
+{
+	int pending_events;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	pending_events = usbi_pending_events(ctx);
+	if (!pending_events)
+		usbi_signal_event(&ctx->event);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+static usbi_thread_ret_t USBI_THREAD_CALL callback_worker_main(void *arg)
+{
+	struct usbi_callback_worker *worker = arg;
+
+	pin_to_numa_node(worker->ctx, "callback worker");
+	usbi_dbg("callback worker running");
+	usbi_mutex_lock(&worker->lock);
+	for (;;) {
+		struct usbi_transfer *itransfer;
+
+		while (list_empty(&worker->transfers) && !worker->stop)
+			usbi_cond_wait(&worker->cond, &worker->lock);
+		/* the callbacks queued before stopping still run */
+		if (list_empty(&worker->transfers))
+			break;
+
+		itransfer = list_first_entry(&worker->transfers, struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+		usbi_mutex_unlock(&worker->lock);
+		libusb_run_transfer_callback(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+		usbi_mutex_lock(&worker->lock);
+
+		/* once for the callbacks run back to back */
+		if (list_empty(&worker->transfers)) {
+			usbi_mutex_unlock(&worker->lock);
+			wake_event_waiters(worker->ctx);
+			usbi_mutex_lock(&worker->lock);
+		}
+	}
+	usbi_mutex_unlock(&worker->lock);
+
+	usbi_dbg("callback worker exiting");
+	return 0;
+}
+
+static void stop_callback_worker(struct usbi_callback_worker *worker)
+{
+	usbi_mutex_lock(&worker->lock);
+	worker->stop = 1;
+	usbi_cond_signal(&worker->cond);
+	usbi_mutex_unlock(&worker->lock);
+	usbi_thread_join(worker->thread);
+
+	usbi_cond_destroy(&worker->cond);
+	usbi_mutex_destroy(&worker->lock);
+}
+
+int usbi_start_callback_workers(struct libusb_context *ctx, int count)
+{
+	struct usbi_callback_worker *workers;
+	int i;
+
+	if (count <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	if (ctx->num_callback_workers) {
+		usbi_mutex_unlock(&ctx->callback_workers_lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	workers = calloc((size_t)count, sizeof(*workers));
+	if (!workers) {
+		usbi_mutex_unlock(&ctx->callback_workers_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct usbi_callback_worker *worker = &workers[i];
+
+		worker->ctx = ctx;
+		list_init(&worker->transfers);
+		usbi_mutex_init(&worker->lock, NULL);
+		usbi_cond_init(&worker->cond, NULL);
+		if (usbi_thread_create(&worker->thread, callback_worker_main, worker) != 0) {
+			usbi_err(ctx, "failed to create callback worker thread");
+			usbi_cond_destroy(&worker->cond);
+			usbi_mutex_destroy(&worker->lock);
+			while (i > 0)
+				stop_callback_worker(&workers[--i]);
+			free(workers);
+			usbi_mutex_unlock(&ctx->callback_workers_lock);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+
+	ctx->callback_workers = workers;
+	ctx->num_callback_workers = (unsigned int)count;
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+	usbi_dbg("started %d callback workers", count);
+	return 0;
+}
+
+void usbi_stop_callback_workers(struct libusb_context *ctx)
+{
+	struct usbi_callback_worker *workers;
+	unsigned int i, n;
+
+	/* completions from here on run their callbacks right away. the ones
+	 * queued before are still run by the workers */
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	workers = ctx->callback_workers;
+	n = ctx->num_callback_workers;
+	ctx->num_callback_workers = 0;
+	ctx->callback_workers = NULL;
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+
+	for (i = 0; i < n; i++)
+		stop_callback_worker(&workers[i]);
+	free(workers);
+}
+
 void usbi_io_exit(struct libusb_context *ctx)
 {
+	libusb_hotplug_message *message, *next;
+
+	list_for_each_entry_safe(message, next, &ctx->free_hotplug_msgs, list, libusb_hotplug_message)
+		free(message);
+	free(ctx->batch_spare);
 	usbi_remove_event_source(ctx, USBI_EVENT_GET_SOURCE(ctx->event));
 	usbi_destroy_event(&ctx->event);
 	if (usbi_using_timer(ctx)) {
@@ -1172,56 +1705,93 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
-	if (ctx->event_data)
-		free(ctx->event_data);
+	usbi_mutex_destroy(&ctx->callback_workers_lock);
+	usbi_free_event_data(ctx);
+	usbi_free_removed_event_sources(ctx);
+	free(ctx->timeout_heap);
+	if (ctx->stats) {
+		usbi_mutex_destroy(&ctx->stats->lock);
+		free(ctx->stats);
+	}
+}
+
+/* the timeout of a transfer as a timeval, in milliseconds or in
+ * microseconds depending on LIBUSB_TRANSFER_TIMEOUT_US */
+static void transfer_timeout_to_timeval(struct libusb_transfer *transfer,
+	struct timeval *tv)
+{
+	unsigned int timeout = transfer->timeout;
+
+	if (transfer->flags & LIBUSB_TRANSFER_TIMEOUT_US) {
+		tv->tv_sec = timeout / 1000000;
+		tv->tv_usec = timeout % 1000000;
+	} else {
+		tv->tv_sec = timeout / 1000;
+		tv->tv_usec = (timeout % 1000) * 1000;
+	}
 }
 
-static int calculate_timeout(struct usbi_transfer *transfer)
+/* The monotonic time, read from the backend at most once for work that
+ * belongs together, such as a batch of submissions or the expiry of several
+ * timeouts and the re-arming of the timer that follows. Initialize with
+ * USBI_NOW_INIT; the clock is read on first use. */
+struct usbi_now {
+	struct timeval tv;
+	int valid;
+};
+
+#define USBI_NOW_INIT	{ { 0, 0 }, 0 }
+
+static int get_now(struct libusb_context *ctx, struct usbi_now *now)
 {
+	struct timespec ts;
 	int r;
-	struct timespec current_time;
-	unsigned int timeout =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
 
-	if (!timeout)
+	if (now->valid)
 		return 0;
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &current_time);
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts);
 	if (r < 0) {
-		usbi_err(ITRANSFER_CTX(transfer), "failed to read monotonic clock");
+		usbi_err(ctx, "failed to read monotonic clock");
 		return r;
 	}
+	TIMESPEC_TO_TIMEVAL(&now->tv, &ts);
+	now->valid = 1;
+	return 0;
+}
+
+static int calculate_timeout(struct usbi_transfer *transfer,
+	struct usbi_now *now)
+{
+	int r;
+	struct timeval timeout;
 
-	current_time.tv_sec += timeout / 1000;
-	current_time.tv_nsec += (timeout % 1000) * 1000000;
+	if (!USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout)
+		return 0;
 
-	while (current_time.tv_nsec >= 1000000000) {
-		current_time.tv_nsec -= 1000000000;
-		current_time.tv_sec++;
-	}
+	r = get_now(ITRANSFER_CTX(transfer), now);
+	if (r < 0)
+		return r;
 
-	TIMESPEC_TO_TIMEVAL(&transfer->timeout, &current_time);
+	transfer_timeout_to_timeval(USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer), &timeout);
+	timeradd(&now->tv, &timeout, &transfer->timeout);
 	return 0;
 }
 
-static int calculate_remaining(struct usbi_transfer *transfer, struct timeval *result)
+static int calculate_remaining(struct usbi_transfer *transfer,
+	struct usbi_now *now, struct timeval *result)
 {
-	struct timespec cur_ts;
-	struct timeval cur_tv;
 	int r;
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
-	if (r < 0) {
-		usbi_err(ITRANSFER_CTX(transfer), "failed to read monotonic clock");
+	r = get_now(ITRANSFER_CTX(transfer), now);
+	if (r < 0)
 		return r;
-	}
-	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	if (!timercmp(&cur_tv, &transfer->timeout, <)) {
+	if (!timercmp(&now->tv, &transfer->timeout, <)) {
 		usbi_dbg("first timeout already expired");
 		timerclear(result);
 	} else {
-		timersub(&transfer->timeout, &cur_tv, result);
+		timersub(&transfer->timeout, &now->tv, result);
 		usbi_dbg("next timeout in %d.%06ds", result->tv_sec, result->tv_usec);
 	}
 
@@ -1266,13 +1836,56 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 		return NULL;
 
 	itransfer->num_iso_packets = iso_packets;
+	itransfer->timeout_heap_index = -1;
 	usbi_mutex_init(&itransfer->lock, NULL);
-	usbi_mutex_init(&itransfer->flags_lock, NULL);
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	usbi_dbg("transfer %p", transfer);
 	return transfer;
 }
 
+static void destroy_transfer(struct usbi_transfer *itransfer)
+{
+	if (usbi_backend->destroy_transfer_priv)
+		usbi_backend->destroy_transfer_priv(itransfer);
+	free(itransfer->iov_bounce);
+	free(itransfer->iso_packet_info);
+	if (itransfer->waiter) {
+		usbi_mutex_destroy(&itransfer->waiter->lock);
+		usbi_cond_destroy(&itransfer->waiter->cond);
+		free(itransfer->waiter);
+	}
+	usbi_mutex_destroy(&itransfer->lock);
+	free(itransfer);
+}
+
+static void destroy_transfer_pool(struct libusb_transfer_pool *pool)
+{
+	usbi_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* return a pooled transfer to its pool, caching it if there is room */
+static void release_pooled_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer_pool *pool = itransfer->pool;
+	int free_pool;
+
+	usbi_mutex_lock(&pool->lock);
+	pool->outstanding--;
+	if (!pool->destroyed && pool->cached_cnt < pool->max_cached) {
+		list_add(&itransfer->list, &pool->cached);
+		pool->cached_cnt++;
+		itransfer = NULL;
+	}
+	free_pool = pool->destroyed && !pool->outstanding;
+	usbi_mutex_unlock(&pool->lock);
+
+	if (itransfer)
+		destroy_transfer(itransfer);
+	if (free_pool)
+		destroy_transfer_pool(pool);
+}
+
 /** \ingroup asyncio
  * Free a transfer structure. This should be called for all transfers
  * allocated with libusb_alloc_transfer().
@@ -1297,229 +1910,1623 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		return;
 
 	usbi_dbg("transfer %p", transfer);
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer)
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer &&
+			transfer->buffer != itransfer->iov_bounce)
 		free(transfer->buffer);
 
-	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
-	usbi_mutex_destroy(&itransfer->flags_lock);
-	free(itransfer);
+	if (itransfer->pool)
+		release_pooled_transfer(itransfer);
+	else
+		destroy_transfer(itransfer);
 }
 
-/* iterates through the flying transfers, and rearms the timer based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
- * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
- * or a LIBUSB_ERROR code on failure.
+/** \ingroup asyncio
+ * Create a pool of transfers with a given number of isochronous packet
+ * descriptors. Allocating from a pool with libusb_transfer_pool_alloc()
+ * reuses transfers previously released with libusb_free_transfer(), avoiding
+ * the memory allocation and lock initialization that libusb_alloc_transfer()
+ * performs every time.
+ *
+ * A pool may be used from several threads at once.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param iso_packets number of isochronous packet descriptors to allocate
+ * in each transfer of the pool
+ * \param max_cached maximum number of freed transfers that the pool keeps
+ * for reuse. Transfers freed beyond this limit are released to the system
+ * \param pool output location for the newly created pool. Only populated
+ * if the function returns 0
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if iso_packets is negative
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
  */
-static int arm_timer_for_next_timeout(struct libusb_context *ctx)
+int API_EXPORTED libusb_transfer_pool_create(int iso_packets,
+	unsigned int max_cached, libusb_transfer_pool **pool)
 {
-	struct usbi_transfer *transfer;
-
-	if (!usbi_using_timer(ctx))
-		return 0;
+	struct libusb_transfer_pool *_pool;
 
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(&transfer->timeout))
-			goto disarm;
-
-		/* act on first transfer that is not already cancelled */
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			struct timeval timeout;
-			int r;
-			usbi_dbg("next timeout originally %dms",
-					USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-
-			/* since time has elapsed since this transfer was added to the list,
-			 * we calculate the remaining time and arm the timer to expire then.
-			 * if the transfer has already timed out, we arm the timer with the
-			 * smallest possible timeout so that it is immediately triggered. */
-			r = calculate_remaining(transfer, &timeout);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
+	if (iso_packets < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-			if (!timerisset(&timeout)) {
-				usbi_dbg("transfer already timed out, arming timer for shortest timeout");
-				timeout.tv_usec = 1;
-			}
+	_pool = malloc(sizeof(*_pool));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
 
-			r = usbi_arm_timer(ctx->timer, &timeout);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 1;
-		}
+	if (usbi_mutex_init(&_pool->lock, NULL)) {
+		free(_pool);
+		return LIBUSB_ERROR_OTHER;
 	}
 
-disarm:
-	usbi_dbg("no timeouts, disarming timer");
-	return usbi_disarm_timer(ctx->timer);
+	_pool->iso_packets = iso_packets;
+	list_init(&_pool->cached);
+	_pool->cached_cnt = 0;
+	_pool->max_cached = max_cached;
+	_pool->outstanding = 0;
+	_pool->destroyed = 0;
+	*pool = _pool;
+	return 0;
 }
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * This function will return non 0 if fails to update the timer,
- * in which case the transfer is *not* on the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *transfer)
+/** \ingroup asyncio
+ * Destroy a transfer pool, releasing the transfers it has cached. Transfers
+ * allocated from the pool that have not yet been freed remain valid, and are
+ * released to the system when they are passed to libusb_free_transfer().
+ *
+ * It is legal to call this function with a NULL pool.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param pool the pool to destroy
+ */
+void API_EXPORTED libusb_transfer_pool_destroy(libusb_transfer_pool *pool)
 {
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int r = 0;
-	int first = 1;
+	struct usbi_transfer *itransfer;
+	struct usbi_transfer *tmp;
+	int free_pool;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (!pool)
+		return;
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
+	usbi_mutex_lock(&pool->lock);
+	list_for_each_entry_safe(itransfer, tmp, &pool->cached, list, struct usbi_transfer) {
+		list_del(&itransfer->list);
+		destroy_transfer(itransfer);
 	}
+	pool->cached_cnt = 0;
+	pool->destroyed = 1;
+	free_pool = !pool->outstanding;
+	usbi_mutex_unlock(&pool->lock);
 
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
+	if (free_pool)
+		destroy_transfer_pool(pool);
+}
+
+/** \ingroup asyncio
+ * Allocate a transfer from a pool created with libusb_transfer_pool_create().
+ * The returned transfer has the number of isochronous packet descriptors the
+ * pool was created with, and is otherwise in the same state as one returned
+ * by libusb_alloc_transfer(). Free it with libusb_free_transfer() as usual,
+ * which returns it to the pool.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param pool the pool to allocate from
+ * \returns a newly allocated transfer, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_alloc(
+	libusb_transfer_pool *pool)
+{
+	struct usbi_transfer *itransfer = NULL;
+	struct libusb_transfer *transfer;
+
+	usbi_mutex_lock(&pool->lock);
+	if (!list_empty(&pool->cached)) {
+		itransfer = list_first_entry(&pool->cached, struct usbi_transfer, list);
+		list_del(&itransfer->list);
+		pool->cached_cnt--;
+	}
+	pool->outstanding++;
+	usbi_mutex_unlock(&pool->lock);
+
+	if (!itransfer) {
+		transfer = libusb_alloc_transfer(pool->iso_packets);
+		if (!transfer) {
+			usbi_mutex_lock(&pool->lock);
+			pool->outstanding--;
+			usbi_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+		itransfer->pool = pool;
+		return transfer;
 	}
 
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
+	/* reset everything the user could have changed. the locks and the
+	 * backend private data are left as they are */
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	memset(transfer, 0, sizeof(*transfer)
+		+ sizeof(struct libusb_iso_packet_descriptor) * pool->iso_packets);
+	itransfer->transferred = 0;
+	itransfer->stream_id = 0;
+	usbi_atomic_and(&itransfer->flags, 0);
+	itransfer->iov = NULL;
+	itransfer->num_iov = 0;
+	itransfer->inline_callback = 0;
+	timerclear(&itransfer->timeout);
+	usbi_dbg("transfer %p (cached)", transfer);
+	return transfer;
+}
+
+/* cancel every transfer of a stream, some of which may not be in flight.
+ * stream->lock must be held */
+static void cancel_iso_stream_transfers(struct libusb_iso_stream *stream,
+	struct libusb_transfer *skip)
+{
+	int i;
+
+	for (i = 0; i < stream->num_transfers; i++) {
+		if (stream->transfers[i] != skip)
+			libusb_cancel_transfer(stream->transfers[i]);
+	}
+}
 
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
+static void LIBUSB_CALL iso_stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_iso_stream *stream = transfer->user_data;
+	size_t slot_size = (size_t)stream->packets_per_transfer * stream->packet_length;
+	unsigned char *buffer = transfer->buffer;
+	int slot = (int)((size_t)(buffer - stream->buffer) / slot_size);
+	struct libusb_iso_packet_descriptor *packets =
+		&stream->packets[slot * stream->packets_per_transfer];
+	enum libusb_transfer_status status = transfer->status;
+	enum libusb_transfer_status final_status;
+	int deliver = (status == LIBUSB_TRANSFER_COMPLETED);
+	int stopped;
+	int r;
+
+	memcpy(packets, transfer->iso_packet_desc,
+		stream->packets_per_transfer * sizeof(*packets));
+
+	usbi_mutex_lock(&stream->lock);
+	if (deliver && !stream->stopping) {
+		/* the packet lengths are left as they are, so the backend can
+		 * reuse its setup from the previous submission */
+		transfer->buffer = stream->buffer + stream->next_slot * slot_size;
+		r = libusb_submit_transfer(transfer);
+		if (r == 0) {
+			stream->next_slot = (stream->next_slot + 1) % stream->num_slots;
+			usbi_mutex_unlock(&stream->lock);
+			stream->callback(stream, LIBUSB_TRANSFER_COMPLETED, buffer,
+				packets, stream->packets_per_transfer, stream->user_data);
+			return;
 		}
-		first = 0;
+		usbi_dbg("resubmission failed with error %d, stopping stream", r);
+		transfer->buffer = buffer;
+		status = (r == LIBUSB_ERROR_NO_DEVICE) ?
+			LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
-	if (first && usbi_using_timer(ctx) && timerisset(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timer with this transfer's timeout */
-		int timeout_ms = USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
-		struct timeval timeout_tv = { (timeout_ms / 1000), ((timeout_ms % 1000) * 1000) };
-		usbi_dbg("arm timer for timeout in %dms (first in line)", timeout_ms);
-		r = usbi_arm_timer(ctx->timer, &timeout_tv);
+	if (!stream->stopping) {
+		stream->stopping = 1;
+		stream->status = status;
+		cancel_iso_stream_transfers(stream, transfer);
+	}
+	stopped = (--stream->in_flight == 0);
+	final_status = stream->status;
+	usbi_mutex_unlock(&stream->lock);
+
+	if (deliver)
+		stream->callback(stream, LIBUSB_TRANSFER_COMPLETED, buffer,
+			packets, stream->packets_per_transfer, stream->user_data);
+
+	/* the stream may be freed by this call, do not use it afterwards */
+	if (stopped)
+		stream->callback(stream, final_status, NULL, NULL, 0,
+			stream->user_data);
+}
+
+/** \ingroup asyncio
+ * Allocate a continuous isochronous stream. Once started with
+ * libusb_start_iso_stream(), libusb keeps num_transfers transfers queued on
+ * the endpoint, each covering one slot of a ring buffer of num_slots slots.
+ * When a transfer completes it is resubmitted into the next slot before your
+ * callback is invoked, so a slow callback does not leave a gap in the stream
+ * and no per-transfer setup is repeated.
+ *
+ * Each slot holds packets_per_transfer packets of packet_length bytes. As a
+ * slot is only reused after the next num_slots - num_transfers completions,
+ * this is how long you may keep working on the data of an IN slot after its
+ * callback, or how far ahead you must fill OUT slots.
+ *
+ * The stream callback is invoked from libusb's event handling, like any
+ * transfer callback.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint address of the isochronous endpoint
+ * \param buffer the ring buffer, num_slots * packets_per_transfer *
+ * packet_length bytes long. It must remain valid until the stream is freed.
+ * \param num_slots number of slots in the ring buffer, greater than
+ * num_transfers
+ * \param num_transfers number of transfers kept in flight
+ * \param packets_per_transfer number of packets in each transfer
+ * \param packet_length length of each packet in bytes
+ * \param callback function invoked for each completed slot and once the
+ * stream has stopped
+ * \param user_data user data passed to the callback
+ * \param stream output location for the new stream. Only populated if the
+ * function returns 0
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the geometry is not valid
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_alloc_iso_stream(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *buffer, int num_slots,
+	int num_transfers, int packets_per_transfer, unsigned int packet_length,
+	libusb_iso_stream_cb_fn callback, void *user_data,
+	libusb_iso_stream **stream)
+{
+	struct libusb_iso_stream *_stream;
+	int i;
+
+	if (!buffer || !callback || num_transfers < 1 ||
+	    num_slots <= num_transfers || packets_per_transfer < 1 ||
+	    packet_length < 1 ||
+	    (size_t)packets_per_transfer * packet_length > INT_MAX)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_stream = calloc(1, sizeof(*_stream)
+		+ num_transfers * sizeof(struct libusb_transfer *));
+	if (!_stream)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_stream->packets = calloc((size_t)num_slots * packets_per_transfer,
+		sizeof(struct libusb_iso_packet_descriptor));
+	if (!_stream->packets)
+		goto err_free;
+
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer =
+			libusb_alloc_transfer(packets_per_transfer);
+		if (!transfer)
+			goto err_free;
+
+		_stream->transfers[_stream->num_transfers++] = transfer;
+		libusb_fill_iso_transfer(transfer, dev_handle, endpoint, buffer,
+			(int)(packets_per_transfer * packet_length),
+			packets_per_transfer, iso_stream_transfer_cb, _stream, 0);
+		libusb_set_iso_packet_lengths(transfer, packet_length);
+	}
+
+	if (usbi_mutex_init(&_stream->lock, NULL))
+		goto err_free;
+
+	_stream->buffer = buffer;
+	_stream->num_slots = num_slots;
+	_stream->packets_per_transfer = packets_per_transfer;
+	_stream->packet_length = packet_length;
+	_stream->callback = callback;
+	_stream->user_data = user_data;
+	*stream = _stream;
+	return 0;
+
+err_free:
+	for (i = 0; i < _stream->num_transfers; i++)
+		libusb_free_transfer(_stream->transfers[i]);
+	free(_stream->packets);
+	free(_stream);
+	return LIBUSB_ERROR_NO_MEM;
+}
+
+/** \ingroup asyncio
+ * Start an isochronous stream, submitting all of its transfers. The stream
+ * keeps running until it is stopped with libusb_stop_iso_stream() or a
+ * transfer fails, after which the callback is invoked a final time.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param stream the stream to start
+ * \returns 0 on success. If only some of the transfers could be submitted,
+ * the stream is stopped and the error is reported through the final
+ * callback.
+ * \returns LIBUSB_ERROR_BUSY if the stream is already running or stopping
+ * \returns another LIBUSB_ERROR code if no transfer could be submitted, in
+ * which case the callback is not invoked
+ */
+int API_EXPORTED libusb_start_iso_stream(libusb_iso_stream *stream)
+{
+	size_t slot_size = (size_t)stream->packets_per_transfer * stream->packet_length;
+	int i, r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->in_flight) {
+		usbi_mutex_unlock(&stream->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	stream->stopping = 0;
+	stream->status = LIBUSB_TRANSFER_COMPLETED;
+	stream->next_slot = 0;
+
+	for (i = 0; i < stream->num_transfers; i++) {
+		struct libusb_transfer *transfer = stream->transfers[i];
+
+		transfer->buffer = stream->buffer + stream->next_slot * slot_size;
+		r = libusb_submit_transfer(transfer);
+		if (r < 0)
+			break;
+		stream->next_slot++;
+		stream->in_flight++;
+	}
+
+	if (r < 0 && stream->in_flight) {
+		/* stop like the Linux backend does for a partially submitted
+		 * transfer: report the error once everything has retired */
+		stream->stopping = 1;
+		stream->status = (r == LIBUSB_ERROR_NO_DEVICE) ?
+			LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		cancel_iso_stream_transfers(stream, NULL);
+		r = 0;
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	return r;
+}
+
+/** \ingroup asyncio
+ * Asynchronously stop an isochronous stream. All of its transfers are
+ * cancelled, and the callback is invoked with LIBUSB_TRANSFER_CANCELLED once
+ * they have all retired.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param stream the stream to stop
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the stream is not running
+ */
+int API_EXPORTED libusb_stop_iso_stream(libusb_iso_stream *stream)
+{
+	int r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	if (!stream->in_flight || stream->stopping) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	} else {
+		stream->stopping = 1;
+		stream->status = LIBUSB_TRANSFER_CANCELLED;
+		cancel_iso_stream_transfers(stream, NULL);
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	return r;
+}
+
+/** \ingroup asyncio
+ * Free an isochronous stream. The stream must not be running: free it
+ * before starting it, or once its final callback has been invoked (which
+ * may be done from the final callback itself). The ring buffer is not freed.
+ *
+ * It is legal to call this function with a NULL stream.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param stream the stream to free
+ */
+void API_EXPORTED libusb_free_iso_stream(libusb_iso_stream *stream)
+{
+	int i;
+
+	if (!stream)
+		return;
+
+	for (i = 0; i < stream->num_transfers; i++)
+		libusb_free_transfer(stream->transfers[i]);
+	usbi_mutex_destroy(&stream->lock);
+	free(stream->packets);
+	free(stream);
+}
+
+static int bulk_reader_status_to_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* stop resubmitting and cancel in-flight transfers. reader->lock must be
+ * held */
+static void stop_bulk_reader_locked(struct libusb_bulk_reader *reader,
+	int error, struct libusb_transfer *skip)
+{
+	int i;
+
+	if (reader->stopping)
+		return;
+
+	reader->stopping = 1;
+	reader->status = error;
+	reader->num_parked = 0;
+	for (i = 0; i < reader->num_transfers; i++) {
+		if (reader->transfers[i] != skip)
+			libusb_cancel_transfer(reader->transfers[i]);
+	}
+}
+
+/* submit a transfer into a buffer. reader->lock must be held */
+static int submit_bulk_reader_transfer(struct libusb_bulk_reader *reader,
+	struct libusb_transfer *transfer, int index)
+{
+	int r;
+
+	transfer->buffer = reader->buffers + (size_t)index * reader->buffer_size;
+	r = libusb_submit_transfer(transfer);
+	if (r == 0)
+		reader->in_flight++;
+	return r;
+}
+
+static void LIBUSB_CALL bulk_reader_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_bulk_reader *reader = transfer->user_data;
+	int index = (int)((size_t)(transfer->buffer - reader->buffers) / reader->buffer_size);
+	int r;
+
+	usbi_mutex_lock(&reader->lock);
+	reader->in_flight--;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		reader->free_buffers[reader->free_count++] = index;
+		stop_bulk_reader_locked(reader,
+			bulk_reader_status_to_error(transfer->status), transfer);
+		usbi_mutex_unlock(&reader->lock);
+		return;
+	}
+
+	/* queue the data up first, then get the endpoint busy again with a
+	 * free buffer before the consumer sees anything */
+	reader->ready[(reader->ready_head + reader->ready_count) % reader->num_buffers].index = index;
+	reader->ready[(reader->ready_head + reader->ready_count) % reader->num_buffers].length =
+		transfer->actual_length;
+	reader->ready_count++;
+
+	if (!reader->stopping) {
+		if (!reader->free_count) {
+			reader->parked[reader->num_parked++] = transfer;
+		} else {
+			index = reader->free_buffers[--reader->free_count];
+			r = submit_bulk_reader_transfer(reader, transfer, index);
+			if (r < 0) {
+				reader->free_buffers[reader->free_count++] = index;
+				stop_bulk_reader_locked(reader, r, transfer);
+			}
+		}
+	}
+	usbi_mutex_unlock(&reader->lock);
+}
+
+/** \ingroup asyncio
+ * Allocate a continuous bulk IN reader. Once started with
+ * libusb_start_bulk_reader(), libusb keeps queue_depth transfers queued on
+ * the endpoint. When one completes it is resubmitted into a free buffer
+ * straight away, from libusb's event handling, so the endpoint is not left
+ * idle while the data is consumed. Filled buffers are queued in completion
+ * order for libusb_bulk_reader_get().
+ *
+ * Completions are processed by libusb's event handling as usual, so some
+ * thread must be handling events while the reader is running.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint address of the bulk IN endpoint
+ * \param queue_depth number of transfers kept in flight
+ * \param num_buffers number of buffers, at least queue_depth. Buffers
+ * beyond queue_depth let the endpoint stay busy while the consumer holds
+ * on to some
+ * \param buffer_size size of each buffer, and so of each transfer, in bytes.
+ * If \ref libusb_pipe_policy::LIBUSB_PIPE_POLICY_RAW_IO "LIBUSB_PIPE_POLICY_RAW_IO"
+ * is enabled on the endpoint, it is rounded down to a multiple of the maximum
+ * packet size and limited to the maximum transfer size of the pipe
+ * \param reader output location for the new reader. Only populated if the
+ * function returns 0
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the parameters are not valid
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_alloc_bulk_reader(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int queue_depth, int num_buffers,
+	int buffer_size, libusb_bulk_reader **reader)
+{
+	struct libusb_bulk_reader *_reader;
+	unsigned int raw_io, max_size;
+	int max_packet;
+	int i;
+
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) || queue_depth < 1 ||
+	    num_buffers < queue_depth || buffer_size < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* with RAW_IO the driver fails transfers that are not made of whole
+	 * packets or that exceed its transfer size */
+	if (libusb_get_pipe_policy(dev_handle, endpoint,
+	    LIBUSB_PIPE_POLICY_RAW_IO, &raw_io) == 0 && raw_io) {
+		max_packet = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+		if (max_packet > 0) {
+			if (libusb_get_pipe_policy(dev_handle, endpoint,
+			    LIBUSB_PIPE_POLICY_MAX_TRANSFER_SIZE, &max_size) == 0 &&
+			    max_size >= (unsigned int)max_packet &&
+			    (unsigned int)buffer_size > max_size)
+				buffer_size = (int)max_size;
+			if (buffer_size > max_packet)
+				buffer_size -= buffer_size % max_packet;
+			else
+				buffer_size = max_packet;
+			usbi_dbg("RAW_IO on endpoint %x, buffer size %d",
+				endpoint, buffer_size);
+		}
+	}
+
+	_reader = calloc(1, sizeof(*_reader)
+		+ queue_depth * sizeof(struct libusb_transfer *));
+	if (!_reader)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_reader->buffers = malloc((size_t)num_buffers * buffer_size);
+	_reader->ready = malloc(num_buffers * sizeof(*_reader->ready));
+	_reader->free_buffers = malloc(num_buffers * sizeof(int));
+	_reader->parked = malloc(queue_depth * sizeof(struct libusb_transfer *));
+	if (!_reader->buffers || !_reader->ready || !_reader->free_buffers ||
+	    !_reader->parked)
+		goto err_free;
+
+	for (i = 0; i < queue_depth; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			goto err_free;
+
+		_reader->transfers[_reader->num_transfers++] = transfer;
+		libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, NULL,
+			buffer_size, bulk_reader_transfer_cb, _reader, 0);
+	}
+
+	if (usbi_mutex_init(&_reader->lock, NULL))
+		goto err_free;
+
+	_reader->num_buffers = num_buffers;
+	_reader->buffer_size = buffer_size;
+	for (i = num_buffers - 1; i >= 0; i--)
+		_reader->free_buffers[_reader->free_count++] = i;
+	_reader->stopping = 1;
+	_reader->status = LIBUSB_ERROR_NOT_FOUND;
+	*reader = _reader;
+	return 0;
+
+err_free:
+	for (i = 0; i < _reader->num_transfers; i++)
+		libusb_free_transfer(_reader->transfers[i]);
+	free(_reader->parked);
+	free(_reader->free_buffers);
+	free(_reader->ready);
+	free(_reader->buffers);
+	free(_reader);
+	return LIBUSB_ERROR_NO_MEM;
+}
+
+/** \ingroup asyncio
+ * Start a bulk reader, submitting all of its transfers. Any data left over
+ * from a previous run is discarded. Buffers that the consumer still holds
+ * from a previous run stay valid until they are released, transfers that
+ * find no free buffer are submitted as buffers are released.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param reader the reader to start
+ * \returns 0 on success. If only some of the transfers could be submitted,
+ * the reader is stopped and the error is reported by libusb_bulk_reader_get()
+ * \returns LIBUSB_ERROR_BUSY if transfers of a previous run are still in
+ * flight
+ * \returns another LIBUSB_ERROR code if no transfer could be submitted
+ */
+int API_EXPORTED libusb_start_bulk_reader(libusb_bulk_reader *reader)
+{
+	int i, index, r = 0;
+
+	usbi_mutex_lock(&reader->lock);
+	if (reader->in_flight) {
+		usbi_mutex_unlock(&reader->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	/* the discarded data frees its buffers. buffers that the consumer
+	 * holds come back through libusb_bulk_reader_release() */
+	for (i = 0; i < reader->ready_count; i++)
+		reader->free_buffers[reader->free_count++] =
+			reader->ready[(reader->ready_head + i) % reader->num_buffers].index;
+	reader->stopping = 0;
+	reader->status = 0;
+	reader->ready_head = 0;
+	reader->ready_count = 0;
+	reader->num_parked = 0;
+
+	for (i = 0; i < reader->num_transfers; i++) {
+		if (!reader->free_count) {
+			reader->parked[reader->num_parked++] = reader->transfers[i];
+			continue;
+		}
+		index = reader->free_buffers[--reader->free_count];
+		r = submit_bulk_reader_transfer(reader, reader->transfers[i], index);
 		if (r < 0) {
-			usbi_warn(ctx, "failed to arm first timer (errno %d)", errno);
-			r = LIBUSB_ERROR_OTHER;
+			reader->free_buffers[reader->free_count++] = index;
+			break;
 		}
 	}
 
-	if (r)
-		list_del(&transfer->list);
+	if (r < 0) {
+		if (reader->in_flight)
+			r = 0;
+		stop_bulk_reader_locked(reader, r ? r : LIBUSB_ERROR_IO, NULL);
+	}
+	usbi_mutex_unlock(&reader->lock);
+
+	return r;
+}
+
+/** \ingroup asyncio
+ * Take the oldest filled buffer of a bulk reader. This function does not
+ * block. The buffer belongs to the caller until it is handed back with
+ * libusb_bulk_reader_release().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param reader the reader
+ * \param buffer output location for the buffer
+ * \param length output location for the number of bytes received
+ * \returns 1 if a buffer was returned
+ * \returns 0 if no buffer is ready yet
+ * \returns a LIBUSB_ERROR code once the reader has stopped and all of its
+ * data has been taken: LIBUSB_ERROR_INTERRUPTED after
+ * libusb_stop_bulk_reader(), LIBUSB_ERROR_NOT_FOUND if it was never started,
+ * or the error that stopped it
+ */
+int API_EXPORTED libusb_bulk_reader_get(libusb_bulk_reader *reader,
+	unsigned char **buffer, int *length)
+{
+	struct usbi_bulk_reader_entry *entry;
+	int r = 0;
+
+	usbi_mutex_lock(&reader->lock);
+	if (reader->ready_count) {
+		entry = &reader->ready[reader->ready_head];
+		*buffer = reader->buffers + (size_t)entry->index * reader->buffer_size;
+		*length = entry->length;
+		reader->ready_head = (reader->ready_head + 1) % reader->num_buffers;
+		reader->ready_count--;
+		r = 1;
+	} else if (reader->stopping && !reader->in_flight) {
+		r = reader->status;
+	}
+	usbi_mutex_unlock(&reader->lock);
+
+	return r;
+}
+
+/** \ingroup asyncio
+ * Hand a buffer obtained from libusb_bulk_reader_get() back to its reader,
+ * which may resubmit a transfer into it immediately.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param reader the reader
+ * \param buffer the buffer to release
+ */
+void API_EXPORTED libusb_bulk_reader_release(libusb_bulk_reader *reader,
+	unsigned char *buffer)
+{
+	int index = (int)((size_t)(buffer - reader->buffers) / reader->buffer_size);
+	int r;
+
+	usbi_mutex_lock(&reader->lock);
+	if (reader->num_parked && !reader->stopping) {
+		struct libusb_transfer *transfer = reader->parked[--reader->num_parked];
+
+		r = submit_bulk_reader_transfer(reader, transfer, index);
+		if (r < 0) {
+			reader->free_buffers[reader->free_count++] = index;
+			stop_bulk_reader_locked(reader, r, NULL);
+		}
+	} else {
+		reader->free_buffers[reader->free_count++] = index;
+	}
+	usbi_mutex_unlock(&reader->lock);
+}
+
+/** \ingroup asyncio
+ * Asynchronously stop a bulk reader by cancelling its transfers. Data that
+ * was already received can still be taken with libusb_bulk_reader_get(),
+ * which reports LIBUSB_ERROR_INTERRUPTED once all transfers have retired.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param reader the reader to stop
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the reader is not running
+ */
+int API_EXPORTED libusb_stop_bulk_reader(libusb_bulk_reader *reader)
+{
+	int r = 0;
+
+	usbi_mutex_lock(&reader->lock);
+	if (reader->stopping)
+		r = LIBUSB_ERROR_NOT_FOUND;
+	else
+		stop_bulk_reader_locked(reader, LIBUSB_ERROR_INTERRUPTED, NULL);
+	usbi_mutex_unlock(&reader->lock);
 
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 	return r;
 }
 
+/** \ingroup asyncio
+ * Free a bulk reader and its buffers. The reader must not have any transfer
+ * in flight: free it before starting it, or once libusb_bulk_reader_get()
+ * has reported that it stopped.
+ *
+ * It is legal to call this function with a NULL reader.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param reader the reader to free
+ */
+void API_EXPORTED libusb_free_bulk_reader(libusb_bulk_reader *reader)
+{
+	int i;
+
+	if (!reader)
+		return;
+
+	for (i = 0; i < reader->num_transfers; i++)
+		libusb_free_transfer(reader->transfers[i]);
+	usbi_mutex_destroy(&reader->lock);
+	free(reader->parked);
+	free(reader->free_buffers);
+	free(reader->ready);
+	free(reader->buffers);
+	free(reader);
+}
+
+/* timeout heap helpers. all of these must be called with the flying_list
+ * locked. */
+#define TIMEOUT_HEAP_PARENT(i)	(((i) - 1) / 2)
+#define TIMEOUT_HEAP_LEFT(i)	(2 * (i) + 1)
+
+static int timeout_heap_less(struct libusb_context *ctx, unsigned int a, unsigned int b)
+{
+	return timercmp(&ctx->timeout_heap[a]->timeout, &ctx->timeout_heap[b]->timeout, <);
+}
+
+static void timeout_heap_swap(struct libusb_context *ctx, unsigned int a, unsigned int b)
+{
+	struct usbi_transfer *tmp = ctx->timeout_heap[a];
+
+	ctx->timeout_heap[a] = ctx->timeout_heap[b];
+	ctx->timeout_heap[b] = tmp;
+	ctx->timeout_heap[a]->timeout_heap_index = (int)a;
+	ctx->timeout_heap[b]->timeout_heap_index = (int)b;
+}
+
+static unsigned int timeout_heap_sift_up(struct libusb_context *ctx, unsigned int i)
+{
+	while (i > 0 && timeout_heap_less(ctx, i, TIMEOUT_HEAP_PARENT(i))) {
+		timeout_heap_swap(ctx, i, TIMEOUT_HEAP_PARENT(i));
+		i = TIMEOUT_HEAP_PARENT(i);
+	}
+
+	return i;
+}
+
+static void timeout_heap_sift_down(struct libusb_context *ctx, unsigned int i)
+{
+	while (1) {
+		unsigned int child = TIMEOUT_HEAP_LEFT(i);
+
+		if (child >= ctx->timeout_heap_len)
+			break;
+		if (child + 1 < ctx->timeout_heap_len && timeout_heap_less(ctx, child + 1, child))
+			child++;
+		if (!timeout_heap_less(ctx, child, i))
+			break;
+		timeout_heap_swap(ctx, i, child);
+		i = child;
+	}
+}
+
+/* returns the heap position of the newly inserted transfer, or a
+ * LIBUSB_ERROR code on failure */
+static int timeout_heap_insert(struct libusb_context *ctx, struct usbi_transfer *transfer)
+{
+	unsigned int i;
+
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		unsigned int size = ctx->timeout_heap_size ? ctx->timeout_heap_size * 2 : 16;
+		struct usbi_transfer **heap;
+
+		heap = realloc(ctx->timeout_heap, size * sizeof(*heap));
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = size;
+	}
+
+	i = ctx->timeout_heap_len++;
+	ctx->timeout_heap[i] = transfer;
+	transfer->timeout_heap_index = (int)i;
+	return (int)timeout_heap_sift_up(ctx, i);
+}
+
+static void timeout_heap_remove(struct libusb_context *ctx, struct usbi_transfer *transfer)
+{
+	unsigned int i = (unsigned int)transfer->timeout_heap_index;
+	unsigned int last = --ctx->timeout_heap_len;
+
+	transfer->timeout_heap_index = -1;
+	if (i == last)
+		return;
+
+	ctx->timeout_heap[i] = ctx->timeout_heap[last];
+	ctx->timeout_heap[i]->timeout_heap_index = (int)i;
+	if (timeout_heap_sift_up(ctx, i) == i)
+		timeout_heap_sift_down(ctx, i);
+}
+
+/* drop transfers whose timeouts no longer need to be tracked from the top
+ * of the heap, and return the transfer with the next pending timeout */
+static struct usbi_transfer *timeout_heap_peek(struct libusb_context *ctx)
+{
+	while (ctx->timeout_heap_len) {
+		struct usbi_transfer *transfer = ctx->timeout_heap[0];
+
+		if (!(usbi_atomic_load(&transfer->flags) &
+				(USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return transfer;
+		timeout_heap_remove(ctx, transfer);
+	}
+
+	return NULL;
+}
+
+/* rearms the timer based on the next upcoming timeout.
+ * must be called with flying_list locked.
+ * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
+ * or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timer_for_next_timeout(struct libusb_context *ctx,
+	struct usbi_now *now)
+{
+	struct usbi_transfer *transfer;
+	struct timeval timeout;
+	int r;
+
+	if (!usbi_using_timer(ctx))
+		return 0;
+
+	transfer = timeout_heap_peek(ctx);
+	if (!transfer) {
+		usbi_dbg("no timeouts, disarming timer");
+		return usbi_disarm_timer(ctx->timer);
+	}
+
+	usbi_dbg("next timeout originally %u%s",
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout,
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->flags &
+				LIBUSB_TRANSFER_TIMEOUT_US ? "us" : "ms");
+
+	/* since time has elapsed since this transfer was added to the list,
+	 * we calculate the remaining time and arm the timer to expire then.
+	 * if the transfer has already timed out, we arm the timer with the
+	 * smallest possible timeout so that it is immediately triggered. */
+	r = calculate_remaining(transfer, now, &timeout);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	if (!timerisset(&timeout)) {
+		usbi_dbg("transfer already timed out, arming timer for shortest timeout");
+		timeout.tv_usec = 1;
+	}
+
+	r = usbi_arm_timer(ctx->timer, &timeout);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	return 1;
+}
+
+/* the bulk stream transfers in flight on one stream */
+struct usbi_stream {
+	struct list_head transfers;	/* through usbi_transfer.stream_list */
+	int count;
+};
+
+/* the streams allocated on one endpoint, stream id N is streams[N - 1] */
+struct usbi_stream_table {
+	uint32_t num_streams;
+	struct usbi_stream streams
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+	[] /* valid C99 code */
+#else
+	[0] /* non-standard, but usually working code */
+#endif
+	;
+};
+
+/* Callers must hold the handle's flying_transfers_lock. */
+static struct usbi_stream *find_stream(struct libusb_device_handle *handle,
+	unsigned char endpoint, uint32_t stream_id)
+{
+	struct usbi_stream_table *table =
+		handle->stream_tables[usbi_stats_endpoint_index(endpoint)];
+
+	if (!table || stream_id == 0 || stream_id > table->num_streams)
+		return NULL;
+	return &table->streams[stream_id - 1];
+}
+
+/* unlink the transfers still listed on a table and free it. Callers must
+ * hold the handle's flying_transfers_lock. */
+static void free_stream_table(struct usbi_stream_table *table)
+{
+	struct usbi_transfer *itransfer, *tmp;
+	uint32_t i;
+
+	for (i = 0; i < table->num_streams; i++) {
+		list_for_each_entry_safe(itransfer, tmp, &table->streams[i].transfers,
+				stream_list, struct usbi_transfer) {
+			list_del(&itransfer->stream_list);
+			itransfer->stream = NULL;
+		}
+	}
+	free(table);
+}
+
+/* called once the backend allocated num_streams streams on the endpoints.
+ * Without a table an endpoint's stream transfers still work, they are only
+ * not tracked */
+void usbi_create_stream_tables(struct libusb_device_handle *handle,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	struct usbi_stream_table *table;
+	uint32_t j;
+	int i, idx;
+
+	for (i = 0; i < num_endpoints; i++) {
+		table = malloc(sizeof(*table) +
+			num_streams * sizeof(struct usbi_stream));
+		if (!table) {
+			usbi_warn(HANDLE_CTX(handle),
+				"no stream table for endpoint 0x%02x", endpoints[i]);
+			continue;
+		}
+		table->num_streams = num_streams;
+		for (j = 0; j < num_streams; j++) {
+			list_init(&table->streams[j].transfers);
+			table->streams[j].count = 0;
+		}
+
+		idx = usbi_stats_endpoint_index(endpoints[i]);
+		usbi_mutex_lock(&handle->flying_transfers_lock);
+		if (handle->stream_tables[idx])
+			free_stream_table(handle->stream_tables[idx]);
+		handle->stream_tables[idx] = table;
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+	}
+}
+
+/* drop the tables of the endpoints, or of all endpoints if endpoints is
+ * NULL. transfers in flight on them are no longer tracked */
+void usbi_destroy_stream_tables(struct libusb_device_handle *handle,
+	unsigned char *endpoints, int num_endpoints)
+{
+	int i, idx;
+
+	if (!endpoints)
+		num_endpoints = USBI_MAX_ENDPOINT_INDEX;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	for (i = 0; i < num_endpoints; i++) {
+		idx = endpoints ? usbi_stats_endpoint_index(endpoints[i]) : i;
+		if (!handle->stream_tables[idx])
+			continue;
+		free_stream_table(handle->stream_tables[idx]);
+		handle->stream_tables[idx] = NULL;
+	}
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+}
+
+/* list a transfer as in flight on its device handle, and on its stream if it
+ * is a bulk stream transfer */
+static void add_to_handle_list(struct usbi_transfer *transfer)
+{
+	struct libusb_transfer *ltransfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer);
+	struct libusb_device_handle *handle = ltransfer->dev_handle;
+	struct usbi_stream *stream = NULL;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	list_add_tail(&transfer->handle_list, &handle->flying_transfers);
+	usbi_count_transfers_in_flight(handle, 1);
+	if (ltransfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM)
+		stream = find_stream(handle, ltransfer->endpoint,
+			transfer->stream_id);
+	if (stream) {
+		list_add_tail(&transfer->stream_list, &stream->transfers);
+		stream->count++;
+	}
+	transfer->stream = stream;
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+}
+
+/* wait until libusb_cancel_stream_transfers() lets go of a transfer that is
+ * about to leave the list of its handle, after which its callback may free
+ * it. only transfers in flight are pinned, the submission paths never wait.
+ * called with the handle's flying_transfers_lock held */
+static void wait_until_unpinned(struct libusb_device_handle *handle,
+	struct usbi_transfer *transfer)
+{
+	while (handle->cancel_pinned == transfer)
+		usbi_cond_wait(&handle->cancel_pinned_cond,
+			&handle->flying_transfers_lock);
+}
+
+static void remove_from_handle_list(struct usbi_transfer *transfer)
+{
+	struct libusb_device_handle *handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->dev_handle;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	wait_until_unpinned(handle, transfer);
+	list_del(&transfer->handle_list);
+	usbi_count_transfers_in_flight(handle, -1);
+	if (transfer->stream) {
+		list_del(&transfer->stream_list);
+		transfer->stream->count--;
+		transfer->stream = NULL;
+	}
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+}
+
+/* add a transfer with a finite timeout to the timeout heap, rearming the timer
+ * if it has the lowest timeout of all active transfers. The caller holds
+ * ctx->flying_transfers_lock, taken before the transfer lock.
+ * This function will return non 0 if fails to update the timer,
+ * in which case the transfer is *not* in the timeout heap. */
+static int add_to_timeout_heap(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int r;
+
+	if (!timerisset(&transfer->timeout))
+		return 0;
+
+	r = timeout_heap_insert(ctx, transfer);
+	if (r < 0)
+		return r;
+
+	/* if this transfer has the lowest timeout of all active transfers,
+	 * rearm the timer with this transfer's timeout */
+	if (r == 0 && usbi_using_timer(ctx)) {
+		struct timeval timeout_tv;
+
+		transfer_timeout_to_timeval(USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer),
+			&timeout_tv);
+		usbi_dbg("arm timer for timeout in %d.%06ds (first in line)",
+			(int)timeout_tv.tv_sec, (int)timeout_tv.tv_usec);
+		r = usbi_arm_timer(ctx->timer, &timeout_tv);
+		if (r < 0) {
+			usbi_warn(ctx, "failed to arm first timer (errno %d)", errno);
+			timeout_heap_remove(ctx, transfer);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+	return 0;
+}
+
 /* remove a transfer from the active transfers list.
  * This function will *always* remove the transfer from the
  * flying_transfers list. It will return non 0 if it fails to
  * update the timer for the next timeout. */
 static int remove_from_flying_list(struct usbi_transfer *transfer)
+{
+	remove_from_handle_list(transfer);
+	return usbi_remove_from_timeout_heap(transfer);
+}
+
+/* remove a transfer from the timeout heap, if it is in it, and rearm the timer
+ * when it was armed for this transfer. The transfer must still have its
+ * device handle. It will return non 0 if it fails to update the timer. */
+int usbi_remove_from_timeout_heap(struct usbi_transfer *transfer)
 {
 	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int rearm = 0;
 	int r = 0;
 
-	/* FIXME: could be more intelligent with the timer here. we don't need
-	 * to disarm the timer if there was no timer running, and we only need
-	 * to rearm the timer if the transfer that expired was the one with
-	 * the shortest timeout. */
+	/* the timeout is only written at submission, the heap index may be
+	 * changed by other threads and is looked at under the lock */
+	if (!timerisset(&transfer->timeout))
+		return 0;
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	list_del(&transfer->list);
-	if (usbi_using_timer(ctx))
-		r = arm_timer_for_next_timeout(ctx);
+	if (transfer->timeout_heap_index >= 0) {
+		/* the timer only needs to change if it was armed for this transfer */
+		rearm = (transfer->timeout_heap_index == 0);
+		timeout_heap_remove(ctx, transfer);
+	}
+	if (rearm && usbi_using_timer(ctx)) {
+		struct usbi_now now = USBI_NOW_INIT;
+
+		r = arm_timer_for_next_timeout(ctx, &now);
+		/* 1 only means the timer was armed for another transfer */
+		if (r > 0)
+			r = 0;
+	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 	return r;
 }
 
+/* check that a transfer's buffer segments can be used, and gather them into
+ * the bounce buffer for backends that cannot submit them directly */
+static int prepare_iovec(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	unsigned char *dest;
+	int i;
+
+	if (!itransfer->iov)
+		return 0;
+
+	if ((transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+			transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM) ||
+			(transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_OUT) {
+		usbi_err(TRANSFER_CTX(transfer),
+			"buffer segments are only supported on bulk OUT endpoints");
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (usbi_backend->caps & USBI_CAP_HAS_BULK_IOVEC)
+		return 0;
+
+	if (transfer->length > itransfer->iov_bounce_size) {
+		dest = malloc(transfer->length);
+		if (!dest)
+			return LIBUSB_ERROR_NO_MEM;
+		free(itransfer->iov_bounce);
+		itransfer->iov_bounce = dest;
+		itransfer->iov_bounce_size = transfer->length;
+	}
+
+	dest = itransfer->iov_bounce;
+	for (i = 0; i < itransfer->num_iov; i++) {
+		memcpy(dest, itransfer->iov[i].buffer, itransfer->iov[i].length);
+		dest += itransfer->iov[i].length;
+	}
+	transfer->buffer = itransfer->iov_bounce;
+	return 0;
+}
+
+/* assign each packet the offset it has in the buffer when all preceding
+ * packets are complete */
+static void calculate_iso_packet_offsets(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_iso_packet_info *info = itransfer->iso_packet_info;
+	unsigned int offset = 0;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets && i < itransfer->num_iso_packets; i++) {
+		info[i].offset = offset;
+		offset += transfer->iso_packet_desc[i].length;
+	}
+	itransfer->iso_packet_info_done = 0;
+}
+
 /** \ingroup asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
- *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns another LIBUSB_ERROR code on other failure
+ * Get the location and result of every packet of a completed isochronous
+ * transfer as one contiguous array, indexed like
+ * \ref libusb_transfer::iso_packet_desc "iso_packet_desc". Unlike
+ * libusb_get_iso_packet_buffer(), the offsets are only computed once per
+ * submission, so walking all packets of a transfer is linear in the number
+ * of packets.
+ *
+ * The array is owned by the transfer. It stays valid until the transfer is
+ * resubmitted or freed.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfer a completed isochronous transfer
+ * \returns an array of \ref libusb_transfer::num_iso_packets "num_iso_packets"
+ * entries, or NULL if the transfer is not isochronous, has no packets, or
+ * memory could not be allocated
  */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+DEFAULT_VISIBILITY
+const struct libusb_iso_packet_info * LIBUSB_CALL libusb_get_iso_packet_info(
+	struct libusb_transfer *transfer)
 {
 	struct usbi_transfer *itransfer =
 		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int remove = 0;
+	struct libusb_iso_packet_info *info;
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ||
+	    transfer->num_iso_packets <= 0 ||
+	    transfer->num_iso_packets > itransfer->num_iso_packets)
+		return NULL;
+
+	if (!itransfer->iso_packet_info) {
+		itransfer->iso_packet_info = malloc(itransfer->num_iso_packets
+			* sizeof(struct libusb_iso_packet_info));
+		if (!itransfer->iso_packet_info)
+			return NULL;
+		calculate_iso_packet_offsets(itransfer);
+	}
+
+	info = itransfer->iso_packet_info;
+	if (!itransfer->iso_packet_info_done) {
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			info[i].actual_length = transfer->iso_packet_desc[i].actual_length;
+			info[i].status = transfer->iso_packet_desc[i].status;
+		}
+		itransfer->iso_packet_info_done = 1;
+	}
+
+	return info;
+}
+
+/** \ingroup asyncio
+ * Pack the data received by a completed isochronous IN transfer at the start
+ * of its buffer, in packet order, dropping the unused space after short
+ * packets and the packets that did not complete.
+ *
+ * Afterwards, the array returned by libusb_get_iso_packet_info() describes
+ * the packed layout: the offset of each packet points at its data in the
+ * packed buffer, and packets that did not complete have an actual_length of
+ * 0 there. The iso_packet_desc array of the transfer is left untouched.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfer a completed isochronous transfer
+ * \returns the number of bytes of packed data
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not isochronous or
+ * has no packets
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_compact_iso_packets(struct libusb_transfer *transfer)
+{
+	struct libusb_iso_packet_info *info;
+	unsigned int length = 0;
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ||
+	    transfer->num_iso_packets <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	info = (struct libusb_iso_packet_info *)libusb_get_iso_packet_info(transfer);
+	if (!info)
+		return transfer->num_iso_packets >
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->num_iso_packets ?
+			LIBUSB_ERROR_INVALID_PARAM : LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		if (info[i].status != LIBUSB_TRANSFER_COMPLETED)
+			info[i].actual_length = 0;
+		if (info[i].offset != length && info[i].actual_length)
+			memmove(transfer->buffer + length,
+				transfer->buffer + info[i].offset, info[i].actual_length);
+		info[i].offset = length;
+		length += info[i].actual_length;
+	}
+
+	return (int)length;
+}
+
+/* check and prepare a transfer for submission. on success, the transfer
+ * lock is left held and USBI_TRANSFER_SUBMITTING is set. */
+static int begin_submission(struct usbi_transfer *itransfer,
+	struct usbi_now *now)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int r;
 
-	usbi_dbg("transfer %p", transfer);
+	usbi_trace_transfer(submit, transfer, transfer->length, 0);
 	usbi_mutex_lock(&itransfer->lock);
-	usbi_mutex_lock(&itransfer->flags_lock);
-	if (itransfer->flags & USBI_TRANSFER_IN_FLIGHT) {
+	if (usbi_atomic_load(&itransfer->flags) & USBI_TRANSFER_IN_FLIGHT) {
 		r = LIBUSB_ERROR_BUSY;
-		goto out;
+		goto err;
 	}
 	itransfer->transferred = 0;
-	itransfer->flags = 0;
-	r = calculate_timeout(itransfer);
+	usbi_atomic_and(&itransfer->flags, 0);
+	r = prepare_iovec(itransfer);
+	if (r < 0)
+		goto err;
+	if (itransfer->iso_packet_info)
+		calculate_iso_packet_offsets(itransfer);
+	r = calculate_timeout(itransfer, now);
 	if (r < 0) {
 		r = LIBUSB_ERROR_OTHER;
-		goto out;
+		goto err;
 	}
-	itransfer->flags |= USBI_TRANSFER_SUBMITTING;
-	usbi_mutex_unlock(&itransfer->flags_lock);
+	usbi_atomic_or(&itransfer->flags, USBI_TRANSFER_SUBMITTING);
+	return 0;
 
-	r = add_to_flying_list(itransfer);
-	if (r) {
-		usbi_mutex_lock(&itransfer->flags_lock);
-		itransfer->flags = 0;
-		goto out;
-	}
+err:
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/* give up on a transfer prepared by begin_submission() without handing it to
+ * the backend, removing it from its handle's list if it was added.
+ *
+ * ctx->flying_transfers_lock is always taken before a transfer lock, the
+ * order handle_timeouts_locked() takes them in. A listed transfer is left in
+ * the timeout heap for the caller to remove with
+ * usbi_remove_from_timeout_heap() once it holds no transfer lock. Its flags
+ * are cleared first, so an expiring timeout leaves it alone until then. */
+static void abort_submission(struct usbi_transfer *itransfer, int listed)
+{
+	if (listed)
+		remove_from_handle_list(itransfer);
+	usbi_atomic_and(&itransfer->flags, 0);
+	usbi_mutex_unlock(&itransfer->lock);
+}
+
+/* hand a transfer on the active transfers list to the backend and release
+ * the transfer lock taken by begin_submission(). On failure the transfer is
+ * left in the timeout heap, as for abort_submission() */
+static int finish_submission(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	long flags, new_flags;
+	int remove = 0;
+	int r;
 
 	/* keep a reference to this device */
 	libusb_ref_device(transfer->dev_handle->dev);
+	/* recorded first, the transfer may complete before we get it back */
+	usbi_stats_transfer_submitted(itransfer);
 	r = usbi_backend->submit_transfer(itransfer);
+	usbi_trace_transfer(backend_submit, transfer, transfer->length, r);
+
+	/* the completion and disconnect paths may change the flags at the same
+	 * time, so IN_FLIGHT is only set if neither got there first */
+	flags = usbi_atomic_load(&itransfer->flags);
+	do {
+		new_flags = flags & ~USBI_TRANSFER_SUBMITTING;
+		if (r == LIBUSB_SUCCESS && !(flags &
+				(USBI_TRANSFER_DEVICE_DISAPPEARED | USBI_TRANSFER_COMPLETED)))
+			new_flags |= USBI_TRANSFER_IN_FLIGHT;
+	} while (!usbi_atomic_cas(&itransfer->flags, flags, new_flags));
 
-	usbi_mutex_lock(&itransfer->flags_lock);
-	itransfer->flags &= ~USBI_TRANSFER_SUBMITTING;
 	if (r == LIBUSB_SUCCESS) {
 		/* check for two possible special conditions:
 		 *   1) device disconnect occurred immediately after submission
 		 *   2) transfer completed before we got here to update the flags
 		 */
-		if (itransfer->flags & USBI_TRANSFER_DEVICE_DISAPPEARED) {
+		if (flags & USBI_TRANSFER_DEVICE_DISAPPEARED) {
 			usbi_backend->clear_transfer_priv(itransfer);
 			remove = 1;
 			r = LIBUSB_ERROR_NO_DEVICE;
 		}
-		else if (!(itransfer->flags & USBI_TRANSFER_COMPLETED)) {
-			itransfer->flags |= USBI_TRANSFER_IN_FLIGHT;
-		}
 	} else {
 		remove = 1;
 	}
-out:
-	usbi_mutex_unlock(&itransfer->flags_lock);
 	if (remove) {
+		usbi_stats_transfer_unsubmitted(itransfer);
 		libusb_unref_device(transfer->dev_handle->dev);
-		remove_from_flying_list(itransfer);
+		remove_from_handle_list(itransfer);
 	}
 	usbi_mutex_unlock(&itransfer->lock);
 	return r;
 }
 
+/** \ingroup asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct usbi_now now = USBI_NOW_INIT;
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	int timed = transfer->timeout != 0;
+	int r;
+
+	usbi_dbg("transfer %p", transfer);
+	/* the heap lock goes before the transfer lock, see abort_submission() */
+	if (timed)
+		usbi_mutex_lock(&ctx->flying_transfers_lock);
+	r = begin_submission(itransfer, &now);
+	if (r == 0) {
+		r = add_to_timeout_heap(itransfer);
+		if (r)
+			abort_submission(itransfer, 0);
+	}
+	if (timed)
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (r)
+		return r;
+
+	add_to_handle_list(itransfer);
+	r = finish_submission(itransfer);
+	if (r < 0)
+		usbi_remove_from_timeout_heap(itransfer);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Submit several transfers at once. This behaves like calling
+ * libusb_submit_transfer() on each transfer in turn, but the transfers are
+ * added to libusb's list of active transfers in one go, the timeout timer is
+ * re-armed at most once, and the transfers are then handed to the operating
+ * system back to back. Use it to prime a queue of transfers on an endpoint.
+ *
+ * All transfers must belong to device handles of the same context, and a
+ * transfer must not appear in the array more than once.
+ * Transfers are submitted in array order. If one of them cannot be
+ * submitted, the transfers after it are not submitted either.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfers array of transfers to submit
+ * \param count number of transfers in the array
+ * \returns the number of transfers submitted, counted from the start of the
+ * array. If this is less than count, transfers[returned value] failed to
+ * submit
+ * \returns LIBUSB_ERROR_INVALID_PARAM if count is not positive or the
+ * transfers belong to different contexts
+ * \returns the error of the first transfer if none could be submitted, as
+ * documented for libusb_submit_transfer()
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count)
+{
+	struct libusb_context *ctx;
+	struct usbi_transfer *itransfer;
+	struct usbi_now now = USBI_NOW_INIT;
+	int i, n, prepared, timed = 0, rearm = 0;
+	int r = 0;
+
+	if (count <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ctx = TRANSFER_CTX(transfers[0]);
+	for (i = 1; i < count; i++) {
+		if (TRANSFER_CTX(transfers[i]) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	for (i = 0; i < count; i++)
+		timed |= (transfers[i]->timeout != 0);
+
+	usbi_dbg("%d transfers", count);
+	/* the heap lock goes before the transfer locks, see abort_submission() */
+	if (timed)
+		usbi_mutex_lock(&ctx->flying_transfers_lock);
+	for (n = 0; n < count; n++) {
+		r = begin_submission(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[n]), &now);
+		if (r < 0)
+			break;
+	}
+
+	/* one pass over the timeout heap for the whole batch */
+	i = n;
+	if (timed) {
+		for (i = 0; i < n; i++) {
+			itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+			if (!timerisset(&itransfer->timeout))
+				continue;
+			r = timeout_heap_insert(ctx, itransfer);
+			if (r < 0)
+				break;
+			rearm |= (r == 0);
+		}
+		if (rearm && arm_timer_for_next_timeout(ctx, &now) < 0) {
+			usbi_warn(ctx, "failed to arm first timer (errno %d)", errno);
+			r = LIBUSB_ERROR_OTHER;
+			i = 0;
+		}
+	}
+
+	/* transfers that did not make it into the heap are given up */
+	prepared = n;
+	while (n > i)
+		abort_submission(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[--n]), 0);
+	if (timed)
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	for (i = 0; i < n; i++)
+		add_to_handle_list(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+
+	for (i = 0; i < n; i++) {
+		r = finish_submission(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+		if (r < 0)
+			break;
+	}
+	/* the rest of the batch is left unsubmitted */
+	while (n > i + 1)
+		abort_submission(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[--n]), 1);
+
+	/* the failed and given up transfers leave the heap now that none of
+	 * their locks is held */
+	for (n = i; n < prepared; n++)
+		usbi_remove_from_timeout_heap(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[n]));
+
+	return i ? i : r;
+}
+
+/* Record that a cancellation was requested from the backend, r being what
+ * the backend returned for it. Callers must hold the transfer lock. */
+static void mark_cancelling(struct usbi_transfer *itransfer, int r)
+{
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(ITRANSFER_CTX(itransfer),
+				"cancel transfer failed error %d", r);
+		else
+			usbi_dbg("cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			usbi_atomic_or(&itransfer->flags,
+				USBI_TRANSFER_DEVICE_DISAPPEARED);
+	}
+
+	usbi_atomic_or(&itransfer->flags, USBI_TRANSFER_CANCELLING);
+}
+
+/* Callers must hold the transfer lock. */
+static int cancel_transfer_locked(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	long flags;
+	int r;
+
+	flags = usbi_atomic_load(&itransfer->flags);
+	if (!(flags & USBI_TRANSFER_IN_FLIGHT)
+			|| (flags & USBI_TRANSFER_CANCELLING)) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+	r = usbi_backend->cancel_transfer(itransfer);
+	mark_cancelling(itransfer, r);
+
+out:
+	usbi_trace_transfer(cancel, transfer, transfer->length, r);
+	return r;
+}
+
 /** \ingroup asyncio
  * Asynchronously cancel a previously submitted transfer.
  * This function returns immediately, but this does not indicate cancellation
@@ -1542,30 +3549,253 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 
 	usbi_dbg("transfer %p", transfer );
 	usbi_mutex_lock(&itransfer->lock);
-	usbi_mutex_lock(&itransfer->flags_lock);
-	if (!(itransfer->flags & USBI_TRANSFER_IN_FLIGHT)
-			|| (itransfer->flags & USBI_TRANSFER_CANCELLING)) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
+	r = cancel_transfer_locked(itransfer);
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all transfers in flight on one bulk stream of an
+ * endpoint. The transfers are found through the stream table kept for the
+ * streams allocated by libusb_alloc_streams(), so the cost does not depend on
+ * the number of transfers in flight on other streams or endpoints. As with
+ * libusb_cancel_transfer(), the callback of each transfer is invoked later
+ * with a status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED".
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the endpoint the streams were allocated on
+ * \param stream_id the stream to cancel the transfers of
+ * \returns the number of transfers a cancellation was requested for, which
+ * may be 0
+ * \returns LIBUSB_ERROR_NOT_FOUND if stream_id is not a stream allocated on
+ * the endpoint
+ * \see libusb_get_stream_transfer_count()
+ */
+int API_EXPORTED libusb_cancel_stream_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	uint32_t stream_id)
+{
+	struct usbi_stream *stream;
+	struct usbi_transfer *itransfer, *next;
+	int cancelled = 0;
+	long flags;
+
+	usbi_dbg("endpoint 0x%02x stream %u", endpoint, (unsigned) stream_id);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	if (!find_stream(dev_handle, endpoint, stream_id)) {
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+		return LIBUSB_ERROR_NOT_FOUND;
 	}
-	r = usbi_backend->cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(TRANSFER_CTX(transfer),
-				"cancel transfer failed error %d", r);
-		else
-			usbi_dbg("cancel transfer failed error %d", r);
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	/* the transfer lock goes before the handle lock, so each transfer is
+	 * pinned to the stream while the handle lock is dropped to take it.
+	 * transfers still being submitted are left alone */
+	for (;;) {
+		while (dev_handle->cancel_pinned)
+			usbi_cond_wait(&dev_handle->cancel_pinned_cond,
+				&dev_handle->flying_transfers_lock);
+
+		next = NULL;
+		stream = find_stream(dev_handle, endpoint, stream_id);
+		if (stream) {
+			list_for_each_entry(itransfer, &stream->transfers, stream_list, struct usbi_transfer) {
+				flags = usbi_atomic_load(&itransfer->flags);
+				if ((flags & (USBI_TRANSFER_IN_FLIGHT | USBI_TRANSFER_CANCELLING |
+						USBI_TRANSFER_COMPLETED)) == USBI_TRANSFER_IN_FLIGHT) {
+					next = itransfer;
+					break;
+				}
+			}
+		}
+		if (!next)
+			break;
+
+		dev_handle->cancel_pinned = next;
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+		usbi_mutex_lock(&next->lock);
+		if (cancel_transfer_locked(next) == LIBUSB_SUCCESS)
+			cancelled++;
+		usbi_mutex_unlock(&next->lock);
+
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		dev_handle->cancel_pinned = NULL;
+		usbi_cond_broadcast(&dev_handle->cancel_pinned_cond);
 	}
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
-	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+	return cancelled;
+}
 
-out:
-	usbi_mutex_unlock(&itransfer->flags_lock);
-	usbi_mutex_unlock(&itransfer->lock);
+/* Whether the backend can abort all transfers of this one's endpoint at once.
+ * Control transfers share endpoint 0 and bulk streams are aborted per
+ * stream, both are cancelled one by one. */
+static int can_cancel_endpoint(struct libusb_transfer *transfer)
+{
+	if (!usbi_backend->cancel_endpoint_transfers)
+		return 0;
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Cancel the transfers in flight on endpoint, or on all endpoints if endpoint
+ * is negative. Where the backend supports it each endpoint is aborted once,
+ * the first time one of its transfers is found, and the other transfers of
+ * the endpoint are only marked as cancelling. A transfer is found again if
+ * it was busy during the abort, it may have been submitted after it. */
+static int cancel_transfers(libusb_device_handle *dev_handle, int endpoint)
+{
+	struct usbi_transfer *itransfer;
+	struct libusb_transfer *transfer;
+	int results[USBI_MAX_ENDPOINT_INDEX];
+	uint32_t aborted, unsupported = 0;
+	unsigned int idx;
+	long flags;
+	int busy, cancelled = 0;
+	int r;
+
+	do {
+		busy = 0;
+		aborted = 0;
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		list_for_each_entry(itransfer, &dev_handle->flying_transfers, handle_list, struct usbi_transfer) {
+			transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+			if (endpoint >= 0 && transfer->endpoint != endpoint)
+				continue;
+			if (usbi_atomic_load(&itransfer->flags) & USBI_TRANSFER_CANCELLING)
+				continue;
+			/* submission and completion take the transfer lock
+			 * first, a transfer they hold is retried once they let
+			 * go */
+			if (usbi_mutex_trylock(&itransfer->lock) != 0) {
+				busy = 1;
+				continue;
+			}
+
+			idx = usbi_stats_endpoint_index(transfer->endpoint);
+			if (!can_cancel_endpoint(transfer) || (unsupported & (1U << idx))) {
+				if (cancel_transfer_locked(itransfer) == LIBUSB_SUCCESS)
+					cancelled++;
+				usbi_mutex_unlock(&itransfer->lock);
+				continue;
+			}
+
+			flags = usbi_atomic_load(&itransfer->flags);
+			if (!(flags & USBI_TRANSFER_IN_FLIGHT)) {
+				usbi_mutex_unlock(&itransfer->lock);
+				continue;
+			}
+
+			if (!(aborted & (1U << idx))) {
+				r = usbi_backend->cancel_endpoint_transfers(itransfer);
+				if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+					/* e.g. an interface driver without a pipe abort */
+					unsupported |= 1U << idx;
+					if (cancel_transfer_locked(itransfer) == LIBUSB_SUCCESS)
+						cancelled++;
+					usbi_mutex_unlock(&itransfer->lock);
+					continue;
+				}
+				usbi_dbg("aborted endpoint 0x%02x, error %d",
+					transfer->endpoint, r);
+				aborted |= 1U << idx;
+				results[idx] = r;
+			}
+
+			r = results[idx];
+			mark_cancelling(itransfer, r);
+			usbi_trace_transfer(cancel, transfer, transfer->length, r);
+			if (r == LIBUSB_SUCCESS)
+				cancelled++;
+			usbi_mutex_unlock(&itransfer->lock);
+		}
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+	} while (busy);
+
+	return cancelled;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all transfers in flight on an endpoint. Stopping a
+ * deep transfer queue this way costs one abort of the endpoint on the
+ * platforms that have one, Darwin and WinUSB, instead of one per transfer.
+ * Elsewhere the transfers are cancelled one by one, as by
+ * libusb_cancel_transfer() but in one pass. As with libusb_cancel_transfer(),
+ * the callback of each transfer is invoked later with a status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED".
+ *
+ * Transfers submitted to the endpoint by other threads while this function
+ * runs may be cancelled as well.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint, 0 for control transfers
+ * \returns the number of transfers a cancellation was requested for, which
+ * may be 0
+ * \see libusb_cancel_all_transfers()
+ */
+int API_EXPORTED libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	usbi_dbg("endpoint 0x%02x", endpoint);
+	return cancel_transfers(dev_handle, endpoint);
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all transfers in flight on a device handle, as by
+ * libusb_cancel_endpoint_transfers() for each of its endpoints.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \returns the number of transfers a cancellation was requested for, which
+ * may be 0
+ */
+int API_EXPORTED libusb_cancel_all_transfers(libusb_device_handle *dev_handle)
+{
+	usbi_dbg("handle %p", dev_handle);
+	return cancel_transfers(dev_handle, -1);
+}
+
+/** \ingroup asyncio
+ * Get the number of transfers in flight on one bulk stream of an endpoint,
+ * for streams allocated by libusb_alloc_streams(). Transfers count from
+ * their submission until their completion is handled, cancelled transfers
+ * included.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the endpoint the streams were allocated on
+ * \param stream_id the stream to count the transfers of
+ * \returns the number of transfers in flight on the stream
+ * \returns LIBUSB_ERROR_NOT_FOUND if stream_id is not a stream allocated on
+ * the endpoint
+ */
+int API_EXPORTED libusb_get_stream_transfer_count(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	uint32_t stream_id)
+{
+	struct usbi_stream *stream;
+	int r;
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	stream = find_stream(dev_handle, endpoint, stream_id);
+	r = stream ? stream->count : LIBUSB_ERROR_NOT_FOUND;
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 	return r;
 }
 
@@ -1589,6 +3819,65 @@ void API_EXPORTED libusb_transfer_set_stream_id(
 	itransfer->stream_id = stream_id;
 }
 
+/** \ingroup asyncio
+ * Make a bulk OUT transfer send its data from a list of buffer segments
+ * instead of one contiguous buffer. The segments are sent back to back, in
+ * order, as if they had been copied into a single buffer. Where the platform
+ * allows it, the segments are handed to the operating system directly,
+ * avoiding that copy. Elsewhere libusb gathers them into an internal buffer.
+ *
+ * Call this after filling in the transfer. The transfer's length is set to
+ * the total length of the segments, and its buffer is managed by libusb
+ * until the segments are cleared again by calling this function with num_iov
+ * set to 0. The segment array and the memory it points to must remain valid
+ * until the transfer completes.
+ *
+ * For the data to reach the device as a single USB transfer, every segment
+ * except the last one should have a length that is a multiple of the
+ * endpoint's maximum packet size. A shorter segment ends the USB transfer.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfer the transfer to set the segments for
+ * \param iov array of buffer segments
+ * \param num_iov number of entries in iov, or 0 to clear the segments
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the transfer is in flight
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a segment length is negative or the
+ * total length is too large
+ */
+int API_EXPORTED libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int num_iov)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int length = 0;
+	int i;
+
+	if (usbi_atomic_load(&itransfer->flags) & USBI_TRANSFER_IN_FLIGHT)
+		return LIBUSB_ERROR_BUSY;
+
+	if (num_iov <= 0) {
+		if (itransfer->iov && transfer->buffer == itransfer->iov_bounce)
+			transfer->buffer = NULL;
+		itransfer->iov = NULL;
+		itransfer->num_iov = 0;
+		return 0;
+	}
+
+	for (i = 0; i < num_iov; i++) {
+		if (iov[i].length < 0 || iov[i].length > INT_MAX - length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		length += iov[i].length;
+	}
+
+	itransfer->iov = iov;
+	itransfer->num_iov = num_iov;
+	transfer->buffer = NULL;
+	transfer->length = length;
+	return 0;
+}
+
 /** \ingroup asyncio
  * Get a transfers bulk stream id.
  *
@@ -1606,6 +3895,195 @@ uint32_t API_EXPORTED libusb_transfer_get_stream_id(
 	return itransfer->stream_id;
 }
 
+/* the last part of completing a transfer, once its status has been set */
+static void run_transfer_callback(struct libusb_transfer *transfer)
+{
+	struct libusb_device *dev = transfer->dev_handle->dev;
+	unsigned char endpoint = transfer->endpoint;
+	int actual_length = transfer->actual_length;
+	enum libusb_transfer_status status = transfer->status;
+	uint8_t flags = transfer->flags;
+
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	usbi_trace_transfer(callback_enter, transfer, actual_length, status);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	/* only the values saved above may be traced, see trace.h */
+	USBI_TRACE(callback_exit, transfer, endpoint, actual_length, status);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+	libusb_unref_device(dev);
+}
+
+/* hand a completed transfer to the executor of its handle or to the
+ * context's callback workers. returns 0 if the callback has to be run
+ * right away */
+static int defer_transfer_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct usbi_callback_worker *worker;
+
+	if (handle->executor) {
+		handle->executor(transfer, handle->executor_user_data);
+		return 1;
+	}
+
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	if (!ctx->num_callback_workers) {
+		usbi_mutex_unlock(&ctx->callback_workers_lock);
+		return 0;
+	}
+
+	worker = &ctx->callback_workers[handle->callback_worker % ctx->num_callback_workers];
+	usbi_mutex_lock(&worker->lock);
+	if (list_empty(&worker->transfers))
+		usbi_cond_signal(&worker->cond);
+	list_add_tail(&itransfer->completed_list, &worker->transfers);
+	usbi_mutex_unlock(&worker->lock);
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+	return 1;
+}
+
+/* add a completed transfer to the batch of its handle, which stays on the
+ * flying list until the batch is delivered. returns 0 if the transfer has to
+ * be completed on its own */
+static int add_to_transfer_batch(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+
+	if (!handle->batch_callback || itransfer->inline_callback)
+		return 0;
+
+	if (handle->batch_len == handle->batch_size) {
+		struct libusb_transfer **batch;
+		int size = handle->batch_size ? handle->batch_size * 2 : 16;
+
+		/* the second half takes the transfers to free after the call */
+		batch = realloc(handle->batch, 2 * (size_t)size * sizeof(*batch));
+		if (!batch)
+			return 0;
+		handle->batch = batch;
+		handle->batch_size = size;
+	}
+
+	if (!handle->batch_len)
+		list_add_tail(&handle->batch_list, handle->shard ?
+			&handle->shard->batch_handles : &HANDLE_CTX(handle)->batch_handles);
+	handle->batch[handle->batch_len++] = transfer;
+	return 1;
+}
+
+/* Deliver the batch of a handle to its batch callback. The transfers leave
+ * the flying list of the handle under one lock, and the timeout heap under
+ * one more with the timer armed again at most once, rather than one
+ * transfer at a time. */
+void usbi_flush_transfer_batch(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct libusb_device *dev = handle->dev;
+	struct libusb_transfer **transfers = handle->batch;
+	struct libusb_transfer ***spare;
+	struct usbi_transfer *itransfer;
+	int n = handle->batch_len, size = handle->batch_size;
+	int timed = 0, rearm = 0, nfree = 0;
+	int *spare_size;
+	int i;
+
+	if (!n)
+		return;
+	list_del(&handle->batch_list);
+	handle->batch_len = 0;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	for (i = 0; i < n; i++) {
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+		wait_until_unpinned(handle, itransfer);
+		list_del(&itransfer->handle_list);
+		if (itransfer->stream) {
+			list_del(&itransfer->stream_list);
+			itransfer->stream->count--;
+			itransfer->stream = NULL;
+		}
+		timed |= timerisset(&itransfer->timeout);
+	}
+	usbi_count_transfers_in_flight(handle, -n);
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+
+	if (timed) {
+		usbi_mutex_lock(&ctx->flying_transfers_lock);
+		for (i = 0; i < n; i++) {
+			itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+			if (itransfer->timeout_heap_index < 0)
+				continue;
+			rearm |= (itransfer->timeout_heap_index == 0);
+			timeout_heap_remove(ctx, itransfer);
+		}
+		if (rearm && usbi_using_timer(ctx)) {
+			struct usbi_now now = USBI_NOW_INIT;
+
+			if (arm_timer_for_next_timeout(ctx, &now) < 0)
+				usbi_warn(ctx, "failed to arm timer (errno %d)", errno);
+		}
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	}
+
+	/* the callback may free the transfers, see run_transfer_callback() */
+	for (i = 0; i < n; i++) {
+		usbi_trace_transfer(callback_enter, transfers[i],
+			transfers[i]->actual_length, transfers[i]->status);
+		if (transfers[i]->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			transfers[n + nfree++] = transfers[i];
+	}
+
+	/* the array is detached from the handle for the call, which takes the
+	 * spare array instead. the callback may handle events itself, which
+	 * collects a new batch for the handle, or close the handle, which frees
+	 * that new batch. the detached array becomes the spare once the handle
+	 * must no longer be touched */
+	if (handle->shard) {
+		spare = &handle->shard->batch_spare;
+		spare_size = &handle->shard->batch_spare_size;
+	} else {
+		spare = &ctx->batch_spare;
+		spare_size = &ctx->batch_spare_size;
+	}
+	handle->batch = *spare;
+	handle->batch_size = *spare_size;
+	*spare = NULL;
+	*spare_size = 0;
+
+	usbi_dbg("batch of %d transfers for handle %p", n, handle);
+	handle->batch_callback(handle, transfers, n, handle->batch_user_data);
+
+	for (i = 0; i < nfree; i++)
+		libusb_free_transfer(transfers[n + i]);
+	if (size > *spare_size) {
+		free(*spare);
+		*spare = transfers;
+		*spare_size = size;
+	} else {
+		free(transfers);
+	}
+	for (i = 0; i < n; i++)
+		libusb_unref_device(dev);
+}
+
+/* deliver the batches collected during an event handling iteration. a
+ * callback may close other handles, which delivers their batches too */
+void usbi_flush_transfer_batches(struct list_head *batch_handles)
+{
+	while (!list_empty(batch_handles))
+		usbi_flush_transfer_batch(list_first_entry(batch_handles,
+			struct libusb_device_handle, batch_list));
+}
+
 /* Handle completion of a transfer (completion might be an error condition).
  * This will invoke the user-supplied callback function, which may end up
  * freeing the transfer. Therefore you cannot use the transfer structure
@@ -1619,18 +4097,21 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_device_handle *handle = transfer->dev_handle;
-	uint8_t flags;
+	int batched;
+	long state;
 	int r;
 
-	r = remove_from_flying_list(itransfer);
-	if (r)
-		return r;
+	batched = add_to_transfer_batch(itransfer);
+	if (!batched) {
+		r = remove_from_flying_list(itransfer);
+		if (r)
+			return r;
+	}
 
-	usbi_mutex_lock(&itransfer->flags_lock);
-	itransfer->flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	itransfer->flags |= USBI_TRANSFER_COMPLETED;
-	usbi_mutex_unlock(&itransfer->flags_lock);
+	state = usbi_atomic_load(&itransfer->flags);
+	while (!usbi_atomic_cas(&itransfer->flags, state,
+			(state & ~USBI_TRANSFER_IN_FLIGHT) | USBI_TRANSFER_COMPLETED))
+		;
 
 	if (status == LIBUSB_TRANSFER_COMPLETED
 			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
@@ -1643,20 +4124,96 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
-	flags = transfer->flags;
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	libusb_unref_device(handle->dev);
+	usbi_stats_transfer_completed(itransfer, status);
+
+	if (batched)
+		return 0;
+	if (!itransfer->inline_callback && defer_transfer_callback(itransfer))
+		return 0;
+
+	run_transfer_callback(transfer);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Have the callbacks of a device handle's transfers run by an executor
+ * instead of from event handling. When a transfer of the handle completes,
+ * event handling calls the executor with it and goes on with the next
+ * completion, and the executor calls libusb_run_transfer_callback(), for
+ * example from a thread of its own. This keeps slow callbacks from holding
+ * up the transfers of other devices.
+ *
+ * The callbacks of the synchronous I/O functions still run from event
+ * handling. Do not change the executor while transfers of the handle are in
+ * flight, and do not close the handle before the callbacks of all of its
+ * transfers have run.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param executor the executor, or NULL to run the callbacks from event
+ * handling (or from the threads of \ref LIBUSB_OPTION_CALLBACK_WORKERS)
+ * \param user_data passed to the executor along with each transfer
+ * \returns 0 on success
+ */
+int API_EXPORTED libusb_set_transfer_executor(libusb_device_handle *dev_handle,
+	libusb_transfer_executor executor, void *user_data)
+{
+	dev_handle->executor_user_data = user_data;
+	dev_handle->executor = executor;
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Have the completed transfers of a device handle delivered in batches,
+ * with one call per event handling iteration, instead of calling the
+ * callback of each transfer. This saves the cost of a call per transfer at
+ * high completion rates, and the transfers of a batch leave the internal
+ * lists of transfers in flight together. The callbacks of the transfers
+ * themselves are not called, and neither the executor of
+ * libusb_set_transfer_executor() nor the threads of
+ * \ref LIBUSB_OPTION_CALLBACK_WORKERS are used for the handle.
+ *
+ * As with the callback of a transfer, the batch callback runs from event
+ * handling, which it should leave to other threads. The callbacks of the
+ * synchronous I/O functions are never batched. Do not change the batch
+ * callback while transfers of the handle are in flight.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a device handle
+ * \param callback the batch callback, or NULL to call the callback of each
+ * transfer again
+ * \param user_data passed to the batch callback
+ * \returns 0 on success
+ */
+int API_EXPORTED libusb_set_transfer_batch_callback(
+	libusb_device_handle *dev_handle, libusb_transfer_batch_cb_fn callback,
+	void *user_data)
+{
+	dev_handle->batch_user_data = user_data;
+	dev_handle->batch_callback = callback;
 	return 0;
 }
 
+/** \ingroup asyncio
+ * Run the callback of a transfer that was handed to an executor, see
+ * libusb_set_transfer_executor(). This is also where a transfer with
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" set is freed, so the transfer must not be
+ * used afterwards unless the callback resubmitted it.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfer the transfer given to the executor
+ */
+void API_EXPORTED libusb_run_transfer_callback(struct libusb_transfer *transfer)
+{
+	run_transfer_callback(transfer);
+}
+
 /* Similar to usbi_handle_transfer_completion() but exclusively for transfers
  * that were asynchronously cancelled. The same concerns w.r.t. freeing of
  * transfers exist here.
@@ -1666,7 +4223,7 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 {
 	/* if the URB was cancelled due to timeout, report timeout to the user */
-	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
+	if (usbi_atomic_load(&transfer->flags) & USBI_TRANSFER_TIMED_OUT) {
 		usbi_dbg("detected timeout cancellation");
 		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
 	}
@@ -1681,14 +4238,45 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 void usbi_signal_transfer_completion(struct usbi_transfer *transfer)
 {
 	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	struct usbi_event_shard *shard =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->dev_handle->shard;
+	struct usbi_transfer *head;
 	int pending_events;
 
-	usbi_mutex_lock(&ctx->event_data_lock);
-	pending_events = usbi_pending_events(ctx);
-	list_add_tail(&transfer->completed_list, &ctx->completed_transfers);
-	if (!pending_events)
+	if (shard) {
+		usbi_mutex_lock(&shard->lock);
+		pending_events = usbi_shard_pending_events(shard);
+		list_add_tail(&transfer->completed_list, &shard->completed_transfers);
+		if (!pending_events)
+			usbi_signal_event(&shard->event);
+		usbi_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	/* no lock is taken, so that backends completing transfers on threads
+	 * of their own do not contend with event handling. the push that finds
+	 * the list empty signals the event */
+	head = usbi_atomic_load_ptr(&ctx->completed_transfers);
+	do {
+		transfer->completed_next = head;
+	} while (!usbi_atomic_cas_ptr(&ctx->completed_transfers, head, transfer));
+	if (!head)
+		usbi_signal_event(&ctx->event);
+}
+
+/* Clear the event of the context, unless anything is still pending.
+ * Callers must hold the event_data_lock. */
+void usbi_clear_event_if_idle(struct libusb_context *ctx)
+{
+	if (usbi_pending_events(ctx))
+		return;
+
+	usbi_clear_event(&ctx->event);
+
+	/* a completion pushed since the check found the list empty and
+	 * signalled the event, which may have been cleared just now */
+	if (usbi_atomic_load_ptr(&ctx->completed_transfers))
 		usbi_signal_event(&ctx->event);
-	usbi_mutex_unlock(&ctx->event_data_lock);
 }
 
 /** \ingroup poll
@@ -1769,6 +4357,8 @@ void API_EXPORTED libusb_lock_events(libusb_context *ctx)
  */
 void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 {
+	struct usbi_transfer_waiter *waiter;
+
 	USBI_GET_CONTEXT(ctx);
 	ctx->event_handler_active = 0;
 	usbi_mutex_unlock(&ctx->events_lock);
@@ -1778,6 +4368,12 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 	 * (check ctx->device_close)? */
 	usbi_mutex_lock(&ctx->event_waiters_lock);
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	list_for_each_entry(waiter, &ctx->sync_waiters, list, struct usbi_transfer_waiter) {
+		usbi_mutex_lock(&waiter->lock);
+		waiter->woken = 1;
+		usbi_cond_signal(&waiter->cond);
+		usbi_mutex_unlock(&waiter->lock);
+	}
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
@@ -1944,50 +4540,45 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int r;
 
-	itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
+	usbi_trace_transfer(timeout, transfer, transfer->length,
+		LIBUSB_TRANSFER_TIMED_OUT);
+	usbi_atomic_or(&itransfer->flags, USBI_TRANSFER_TIMED_OUT);
 	r = libusb_cancel_transfer(transfer);
 	if (r < 0)
 		usbi_warn(TRANSFER_CTX(transfer),
 			"async cancel failed %d errno=%d", r, errno);
 }
 
-static int handle_timeouts_locked(struct libusb_context *ctx)
+static int handle_timeouts_locked(struct libusb_context *ctx,
+	struct usbi_now *now)
 {
 	int r;
-	struct timespec systime_ts;
-	struct timeval systime;
 	struct usbi_transfer *transfer;
+	long flags;
 
-	if (list_empty(&ctx->flying_transfers))
+	if (!ctx->timeout_heap_len)
 		return 0;
 
-	/* get current time */
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
+	r = get_now(ctx, now);
 	if (r < 0)
 		return r;
 
-	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
-
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			return 0;
-
-		/* ignore timeouts we've already handled */
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
+	/* pop transfers off the timeout heap until we reach one that has not
+	 * yet expired */
+	while ((transfer = timeout_heap_peek(ctx)) != NULL) {
 		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
+		if (timercmp(&transfer->timeout, &now->tv, >))
 			return 0;
 
 		/* otherwise, we've got an expired timeout to handle */
+		timeout_heap_remove(ctx, transfer);
+
+		/* completed but waiting for its batch callback, or given up by a
+		 * submission that takes it out of the heap once we let go */
+		flags = usbi_atomic_load(&transfer->flags);
+		if ((flags & USBI_TRANSFER_COMPLETED) ||
+		    !(flags & (USBI_TRANSFER_IN_FLIGHT | USBI_TRANSFER_SUBMITTING)))
+			continue;
 		handle_timeout(transfer);
 	}
 	return 0;
@@ -1995,14 +4586,54 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 
 static int handle_timeouts(struct libusb_context *ctx)
 {
+	struct usbi_now now = USBI_NOW_INIT;
 	int r;
 	USBI_GET_CONTEXT(ctx);
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = handle_timeouts_locked(ctx);
+	r = handle_timeouts_locked(ctx, &now);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 	return r;
 }
 
+/* only reallocate the event source data when the list of event sources has
+ * been modified since the last handle_events(), otherwise reuse them to
+ * save the additional overhead. called with event_data_lock held by the
+ * thread that holds the events lock */
+static int refresh_event_data(struct libusb_context *ctx,
+	unsigned int internal_event_sources_cnt)
+{
+	int r;
+
+	if (ctx->event_sources_modified) {
+		usbi_dbg("event sources modified, reallocating event data");
+
+		/* sanity check - it is invalid for a context to have fewer than the
+		 * required internal event sources (memory corruption?) */
+		assert(ctx->event_sources_cnt >= internal_event_sources_cnt);
+
+		r = usbi_alloc_event_data(ctx);
+		if (r)
+			return r;
+
+		/* reset the flag now that we have the updated list */
+		ctx->event_sources_modified = 0;
+
+		/* nothing can be referring to sources removed since the last
+		 * rebuild anymore, so release them */
+		usbi_free_removed_event_sources(ctx);
+
+		/* if no further pending events, clear the event so that we do
+		 * not immediately return from poll */
+		usbi_clear_event_if_idle(ctx);
+	} else if (!list_empty(&ctx->removed_event_sources)) {
+		/* sources removed without a rebuild. the previous iteration
+		 * was the last one that could have reported them */
+		usbi_free_removed_event_sources(ctx);
+	}
+
+	return 0;
+}
+
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
 static int handle_events(struct libusb_context *ctx, struct timeval *tv)
@@ -2010,7 +4641,6 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	void *event_data;
 	unsigned int event_sources_cnt;
 	unsigned int internal_event_sources_cnt;
-	int timeout_ms;
 	int r;
 
 	/* there are certain event sources that libusb uses internally, currently:
@@ -2027,42 +4657,19 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	else
 		internal_event_sources_cnt = 1;
 
-	/* only reallocate the event source data when the list of event sources has
-	 * been modified since the last handle_events(), otherwise reuse them to
-	 * save the additional overhead */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	if (ctx->event_sources_modified) {
-		usbi_dbg("event sources modified, reallocating event data");
-
-		/* sanity check - it is invalid for a context to have fewer than the
-		 * required internal event sources (memory corruption?) */
-		assert(ctx->event_sources_cnt >= internal_event_sources_cnt);
-
-		r = usbi_alloc_event_data(ctx);
-		if (r) {
-			usbi_mutex_unlock(&ctx->event_data_lock);
-			return r;
-		}
-
-		/* reset the flag now that we have the updated list */
-		ctx->event_sources_modified = 0;
-
-		/* if no further pending events, clear the event so that we do
-		 * not immediately return from poll */
-		if (!usbi_pending_events(ctx))
-			usbi_clear_event(&ctx->event);
+	usbi_mutex_lock(&ctx->event_data_lock);
+	r = refresh_event_data(ctx, internal_event_sources_cnt);
+	if (r) {
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		return r;
 	}
 	event_data = ctx->event_data;
 	event_sources_cnt = ctx->event_sources_cnt;
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
-	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
-
-	/* round up to next millisecond */
-	if (tv->tv_usec % 1000)
-		timeout_ms++;
-
-	r = usbi_handle_events(ctx, event_data, event_sources_cnt, internal_event_sources_cnt, timeout_ms);
+	/* the wait keeps the full precision of tv where the platform allows */
+	r = usbi_handle_events(ctx, event_data, event_sources_cnt, internal_event_sources_cnt, tv);
+	usbi_flush_transfer_batches(&ctx->batch_handles);
 	if (r == LIBUSB_ERROR_TIMEOUT)
 		return handle_timeouts(ctx);
 
@@ -2175,6 +4782,66 @@ already_done:
 		return 0;
 }
 
+/* Like libusb_handle_events_completed(), but when another thread is handling
+ * events, sleep on the waiter until the transfer completes or that thread
+ * releases the events lock, rather than on event_waiters_cond, which is woken
+ * by every completion in the context. The completion callback must set
+ * *completed and signal the waiter with its lock held. */
+int usbi_handle_events_for_waiter(struct libusb_context *ctx,
+	struct usbi_transfer_waiter *waiter, int *completed)
+{
+	int r;
+	struct timeval tv, poll_timeout;
+
+	/* same bound as libusb_handle_events_completed() */
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	r = get_next_timeout(ctx, &tv, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		return handle_timeouts(ctx);
+	}
+
+retry:
+	if (libusb_try_lock_events(ctx) == 0) {
+		if (!*completed) {
+			/* we obtained the event lock: do our own event handling */
+			usbi_dbg("doing our own event handling");
+			r = handle_events(ctx, &poll_timeout);
+		}
+		libusb_unlock_events(ctx);
+		return r;
+	}
+
+	libusb_lock_event_waiters(ctx);
+	if (!libusb_event_handler_active(ctx)) {
+		/* whoever was event handling earlier finished in the time it took
+		 * us to reach this point. try the cycle again. */
+		libusb_unlock_event_waiters(ctx);
+		usbi_dbg("event handler was active but went away, retrying");
+		goto retry;
+	}
+
+	/* the waiter lock is taken before the event waiters lock is dropped, so
+	 * neither the completion nor the release of the events lock can be
+	 * missed */
+	usbi_mutex_lock(&waiter->lock);
+	waiter->woken = 0;
+	list_add_tail(&waiter->list, &ctx->sync_waiters);
+	libusb_unlock_event_waiters(ctx);
+
+	usbi_dbg("another thread is doing event handling");
+	while (!*completed && !waiter->woken)
+		usbi_cond_wait(&waiter->cond, &waiter->lock);
+	usbi_mutex_unlock(&waiter->lock);
+
+	libusb_lock_event_waiters(ctx);
+	list_del(&waiter->list);
+	libusb_unlock_event_waiters(ctx);
+
+	return 0;
+}
+
 /** \ingroup poll
  * Handle any pending events
  *
@@ -2340,6 +5007,7 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
+	struct usbi_now now = USBI_NOW_INIT;
 	struct usbi_transfer *transfer;
 	int r;
 	int found = 0;
@@ -2349,24 +5017,16 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 		return 0;
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
+	if (!ctx->timeout_heap_len) {
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 		usbi_dbg("no URBs, no timeout!");
 		return 0;
 	}
 
 	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* no timeout for this transfer? */
-		if (!timerisset(&transfer->timeout))
-			continue;
-
+	transfer = timeout_heap_peek(ctx);
+	if (transfer)
 		found = 1;
-		break;
-	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 	if (!found) {
@@ -2374,7 +5034,7 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 		return 0;
 	}
 
-	r = calculate_remaining(transfer, tv);
+	r = calculate_remaining(transfer, &now, tv);
 	if (r < 0)
 		return LIBUSB_ERROR_OTHER;
 
@@ -2431,8 +5091,11 @@ static void usbi_event_source_notification(struct libusb_context *ctx)
 
 /* Add an event source to the list of event sources to be monitored.
  * events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT (ignored on platforms without poll()). */
-int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, short events)
+ * POLLIN and/or POLLOUT (ignored on platforms without poll()).
+ * user_data is handed back to the backend along with the source when it
+ * reports events. */
+int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, short events,
+	void *user_data)
 {
 	struct usbi_event_source *event_source = malloc(sizeof(*event_source));
 	if (!event_source)
@@ -2441,10 +5104,17 @@ int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, s
 	usbi_dbg("add " USBI_OS_HANDLE_DESC " " USBI_OS_HANDLE_FORMAT_SPECIFIER " events %d", source, events);
 	event_source->pollfd.fd = source;
 	event_source->pollfd.events = events;
+	event_source->user_data = user_data;
+	event_source->revents = 0;
+	event_source->removed = 0;
 	usbi_mutex_lock(&ctx->event_data_lock);
 	list_add_tail(&event_source->list, &ctx->event_sources);
 	ctx->event_sources_cnt++;
-	usbi_event_source_notification(ctx);
+	/* only interrupt the event loop if the source cannot be registered
+	 * with the event data while it is in use */
+	if (usbi_add_event_data_source(ctx, ctx->event_data, event_source,
+			ctx->event_sources_cnt))
+		usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
 	if (ctx->event_source_added_cb)
@@ -2472,15 +5142,86 @@ void usbi_remove_event_source(struct libusb_context *ctx, libusb_os_handle sourc
 		return;
 	}
 
+	/* the event handling thread may still hold a pointer to this source,
+	 * so defer freeing it until the next iteration of event handling */
 	list_del(&event_source->list);
+	event_source->removed = 1;
+	list_add_tail(&event_source->list, &ctx->removed_event_sources);
 	ctx->event_sources_cnt--;
-	usbi_event_source_notification(ctx);
+	if (usbi_remove_event_data_source(ctx, ctx->event_data, event_source))
+		usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
-	free(event_source);
 	if (ctx->event_source_removed_cb)
 		ctx->event_source_removed_cb(source, ctx->event_source_cb_user_data);
 }
 
+/* Add an event source owned by a device handle. It is monitored by the
+ * handle's event shard if it has one, and by the context otherwise. */
+int usbi_add_handle_event_source(struct libusb_device_handle *handle,
+	libusb_os_handle source, short events)
+{
+	struct usbi_event_shard *shard = handle->shard;
+	struct usbi_event_source *event_source;
+
+	if (!shard)
+		return usbi_add_event_source(HANDLE_CTX(handle), source, events, handle);
+
+	event_source = malloc(sizeof(*event_source));
+	if (!event_source)
+		return LIBUSB_ERROR_NO_MEM;
+
+	usbi_dbg("add " USBI_OS_HANDLE_DESC " " USBI_OS_HANDLE_FORMAT_SPECIFIER " events %d to shard", source, events);
+	event_source->pollfd.fd = source;
+	event_source->pollfd.events = events;
+	event_source->user_data = handle;
+	event_source->revents = 0;
+	event_source->removed = 0;
+	usbi_mutex_lock(&shard->lock);
+	list_add_tail(&event_source->list, &shard->event_sources);
+	shard->event_sources_cnt++;
+	if (usbi_add_event_data_source(HANDLE_CTX(handle), shard->event_data,
+			event_source, shard->event_sources_cnt)) {
+		if (!usbi_shard_pending_events(shard))
+			usbi_signal_event(&shard->event);
+		shard->event_sources_modified = 1;
+	}
+	usbi_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+void usbi_remove_handle_event_source(struct libusb_device_handle *handle,
+	libusb_os_handle source)
+{
+	struct usbi_event_shard *shard = handle->shard;
+	struct usbi_event_source *event_source;
+
+	if (!shard) {
+		usbi_remove_event_source(HANDLE_CTX(handle), source);
+		return;
+	}
+
+	usbi_dbg("remove " USBI_OS_HANDLE_DESC " " USBI_OS_HANDLE_FORMAT_SPECIFIER " from shard", source);
+	usbi_mutex_lock(&shard->lock);
+	list_for_each_entry(event_source, &shard->event_sources, list, struct usbi_event_source) {
+		if (event_source->pollfd.fd != source)
+			continue;
+
+		/* freed by the next iteration of the shard thread */
+		list_del(&event_source->list);
+		event_source->removed = 1;
+		list_add_tail(&event_source->list, &shard->removed_event_sources);
+		shard->event_sources_cnt--;
+		if (usbi_remove_event_data_source(HANDLE_CTX(handle),
+				shard->event_data, event_source)) {
+			if (!usbi_shard_pending_events(shard))
+				usbi_signal_event(&shard->event);
+			shard->event_sources_modified = 1;
+		}
+		break;
+	}
+	usbi_mutex_unlock(&shard->lock);
+}
+
 /** \ingroup poll
  * Retrieve a list of file descriptors that should be polled by your main loop
  * as libusb event sources.
@@ -2517,12 +5258,76 @@ out:
 	return (const struct libusb_pollfd **) ret;
 }
 
+/** \ingroup poll
+ * Retrieve a single file descriptor that becomes readable whenever any of
+ * the libusb event sources of the context does, including the timerfd. This
+ * is an alternative to libusb_get_pollfds() and libusb_set_pollfd_notifiers()
+ * for applications that integrate libusb into an existing event loop: the
+ * descriptor stays the same for the lifetime of the context, so it only has
+ * to be registered once, and it may be registered edge-triggered.
+ *
+ * When the descriptor is readable, call libusb_handle_events_timeout() with
+ * a zero timeval. This handles all pending events unless
+ * \ref LIBUSB_OPTION_EVENT_BUDGET limits the work done per call, in which
+ * case keep calling it while it makes progress. Timeouts are covered by the
+ * descriptor when libusb_pollfds_handle_timeouts() returns 1, otherwise
+ * libusb_get_next_timeout() must still be honoured.
+ *
+ * Do not mix this with polling the descriptors of libusb_get_pollfds()
+ * yourself or with the event thread of \ref LIBUSB_OPTION_EVENT_THREAD.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param fd output location for the file descriptor. it belongs to the
+ * context and must not be closed
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the event thread is running, or if another
+ * thread handles events before the descriptor was first set up
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot aggregate its
+ * event sources (only Linux with epoll can)
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx, int *fd)
+{
+#if defined(PLATFORM_POSIX)
+	int r;
+	USBI_GET_CONTEXT(ctx);
+
+	if (ctx->event_thread_running)
+		return LIBUSB_ERROR_BUSY;
+
+	/* the event data is built by the thread handling events, do it here if
+	 * nobody does so that the descriptor is available right away */
+	if (libusb_try_lock_events(ctx) == 0) {
+		usbi_mutex_lock(&ctx->event_data_lock);
+		r = refresh_event_data(ctx, usbi_using_timer(ctx) ? 2 : 1);
+		if (r == 0)
+			r = usbi_get_event_data_fd(ctx, fd);
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		libusb_unlock_events(ctx);
+		return r;
+	}
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	r = usbi_get_event_data_fd(ctx, fd);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	return r;
+#else
+	UNUSED(ctx);
+	UNUSED(fd);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 /* OS event abstraction calls this function when the event construct
  * indicates that some sort of event has occurred.
  */
 int usbi_handle_event_trigger(struct libusb_context *ctx)
 {
-	libusb_hotplug_message *message = NULL;
+	libusb_hotplug_message *message, *next;
+	struct list_head hotplug_msgs;
+	struct usbi_transfer *completed;
 	int r = 0;
 	int special_event = 0;
 
@@ -2539,41 +5344,69 @@ int usbi_handle_event_trigger(struct libusb_context *ctx)
 	if (ctx->device_close)
 		usbi_dbg("someone is closing a device");
 
-	/* check for any pending hotplug messages */
+	/* take all pending hotplug messages at once, so that a burst of them is
+	 * handled in a single pass */
+	list_init(&hotplug_msgs);
 	if (!list_empty(&ctx->hotplug_msgs)) {
 		usbi_dbg("hotplug message received");
 		special_event = 1;
-		message = list_first_entry(&ctx->hotplug_msgs, libusb_hotplug_message, list);
-		list_del(&message->list);
+		hotplug_msgs.next = ctx->hotplug_msgs.next;
+		hotplug_msgs.prev = ctx->hotplug_msgs.prev;
+		hotplug_msgs.next->prev = &hotplug_msgs;
+		hotplug_msgs.prev->next = &hotplug_msgs;
+		list_init(&ctx->hotplug_msgs);
 	}
 
-	/* complete any pending transfers */
-	while (r == 0 && !list_empty(&ctx->completed_transfers)) {
-		struct usbi_transfer *itransfer =
-			list_first_entry(&ctx->completed_transfers, struct usbi_transfer, completed_list);
-		list_del(&itransfer->completed_list);
+	/* complete the pending transfers, oldest first */
+	completed = usbi_atomic_xchg_ptr(&ctx->completed_transfers, NULL);
+	if (completed) {
+		struct usbi_transfer *itransfer, *oldest = NULL;
+
+		while (completed) {
+			itransfer = completed;
+			completed = itransfer->completed_next;
+			itransfer->completed_next = oldest;
+			oldest = itransfer;
+		}
+
 		usbi_mutex_unlock(&ctx->event_data_lock);
-		r = usbi_backend->handle_transfer_completion(itransfer);
-		if (r)
-			usbi_err(ctx, "backend handle_transfer_completion failed with error %d", r);
+		while (oldest) {
+			itransfer = oldest;
+			oldest = itransfer->completed_next;
+			r = usbi_backend->handle_transfer_completion(itransfer);
+			if (r)
+				usbi_err(ctx, "backend handle_transfer_completion failed with error %d", r);
+		}
 		usbi_mutex_lock(&ctx->event_data_lock);
 	}
 
 	/* if no further pending events, clear the event */
-	if (!usbi_pending_events(ctx))
-		usbi_clear_event(&ctx->event);
+	usbi_clear_event_if_idle(ctx);
 
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
-	/* process the hotplug message, if any */
-	if (message) {
-		usbi_hotplug_match(ctx, message->device, message->event);
+	/* process the hotplug messages, if any */
+	if (special_event) {
+		list_for_each_entry(message, &hotplug_msgs, list, libusb_hotplug_message) {
+			usbi_hotplug_match(ctx, message->device, message->event);
 
-		/* the device left, dereference the device */
-		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
-			libusb_unref_device(message->device);
+			/* the device left, dereference the device */
+			if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
+				libusb_unref_device(message->device);
+		}
 
-		free(message);
+		/* keep a few of the messages for the next notifications */
+		usbi_mutex_lock(&ctx->event_data_lock);
+		list_for_each_entry_safe(message, next, &hotplug_msgs, list, libusb_hotplug_message) {
+			list_del(&message->list);
+			if (ctx->free_hotplug_msgs_cnt < USBI_HOTPLUG_MSGS_CACHED) {
+				list_add(&message->list, &ctx->free_hotplug_msgs);
+				ctx->free_hotplug_msgs_cnt++;
+			} else {
+				free(message);
+			}
+		}
+		usbi_mutex_unlock(&ctx->event_data_lock);
 	}
 
 	if (r)
@@ -2587,19 +5420,20 @@ int usbi_handle_event_trigger(struct libusb_context *ctx)
  */
 int usbi_handle_timer_trigger(struct libusb_context *ctx)
 {
+	struct usbi_now now = USBI_NOW_INIT;
 	int r;
 
 	usbi_dbg("timer triggered");
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
-	/* process the timeout that just happened */
-	r = handle_timeouts_locked(ctx);
+	/* process the timeout that just happened, and arm for the next timeout
+	 * relative to the same time */
+	r = handle_timeouts_locked(ctx, &now);
 	if (r < 0)
 		goto out;
 
-	/* arm for next timeout*/
-	r = arm_timer_for_next_timeout(ctx);
+	r = arm_timer_for_next_timeout(ctx, &now);
 
 out:
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
@@ -2632,20 +5466,23 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 
 	while (1) {
 		to_cancel = NULL;
-		usbi_mutex_lock(&HANDLE_CTX(handle)->flying_transfers_lock);
-		list_for_each_entry(cur, &HANDLE_CTX(handle)->flying_transfers, list, struct usbi_transfer)
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == handle) {
-				usbi_mutex_lock(&cur->flags_lock);
-				if (cur->flags & USBI_TRANSFER_IN_FLIGHT)
-					to_cancel = cur;
-				else
-					cur->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
-				usbi_mutex_unlock(&cur->flags_lock);
+		usbi_mutex_lock(&handle->flying_transfers_lock);
+		list_for_each_entry(cur, &handle->flying_transfers, handle_list, struct usbi_transfer) {
+			long flags = usbi_atomic_load(&cur->flags);
 
-				if (to_cancel)
+			/* finish_submission() sets IN_FLIGHT at the same time */
+			do {
+				if (flags & USBI_TRANSFER_IN_FLIGHT) {
+					to_cancel = cur;
 					break;
-			}
-		usbi_mutex_unlock(&HANDLE_CTX(handle)->flying_transfers_lock);
+				}
+			} while (!usbi_atomic_cas(&cur->flags, flags,
+					flags | USBI_TRANSFER_DEVICE_DISAPPEARED));
+
+			if (to_cancel)
+				break;
+		}
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
 
 		if (!to_cancel)
 			break;
@@ -2660,3 +5497,401 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	}
 
 }
+
+/* Statistics */
+
+/* enable or disable LIBUSB_OPTION_COLLECT_STATS. the statistics are allocated
+ * the first time collection is enabled so that contexts not using them pay
+ * nothing but the flag check */
+int usbi_set_collect_stats(struct libusb_context *ctx, int enable)
+{
+	struct usbi_stats *stats;
+
+	if (!enable) {
+		ctx->collect_stats = 0;
+		return 0;
+	}
+
+	if (!ctx->stats) {
+		stats = calloc(1, sizeof(*stats));
+		if (!stats)
+			return LIBUSB_ERROR_NO_MEM;
+		if (usbi_mutex_init(&stats->lock, NULL)) {
+			free(stats);
+			return LIBUSB_ERROR_OTHER;
+		}
+		ctx->stats = stats;
+	}
+	ctx->collect_stats = 1;
+	return 0;
+}
+
+static uint64_t stats_elapsed_us(const struct timespec *start,
+	const struct timespec *end)
+{
+	int64_t ns = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000
+		+ (end->tv_nsec - start->tv_nsec);
+
+	return ns > 0 ? (uint64_t)ns / 1000 : 0;
+}
+
+/* bucket 0 is below 1us, bucket i covers [2^(i-1), 2^i) us */
+static int stats_latency_bucket(uint64_t us)
+{
+	int bucket = 0;
+
+	while (us && bucket < LIBUSB_STATS_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/* the array is allocated by the first thread that needs it, the others
+ * free theirs when they lose the race */
+static struct usbi_endpoint_stats *stats_endpoint(
+	struct libusb_device_handle *handle, unsigned char endpoint)
+{
+	struct usbi_endpoint_stats *stats, *expected = NULL;
+
+	stats = usbi_atomic_load_ptr(&handle->endpoint_stats);
+	if (!stats) {
+		stats = calloc(USBI_MAX_ENDPOINT_INDEX, sizeof(*stats));
+		if (!stats)
+			return NULL;
+		if (!usbi_atomic_cas_ptr(&handle->endpoint_stats, expected, stats)) {
+			free(stats);
+			stats = expected;
+		}
+	}
+	return &stats[usbi_stats_endpoint_index(endpoint)];
+}
+
+static void stats_count_completion(struct libusb_transfer_stats *stats,
+	enum libusb_transfer_status status, uint64_t bytes, int bucket)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stats->completed++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stats->cancelled++;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		stats->timed_out++;
+		break;
+	default:
+		stats->failed++;
+	}
+	stats->bytes += bytes;
+	stats->latency[bucket]++;
+}
+
+static void stats_count_endpoint_completion(struct usbi_endpoint_stats *stats,
+	enum libusb_transfer_status status, uint64_t bytes, int bucket)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		usbi_atomic64_add(&stats->completed, 1);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		usbi_atomic64_add(&stats->cancelled, 1);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		usbi_atomic64_add(&stats->timed_out, 1);
+		break;
+	default:
+		usbi_atomic64_add(&stats->failed, 1);
+	}
+	usbi_atomic64_add(&stats->bytes, bytes);
+	usbi_atomic64_add(&stats->latency[bucket], 1);
+}
+
+/* read one endpoint's counters. each is exact, but a transfer completing
+ * meanwhile may show up in some of them only */
+static void stats_read_endpoint(struct usbi_endpoint_stats *ep,
+	struct libusb_transfer_stats *stats)
+{
+	int i;
+
+	stats->submitted = usbi_atomic64_load(&ep->submitted);
+	stats->completed = usbi_atomic64_load(&ep->completed);
+	stats->failed = usbi_atomic64_load(&ep->failed);
+	stats->cancelled = usbi_atomic64_load(&ep->cancelled);
+	stats->timed_out = usbi_atomic64_load(&ep->timed_out);
+	stats->bytes = usbi_atomic64_load(&ep->bytes);
+	for (i = 0; i < LIBUSB_STATS_LATENCY_BUCKETS; i++)
+		stats->latency[i] = usbi_atomic64_load(&ep->latency[i]);
+}
+
+void usbi_record_transfer_submitted(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_stats *stats = ITRANSFER_CTX(itransfer)->stats;
+	struct usbi_endpoint_stats *ep;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC,
+			&itransfer->stats_submit_time) < 0)
+		return;
+	itransfer->stats_pending = 1;
+
+	usbi_mutex_lock(&stats->lock);
+	stats->totals.transfers.submitted++;
+	usbi_mutex_unlock(&stats->lock);
+	ep = stats_endpoint(transfer->dev_handle, transfer->endpoint);
+	if (ep)
+		usbi_atomic64_add(&ep->submitted, 1);
+}
+
+/* the backend refused a transfer recorded by usbi_record_transfer_submitted() */
+void usbi_record_transfer_unsubmitted(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_stats *stats = ITRANSFER_CTX(itransfer)->stats;
+	struct usbi_endpoint_stats *ep;
+
+	itransfer->stats_pending = 0;
+
+	usbi_mutex_lock(&stats->lock);
+	stats->totals.transfers.submitted--;
+	usbi_mutex_unlock(&stats->lock);
+	ep = stats_endpoint(transfer->dev_handle, transfer->endpoint);
+	if (ep)
+		usbi_atomic64_add(&ep->submitted, (uint64_t)-1);
+}
+
+void usbi_record_transfer_completed(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_stats *stats = ITRANSFER_CTX(itransfer)->stats;
+	struct usbi_endpoint_stats *ep;
+	struct timespec now;
+	uint64_t bytes = 0;
+	int bucket = LIBUSB_STATS_LATENCY_BUCKETS - 1;
+	int i;
+
+	itransfer->stats_pending = 0;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) == 0)
+		bucket = stats_latency_bucket(stats_elapsed_us(
+			&itransfer->stats_submit_time, &now));
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < transfer->num_iso_packets; i++)
+			bytes += transfer->iso_packet_desc[i].actual_length;
+	} else if (transfer->actual_length > 0) {
+		bytes = transfer->actual_length;
+	}
+
+	usbi_mutex_lock(&stats->lock);
+	stats_count_completion(&stats->totals.transfers, status, bytes, bucket);
+	/* shards never spin, their handles may complete from the context's
+	 * timeouts */
+	if (stats->busy_polled && !transfer->dev_handle->shard)
+		stats->totals.busy_poll_completions++;
+	else
+		stats->totals.event_completions++;
+	usbi_mutex_unlock(&stats->lock);
+	ep = stats_endpoint(transfer->dev_handle, transfer->endpoint);
+	if (ep)
+		stats_count_endpoint_completion(ep, status, bytes, bucket);
+}
+
+void usbi_record_urbs(struct libusb_context *ctx, unsigned int urbs)
+{
+	usbi_mutex_lock(&ctx->stats->lock);
+	ctx->stats->totals.urbs += urbs;
+	usbi_mutex_unlock(&ctx->stats->lock);
+}
+
+void usbi_record_wait_begin(struct timespec *mark)
+{
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, mark) < 0) {
+		mark->tv_sec = 0;
+		mark->tv_nsec = 0;
+	}
+}
+
+/* account the time since mark as waiting or dispatching, then move the mark */
+void usbi_record_event_time(struct libusb_context *ctx, struct timespec *mark,
+	int waited)
+{
+	struct usbi_stats *stats = ctx->stats;
+	struct timespec now;
+	uint64_t elapsed;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		return;
+	elapsed = stats_elapsed_us(mark, &now);
+
+	usbi_mutex_lock(&stats->lock);
+	if (waited) {
+		stats->totals.event_wakeups++;
+		stats->totals.wait_time_us += elapsed;
+		stats->busy_polled = 0;
+	} else {
+		stats->totals.dispatch_time_us += elapsed;
+	}
+	usbi_mutex_unlock(&stats->lock);
+	*mark = now;
+}
+
+/* Spin on poll_events for up to the time of LIBUSB_OPTION_BUSY_POLL before a
+ * usbi_handle_events() implementation waits with *timeout. Returns what
+ * poll_events returned last, 0 if nothing was found, in which case *timeout
+ * is shortened by the time spent spinning. */
+int usbi_busy_poll(struct libusb_context *ctx, usbi_poll_events_fn poll_events,
+	void *event_data, unsigned int cnt, struct timeval *timeout)
+{
+	struct timespec start, now;
+	uint64_t budget, elapsed = 0;
+	int r;
+
+	if (!ctx->busy_poll_us || !timerisset(timeout))
+		return 0;
+	/* only the handles that it serves, not those of shards */
+	if (!usbi_atomic_load(&ctx->transfers_in_flight))
+		return 0;
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &start) < 0)
+		return 0;
+
+	budget = (uint64_t)timeout->tv_sec * 1000000 + (uint64_t)timeout->tv_usec;
+	if (budget > ctx->busy_poll_us)
+		budget = ctx->busy_poll_us;
+
+	do {
+		r = poll_events(ctx, event_data, cnt);
+		if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+			break;
+		elapsed = stats_elapsed_us(&start, &now);
+	} while (r == 0 && elapsed < budget);
+
+	if (r == 0) {
+		uint64_t left = (uint64_t)timeout->tv_sec * 1000000
+			+ (uint64_t)timeout->tv_usec;
+
+		left = left > elapsed ? left - elapsed : 0;
+		timeout->tv_sec = (long)(left / 1000000);
+		timeout->tv_usec = (long)(left % 1000000);
+	}
+
+	if (ctx->collect_stats) {
+		usbi_mutex_lock(&ctx->stats->lock);
+		if (r > 0) {
+			ctx->stats->totals.busy_poll_wakeups++;
+			ctx->stats->busy_polled = 1;
+		}
+		ctx->stats->totals.busy_poll_time_us += elapsed;
+		usbi_mutex_unlock(&ctx->stats->lock);
+	}
+
+	return r;
+}
+
+/** \ingroup lib
+ * Get the statistics of a context. Statistics are only collected while
+ * \ref libusb_option::LIBUSB_OPTION_COLLECT_STATS "LIBUSB_OPTION_COLLECT_STATS"
+ * is enabled; the counters are taken together, so they are consistent with
+ * each other.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if statistics were never collected
+ */
+int API_EXPORTED libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_context_stats *stats)
+{
+	USBI_GET_CONTEXT(ctx);
+
+	if (!ctx->stats) {
+		memset(stats, 0, sizeof(*stats));
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	usbi_mutex_lock(&ctx->stats->lock);
+	*stats = ctx->stats->totals;
+	usbi_mutex_unlock(&ctx->stats->lock);
+	return 0;
+}
+
+/** \ingroup lib
+ * Get the statistics of the transfers submitted on a device handle, summed
+ * over all of its endpoints. See libusb_get_context_stats().
+ *
+ * Unlike the context counters, the endpoint counters are updated without a
+ * lock, so a transfer that completes while they are read may only show up
+ * in some of them.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle the device handle
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if statistics were never collected
+ */
+int API_EXPORTED libusb_get_device_handle_stats(libusb_device_handle *dev_handle,
+	struct libusb_transfer_stats *stats)
+{
+	struct usbi_endpoint_stats *endpoint_stats;
+	struct libusb_transfer_stats ep;
+	int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!HANDLE_CTX(dev_handle)->stats)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	endpoint_stats = usbi_atomic_load_ptr(&dev_handle->endpoint_stats);
+	if (endpoint_stats) {
+		for (i = 0; i < USBI_MAX_ENDPOINT_INDEX; i++) {
+			stats_read_endpoint(&endpoint_stats[i], &ep);
+			stats->submitted += ep.submitted;
+			stats->completed += ep.completed;
+			stats->failed += ep.failed;
+			stats->cancelled += ep.cancelled;
+			stats->timed_out += ep.timed_out;
+			stats->bytes += ep.bytes;
+			for (j = 0; j < LIBUSB_STATS_LATENCY_BUCKETS; j++)
+				stats->latency[j] += ep.latency[j];
+		}
+	}
+	return 0;
+}
+
+/** \ingroup lib
+ * Get the statistics of the transfers submitted to one endpoint of a device
+ * handle. See libusb_get_context_stats().
+ *
+ * Unlike the context counters, the endpoint counters are updated without a
+ * lock, so a transfer that completes while they are read may only show up
+ * in some of them.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle the device handle
+ * \param endpoint the endpoint address, including its direction bit
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if statistics were never collected
+ */
+int API_EXPORTED libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_transfer_stats *stats)
+{
+	struct usbi_endpoint_stats *endpoint_stats;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!HANDLE_CTX(dev_handle)->stats)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	endpoint_stats = usbi_atomic_load_ptr(&dev_handle->endpoint_stats);
+	if (endpoint_stats)
+		stats_read_endpoint(
+			&endpoint_stats[usbi_stats_endpoint_index(endpoint)], stats);
+	return 0;
+}
@@ -115,11 +115,15 @@ typedef unsigned __int32  uint32_t;
  * The placement of this macro is important too; it must appear after the
  * return type, before the function name. See internal documentation for
  * API_EXPORTED.
+ * LIBUSB_CALLV is its counterpart for functions taking a variable number of
+ * arguments, which always use the C calling convention.
  */
 #if defined(_WIN32) || defined(__CYGWIN__) || defined(_WIN32_WCE)
 #define LIBUSB_CALL WINAPI
+#define LIBUSB_CALLV WINAPIV
 #else
 #define LIBUSB_CALL
+#define LIBUSB_CALLV
 #endif
 
 /** \def LIBUSB_API_VERSION
@@ -142,7 +146,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x01000104
+#define LIBUSB_API_VERSION 0x01000105
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -863,6 +867,76 @@ struct libusb_container_id_descriptor {
 	uint8_t  ContainerID[16];
 };
 
+/** \ingroup desc
+ * A descriptor found by libusb_next_descriptor() or libusb_find_descriptor().
+ * The descriptor is not copied: data points into the raw descriptor buffer
+ * being walked, and multiple-byte fields are in bus-endian (little-endian)
+ * format. For the standard descriptor types, bLength has been checked to
+ * cover all the fields defined by the USB specification.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+struct libusb_descriptor_view {
+	/** The raw descriptor, bLength bytes long */
+	const unsigned char *data;
+
+	/** Size of this descriptor (in bytes) */
+	uint8_t bLength;
+
+	/** Descriptor type */
+	uint8_t bDescriptorType;
+
+	/** bInterfaceNumber of the interface this descriptor belongs to, or -1
+	 * if it comes before the first interface descriptor */
+	int interface_number;
+
+	/** bAlternateSetting of the interface this descriptor belongs to, or
+	 * -1 if it comes before the first interface descriptor */
+	int altsetting;
+
+	/** bEndpointAddress of the endpoint this descriptor belongs to, or -1
+	 * if it does not follow an endpoint descriptor of the current interface */
+	int endpoint_address;
+};
+
+/** \ingroup desc
+ * State for walking a raw descriptor buffer with libusb_next_descriptor().
+ * Initialize with libusb_init_descriptor_iterator(). The fields are
+ * private to libusb.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+struct libusb_descriptor_iterator {
+	const unsigned char *buffer;
+	int length;
+	int offset;
+	int interface_number;
+	int altsetting;
+	int endpoint_address;
+};
+
+/** \ingroup desc
+ * Prepare an iterator for walking a raw descriptor buffer, such as the one
+ * returned by libusb_get_raw_config_descriptor(). No memory is allocated.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param iter the iterator to initialize
+ * \param buffer the raw descriptors
+ * \param length the size of buffer in bytes
+ */
+static inline void libusb_init_descriptor_iterator(
+	struct libusb_descriptor_iterator *iter, const unsigned char *buffer,
+	int length)
+{
+	iter->buffer = buffer;
+	iter->length = length;
+	iter->offset = 0;
+	iter->interface_number = -1;
+	iter->altsetting = -1;
+	iter->endpoint_address = -1;
+}
+
 /** \ingroup asyncio
  * Setup packet for control transfers. */
 struct libusb_control_setup {
@@ -1170,6 +1244,27 @@ enum libusb_transfer_flags {
 	 * Available since libusb-1.0.9.
 	 */
 	LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1 << 3,
+
+	/** Interpret libusb_transfer::timeout in microseconds rather than
+	 * milliseconds, for deadlines shorter than a millisecond such as a
+	 * single high speed bus interval. The deadline is kept with microsecond
+	 * precision by the library; platforms whose transfer timeouts are in
+	 * milliseconds round it up to the next millisecond.
+	 *
+	 * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+	 */
+	LIBUSB_TRANSFER_TIMEOUT_US = 1 << 4,
+};
+
+/** \ingroup asyncio
+ * Flags for libusb_dev_buffer_alloc().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+enum libusb_dev_buffer_flags {
+	/** Back the buffer with huge pages, falling back to transparent huge
+	 * pages or regular pages where none are available */
+	LIBUSB_DEV_BUFFER_HUGE_PAGES = 1 << 0,
 };
 
 /** \ingroup asyncio
@@ -1185,6 +1280,23 @@ struct libusb_iso_packet_descriptor {
 	enum libusb_transfer_status status;
 };
 
+/** \ingroup asyncio
+ * Location and result of an isochronous packet, as returned by
+ * libusb_get_iso_packet_info().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+struct libusb_iso_packet_info {
+	/** Offset of the packet data from the start of the transfer buffer */
+	unsigned int offset;
+
+	/** Amount of data that was actually transferred */
+	unsigned int actual_length;
+
+	/** Status code for this packet */
+	enum libusb_transfer_status status;
+};
+
 struct libusb_transfer;
 
 /** \ingroup asyncio
@@ -1198,6 +1310,37 @@ struct libusb_transfer;
  */
 typedef void (LIBUSB_CALL *libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
 
+/** \ingroup asyncio
+ * Transfer executor function type, see libusb_set_transfer_executor().
+ * libusb calls it from event handling for each completed transfer of the
+ * device handle, with \ref libusb_transfer::status "status" and
+ * \ref libusb_transfer::actual_length "actual_length" already filled in.
+ * The executor must arrange for libusb_run_transfer_callback() to be called
+ * exactly once for the transfer, possibly later and from another thread.
+ * \param transfer the completed transfer
+ * \param user_data the user data given to libusb_set_transfer_executor()
+ */
+typedef void (LIBUSB_CALL *libusb_transfer_executor)(
+	struct libusb_transfer *transfer, void *user_data);
+
+/** \ingroup asyncio
+ * Batch callback function type, see libusb_set_transfer_batch_callback().
+ * libusb calls it once per event handling iteration with the transfers of
+ * the device handle that completed during the iteration, in the order in
+ * which they completed, with \ref libusb_transfer::status "status" and
+ * \ref libusb_transfer::actual_length "actual_length" filled in. The
+ * transfers may be resubmitted or freed as from their own callbacks, the
+ * array itself belongs to libusb and is only valid during the call.
+ * \param dev_handle the device handle
+ * \param transfers the completed transfers
+ * \param count the number of transfers, at least 1
+ * \param user_data the user data given to
+ * libusb_set_transfer_batch_callback()
+ */
+typedef void (LIBUSB_CALL *libusb_transfer_batch_cb_fn)(
+	libusb_device_handle *dev_handle, struct libusb_transfer **transfers,
+	int count, void *user_data);
+
 /** \ingroup asyncio
  * The generic USB transfer structure. The user populates this structure and
  * then submits it in order to request a transfer. After the transfer has
@@ -1217,8 +1360,9 @@ struct libusb_transfer {
 	/** Type of the endpoint from \ref libusb_transfer_type */
 	unsigned char type;
 
-	/** Timeout for this transfer in millseconds. A value of 0 indicates no
-	 * timeout. */
+	/** Timeout for this transfer in millseconds, or in microseconds if
+	 * \ref libusb_transfer_flags::LIBUSB_TRANSFER_TIMEOUT_US is set. A value
+	 * of 0 indicates no timeout. */
 	unsigned int timeout;
 
 	/** The status of the transfer. Read-only, and only for use within
@@ -1262,6 +1406,130 @@ struct libusb_transfer {
 	;
 };
 
+/** \ingroup asyncio
+ * A segment of a transfer buffer, for use with libusb_transfer_set_iovec().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+struct libusb_iovec {
+	/** Start of the segment */
+	unsigned char *buffer;
+
+	/** Length of the segment in bytes */
+	int length;
+};
+
+/** \ingroup syncio
+ * A control request with an OUT data stage, for use with
+ * libusb_control_write_vec().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+struct libusb_control_write {
+	/** Request type, its direction must be \ref LIBUSB_ENDPOINT_OUT */
+	uint8_t bmRequestType;
+
+	/** Request */
+	uint8_t bRequest;
+
+	/** Value, in host-endian byte order */
+	uint16_t wValue;
+
+	/** Index, in host-endian byte order */
+	uint16_t wIndex;
+
+	/** Data stage of the request */
+	const unsigned char *data;
+
+	/** Length of the data stage, in host-endian byte order */
+	uint16_t wLength;
+};
+
+/** \ingroup asyncio
+ * Structure representing a pool of transfers. This is an opaque type for
+ * which you are only ever provided with a pointer, usually originating from
+ * libusb_transfer_pool_create().
+ *
+ * Transfers taken from a pool with libusb_transfer_pool_alloc() are returned
+ * to it by libusb_free_transfer(), which keeps their internal state
+ * initialized so that the next allocation is cheap.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+typedef struct libusb_transfer_pool libusb_transfer_pool;
+
+/** \ingroup asyncio
+ * Structure representing a continuous isochronous stream. This is an opaque
+ * type for which you are only ever provided with a pointer, usually
+ * originating from libusb_alloc_iso_stream().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+typedef struct libusb_iso_stream libusb_iso_stream;
+
+/** \ingroup asyncio
+ * Isochronous stream callback function type. It is called each time a
+ * transfer of the stream completes, once the transfer has already been
+ * resubmitted, and a final time once the stream has stopped.
+ *
+ * \param stream the stream
+ * \param status LIBUSB_TRANSFER_COMPLETED while the stream is running. For
+ * the final call, the reason the stream stopped (LIBUSB_TRANSFER_CANCELLED if
+ * it was stopped with libusb_stop_iso_stream())
+ * \param buffer the ring buffer slot the transfer used. Packet i starts at
+ * buffer + i * packet_length. NULL for the final call
+ * \param packets the results of each packet of the slot
+ * \param num_packets the number of packets in the slot, or 0 for the final
+ * call
+ * \param user_data the user data passed to libusb_alloc_iso_stream()
+ */
+typedef void (LIBUSB_CALL *libusb_iso_stream_cb_fn)(libusb_iso_stream *stream,
+	enum libusb_transfer_status status, unsigned char *buffer,
+	const struct libusb_iso_packet_descriptor *packets, int num_packets,
+	void *user_data);
+
+/** \ingroup asyncio
+ * Structure representing a continuous bulk IN reader. This is an opaque type
+ * for which you are only ever provided with a pointer, usually originating
+ * from libusb_alloc_bulk_reader().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+typedef struct libusb_bulk_reader libusb_bulk_reader;
+
+/** \ingroup dev
+ * Pipe policies of an endpoint, see libusb_set_pipe_policy() and
+ * libusb_get_pipe_policy().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+enum libusb_pipe_policy {
+	/** Hand the transfers of a bulk or interrupt IN endpoint to the host
+	 * controller without queuing them in the driver, so that the next one
+	 * is already waiting when the previous one completes. The value is
+	 * non-zero to enable it. While enabled, the length of every transfer
+	 * must be a multiple of the maximum packet size of the endpoint and no
+	 * larger than \ref LIBUSB_PIPE_POLICY_MAX_TRANSFER_SIZE. Disabled by
+	 * default. */
+	LIBUSB_PIPE_POLICY_RAW_IO = 0,
+
+	/** Clear a stall condition of the endpoint automatically, without
+	 * failing the transfers with
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_STALL
+	 * "LIBUSB_TRANSFER_STALL". The value is non-zero to enable it. Enabled
+	 * by default on Windows. */
+	LIBUSB_PIPE_POLICY_AUTO_CLEAR_STALL = 1,
+
+	/** Time in milliseconds after which the transfers of the endpoint are
+	 * failed by the driver, in addition to the timeout of each transfer.
+	 * The default of 0 means no limit. */
+	LIBUSB_PIPE_POLICY_TRANSFER_TIMEOUT = 2,
+
+	/** Largest transfer that the driver accepts on the endpoint, in bytes.
+	 * Read-only. */
+	LIBUSB_PIPE_POLICY_MAX_TRANSFER_SIZE = 3,
+};
+
 /** \ingroup misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1300,9 +1568,259 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Available option values for libusb_set_option().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+enum libusb_option {
+	/** Set the log message verbosity. The argument is an int holding a
+	 * \ref libusb_log_level value. This is equivalent to calling
+	 * libusb_set_debug(). */
+	LIBUSB_OPTION_LOG_LEVEL = 0,
+
+	/** Do not enumerate devices and do not monitor hotplug events, for
+	 * hosts on which the process has no access to the devices except
+	 * through system device handles received from elsewhere, see
+	 * libusb_wrap_sys_device(). The argument is an int: non-zero enables
+	 * the option, zero disables it again. Set with a NULL context, also
+	 * before the first libusb_init(), it applies to the contexts
+	 * initialized afterwards. Set on a context, libusb_get_device_list()
+	 * of that context lists no devices from then on, or lists them again.
+	 *
+	 * The device list of a context initialized with it stays empty,
+	 * hotplug callbacks are never called and on Linux libusb_init()
+	 * succeeds without usbfs and sysfs. */
+	LIBUSB_OPTION_WEAK_AUTHORITY = 2,
+
+	/** The name that other releases of libusb use for
+	 * \ref LIBUSB_OPTION_WEAK_AUTHORITY. */
+	LIBUSB_OPTION_NO_DEVICE_DISCOVERY = LIBUSB_OPTION_WEAK_AUTHORITY,
+
+	/** Collect transfer and event handling statistics, see
+	 * libusb_get_context_stats(). The argument is an int: non-zero starts
+	 * collecting, zero stops it again. The statistics collected so far are
+	 * kept until the context is destroyed. */
+	LIBUSB_OPTION_COLLECT_STATS = 3,
+
+	/** Handle the events of device handles on several threads owned by
+	 * libusb, called event shards. The arguments are an int holding the
+	 * number of shards and, if it is not zero, a const int pointer to an
+	 * array of that many CPU numbers that the shard threads are pinned to,
+	 * which may be NULL. An entry of -1 leaves its shard unpinned. A count
+	 * of zero, passed without the array, stops the shards again.
+	 *
+	 * Every handle opened while the shards run is assigned to the shard
+	 * with the fewest handles, and the completion callbacks of its transfers
+	 * are always invoked from that shard's thread. Timeouts, hotplug and the
+	 * handles opened before the shards were started remain with the event
+	 * thread of \ref LIBUSB_OPTION_EVENT_THREAD, which is started as well.
+	 *
+	 * Starting returns LIBUSB_ERROR_BUSY if the shards already run, and
+	 * stopping returns LIBUSB_ERROR_BUSY while handles assigned to a shard
+	 * are open. Shards are stopped automatically by libusb_exit(). Only
+	 * supported on POSIX platforms, elsewhere LIBUSB_ERROR_NOT_SUPPORTED is
+	 * returned. */
+	LIBUSB_OPTION_EVENT_SHARDS = 4,
+
+	/** Run transfer callbacks on a pool of threads owned by libusb rather
+	 * than from event handling, so that slow callbacks do not hold up the
+	 * completion of other transfers. The argument is an int holding the
+	 * number of threads, zero stops them after they have run the callbacks
+	 * queued to them.
+	 *
+	 * The pool serves every device handle of the context without an
+	 * executor of its own, see libusb_set_transfer_executor(). All callbacks
+	 * of one handle run on the same thread, in the order in which the
+	 * transfers completed. The callbacks of the synchronous I/O functions
+	 * are never deferred. Threads waiting in
+	 * libusb_handle_events_completed() or libusb_wait_for_event() are woken
+	 * after deferred callbacks ran, so they see the completed flags the
+	 * callbacks set.
+	 *
+	 * Starting returns LIBUSB_ERROR_BUSY if the threads already run. Do not
+	 * stop them while transfers are in flight. They are stopped
+	 * automatically by libusb_exit(). */
+	LIBUSB_OPTION_CALLBACK_WORKERS = 5,
+
+	/** Set how many transfers each endpoint of a device handle keeps in
+	 * flight, on backends that only have blocking kernel calls and run them
+	 * on threads. The argument is an unsigned int, the default of 0 means
+	 * one. It applies to handles opened afterwards.
+	 *
+	 * With more than one, transfers of the same endpoint may reach the
+	 * kernel, and complete, in a different order than they were submitted.
+	 * Only the Haiku backend uses this option. */
+	LIBUSB_OPTION_ENDPOINT_QUEUE_DEPTH = 6,
+
+	/** Do not scan for devices when a context is initialized. The argument
+	 * is an int: non-zero enables the option, zero disables it again. Set
+	 * with a NULL context, also before the first libusb_init(), it applies
+	 * to the contexts initialized afterwards. Set to zero on a context whose
+	 * scan is still deferred, the devices are scanned right away. Non-zero
+	 * has no effect on a context that is already initialized.
+	 *
+	 * The devices of such a context are scanned by its first call to
+	 * libusb_get_device_list(), which includes libusb_open_device_with_vid_pid()
+	 * and hotplug registration with \ref LIBUSB_HOTPLUG_ENUMERATE, so that
+	 * contexts that never look at the device list do not pay for a scan.
+	 * Devices arriving in the meantime are still reported to hotplug
+	 * callbacks. Only backends with hotplug support scan when initialized,
+	 * elsewhere this option has no effect. */
+	LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY = 7,
+
+	/** Keep the string descriptors read by
+	 * libusb_get_string_descriptor_ascii() and
+	 * libusb_get_string_descriptors_ascii() with their device, so that
+	 * reading them again needs no requests to the device. The argument is
+	 * an int: non-zero enables the cache, zero disables it. The cache of a
+	 * device is dropped when it is reset or disconnected.
+	 *
+	 * Only enable it for devices whose strings do not change while they
+	 * are connected. */
+	LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS = 8,
+
+	/** Pin the threads that libusb starts for the context to the CPUs of a
+	 * NUMA node, usually the one returned by libusb_get_device_numa_node()
+	 * for the devices in use. The argument is an int holding the node, -1
+	 * to stop pinning. It applies to the threads of
+	 * \ref LIBUSB_OPTION_EVENT_THREAD, \ref LIBUSB_OPTION_CALLBACK_WORKERS
+	 * and the shards of \ref LIBUSB_OPTION_EVENT_SHARDS without a CPU of
+	 * their own that are started afterwards.
+	 *
+	 * Only supported on Linux, elsewhere the threads warn and run
+	 * unpinned. */
+	LIBUSB_OPTION_NUMA_NODE = 9,
+
+	/** Run event handling on a thread owned by libusb. The argument is an
+	 * int: non-zero starts the thread, zero stops it again. While the
+	 * thread runs, the application does not need to call any of the
+	 * libusb_handle_events() functions. Transfer and hotplug callbacks are
+	 * invoked from the event thread. Threads blocked in synchronous I/O
+	 * sleep until their own transfer completes and are woken individually,
+	 * instead of competing for the event handling lock.
+	 *
+	 * The thread is stopped automatically by libusb_exit(). Do not stop it
+	 * while other threads are performing synchronous I/O, and do not stop it
+	 * from within a callback. */
+	LIBUSB_OPTION_EVENT_THREAD = 10,
+
+	/** Poll for events without blocking for a while before event handling
+	 * sleeps, to save the wake-up latency of the sleep when transfers
+	 * complete at a high rate. The argument is an unsigned int holding
+	 * the time to spin in microseconds, 0, the default, sleeps right away.
+	 *
+	 * Event handling only spins while device handles that it serves have
+	 * transfers in flight, and never for longer than the timeout it was
+	 * given. The thread handling events keeps a CPU busy while it spins.
+	 * The busy_poll_completions and event_completions counters of
+	 * libusb_context_stats tell how many transfers completed from events
+	 * caught by spinning and by sleeping. The shards of
+	 * \ref LIBUSB_OPTION_EVENT_SHARDS do not spin. */
+	LIBUSB_OPTION_BUSY_POLL = 11,
+
+	/** Set the maximum number of transfer completions that a single
+	 * iteration of event handling processes before returning to the
+	 * caller. The argument is an unsigned int. The default of 0 means no
+	 * limit. A transfer that is carried out in several pieces, such as an
+	 * isochronous transfer split into several URBs on Linux, counts once,
+	 * when it completes. Backends that process completions for several
+	 * devices share the budget between them in round-robin fashion, so that
+	 * a busy device cannot starve the others. */
+	LIBUSB_OPTION_EVENT_BUDGET = 12,
+};
+
+/** \ingroup lib
+ * Number of buckets in the latency histogram of
+ * \ref libusb_transfer_stats. */
+#define LIBUSB_STATS_LATENCY_BUCKETS 24
+
+/** \ingroup lib
+ * Transfer statistics, see libusb_get_context_stats(),
+ * libusb_get_device_handle_stats() and libusb_get_endpoint_stats().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+struct libusb_transfer_stats {
+	/** Number of transfers submitted */
+	uint64_t submitted;
+
+	/** Number of transfers that completed with
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
+	 * "LIBUSB_TRANSFER_COMPLETED" */
+	uint64_t completed;
+
+	/** Number of transfers that failed with an error, stall, overflow or
+	 * device disconnection */
+	uint64_t failed;
+
+	/** Number of transfers that were cancelled */
+	uint64_t cancelled;
+
+	/** Number of transfers that timed out */
+	uint64_t timed_out;
+
+	/** Number of bytes transferred, whatever the transfer status */
+	uint64_t bytes;
+
+	/** Histogram of the time from submission to completion. Bucket 0
+	 * counts transfers that took less than 1 microsecond, bucket i those
+	 * that took from 2^(i-1) up to 2^i microseconds, and the last bucket
+	 * all slower ones. */
+	uint64_t latency[LIBUSB_STATS_LATENCY_BUCKETS];
+};
+
+/** \ingroup lib
+ * Context statistics, see libusb_get_context_stats().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ */
+struct libusb_context_stats {
+	/** Statistics of all transfers of the context */
+	struct libusb_transfer_stats transfers;
+
+	/** Number of requests handed to the operating system for these
+	 * transfers, one or more per transfer. Only counted on Linux, where
+	 * they are URBs */
+	uint64_t urbs;
+
+	/** Number of times event handling woke up from waiting */
+	uint64_t event_wakeups;
+
+	/** Time spent waiting for events, in microseconds */
+	uint64_t wait_time_us;
+
+	/** Time spent handling events after waking up, including callbacks,
+	 * in microseconds */
+	uint64_t dispatch_time_us;
+
+	/** Number of times event handling found events while spinning, see
+	 * \ref libusb_option::LIBUSB_OPTION_BUSY_POLL "LIBUSB_OPTION_BUSY_POLL".
+	 * These are not counted in event_wakeups */
+	uint64_t busy_poll_wakeups;
+
+	/** Time spent spinning, in microseconds */
+	uint64_t busy_poll_time_us;
+
+	/** Number of transfers completed from events found while spinning */
+	uint64_t busy_poll_completions;
+
+	/** Number of transfers completed otherwise, after waiting or from the
+	 * threads of \ref libusb_option::LIBUSB_OPTION_EVENT_SHARDS
+	 * "LIBUSB_OPTION_EVENT_SHARDS" */
+	uint64_t event_completions;
+};
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+int LIBUSB_CALLV libusb_set_option(libusb_context *ctx, enum libusb_option option, ...);
+int LIBUSB_CALL libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_context_stats *stats);
+int LIBUSB_CALL libusb_get_device_handle_stats(libusb_device_handle *dev_handle,
+	struct libusb_transfer_stats *stats);
+int LIBUSB_CALL libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_transfer_stats *stats);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
@@ -1328,6 +1846,14 @@ int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t bConfigurationValue, struct libusb_config_descriptor **config);
 void LIBUSB_CALL libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config);
+int LIBUSB_CALL libusb_get_raw_active_config_descriptor(libusb_device *dev,
+	const unsigned char **buffer);
+int LIBUSB_CALL libusb_get_raw_config_descriptor(libusb_device *dev,
+	uint8_t config_index, const unsigned char **buffer);
+int LIBUSB_CALL libusb_next_descriptor(struct libusb_descriptor_iterator *iter,
+	struct libusb_descriptor_view *view);
+int LIBUSB_CALL libusb_find_descriptor(struct libusb_descriptor_iterator *iter,
+	uint8_t descriptor_type, struct libusb_descriptor_view *view);
 int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(
 	struct libusb_context *ctx,
 	const struct libusb_endpoint_descriptor *endpoint,
@@ -1362,12 +1888,18 @@ int LIBUSB_CALL libusb_get_port_path(libusb_context *ctx, libusb_device *dev, ui
 libusb_device * LIBUSB_CALL libusb_get_parent(libusb_device *dev);
 uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev);
 int LIBUSB_CALL libusb_get_device_speed(libusb_device *dev);
+int LIBUSB_CALL libusb_get_device_numa_node(libusb_device *dev);
 int LIBUSB_CALL libusb_get_max_packet_size(libusb_device *dev,
 	unsigned char endpoint);
 int LIBUSB_CALL libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint);
+int LIBUSB_CALL libusb_export_device_snapshot(libusb_context *ctx,
+	unsigned char **data, size_t *length);
+void LIBUSB_CALL libusb_free_device_snapshot(unsigned char *data);
 
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle);
+int LIBUSB_CALL libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
+	libusb_device_handle **dev_handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
 libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle);
 
@@ -1386,12 +1918,27 @@ int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev,
 int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev,
 	unsigned char endpoint);
 int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev);
+int LIBUSB_CALL libusb_set_pipe_policy(libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_pipe_policy policy,
+	unsigned int value);
+int LIBUSB_CALL libusb_get_pipe_policy(libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_pipe_policy policy,
+	unsigned int *value);
 
 int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev,
 	uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
 int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev,
 	unsigned char *endpoints, int num_endpoints);
 
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handle,
+	size_t length);
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length);
+unsigned char * LIBUSB_CALL libusb_dev_buffer_alloc(
+	libusb_device_handle *dev_handle, size_t length, uint32_t flags);
+int LIBUSB_CALL libusb_dev_buffer_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length);
+
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev,
 	int interface_number);
 int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev,
@@ -1476,12 +2023,56 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_stream_transfers(libusb_device_handle *dev_handle,
+	unsigned char endpoint, uint32_t stream_id);
+int LIBUSB_CALL libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint);
+int LIBUSB_CALL libusb_cancel_all_transfers(libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_get_stream_transfer_count(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	uint32_t stream_id);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_set_transfer_executor(libusb_device_handle *dev_handle,
+	libusb_transfer_executor executor, void *user_data);
+int LIBUSB_CALL libusb_set_transfer_batch_callback(
+	libusb_device_handle *dev_handle, libusb_transfer_batch_cb_fn callback,
+	void *user_data);
+void LIBUSB_CALL libusb_run_transfer_callback(struct libusb_transfer *transfer);
+const struct libusb_iso_packet_info * LIBUSB_CALL libusb_get_iso_packet_info(
+	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_compact_iso_packets(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_transfer_pool_create(int iso_packets,
+	unsigned int max_cached, libusb_transfer_pool **pool);
+void LIBUSB_CALL libusb_transfer_pool_destroy(libusb_transfer_pool *pool);
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_alloc(
+	libusb_transfer_pool *pool);
+int LIBUSB_CALL libusb_alloc_iso_stream(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *buffer, int num_slots,
+	int num_transfers, int packets_per_transfer, unsigned int packet_length,
+	libusb_iso_stream_cb_fn callback, void *user_data,
+	libusb_iso_stream **stream);
+int LIBUSB_CALL libusb_start_iso_stream(libusb_iso_stream *stream);
+int LIBUSB_CALL libusb_stop_iso_stream(libusb_iso_stream *stream);
+void LIBUSB_CALL libusb_free_iso_stream(libusb_iso_stream *stream);
+int LIBUSB_CALL libusb_alloc_bulk_reader(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int queue_depth, int num_buffers,
+	int buffer_size, libusb_bulk_reader **reader);
+int LIBUSB_CALL libusb_start_bulk_reader(libusb_bulk_reader *reader);
+int LIBUSB_CALL libusb_bulk_reader_get(libusb_bulk_reader *reader,
+	unsigned char **buffer, int *length);
+void LIBUSB_CALL libusb_bulk_reader_release(libusb_bulk_reader *reader,
+	unsigned char *buffer);
+int LIBUSB_CALL libusb_stop_bulk_reader(libusb_bulk_reader *reader);
+void LIBUSB_CALL libusb_free_bulk_reader(libusb_bulk_reader *reader);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int num_iov);
 
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1740,6 +2331,9 @@ static inline unsigned char *libusb_get_iso_packet_buffer_simple(
 int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout);
+int LIBUSB_CALL libusb_control_write_vec(libusb_device_handle *dev_handle,
+	const struct libusb_control_write *writes, int num_writes,
+	int *completed, unsigned int timeout);
 
 int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
@@ -1793,6 +2387,9 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 
 int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length);
+int LIBUSB_CALL libusb_get_string_descriptors_ascii(
+	libusb_device_handle *dev_handle, const uint8_t *desc_indexes,
+	int num_indexes, unsigned char *data, int length, int *results);
 
 /* polling and timeouts */
 
@@ -1877,6 +2474,7 @@ typedef void (LIBUSB_CALL *libusb_pollfd_removed_cb)(libusb_os_handle handle, vo
 
 const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	libusb_context *ctx);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx, int *fd);
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
@@ -1923,6 +2521,25 @@ typedef enum {
 	LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT    = 0x02,
 } libusb_hotplug_event;
 
+/** \ingroup dev
+ * A device connection or disconnection, as returned by
+ * libusb_get_device_list_changes().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105 */
+struct libusb_device_list_change {
+	/** The device. The change holds a reference to it. */
+	libusb_device *dev;
+
+	/** Whether the device arrived or left */
+	libusb_hotplug_event event;
+};
+
+uint32_t LIBUSB_CALL libusb_get_device_list_generation(libusb_context *ctx);
+ssize_t LIBUSB_CALL libusb_get_device_list_changes(libusb_context *ctx,
+	uint32_t *generation, struct libusb_device_list_change **changes);
+void LIBUSB_CALL libusb_free_device_list_changes(
+	struct libusb_device_list_change *changes, ssize_t count);
+
 /** \ingroup hotplug
  * Wildcard matching for hotplug events */
 #define LIBUSB_HOTPLUG_MATCH_ANY -1
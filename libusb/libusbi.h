@@ -35,6 +35,7 @@
 
 #include "libusb.h"
 #include "version.h"
+#include "trace.h"
 
 /* Inside the libusb code, mark all public functions as follows:
  *   return_type API_EXPORTED function_name(params) { ... }
@@ -45,6 +46,9 @@
  */
 #define API_EXPORTED LIBUSB_CALL DEFAULT_VISIBILITY
 
+/* Same as API_EXPORTED, for functions taking a variable number of arguments */
+#define API_EXPORTEDV LIBUSB_CALLV DEFAULT_VISIBILITY
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -55,9 +59,26 @@ extern "C" {
 #define USB_MAXINTERFACES	32
 #define USB_MAXCONFIG		8
 
+/* Number of transfers each device handle keeps for synchronous I/O */
+#define SYNC_POOL_MAX_CACHED	4
+
+/* Initial number of buckets in the context device hash indexes (power of 2) */
+#define USBI_DEV_HASH_INIT_SIZE	32
+
+/* Maximum depth of a port path, as allowed by the USB 3.0 specification */
+#define USBI_MAX_PORT_DEPTH	7
+
+/* Number of device arrivals/departures remembered for
+ * libusb_get_device_list_changes() (power of 2) */
+#define USBI_DEVICE_CHANGE_LOG_SIZE	64
+
+/* Number of endpoint addresses, as numbered by usbi_stats_endpoint_index() */
+#define USBI_MAX_ENDPOINT_INDEX	32
+
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS					0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_HAS_BULK_IOVEC					0x00040000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -178,17 +199,51 @@ static inline void *usbi_reallocf(void *ptr, size_t size)
 	} while (0)
 #endif
 
+#if !defined(timeradd)
+#define timeradd(a, b, result)						\
+	do {								\
+		(result)->tv_sec = (a)->tv_sec + (b)->tv_sec;		\
+		(result)->tv_usec = (a)->tv_usec + (b)->tv_usec;	\
+		if ((result)->tv_usec >= 1000000) {			\
+			++(result)->tv_sec;				\
+			(result)->tv_usec -= 1000000;			\
+		}							\
+	} while (0)
+#endif
+
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...);
 
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args);
 
+/* the most verbose level that any context, or logging without a context,
+ * currently uses. checked before a message's arguments are evaluated, so
+ * that disabled messages cost a single comparison. it starts above all
+ * levels, so messages logged before the first context exists go through
+ * the full check in usbi_log_v() */
+extern int usbi_log_level_max;
+void usbi_update_log_level_max(void);
+
+#ifdef ENABLE_DEBUG_LOGGING
+#define usbi_log_enabled(level) 1
+#else
+#define usbi_log_enabled(level) ((int)(level) <= usbi_log_level_max)
+#endif
+
 #if !defined(_MSC_VER) || _MSC_VER >= 1400
 
 #ifdef ENABLE_LOGGING
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__)
+#define _usbi_log(ctx, level, ...) \
+	do { \
+		if (usbi_log_enabled(level)) \
+			usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__); \
+	} while (0)
+#ifdef DISABLE_DEBUG_MESSAGES
+#define usbi_dbg(...) do {} while(0)
+#else
 #define usbi_dbg(...) _usbi_log(NULL, LIBUSB_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
 #else
 #define _usbi_log(ctx, level, ...) do { (void)(ctx); } while(0)
 #define usbi_dbg(...) do {} while(0)
@@ -204,6 +259,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #define LOG_BODY(ctxt, level) \
 {                             \
 	va_list args;             \
+	if (!usbi_log_enabled(level)) \
+		return;               \
 	va_start (args, format);  \
 	usbi_log_v(ctxt, level, "", format, args); \
 	va_end(args);             \
@@ -222,8 +279,15 @@ static inline void usbi_err( struct libusb_context *ctx, const char *format,
 	...)
 	LOG_BODY(ctx,LIBUSB_LOG_LEVEL_ERROR)
 
+#ifdef DISABLE_DEBUG_MESSAGES
+static inline void usbi_dbg(const char *format, ...)
+{
+	(void)format;
+}
+#else
 static inline void usbi_dbg(const char *format, ...)
 	LOG_BODY(NULL,LIBUSB_LOG_LEVEL_DEBUG)
+#endif
 
 #endif /* !defined(_MSC_VER) || _MSC_VER >= 1400 */
 
@@ -254,6 +318,69 @@ struct libusb_context {
 	int debug;
 	int debug_fixed;
 
+	/* maximum number of transfer completions processed per event handling
+	 * iteration, 0 for no limit. see LIBUSB_OPTION_EVENT_BUDGET */
+	unsigned int event_budget;
+
+	/* transfers in flight per endpoint on backends running blocking
+	 * kernel calls on threads, 0 for one. see
+	 * LIBUSB_OPTION_ENDPOINT_QUEUE_DEPTH */
+	unsigned int endpoint_queue_depth;
+
+	/* see LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS */
+	int cache_string_descriptors;
+
+	/* microseconds to poll for events before waiting, 0 for none. see
+	 * LIBUSB_OPTION_BUSY_POLL */
+	unsigned int busy_poll_us;
+
+	/* transfers on the flying lists of the handles without a shard, which
+	 * the context's event handling serves, so that it can tell cheaply
+	 * whether to spin. see usbi_count_transfers_in_flight() */
+	usbi_atomic_t transfers_in_flight;
+
+	/* node that the threads of the context are pinned to, -1 for none.
+	 * see LIBUSB_OPTION_NUMA_NODE */
+	int numa_node;
+
+	/* set by libusb_init() under LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY, the
+	 * backend then leaves the device scan to the first
+	 * libusb_get_device_list(), which clears it. device_scan_lock keeps
+	 * concurrent first calls from scanning twice */
+	int device_scan_deferred;
+	usbi_mutex_t device_scan_lock;
+
+	/* see LIBUSB_OPTION_WEAK_AUTHORITY, set by libusb_init() and
+	 * libusb_set_option() */
+	int weak_authority;
+
+	/* statistics, see LIBUSB_OPTION_COLLECT_STATS. stats is allocated when
+	 * collection is first enabled and kept until the context is destroyed */
+	int collect_stats;
+	struct usbi_stats *stats;
+
+	/* internal event thread, see LIBUSB_OPTION_EVENT_THREAD. event_thread_stop
+	 * is set with the event_data_lock held to ask the thread to exit */
+	usbi_thread_t event_thread;
+	int event_thread_running;
+	int event_thread_stop;
+
+	/* event loops started with LIBUSB_OPTION_EVENT_SHARDS, each handling the
+	 * device handles assigned to it when they were opened. num_shards is
+	 * changed with open_devs_lock held */
+	struct usbi_event_shard *shards;
+	unsigned int num_shards;
+
+	/* threads started with LIBUSB_OPTION_CALLBACK_WORKERS. handles are
+	 * spread over them by the callback_worker number given to them by
+	 * libusb_open(), which counts next_callback_worker up under
+	 * open_devs_lock. callback_workers_lock protects callback_workers and
+	 * num_callback_workers, which completions read to queue to them */
+	usbi_mutex_t callback_workers_lock;
+	struct usbi_callback_worker *callback_workers;
+	unsigned int num_callback_workers;
+	unsigned int next_callback_worker;
+
 	/* used for signalling occurrence of an internal event. */
 	usbi_event_t event;
 
@@ -264,6 +391,38 @@ struct libusb_context {
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
+	/* hash indexes over usb_devs, keyed by session ID and by bus/port path.
+	 * Protected by usb_devs_lock. Both tables have dev_hash_size buckets,
+	 * which is doubled whenever usb_devs_cnt exceeds it. */
+	struct list_head *session_hash;
+	struct list_head *port_path_hash;
+	unsigned int dev_hash_size;
+	unsigned int usb_devs_cnt;
+
+	/* generation of usb_devs, bumped on every connect and disconnect, and
+	 * a ring of the most recent changes indexed by generation. Each entry
+	 * holds a device reference until libusb_get_device_list_changes()
+	 * hands it over to its caller, which devs_changes_taken records the
+	 * generation of. Protected by usb_devs_lock. */
+	uint32_t devs_generation;
+	uint32_t devs_changes_taken;
+	struct usbi_device_change {
+		struct libusb_device *dev;
+		int event;
+	} devs_changes[USBI_DEVICE_CHANGE_LOG_SIZE];
+
+	/* result of the last enumeration by a backend without hotplug support,
+	 * returned again while the backend's get_device_list_generation reports
+	 * no change. Holds a reference to each device. Protected by
+	 * usb_devs_lock. */
+	struct discovered_devs *cached_discdevs;
+	unsigned long cached_discdevs_generation;
+
+	/* device snapshot named by LIBUSB_DEVICE_SNAPSHOT, validated when
+	 * loaded by libusb_init() and read-only afterwards. */
+	unsigned char *snapshot;
+	size_t snapshot_len;
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
@@ -273,13 +432,26 @@ struct libusb_context {
 	struct list_head hotplug_cbs;
 	usbi_mutex_t hotplug_cbs_lock;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
+	/* The same callbacks indexed for matching: callbacks with a vendor ID
+	 * are hashed by vendor and product ID (which may be
+	 * LIBUSB_HOTPLUG_MATCH_ANY), the others are kept in hotplug_wildcard_cbs.
+	 * Protected by hotplug_cbs_lock. */
+#define USBI_HOTPLUG_CB_BUCKET_BITS	6
+	struct list_head hotplug_cb_buckets[1 << USBI_HOTPLUG_CB_BUCKET_BITS];
+	struct list_head hotplug_wildcard_cbs;
+
+	/* protects the timeout heap and the timer. in-flight transfers are
+	 * listed by their device handle, so that transfers without a timeout do
+	 * not take a context-wide lock */
 	usbi_mutex_t flying_transfers_lock;
 
+	/* binary min-heap of the in-flight transfers that have a finite timeout,
+	 * ordered by timeout expiration. The transfer to time out the soonest is
+	 * always at index 0. Protected by flying_transfers_lock. */
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
+
 	/* user callbacks for event source changes */
 	libusb_pollfd_added_cb event_source_added_cb;
 	libusb_pollfd_removed_cb event_source_removed_cb;
@@ -296,6 +468,10 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* synchronous transfer waiters to wake when the events lock is released,
+	 * protected by event_waiters_lock */
+	struct list_head sync_waiters;
+
 	/* A lock to protect internal context event data. */
 	usbi_mutex_t event_data_lock;
 
@@ -313,27 +489,82 @@ struct libusb_context {
 	unsigned int event_sources_modified;
 	void *event_data;
 
+	/* event sources that have been removed but may still be referenced by
+	 * the event handling thread. These are freed the next time the event
+	 * data is rebuilt. Protected by event_data_lock. */
+	struct list_head removed_event_sources;
+
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
-	/* A list of pending completed transfers. Protected by event_data_lock. */
-	struct list_head completed_transfers;
+	/* Processed hotplug messages kept for reuse, at most
+	 * USBI_HOTPLUG_MSGS_CACHED of them. Protected by event_data_lock. */
+#define USBI_HOTPLUG_MSGS_CACHED	16
+	struct list_head free_hotplug_msgs;
+	unsigned int free_hotplug_msgs_cnt;
+
+	/* Pending completed transfers, most recent first and linked through
+	 * completed_next. Pushed and taken without a lock, see
+	 * usbi_signal_transfer_completion(). */
+	struct usbi_transfer *completed_transfers;
+
+	/* handles with completions for their batch callback, see
+	 * libusb_device_handle.batch, and the array of a delivered batch that
+	 * the next handle to deliver one takes over, room for
+	 * batch_spare_size transfers. Only used by the thread holding the
+	 * events lock */
+	struct list_head batch_handles;
+	struct libusb_transfer **batch_spare;
+	int batch_spare_size;
 
 	struct list_head list;
 };
 
 /* Update the following macro if new event sources are added */
 #define usbi_pending_events(ctx) \
-	((ctx)->device_close || (ctx)->event_sources_modified \
-	 || !list_empty(&(ctx)->hotplug_msgs) || !list_empty(&(ctx)->completed_transfers))
+	((ctx)->device_close || (ctx)->event_sources_modified || (ctx)->event_thread_stop \
+	 || !list_empty(&(ctx)->hotplug_msgs) || usbi_atomic_load_ptr(&(ctx)->completed_transfers))
 
 #define usbi_using_timer(ctx) ((ctx)->timer != USBI_INVALID_TIMER)
 
+/* Per-endpoint information extracted from the active configuration */
+struct usbi_endpoint_info {
+	uint16_t max_packet_size;	/* raw wMaxPacketSize */
+	uint8_t present;
+	uint8_t type;			/* enum libusb_transfer_type */
+	uint8_t interval;
+	uint8_t mult;			/* transactions per microframe */
+	uint8_t max_burst;		/* from the SS endpoint companion, or 0 */
+};
+
+/* Immutable, refcounted copy of the parsed active configuration, indexed by
+ * endpoint address (see USBI_EP_INDEX) */
+struct usbi_config_cache {
+	int refcnt;			/* protected by the device lock */
+	struct libusb_config_descriptor *config;
+	struct usbi_endpoint_info endpoints[USB_MAXENDPOINTS];
+};
+
+#define USBI_EP_INDEX(ep)	(((ep) & 0x0f) | (((ep) & 0x80) >> 3))
+
+/* A string descriptor as read from the device, cached while
+ * LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS is set. Index 0 is the LANGID
+ * table */
+struct usbi_string_cache_entry {
+	struct usbi_string_cache_entry *next;
+	uint16_t langid;
+	uint8_t desc_index;
+	uint8_t length;
+	unsigned char data[255];
+};
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt, config_cache and string_cache, everything else
+	 * is finalized at initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
+	struct usbi_config_cache *config_cache;
+	struct usbi_string_cache_entry *string_cache;
 
 	struct libusb_context *ctx;
 
@@ -345,11 +576,19 @@ struct libusb_device {
 	enum libusb_speed speed;
 
 	struct list_head list;
+	struct list_head session_list;
+	struct list_head port_path_list;
 	unsigned long session_data;
 
 	struct libusb_device_descriptor device_descriptor;
 	int attached;
 
+	/* a value that backends taking descriptors from a device snapshot
+	 * change whenever the device is enumerated again, such as the mtime of
+	 * its sysfs directory. kept in the snapshot, whose entry is only
+	 * trusted while the values still match */
+	uint64_t snapshot_stamp;
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -360,13 +599,66 @@ struct libusb_device {
 };
 
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces and dev_buffers */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+
+	/* transfers in flight for this handle, linked through
+	 * usbi_transfer.handle_list. Protected by flying_transfers_lock. The
+	 * context's flying_transfers_lock may be taken while it is held, not
+	 * the other way round */
+	struct list_head flying_transfers;
+	usbi_mutex_t flying_transfers_lock;
+
+	/* event loop handling this handle's event sources and completions, or
+	 * NULL if that is the context's. set when the handle is opened */
+	struct usbi_event_shard *shard;
+
+	/* recycles the transfers used by the synchronous I/O functions */
+	struct libusb_transfer_pool *sync_pool;
+
+	/* set by libusb_set_transfer_executor() */
+	libusb_transfer_executor executor;
+	void *executor_user_data;
+
+	/* set by libusb_set_transfer_batch_callback(). the transfers completed
+	 * during an event handling iteration are collected in batch, which has
+	 * room for batch_size of them, and the handle is listed on the
+	 * batch_handles of its shard or context until the end of the
+	 * iteration. only used by the thread handling the handle's events */
+	libusb_transfer_batch_cb_fn batch_callback;
+	void *batch_user_data;
+	struct libusb_transfer **batch;
+	int batch_len;
+	int batch_size;
+	struct list_head batch_list;
+
+	/* picks the context's callback worker, if there are any */
+	unsigned int callback_worker;
+
+	/* per-endpoint statistics, indexed by usbi_stats_endpoint_index().
+	 * allocated on first use and updated without a lock */
+	struct usbi_endpoint_stats *endpoint_stats;
+
+	/* bulk streams allocated by libusb_alloc_streams() and the transfers
+	 * in flight on each of them, indexed by usbi_stats_endpoint_index().
+	 * protected by flying_transfers_lock */
+	struct usbi_stream_table *stream_tables[USBI_MAX_ENDPOINT_INDEX];
+
+	/* the stream transfer that libusb_cancel_stream_transfers() is about
+	 * to lock. it does not leave flying_transfers on completion until it
+	 * is no longer pinned, which cancel_pinned_cond is signalled for.
+	 * protected by flying_transfers_lock */
+	struct usbi_transfer *cancel_pinned;
+	usbi_cond_t cancel_pinned_cond;
+
+	/* buffers of libusb_dev_buffer_alloc() not freed yet, with the length
+	 * of their mapping. protected by lock */
+	struct list_head dev_buffers;
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -397,11 +689,57 @@ enum {
 struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
+	struct list_head handle_list;
 	struct list_head completed_list;
+	struct usbi_transfer *completed_next;
 	struct timeval timeout;
+	int timeout_heap_index;	/* -1 when not in the context's timeout heap */
 	int transferred;
 	uint32_t stream_id;
-	uint8_t flags;
+
+	/* the stream table entry of a bulk stream transfer in flight, or NULL.
+	 * linked through stream_list, protected by the handle's
+	 * flying_transfers_lock */
+	struct usbi_stream *stream;
+	struct list_head stream_list;
+
+	/* enum usbi_transfer_flags, only accessed through the usbi_atomic_*
+	 * functions. changes that depend on the flags already set are made
+	 * with usbi_atomic_cas() */
+	usbi_atomic_t flags;
+
+	/* the pool this transfer is returned to when freed, or NULL */
+	struct libusb_transfer_pool *pool;
+
+	/* allocated on first use by the synchronous API and kept until the
+	 * transfer is freed */
+	struct usbi_transfer_waiter *waiter;
+
+	/* buffer segments set with libusb_transfer_set_iovec(), or NULL. when
+	 * the backend lacks USBI_CAP_HAS_BULK_IOVEC the segments are gathered
+	 * into iov_bounce, which is kept until the transfer is freed */
+	const struct libusb_iovec *iov;
+	int num_iov;
+	unsigned char *iov_bounce;
+	int iov_bounce_size;
+
+	/* array returned by libusb_get_iso_packet_info(), allocated on first
+	 * use and kept until the transfer is freed. the offsets are computed
+	 * when the transfer is submitted. a backend may fill in the results
+	 * while completing the transfer and set iso_packet_info_done, otherwise
+	 * they are copied from iso_packet_desc on request */
+	struct libusb_iso_packet_info *iso_packet_info;
+	int iso_packet_info_done;
+
+	/* submission time, valid while stats_pending is set. only recorded
+	 * while the context collects statistics */
+	struct timespec stats_submit_time;
+	int stats_pending;
+
+	/* set for the transfers of the synchronous I/O functions. their
+	 * callback has to run from event handling, which the waiting thread may
+	 * be doing itself, so it is never handed to an executor */
+	int inline_callback;
 
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
@@ -411,10 +749,116 @@ struct usbi_transfer {
 	 * its completion (presumably there would be races within your OS backend
 	 * if this were possible). */
 	usbi_mutex_t lock;
+};
+
+/* lets a thread sleep until one particular transfer completes, without
+ * running the event loop itself. used by the synchronous API while the
+ * internal event thread or another thread is handling events, so that each
+ * completion wakes only the thread waiting for it */
+struct usbi_transfer_waiter {
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
 
-	/* this lock should be held whenever viewing or modifying flags
-	 * relating to the transfer state */
-	usbi_mutex_t flags_lock;
+	/* entry in the context's sync_waiters list while waiting for another
+	 * thread's event handling, and set under lock when that thread releases
+	 * the events lock */
+	struct list_head list;
+	int woken;
+};
+
+struct libusb_transfer_pool {
+	/* lock protects all of the fields below */
+	usbi_mutex_t lock;
+	int iso_packets;
+
+	/* idle transfers, linked through usbi_transfer.list */
+	struct list_head cached;
+	unsigned int cached_cnt;
+	unsigned int max_cached;
+
+	/* transfers handed out by the pool that have not been freed yet. the
+	 * pool itself is freed with the last of them once destroyed is set */
+	unsigned int outstanding;
+	int destroyed;
+};
+
+struct libusb_iso_stream {
+	/* ring buffer geometry, fixed at allocation */
+	unsigned char *buffer;
+	int num_slots;
+	int packets_per_transfer;
+	unsigned int packet_length;
+	libusb_iso_stream_cb_fn callback;
+	void *user_data;
+
+	/* lock protects the fields below */
+	usbi_mutex_t lock;
+
+	/* slot used by the next submission */
+	int next_slot;
+
+	/* number of submitted transfers. the stream is running while this is
+	 * nonzero and stopping is not set, in which case status holds the
+	 * reason it is stopping */
+	int in_flight;
+	int stopping;
+	enum libusb_transfer_status status;
+
+	/* results of each slot, copied out of a transfer before it is
+	 * resubmitted into the next slot */
+	struct libusb_iso_packet_descriptor *packets;
+
+	int num_transfers;
+	struct libusb_transfer *transfers
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+	[] /* valid C99 code */
+#else
+	[0] /* non-standard, but usually working code */
+#endif
+	;
+};
+
+struct libusb_bulk_reader {
+	/* num_buffers buffers of buffer_size bytes, fixed at allocation */
+	unsigned char *buffers;
+	int num_buffers;
+	int buffer_size;
+
+	/* lock protects the fields below */
+	usbi_mutex_t lock;
+
+	/* filled buffers waiting for the consumer, as a ring of buffer
+	 * indexes and lengths */
+	struct usbi_bulk_reader_entry {
+		int index;
+		int length;
+	} *ready;
+	int ready_head;
+	int ready_count;
+
+	/* stack of buffer indexes that no transfer or consumer is using */
+	int *free_buffers;
+	int free_count;
+
+	/* transfers that completed while no buffer was free */
+	struct libusb_transfer **parked;
+	int num_parked;
+
+	/* number of submitted transfers. once stopping is set, nothing is
+	 * resubmitted and status holds the error reported to the consumer
+	 * after the remaining data */
+	int in_flight;
+	int stopping;
+	int status;
+
+	int num_transfers;
+	struct libusb_transfer *transfers
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+	[] /* valid C99 code */
+#else
+	[0] /* non-standard, but usually working code */
+#endif
+	;
 };
 
 enum usbi_transfer_flags {
@@ -455,6 +899,22 @@ static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 			* sizeof(struct libusb_iso_packet_descriptor));
 }
 
+/* the timeout of a transfer in milliseconds, for backends handing it to an
+ * OS that only takes milliseconds. microsecond timeouts are rounded up */
+static inline unsigned int usbi_transfer_timeout_ms(struct libusb_transfer *transfer)
+{
+	if (transfer->flags & LIBUSB_TRANSFER_TIMEOUT_US)
+		return transfer->timeout / 1000 + (transfer->timeout % 1000 != 0);
+	return transfer->timeout;
+}
+
+/* a relative timeout in milliseconds for poll() and friends, rounded up so
+ * that waits never end before the timeout */
+static inline int usbi_timeval_to_ms(const struct timeval *tv)
+{
+	return (int)(tv->tv_sec * 1000) + (int)((tv->tv_usec + 999) / 1000);
+}
+
 /* bus structures */
 
 /* All standard descriptors have these 2 fields in common */
@@ -472,6 +932,8 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
+struct libusb_device *usbi_get_device_by_port_path(struct libusb_context *ctx,
+	uint8_t bus_number, const uint8_t *port_numbers, int num_ports);
 int usbi_sanitize_device(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *handle);
 
@@ -479,10 +941,141 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
 void usbi_signal_transfer_completion(struct usbi_transfer *transfer);
+int usbi_remove_from_timeout_heap(struct usbi_transfer *transfer);
+int usbi_handle_events_for_waiter(struct libusb_context *ctx,
+	struct usbi_transfer_waiter *waiter, int *completed);
+
+/* one request of usbi_control_read_vec() */
+struct usbi_control_read {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	unsigned char *data;
+	uint16_t wLength;
+	int result;	/* bytes read, or a LIBUSB_ERROR code */
+};
+
+int usbi_control_read_vec(struct libusb_device_handle *dev_handle,
+	struct usbi_control_read *reads, int num_reads, unsigned int timeout);
+
+void usbi_create_stream_tables(struct libusb_device_handle *handle,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+void usbi_destroy_stream_tables(struct libusb_device_handle *handle,
+	unsigned char *endpoints, int num_endpoints);
+
+/* statistics collected while LIBUSB_OPTION_COLLECT_STATS is enabled. the
+ * inline helpers only cost a flag check otherwise */
+struct usbi_stats {
+	usbi_mutex_t lock;
+	struct libusb_context_stats totals;
+
+	/* whether the context's event handling found its last events by
+	 * spinning, which the completions they bring are counted for */
+	int busy_polled;
+};
+
+/* the counters of struct libusb_transfer_stats for one endpoint, kept with
+ * atomic updates so that completions on different threads and shards do not
+ * serialise on the stats lock */
+struct usbi_endpoint_stats {
+	usbi_atomic64_t submitted;
+	usbi_atomic64_t completed;
+	usbi_atomic64_t failed;
+	usbi_atomic64_t cancelled;
+	usbi_atomic64_t timed_out;
+	usbi_atomic64_t bytes;
+	usbi_atomic64_t latency[LIBUSB_STATS_LATENCY_BUCKETS];
+};
+
+#define usbi_stats_endpoint_index(endpoint) \
+	(((endpoint) & 0x0f) | (((endpoint) & LIBUSB_ENDPOINT_IN) >> 3))
+
+int usbi_set_collect_stats(struct libusb_context *ctx, int enable);
+void usbi_record_transfer_submitted(struct usbi_transfer *itransfer);
+void usbi_record_transfer_unsubmitted(struct usbi_transfer *itransfer);
+void usbi_record_transfer_completed(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status);
+void usbi_record_urbs(struct libusb_context *ctx, unsigned int urbs);
+void usbi_record_event_time(struct libusb_context *ctx, struct timespec *mark,
+	int waited);
+void usbi_record_wait_begin(struct timespec *mark);
+
+/* for the usbi_handle_events() implementations: checks the sources of
+ * event_data without blocking, like their wait does with a zero timeout */
+typedef int (*usbi_poll_events_fn)(struct libusb_context *ctx,
+	void *event_data, unsigned int cnt);
+int usbi_busy_poll(struct libusb_context *ctx, usbi_poll_events_fn poll_events,
+	void *event_data, unsigned int cnt, struct timeval *timeout);
+
+/* account count transfers joining, or with a negative count leaving, the
+ * flying list of a handle */
+static inline void usbi_count_transfers_in_flight(
+	struct libusb_device_handle *handle, long count)
+{
+	if (!handle->shard)
+		usbi_atomic_add(&HANDLE_CTX(handle)->transfers_in_flight, count);
+}
+
+static inline void usbi_stats_transfer_submitted(struct usbi_transfer *itransfer)
+{
+	if (ITRANSFER_CTX(itransfer)->collect_stats)
+		usbi_record_transfer_submitted(itransfer);
+}
+
+static inline void usbi_stats_transfer_unsubmitted(struct usbi_transfer *itransfer)
+{
+	if (itransfer->stats_pending)
+		usbi_record_transfer_unsubmitted(itransfer);
+}
+
+static inline void usbi_stats_transfer_completed(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	if (itransfer->stats_pending)
+		usbi_record_transfer_completed(itransfer, status);
+}
+
+static inline void usbi_stats_urbs(struct libusb_context *ctx, unsigned int urbs)
+{
+	if (ctx->collect_stats)
+		usbi_record_urbs(ctx, urbs);
+}
+
+/* for the usbi_handle_events() implementations: call usbi_stats_wait_begin()
+ * before waiting, usbi_stats_waited() when the wait returns and
+ * usbi_stats_dispatched() once the events have been handled */
+static inline void usbi_stats_wait_begin(struct libusb_context *ctx,
+	struct timespec *mark)
+{
+	mark->tv_sec = 0;
+	mark->tv_nsec = 0;
+	if (ctx->collect_stats)
+		usbi_record_wait_begin(mark);
+}
+
+static inline void usbi_stats_waited(struct libusb_context *ctx,
+	struct timespec *mark)
+{
+	if (mark->tv_sec || mark->tv_nsec)
+		usbi_record_event_time(ctx, mark, 1);
+}
+
+static inline void usbi_stats_dispatched(struct libusb_context *ctx,
+	struct timespec *mark)
+{
+	if (mark->tv_sec || mark->tv_nsec)
+		usbi_record_event_time(ctx, mark, 0);
+}
 
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
 int usbi_device_cache_descriptor(libusb_device *dev);
+int usbi_load_device_snapshot(struct libusb_context *ctx, const char *path);
+void usbi_clear_string_cache(struct libusb_device *dev);
+const unsigned char *usbi_snapshot_find_device(struct libusb_context *ctx,
+	uint8_t bus_number, uint8_t device_address, const uint8_t *port_numbers,
+	int num_ports, uint64_t stamp, enum libusb_speed *speed, size_t *length);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
 
@@ -506,13 +1099,112 @@ struct usbi_event_source {
 	/* must come first */
 	struct libusb_pollfd pollfd;
 
+	/* opaque pointer supplied by whoever added the source (e.g. the device
+	 * handle that owns it), so that a ready source can be dispatched
+	 * without searching for its owner */
+	void *user_data;
+
+	/* events reported by the last wait. only valid while the source is
+	 * being passed to the backend's handle_events function */
+	short revents;
+
+	/* set once the source has been removed. removed sources stay allocated
+	 * until the event handling thread has finished with them, so the backend
+	 * must skip any source with this flag set */
+	unsigned char removed;
+
 	struct list_head list;
 };
 
-int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, short events);
+int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, short events,
+	void *user_data);
 void usbi_remove_event_source(struct libusb_context *ctx, libusb_os_handle source);
 
+/* one of the event loops of a context started with LIBUSB_OPTION_EVENT_SHARDS.
+ * it runs on its own thread and handles the event sources and signalled
+ * completions of the device handles assigned to it, so that their callbacks
+ * always run on that thread. timeouts, hotplug and handles that are not
+ * assigned to a shard stay with the context's event loop */
+struct usbi_event_shard {
+	struct libusb_context *ctx;
+	usbi_thread_t thread;
+	int cpu;
+
+	/* usbi_get_tid() of the thread, so that a handle closed from one of
+	 * the shard's own callbacks does not wait for the shard to go idle */
+	int tid;
+
+	/* wakes the thread when one of the pending conditions below is set */
+	usbi_event_t event;
+
+	/* lock protects the fields below, cond is signalled when busy is
+	 * cleared or close_pending drops to 0 */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+
+	/* set while the thread handles events. libusb_close() raises
+	 * close_pending and waits for busy to clear before it removes the
+	 * handle, as the context's event loop does with device_close */
+	int busy;
+	unsigned int close_pending;
+	int stop;
+
+	/* the event sources of the assigned handles, as for the context */
+	struct list_head event_sources;
+	unsigned int event_sources_cnt;
+	unsigned int event_sources_modified;
+	struct list_head removed_event_sources;
+	void *event_data;
+
+	/* completions signalled by usbi_signal_transfer_completion() */
+	struct list_head completed_transfers;
+
+	/* as for the context, only used by the shard thread */
+	struct list_head batch_handles;
+	struct libusb_transfer **batch_spare;
+	int batch_spare_size;
+
+	/* number of open handles assigned, protected by open_devs_lock */
+	unsigned int handles;
+};
+
+#define usbi_shard_pending_events(shard) \
+	((shard)->stop || (shard)->close_pending || (shard)->event_sources_modified \
+	 || !list_empty(&(shard)->completed_transfers))
+
+/* one thread of the context's callback workers. the completed transfers
+ * queued to it, linked through completed_list, have their callbacks run in
+ * order. lock protects transfers and stop */
+struct usbi_callback_worker {
+	struct libusb_context *ctx;
+	usbi_thread_t thread;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	struct list_head transfers;
+	int stop;
+};
+
+int usbi_start_callback_workers(struct libusb_context *ctx, int count);
+void usbi_stop_callback_workers(struct libusb_context *ctx);
+
+int usbi_add_handle_event_source(struct libusb_device_handle *handle,
+	libusb_os_handle source, short events);
+void usbi_remove_handle_event_source(struct libusb_device_handle *handle,
+	libusb_os_handle source);
+
+int usbi_start_event_shards(struct libusb_context *ctx, int count,
+	const int *cpus);
+int usbi_stop_event_shards(struct libusb_context *ctx, int force);
+struct usbi_event_shard *usbi_assign_event_shard(struct libusb_context *ctx);
+void usbi_flush_transfer_batch(struct libusb_device_handle *handle);
+void usbi_flush_transfer_batches(struct list_head *batch_handles);
+void usbi_release_event_shard(struct libusb_context *ctx,
+	struct libusb_device_handle *handle);
+void usbi_pause_event_shard(struct usbi_event_shard *shard);
+void usbi_resume_event_shard(struct usbi_event_shard *shard);
+
 int usbi_handle_event_trigger(struct libusb_context *ctx);
+void usbi_clear_event_if_idle(struct libusb_context *ctx);
 int usbi_handle_timer_trigger(struct libusb_context *ctx);
 
 int usbi_create_event(usbi_event_t *event);
@@ -527,8 +1219,24 @@ int usbi_destroy_timer(usbi_timer_t timer);
 
 /* OS event abstraction implements the following functions */
 int usbi_alloc_event_data(struct libusb_context *ctx);
+void usbi_free_event_data(struct libusb_context *ctx);
+int usbi_add_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source, unsigned int cnt);
+int usbi_remove_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source);
+#if defined(PLATFORM_POSIX)
+int usbi_get_event_data_fd(struct libusb_context *ctx, int *fd);
+int usbi_alloc_shard_event_data(struct usbi_event_shard *shard);
+void usbi_free_shard_event_data(struct usbi_event_shard *shard);
+int usbi_wait_for_shard_events(struct usbi_event_shard *shard,
+	unsigned int cnt, const struct timeval *tv,
+	struct usbi_event_source ***ready);
+#endif
+
+int usbi_start_event_thread(struct libusb_context *ctx);
+void usbi_stop_event_thread(struct libusb_context *ctx);
 int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned int cnt,
-	unsigned int internal_cnt, int timeout_ms);
+	unsigned int internal_cnt, const struct timeval *tv);
 
 /* device discovery */
 
@@ -652,6 +1360,31 @@ struct usbi_os_backend {
 	 */
 	void (*hotplug_poll)(void);
 
+	/* Return a value that changes whenever the set of devices returned by
+	 * get_device_list may have changed, or 0 if the backend cannot tell.
+	 *
+	 * For backends without hotplug support, libusb_get_device_list keeps
+	 * the result of the last enumeration and returns it again without
+	 * calling get_device_list for as long as this value is nonzero and
+	 * unchanged.
+	 *
+	 * This function must not block and may be called from any thread.
+	 *
+	 * Optional, not used by backends with hotplug support.
+	 */
+	unsigned long (*get_device_list_generation)(void);
+
+	/* Scan for the devices of a context whose init skipped the scan
+	 * because ctx->device_scan_deferred was set, adding them as hotplug
+	 * would. Called by the first libusb_get_device_list() on the context.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 *
+	 * Optional, only used by backends with hotplug support. Without it
+	 * devices are always scanned by init.
+	 */
+	int (*scan_devices)(struct libusb_context *ctx);
+
 	/* Open a device for I/O and other USB operations. The device handle
 	 * is preallocated for you, you can retrieve the device in question
 	 * through handle->dev.
@@ -679,6 +1412,22 @@ struct usbi_os_backend {
 	 */
 	int (*open)(struct libusb_device_handle *handle);
 
+	/* Wrap a platform-specific device handle that the application obtained
+	 * outside of libusb, see libusb_wrap_sys_device(). Optional.
+	 *
+	 * The backend creates the device from sys_dev, reading its descriptors
+	 * through it, sets handle->dev and prepares the handle as open() does.
+	 * The device is attached but not added to the devices of the context.
+	 * On failure handle->dev must be left NULL.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*wrap_sys_device)(struct libusb_context *ctx,
+		struct libusb_device_handle *handle, intptr_t sys_dev);
+
 	/* Close a device such that the handle cannot be used again. Your backend
 	 * should destroy any resources that were allocated in the open path.
 	 * This may also be a good place to call usbi_remove_event_source() to inform
@@ -906,6 +1655,53 @@ struct usbi_os_backend {
 	int (*free_streams)(struct libusb_device_handle *handle,
 		unsigned char *endpoints, int num_endpoints);
 
+	/* Allocate memory that the device can perform I/O on directly, avoiding
+	 * a copy between user and kernel buffers. Optional.
+	 *
+	 * Return a pointer to the memory, or NULL on failure. Transfers on the
+	 * handle may use any part of the memory as their buffer.
+	 */
+	unsigned char *(*dev_mem_alloc)(struct libusb_device_handle *handle,
+		size_t len);
+
+	/* Free memory allocated with dev_mem_alloc. Mandatory when dev_mem_alloc
+	 * is provided.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*dev_mem_free)(struct libusb_device_handle *handle,
+		unsigned char *buffer, size_t len);
+
+	/* Set a policy of the pipe of an endpoint. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the endpoint is not on a claimed interface
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the driver of the interface does not
+	 *   have the policy
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_pipe_policy)(struct libusb_device_handle *handle,
+		unsigned char endpoint, enum libusb_pipe_policy policy,
+		unsigned int value);
+
+	/* Read a policy of the pipe of an endpoint. Mandatory when
+	 * set_pipe_policy is provided. Same return values as set_pipe_policy.
+	 */
+	int (*get_pipe_policy)(struct libusb_device_handle *handle,
+		unsigned char endpoint, enum libusb_pipe_policy policy,
+		unsigned int *value);
+
+	/* Determine the NUMA node of the host controller that a device is
+	 * connected to. Optional.
+	 *
+	 * Return:
+	 * - the node number, >= 0
+	 * - LIBUSB_ERROR_NOT_FOUND if the system has no node for the controller
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_numa_node)(struct libusb_device *dev);
+
 	/* Determine if a kernel driver is active on an interface. Optional.
 	 *
 	 * The presence of a kernel driver on an interface indicates that any
@@ -968,7 +1764,7 @@ struct usbi_os_backend {
 	 *
 	 * This function must not block.
 	 *
-	 * This function gets called with the flying_transfers_lock locked!
+	 * This function gets called with the transfer lock held.
 	 *
 	 * Return:
 	 * - 0 on success
@@ -985,6 +1781,23 @@ struct usbi_os_backend {
 	 */
 	int (*cancel_transfer)(struct usbi_transfer *itransfer);
 
+	/* Cancel every transfer in flight on the endpoint of a bulk, interrupt
+	 * or isochronous transfer, on the same device handle, in one operation.
+	 * Optional, used by libusb_cancel_endpoint_transfers().
+	 *
+	 * As for cancel_transfer, this function must not block and each
+	 * cancellation must complete later. It is called with the transfer lock
+	 * of itransfer and the flying transfers lock of its handle held.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the transfers of this endpoint must
+	 *   be cancelled one by one
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*cancel_endpoint_transfers)(struct usbi_transfer *itransfer);
+
 	/* Clear a transfer as if it has completed or cancelled, but do not
 	 * report any completion/cancellation to the library. You should free
 	 * all private data from the transfer as if you were just about to report
@@ -997,6 +1810,14 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Release any private data that the backend keeps for a transfer across
+	 * submissions. Optional.
+	 *
+	 * This is called when the transfer itself is freed. The transfer is not
+	 * in flight at that point.
+	 */
+	void (*destroy_transfer_priv)(struct usbi_transfer *itransfer);
+
 	/* Handle any pending events on event sources. Optional.
 	 *
 	 * Provide this function when event sources directly indicate device
@@ -1013,6 +1834,13 @@ struct usbi_os_backend {
 	 * determine which actions need to be taken on the currently
 	 * active transfers.
 	 *
+	 * On POSIX platforms the array holds only the event sources that
+	 * reported events (struct usbi_event_source *), with the reported
+	 * events stored in each source's revents field. The user_data pointer
+	 * given to usbi_add_event_source() can be used to find the owner of
+	 * the source directly. Sources that have the removed flag set must be
+	 * skipped.
+	 *
 	 * For any cancelled transfers, call usbi_handle_transfer_cancellation().
 	 * For completed transfers, call usbi_handle_transfer_completion().
 	 * For control/bulk/interrupt transfers, populate the "transferred"
@@ -1093,6 +1921,7 @@ extern const struct usbi_os_backend netbsd_backend;
 extern const struct usbi_os_backend windows_backend;
 extern const struct usbi_os_backend wince_backend;
 extern const struct usbi_os_backend haiku_usb_raw_backend;
+extern const struct usbi_os_backend null_backend;
 
 extern struct list_head active_contexts_list;
 extern usbi_mutex_static_t active_contexts_lock;
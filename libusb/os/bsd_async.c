@@ -0,0 +1,371 @@
+/*
+ * Endpoint worker threads for the OpenBSD and NetBSD backends
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bsd_async.h"
+
+/*
+ * Sent to a worker to interrupt the blocking ugen(4) call of a transfer that
+ * is cancelled or whose handle is closed. Its default action is to ignore
+ * it, which does not interrupt anything, so a handler that does nothing is
+ * installed unless the application has one of its own.
+ */
+#define BSD_ASYNC_SIGNAL	SIGURG
+
+/* how often a worker that is being stopped is interrupted, in ms */
+#define BSD_ASYNC_STOP_INTERVAL	10
+
+struct bsd_async_worker {
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	struct list_head queue;			/* struct bsd_async_transfer */
+	struct bsd_async_transfer *running;	/* in the blocking call */
+	int stop;
+	int exited;
+	usbi_thread_t thread;
+};
+
+static usbi_mutex_static_t signal_lock = USBI_MUTEX_INITIALIZER;
+static int signal_installed;
+
+static void
+_signal_handler(int signum)
+{
+	(void)signum;
+}
+
+static void
+_install_signal_handler(void)
+{
+	struct sigaction sa;
+
+	usbi_mutex_static_lock(&signal_lock);
+	if (!signal_installed && sigaction(BSD_ASYNC_SIGNAL, NULL, &sa) == 0) {
+		/* no SA_RESTART, the interrupted call must fail with EINTR */
+		if (sa.sa_handler == SIG_DFL) {
+			sa.sa_handler = _signal_handler;
+			sa.sa_flags = 0;
+			sigemptyset(&sa.sa_mask);
+			sigaction(BSD_ASYNC_SIGNAL, &sa, NULL);
+		}
+		signal_installed = 1;
+	}
+	usbi_mutex_static_unlock(&signal_lock);
+}
+
+static int
+_worker_index(struct libusb_transfer *transfer)
+{
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return (0);
+
+	return ((transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) |
+	    ((transfer->endpoint & LIBUSB_ENDPOINT_IN) ? 0x10 : 0));
+}
+
+/*
+ * do_close() clears the handle of the transfers still in flight under their
+ * lock before the backend stops the workers, such transfers are dropped.
+ */
+static int
+_transfer_closed(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer;
+	int closed;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	usbi_mutex_lock(&itransfer->lock);
+	closed = transfer->dev_handle == NULL;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	return (closed);
+}
+
+static usbi_thread_ret_t USBI_THREAD_CALL
+_worker_main(void *arg)
+{
+	struct bsd_async_worker *worker = arg;
+	struct bsd_async_transfer *tpriv;
+	struct usbi_transfer *itransfer;
+	sigset_t set;
+
+	/* the creating thread may have blocked the signal */
+	sigemptyset(&set);
+	sigaddset(&set, BSD_ASYNC_SIGNAL);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	usbi_mutex_lock(&worker->lock);
+	for (;;) {
+		while (list_empty(&worker->queue) && !worker->stop)
+			usbi_cond_wait(&worker->cond, &worker->lock);
+		if (worker->stop)
+			break;
+
+		tpriv = list_first_entry(&worker->queue,
+		    struct bsd_async_transfer, list);
+		list_del(&tpriv->list);
+		worker->running = tpriv;
+		usbi_mutex_unlock(&worker->lock);
+
+		itransfer = tpriv->itransfer;
+		if (_transfer_closed(itransfer)) {
+			usbi_mutex_lock(&worker->lock);
+			worker->running = NULL;
+			continue;
+		}
+
+		tpriv->result = tpriv->run(itransfer, tpriv->handle);
+
+		usbi_mutex_lock(&worker->lock);
+		worker->running = NULL;
+		usbi_mutex_unlock(&worker->lock);
+
+		/*
+		 * Hold the transfer lock while signalling so that do_close()
+		 * cannot clear the handle in between.
+		 */
+		usbi_mutex_lock(&itransfer->lock);
+		if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle)
+			usbi_signal_transfer_completion(itransfer);
+		usbi_mutex_unlock(&itransfer->lock);
+
+		usbi_mutex_lock(&worker->lock);
+	}
+	worker->exited = 1;
+	usbi_cond_broadcast(&worker->cond);
+	usbi_mutex_unlock(&worker->lock);
+
+	return (0);
+}
+
+static void
+_stop_worker(struct bsd_async_worker *worker)
+{
+	struct timespec timeout;
+
+	/* the queued transfers belong to a handle being closed, drop them */
+	usbi_mutex_lock(&worker->lock);
+	list_init(&worker->queue);
+	worker->stop = 1;
+	usbi_cond_broadcast(&worker->cond);
+
+	/*
+	 * A transfer without a timeout can block the worker forever. It is
+	 * interrupted until the worker exits, as the signal is lost if it
+	 * arrives just before the blocking call.
+	 */
+	while (!worker->exited) {
+		if (worker->running != NULL)
+			pthread_kill(worker->thread, BSD_ASYNC_SIGNAL);
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_nsec += BSD_ASYNC_STOP_INTERVAL * 1000000L;
+		if (timeout.tv_nsec >= 1000000000L) {
+			timeout.tv_nsec -= 1000000000L;
+			timeout.tv_sec++;
+		}
+		usbi_cond_timedwait(&worker->cond, &worker->lock, &timeout);
+	}
+	usbi_mutex_unlock(&worker->lock);
+	usbi_thread_join(worker->thread);
+
+	usbi_cond_destroy(&worker->cond);
+	usbi_mutex_destroy(&worker->lock);
+	free(worker);
+}
+
+int
+bsd_async_init(struct bsd_async_handle *async)
+{
+	int i;
+
+	for (i = 0; i < BSD_ASYNC_WORKERS; i++)
+		async->workers[i] = NULL;
+
+	_install_signal_handler();
+
+	return (usbi_mutex_init(&async->lock, NULL) ? LIBUSB_ERROR_OTHER : 0);
+}
+
+void
+bsd_async_exit(struct bsd_async_handle *async)
+{
+	int i;
+
+	for (i = 0; i < BSD_ASYNC_WORKERS; i++) {
+		if (async->workers[i] == NULL)
+			continue;
+
+		_stop_worker(async->workers[i]);
+		async->workers[i] = NULL;
+	}
+
+	usbi_mutex_destroy(&async->lock);
+}
+
+int
+bsd_async_submit(struct bsd_async_handle *async,
+    struct usbi_transfer *itransfer,
+    int (*run)(struct usbi_transfer *, struct libusb_device_handle *))
+{
+	struct libusb_transfer *transfer;
+	struct bsd_async_transfer *tpriv;
+	struct bsd_async_worker *worker;
+	int idx;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+	idx = _worker_index(transfer);
+
+	tpriv->itransfer = itransfer;
+	tpriv->handle = transfer->dev_handle;
+	tpriv->run = run;
+	tpriv->result = 0;
+	tpriv->cancelled = 0;
+
+	/* workers are started by the first transfer on their endpoint */
+	usbi_mutex_lock(&async->lock);
+	worker = async->workers[idx];
+	if (worker == NULL) {
+		worker = calloc(1, sizeof(*worker));
+		if (worker == NULL) {
+			usbi_mutex_unlock(&async->lock);
+			return (LIBUSB_ERROR_NO_MEM);
+		}
+
+		list_init(&worker->queue);
+		usbi_mutex_init(&worker->lock, NULL);
+		usbi_cond_init(&worker->cond, NULL);
+		if (usbi_thread_create(&worker->thread, _worker_main,
+		    worker) != 0) {
+			usbi_err(TRANSFER_CTX(transfer),
+			    "failed to create worker for endpoint 0x%02x",
+			    transfer->endpoint);
+			usbi_cond_destroy(&worker->cond);
+			usbi_mutex_destroy(&worker->lock);
+			free(worker);
+			usbi_mutex_unlock(&async->lock);
+			return (LIBUSB_ERROR_OTHER);
+		}
+
+		usbi_dbg("worker for endpoint 0x%02x", transfer->endpoint);
+		async->workers[idx] = worker;
+	}
+	usbi_mutex_unlock(&async->lock);
+
+	usbi_mutex_lock(&worker->lock);
+	list_add_tail(&tpriv->list, &worker->queue);
+	usbi_cond_signal(&worker->cond);
+	usbi_mutex_unlock(&worker->lock);
+
+	return (LIBUSB_SUCCESS);
+}
+
+int
+bsd_async_cancel(struct bsd_async_handle *async,
+    struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer;
+	struct bsd_async_transfer *tpriv, *queued;
+	struct bsd_async_worker *worker;
+	int found = 0, running = 0;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	usbi_mutex_lock(&async->lock);
+	worker = async->workers[_worker_index(transfer)];
+	usbi_mutex_unlock(&async->lock);
+
+	if (worker == NULL)
+		return (LIBUSB_ERROR_NOT_FOUND);
+
+	usbi_mutex_lock(&worker->lock);
+	if (worker->running == tpriv) {
+		/*
+		 * The worker completes it once the blocking call fails. A
+		 * signal that arrives before the call blocks is lost, the
+		 * transfer then ends with its ugen(4) timeout or at close.
+		 */
+		tpriv->cancelled = BSD_ASYNC_INTERRUPTED;
+		pthread_kill(worker->thread, BSD_ASYNC_SIGNAL);
+		running = 1;
+	} else {
+		list_for_each_entry(queued, &worker->queue, list,
+		    struct bsd_async_transfer) {
+			if (queued == tpriv) {
+				list_del(&tpriv->list);
+				tpriv->cancelled = BSD_ASYNC_DEQUEUED;
+				found = 1;
+				break;
+			}
+		}
+	}
+	usbi_mutex_unlock(&worker->lock);
+
+	if (running)
+		return (LIBUSB_SUCCESS);
+	if (!found)
+		return (LIBUSB_ERROR_NOT_FOUND);
+
+	usbi_signal_transfer_completion(itransfer);
+
+	return (LIBUSB_SUCCESS);
+}
+
+int
+bsd_async_handle_completion(struct usbi_transfer *itransfer)
+{
+	struct bsd_async_transfer *tpriv = usbi_transfer_get_os_priv(itransfer);
+	enum libusb_transfer_status status;
+
+	/* an interrupted transfer may have completed before the signal */
+	if (tpriv->cancelled == BSD_ASYNC_DEQUEUED ||
+	    (tpriv->cancelled == BSD_ASYNC_INTERRUPTED &&
+	    tpriv->result != LIBUSB_SUCCESS))
+		return usbi_handle_transfer_cancellation(itransfer);
+
+	switch (tpriv->result) {
+	case LIBUSB_SUCCESS:
+		status = LIBUSB_TRANSFER_COMPLETED;
+		break;
+	case LIBUSB_ERROR_TIMEOUT:
+		status = LIBUSB_TRANSFER_TIMED_OUT;
+		break;
+	case LIBUSB_ERROR_PIPE:
+		status = LIBUSB_TRANSFER_STALL;
+		break;
+	case LIBUSB_ERROR_OVERFLOW:
+		status = LIBUSB_TRANSFER_OVERFLOW;
+		break;
+	case LIBUSB_ERROR_NO_DEVICE:
+		status = LIBUSB_TRANSFER_NO_DEVICE;
+		break;
+	default:
+		status = LIBUSB_TRANSFER_ERROR;
+		break;
+	}
+
+	return usbi_handle_transfer_completion(itransfer, status);
+}
@@ -0,0 +1,64 @@
+/*
+ * Endpoint worker threads for the OpenBSD and NetBSD backends
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_BSD_ASYNC_H
+#define LIBUSB_BSD_ASYNC_H
+
+#include "libusbi.h"
+
+/*
+ * ugen(4) only offers blocking read(2), write(2) and USB_DO_REQUEST. The
+ * transfers of a handle are queued per endpoint address and each endpoint
+ * has a thread running them in order, so that submission does not block,
+ * transfers queue up on an endpoint and endpoints progress independently.
+ * Control transfers share the endpoint 0 worker.
+ */
+
+/* endpoint number plus direction */
+#define BSD_ASYNC_WORKERS	32
+
+struct bsd_async_worker;
+
+struct bsd_async_handle {
+	usbi_mutex_t lock;			/* protects workers */
+	struct bsd_async_worker *workers[BSD_ASYNC_WORKERS];
+};
+
+/* transfer private data of the backends */
+struct bsd_async_transfer {
+	struct list_head list;			/* queued on the worker */
+	struct usbi_transfer *itransfer;
+	struct libusb_device_handle *handle;	/* valid until the workers stop */
+	int (*run)(struct usbi_transfer *,	/* blocking transfer */
+	    struct libusb_device_handle *);
+	int result;				/* LIBUSB_ERROR code of run */
+	int cancelled;				/* BSD_ASYNC_* or 0 */
+};
+
+#define BSD_ASYNC_DEQUEUED	1		/* cancelled before it ran */
+#define BSD_ASYNC_INTERRUPTED	2		/* cancelled while running */
+
+int bsd_async_init(struct bsd_async_handle *);
+void bsd_async_exit(struct bsd_async_handle *);
+
+int bsd_async_submit(struct bsd_async_handle *, struct usbi_transfer *,
+    int (*)(struct usbi_transfer *, struct libusb_device_handle *));
+int bsd_async_cancel(struct bsd_async_handle *, struct usbi_transfer *);
+int bsd_async_handle_completion(struct usbi_transfer *);
+
+#endif
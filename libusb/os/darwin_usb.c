@@ -30,10 +30,8 @@
 #include <fcntl.h>
 #include <libkern/OSAtomic.h>
 
-#include <mach/clock.h>
-#include <mach/clock_types.h>
-#include <mach/mach_host.h>
-#include <mach/mach_port.h>
+#include <sys/time.h>
+#include <mach/mach_time.h>
 
 #include <AvailabilityMacros.h>
 #if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
@@ -46,10 +44,10 @@
 static pthread_mutex_t libusb_darwin_at_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t  libusb_darwin_at_cond = PTHREAD_COND_INITIALIZER;
 
-static clock_serv_t clock_realtime;
-static clock_serv_t clock_monotonic;
+/* converts mach_absolute_time() ticks to nanoseconds */
+static mach_timebase_info_data_t darwin_timebase;
 
-static CFRunLoopRef libusb_darwin_acfl = NULL; /* event cf loop */
+static CFRunLoopRef libusb_darwin_acfl = NULL; /* hotplug cf loop */
 static volatile int32_t initCount = 0;
 
 static usbi_mutex_t darwin_cached_devices_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -68,6 +66,7 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
 
 static int darwin_scan_devices(struct libusb_context *ctx);
 static int process_new_device (struct libusb_context *ctx, io_service_t service);
+static int darwin_cache_configuration (struct libusb_context *ctx, struct darwin_cached_device *dev);
 
 #if defined(ENABLE_LOGGING)
 static const char *darwin_error_str (int result) {
@@ -405,7 +404,8 @@ static void *darwin_event_thread_main (void *arg0) {
   /* signal the main thread that the hotplug runloop has been created. */
   pthread_mutex_lock (&libusb_darwin_at_mutex);
   libusb_darwin_acfl = runloop;
-  pthread_cond_signal (&libusb_darwin_at_cond);
+  /* the cond is shared with the async I/O threads */
+  pthread_cond_broadcast (&libusb_darwin_at_cond);
   pthread_mutex_unlock (&libusb_darwin_at_mutex);
 
   /* run the runloop */
@@ -430,6 +430,76 @@ static void *darwin_event_thread_main (void *arg0) {
   pthread_exit (NULL);
 }
 
+/* performed once from inside CFRunLoopRun (), so that the runloop is only
+ * handed out, and can be stopped, once it is actually running */
+static void darwin_async_keepalive (void *info) {
+  struct darwin_cached_device *dpriv = (struct darwin_cached_device *) info;
+
+  pthread_mutex_lock (&libusb_darwin_at_mutex);
+  if (!dpriv->async_runloop) {
+    dpriv->async_runloop = CFRunLoopGetCurrent ();
+    pthread_cond_broadcast (&libusb_darwin_at_cond);
+  }
+  pthread_mutex_unlock (&libusb_darwin_at_mutex);
+}
+
+/* Each open device completes its async I/O on a runloop of its own, so that
+ * the completions of one device do not queue up behind those of every other
+ * device in the process. The completion callback only hands the transfer to
+ * the context, see usbi_signal_transfer_completion(). */
+static void *darwin_async_thread_main (void *arg0) {
+  struct darwin_cached_device *dpriv = (struct darwin_cached_device *) arg0;
+  CFRunLoopSourceContext keepalive_context;
+  CFRunLoopSourceRef keepalive;
+  CFRunLoopRef runloop;
+
+#if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
+  pthread_setname_np ("org.libusb.async-io");
+  objc_registerThreadWithCollector();
+#endif
+
+  runloop = CFRunLoopGetCurrent ();
+  CFRetain (runloop);
+
+  /* a runloop without sources returns at once. the device's sources are only
+   * added once the thread is running */
+  memset (&keepalive_context, 0, sizeof (keepalive_context));
+  keepalive_context.info = dpriv;
+  keepalive_context.perform = darwin_async_keepalive;
+  keepalive = CFRunLoopSourceCreate (NULL, 0, &keepalive_context);
+  CFRunLoopAddSource (runloop, keepalive, kCFRunLoopDefaultMode);
+
+  /* a CFRunLoopStop () issued before CFRunLoopRun () would be lost, so the
+   * starting thread waits for the keepalive source to be performed */
+  CFRunLoopSourceSignal (keepalive);
+  CFRunLoopRun ();
+
+  CFRunLoopRemoveSource (runloop, keepalive, kCFRunLoopDefaultMode);
+  CFRelease (keepalive);
+  CFRelease (runloop);
+
+  pthread_exit (NULL);
+}
+
+static int darwin_start_async_thread (struct darwin_cached_device *dpriv) {
+  dpriv->async_runloop = NULL;
+  if (pthread_create (&dpriv->async_thread, NULL, darwin_async_thread_main, dpriv))
+    return LIBUSB_ERROR_OTHER;
+
+  pthread_mutex_lock (&libusb_darwin_at_mutex);
+  while (!dpriv->async_runloop)
+    pthread_cond_wait (&libusb_darwin_at_cond, &libusb_darwin_at_mutex);
+  pthread_mutex_unlock (&libusb_darwin_at_mutex);
+
+  return LIBUSB_SUCCESS;
+}
+
+static void darwin_stop_async_thread (struct darwin_cached_device *dpriv) {
+  CFRunLoopStop (dpriv->async_runloop);
+  pthread_join (dpriv->async_thread, NULL);
+  dpriv->async_runloop = NULL;
+}
+
 /* cleanup function to destroy cached devices */
 static void __attribute__((destructor)) _darwin_finalize(void) {
   struct darwin_cached_device *dev, *next;
@@ -442,7 +512,6 @@ static void __attribute__((destructor)) _darwin_finalize(void) {
 }
 
 static int darwin_init(struct libusb_context *ctx) {
-  host_name_port_t host_self;
   int rc;
 
   rc = darwin_scan_devices (ctx);
@@ -451,12 +520,7 @@ static int darwin_init(struct libusb_context *ctx) {
   }
 
   if (OSAtomicIncrement32Barrier(&initCount) == 1) {
-    /* create the clocks that will be used */
-
-    host_self = mach_host_self();
-    host_get_clock_service(host_self, CALENDAR_CLOCK, &clock_realtime);
-    host_get_clock_service(host_self, SYSTEM_CLOCK, &clock_monotonic);
-    mach_port_deallocate(mach_task_self(), host_self);
+    mach_timebase_info (&darwin_timebase);
 
     pthread_create (&libusb_darwin_at, NULL, darwin_event_thread_main, ctx);
 
@@ -471,9 +535,6 @@ static int darwin_init(struct libusb_context *ctx) {
 
 static void darwin_exit (void) {
   if (OSAtomicDecrement32Barrier(&initCount) == 0) {
-    mach_port_deallocate(mach_task_self(), clock_realtime);
-    mach_port_deallocate(mach_task_self(), clock_monotonic);
-
     /* stop the event runloop and wait for the thread to terminate. */
     CFRunLoopStop (libusb_darwin_acfl);
     pthread_join (libusb_darwin_at, NULL);
@@ -515,7 +576,11 @@ static int get_configuration_index (struct libusb_device *dev, int config_value)
 
 static int darwin_get_active_config_descriptor(struct libusb_device *dev, unsigned char *buffer, size_t len, int *host_endian) {
   struct darwin_cached_device *priv = DARWIN_CACHED_DEVICE(dev);
-  int config_index;
+  int config_index, ret;
+
+  ret = darwin_cache_configuration (DEVICE_CTX (dev), priv);
+  if (ret)
+    return ret;
 
   if (0 == priv->active_config)
     return LIBUSB_ERROR_NOT_FOUND;
@@ -556,7 +621,8 @@ static int darwin_get_config_descriptor(struct libusb_device *dev, uint8_t confi
 }
 
 /* check whether the os has configured the device */
-static int darwin_check_configuration (struct libusb_context *ctx, struct darwin_cached_device *dev) {
+static int darwin_check_configuration (struct libusb_context *ctx, struct darwin_cached_device *dev,
+                                       UInt8 *first_config, UInt8 *active_config) {
   usb_device_t **darwin_device = dev->device;
 
   IOUSBConfigurationDescriptorPtr configDesc;
@@ -565,14 +631,9 @@ static int darwin_check_configuration (struct libusb_context *ctx, struct darwin
   io_iterator_t             interface_iterator;
   io_service_t              firstInterface;
 
-  if (dev->dev_descriptor.bNumConfigurations < 1) {
-    usbi_err (ctx, "device has no configurations");
-    return LIBUSB_ERROR_OTHER; /* no configurations at this speed so we can't use it */
-  }
-
   /* find the first configuration */
   kresult = (*darwin_device)->GetConfigurationDescriptorPtr (darwin_device, 0, &configDesc);
-  dev->first_config = (kIOReturnSuccess == kresult) ? configDesc->bConfigurationValue : 1;
+  *first_config = (kIOReturnSuccess == kresult) ? configDesc->bConfigurationValue : 1;
 
   /* check if the device is already configured. there is probably a better way than iterating over the
      to accomplish this (the trick is we need to avoid a call to GetConfigurations since buggy devices
@@ -600,15 +661,42 @@ static int darwin_check_configuration (struct libusb_context *ctx, struct darwin
     /* device is configured */
     if (dev->dev_descriptor.bNumConfigurations == 1)
       /* to avoid problems with some devices get the configurations value from the configuration descriptor */
-      dev->active_config = dev->first_config;
+      *active_config = *first_config;
     else
       /* devices with more than one configuration should work with GetConfiguration */
-      (*darwin_device)->GetConfiguration (darwin_device, &dev->active_config);
+      (*darwin_device)->GetConfiguration (darwin_device, active_config);
   } else
     /* not configured */
-    dev->active_config = 0;
+    *active_config = 0;
   
-  usbi_dbg ("active config: %u, first config: %u", dev->active_config, dev->first_config);
+  usbi_dbg ("active config: %u, first config: %u", *active_config, *first_config);
+
+  return 0;
+}
+
+/* darwin_check_configuration talks to the device so it is deferred until the configuration is first needed. the
+ * lock is only held to read and store the result, threads racing on an uncached device may both ask it */
+static int darwin_cache_configuration (struct libusb_context *ctx, struct darwin_cached_device *dev) {
+  UInt8 first_config = 0, active_config = 0;
+  int cached, ret;
+
+  usbi_mutex_lock(&darwin_cached_devices_lock);
+  cached = dev->config_cached;
+  usbi_mutex_unlock(&darwin_cached_devices_lock);
+  if (cached)
+    return 0;
+
+  ret = darwin_check_configuration (ctx, dev, &first_config, &active_config);
+  if (ret)
+    return ret;
+
+  usbi_mutex_lock(&darwin_cached_devices_lock);
+  if (!dev->config_cached) {
+    dev->first_config = first_config;
+    dev->active_config = active_config;
+    dev->config_cached = 1;
+  }
+  usbi_mutex_unlock(&darwin_cached_devices_lock);
 
   return 0;
 }
@@ -631,7 +719,38 @@ static int darwin_request_descriptor (usb_device_t **device, UInt8 desc, UInt8 d
   return (*device)->DeviceRequestTO (device, &req);
 }
 
-static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct darwin_cached_device *dev) {
+/* Fill in a device descriptor from the properties IOUSBFamily publishes in the IORegistry. Returns 1 if all of
+ * them were found, 0 otherwise. */
+static int darwin_device_descriptor_from_ioregistry (io_service_t service, IOUSBDeviceDescriptor *desc) {
+  UInt16 bcdUSB, idVendor, idProduct, bcdDevice;
+
+  if (!get_ioregistry_value_number (service, CFSTR("bcdUSB"), kCFNumberSInt16Type, &bcdUSB) ||
+      !get_ioregistry_value_number (service, CFSTR("bDeviceClass"), kCFNumberSInt8Type, &desc->bDeviceClass) ||
+      !get_ioregistry_value_number (service, CFSTR("bDeviceSubClass"), kCFNumberSInt8Type, &desc->bDeviceSubClass) ||
+      !get_ioregistry_value_number (service, CFSTR("bDeviceProtocol"), kCFNumberSInt8Type, &desc->bDeviceProtocol) ||
+      !get_ioregistry_value_number (service, CFSTR("bMaxPacketSize0"), kCFNumberSInt8Type, &desc->bMaxPacketSize0) ||
+      !get_ioregistry_value_number (service, CFSTR("idVendor"), kCFNumberSInt16Type, &idVendor) ||
+      !get_ioregistry_value_number (service, CFSTR("idProduct"), kCFNumberSInt16Type, &idProduct) ||
+      !get_ioregistry_value_number (service, CFSTR("bcdDevice"), kCFNumberSInt16Type, &bcdDevice) ||
+      !get_ioregistry_value_number (service, CFSTR("iManufacturer"), kCFNumberSInt8Type, &desc->iManufacturer) ||
+      !get_ioregistry_value_number (service, CFSTR("iProduct"), kCFNumberSInt8Type, &desc->iProduct) ||
+      !get_ioregistry_value_number (service, CFSTR("iSerialNumber"), kCFNumberSInt8Type, &desc->iSerialNumber) ||
+      !get_ioregistry_value_number (service, CFSTR("bNumConfigurations"), kCFNumberSInt8Type, &desc->bNumConfigurations))
+    return 0;
+
+  /* the cached descriptor is kept in bus order */
+  desc->bLength         = LIBUSB_DT_DEVICE_SIZE;
+  desc->bDescriptorType = kUSBDeviceDesc;
+  desc->bcdUSB          = libusb_cpu_to_le16 (bcdUSB);
+  desc->idVendor        = libusb_cpu_to_le16 (idVendor);
+  desc->idProduct       = libusb_cpu_to_le16 (idProduct);
+  desc->bcdDevice       = libusb_cpu_to_le16 (bcdDevice);
+
+  return 1;
+}
+
+static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct darwin_cached_device *dev,
+                                           io_service_t service) {
   usb_device_t **device = dev->device;
   int retries = 1, delay = 30000;
   int unsuspended = 0, try_unsuspend = 1, try_reconfigure = 1;
@@ -646,80 +765,87 @@ static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct da
   (*device)->GetDeviceProduct (device, &idProduct);
   (*device)->GetDeviceVendor (device, &idVendor);
 
-  /* According to Apple's documentation the device must be open for DeviceRequest but we may not be able to open some
-   * devices and Apple's USB Prober doesn't bother to open the device before issuing a descriptor request.  Still,
-   * to follow the spec as closely as possible, try opening the device */
-  is_open = ((*device)->USBDeviceOpenSeize(device) == kIOReturnSuccess);
+  if (darwin_device_descriptor_from_ioregistry (service, &dev->dev_descriptor) &&
+      0 != dev->dev_descriptor.bNumConfigurations && 0 != dev->dev_descriptor.bcdUSB) {
+    /* IOUSBFamily already read the descriptor when the device was attached. no need to talk to the device */
+    usbi_dbg ("using device descriptor from the IORegistry");
+    ret = kIOReturnSuccess;
+  } else {
+    /* According to Apple's documentation the device must be open for DeviceRequest but we may not be able to open some
+     * devices and Apple's USB Prober doesn't bother to open the device before issuing a descriptor request.  Still,
+     * to follow the spec as closely as possible, try opening the device */
+    is_open = ((*device)->USBDeviceOpenSeize(device) == kIOReturnSuccess);
 
-  do {
-    /**** retrieve device descriptor ****/
-    ret = darwin_request_descriptor (device, kUSBDeviceDesc, 0, &dev->dev_descriptor, sizeof(dev->dev_descriptor));
+    do {
+      /**** retrieve device descriptor ****/
+      ret = darwin_request_descriptor (device, kUSBDeviceDesc, 0, &dev->dev_descriptor, sizeof(dev->dev_descriptor));
 
-    if (kIOReturnOverrun == ret && kUSBDeviceDesc == dev->dev_descriptor.bDescriptorType)
-      /* received an overrun error but we still received a device descriptor */
-      ret = kIOReturnSuccess;
+      if (kIOReturnOverrun == ret && kUSBDeviceDesc == dev->dev_descriptor.bDescriptorType)
+        /* received an overrun error but we still received a device descriptor */
+        ret = kIOReturnSuccess;
 
-    if (kIOUSBVendorIDAppleComputer == idVendor) {
-      /* NTH: don't bother retrying or unsuspending Apple devices */
-      break;
-    }
+      if (kIOUSBVendorIDAppleComputer == idVendor) {
+        /* NTH: don't bother retrying or unsuspending Apple devices */
+        break;
+      }
 
-    if (kIOReturnSuccess == ret && (0 == dev->dev_descriptor.bNumConfigurations ||
-                                    0 == dev->dev_descriptor.bcdUSB)) {
-      /* work around for incorrectly configured devices */
-      if (try_reconfigure && is_open) {
-        usbi_dbg("descriptor appears to be invalid. resetting configuration before trying again...");
+      if (kIOReturnSuccess == ret && (0 == dev->dev_descriptor.bNumConfigurations ||
+                                      0 == dev->dev_descriptor.bcdUSB)) {
+        /* work around for incorrectly configured devices */
+        if (try_reconfigure && is_open) {
+          usbi_dbg("descriptor appears to be invalid. resetting configuration before trying again...");
 
-        /* set the first configuration */
-        (*device)->SetConfiguration(device, 1);
+          /* set the first configuration */
+          (*device)->SetConfiguration(device, 1);
 
-        /* don't try to reconfigure again */
-        try_reconfigure = 0;
-      }
+          /* don't try to reconfigure again */
+          try_reconfigure = 0;
+        }
 
-      ret = kIOUSBPipeStalled;
-    }
+        ret = kIOUSBPipeStalled;
+      }
 
-    if (kIOReturnSuccess != ret && is_open && try_unsuspend) {
-      /* device may be suspended. unsuspend it and try again */
+      if (kIOReturnSuccess != ret && is_open && try_unsuspend) {
+        /* device may be suspended. unsuspend it and try again */
 #if DeviceVersion >= 320
-      UInt32 info = 0;
+        UInt32 info = 0;
 
-      /* IOUSBFamily 320+ provides a way to detect device suspension but earlier versions do not */
-      (void)(*device)->GetUSBDeviceInformation (device, &info);
+        /* IOUSBFamily 320+ provides a way to detect device suspension but earlier versions do not */
+        (void)(*device)->GetUSBDeviceInformation (device, &info);
 
-      /* note that the device was suspended */
-      if (info & (1 << kUSBInformationDeviceIsSuspendedBit) || 0 == info)
-        try_unsuspend = 1;
+        /* note that the device was suspended */
+        if (info & (1 << kUSBInformationDeviceIsSuspendedBit) || 0 == info)
+          try_unsuspend = 1;
 #endif
 
-      if (try_unsuspend) {
-        /* try to unsuspend the device */
-        ret2 = (*device)->USBDeviceSuspend (device, 0);
-        if (kIOReturnSuccess != ret2) {
-          /* prevent log spew from poorly behaving devices.  this indicates the
-             os actually had trouble communicating with the device */
-          usbi_dbg("could not retrieve device descriptor. failed to unsuspend: %s",darwin_error_str(ret2));
-        } else
-          unsuspended = 1;
-
-        try_unsuspend = 0;
+        if (try_unsuspend) {
+          /* try to unsuspend the device */
+          ret2 = (*device)->USBDeviceSuspend (device, 0);
+          if (kIOReturnSuccess != ret2) {
+            /* prevent log spew from poorly behaving devices.  this indicates the
+               os actually had trouble communicating with the device */
+            usbi_dbg("could not retrieve device descriptor. failed to unsuspend: %s",darwin_error_str(ret2));
+          } else
+            unsuspended = 1;
+
+          try_unsuspend = 0;
+        }
       }
-    }
 
-    if (kIOReturnSuccess != ret) {
-      usbi_dbg("kernel responded with code: 0x%08x. sleeping for %d ms before trying again", ret, delay/1000);
-      /* sleep for a little while before trying again */
-      usleep (delay);
-    }
-  } while (kIOReturnSuccess != ret && retries--);
+      if (kIOReturnSuccess != ret) {
+        usbi_dbg("kernel responded with code: 0x%08x. sleeping for %d ms before trying again", ret, delay/1000);
+        /* sleep for a little while before trying again */
+        usleep (delay);
+      }
+    } while (kIOReturnSuccess != ret && retries--);
 
-  if (unsuspended)
-    /* resuspend the device */
-    (void)(*device)->USBDeviceSuspend (device, 1);
+    if (unsuspended)
+      /* resuspend the device */
+      (void)(*device)->USBDeviceSuspend (device, 1);
 
-  if (is_open)
-    (void) (*device)->USBDeviceClose (device);
+    if (is_open)
+      (void) (*device)->USBDeviceClose (device);
+  }
 
   if (ret != kIOReturnSuccess) {
     /* a debug message was already printed out for this error */
@@ -828,7 +954,7 @@ static int darwin_get_cached_device(struct libusb_context *ctx, io_service_t ser
     new_device->parent_session = parent_sessionID;
 
     /* cache the device descriptor */
-    ret = darwin_cache_device_descriptor(ctx, new_device);
+    ret = darwin_cache_device_descriptor(ctx, new_device, service);
     if (ret)
       break;
 
@@ -863,11 +989,13 @@ static int process_new_device (struct libusb_context *ctx, io_service_t service)
       return ret;
     }
 
-    /* check current active configuration (and cache the first configuration value--
-       which may be used by claim_interface) */
-    ret = darwin_check_configuration (ctx, cached_device);
-    if (ret)
+    /* the active and first configuration values are looked up when first needed (see
+       darwin_cache_configuration) */
+    if (cached_device->dev_descriptor.bNumConfigurations < 1) {
+      usbi_err (ctx, "device has no configurations");
+      ret = LIBUSB_ERROR_OTHER; /* no configurations at this speed so we can't use it */
       break;
+    }
 
     usbi_dbg ("allocating new device in context %p for with session 0x%" PRIx64,
               ctx, cached_device->session);
@@ -962,11 +1090,25 @@ static int darwin_open (struct libusb_device_handle *dev_handle) {
       priv->is_open = 1;
     }
 
+    if (darwin_start_async_thread (dpriv) != LIBUSB_SUCCESS) {
+      usbi_err (HANDLE_CTX (dev_handle), "could not start async I/O thread");
+
+      if (priv->is_open) {
+        (*(dpriv->device))->USBDeviceClose (dpriv->device);
+      }
+
+      priv->is_open = 0;
+
+      return LIBUSB_ERROR_OTHER;
+    }
+
     /* create async event source */
     kresult = (*(dpriv->device))->CreateDeviceAsyncEventSource (dpriv->device, &priv->cfSource);
     if (kresult != kIOReturnSuccess) {
       usbi_err (HANDLE_CTX (dev_handle), "CreateDeviceAsyncEventSource: %s", darwin_error_str(kresult));
 
+      darwin_stop_async_thread (dpriv);
+
       if (priv->is_open) {
         (*(dpriv->device))->USBDeviceClose (dpriv->device);
       }
@@ -976,12 +1118,13 @@ static int darwin_open (struct libusb_device_handle *dev_handle) {
       return darwin_to_libusb (kresult);
     }
 
-    CFRetain (libusb_darwin_acfl);
-
-    /* add the cfSource to the aync run loop */
-    CFRunLoopAddSource(libusb_darwin_acfl, priv->cfSource, kCFRunLoopCommonModes);
+    /* add the cfSource to the device's async run loop */
+    CFRunLoopAddSource(dpriv->async_runloop, priv->cfSource, kCFRunLoopDefaultMode);
   }
 
+  usbi_mutex_init (&priv->dev_mem_lock, NULL);
+  list_init (&priv->dev_mem);
+
   /* device opened successfully */
   dpriv->open_count++;
 
@@ -1009,15 +1152,19 @@ static void darwin_close (struct libusb_device_handle *dev_handle) {
     if (dev_handle->claimed_interfaces & (1 << i))
       libusb_release_interface (dev_handle, i);
 
+  /* releasing the interfaces destroyed any device memory left */
+  usbi_mutex_destroy (&priv->dev_mem_lock);
+
   if (0 == dpriv->open_count) {
     /* delete the device's async event source */
     if (priv->cfSource) {
-      CFRunLoopRemoveSource (libusb_darwin_acfl, priv->cfSource, kCFRunLoopDefaultMode);
+      CFRunLoopRemoveSource (dpriv->async_runloop, priv->cfSource, kCFRunLoopDefaultMode);
       CFRelease (priv->cfSource);
       priv->cfSource = NULL;
-      CFRelease (libusb_darwin_acfl);
     }
 
+    darwin_stop_async_thread (dpriv);
+
     if (priv->is_open) {
       /* close the device */
       kresult = (*(dpriv->device))->USBDeviceClose(dpriv->device);
@@ -1032,6 +1179,11 @@ static void darwin_close (struct libusb_device_handle *dev_handle) {
 
 static int darwin_get_configuration(struct libusb_device_handle *dev_handle, int *config) {
   struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
+  int ret;
+
+  ret = darwin_cache_configuration (HANDLE_CTX (dev_handle), dpriv);
+  if (ret)
+    return ret;
 
   *config = (int) dpriv->active_config;
 
@@ -1159,7 +1311,8 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
     return darwin_to_libusb (kresult);
 
   /* make sure we have an interface */
-  if (!usbInterface && dpriv->first_config != 0) {
+  if (!usbInterface && 0 == darwin_cache_configuration (HANDLE_CTX (dev_handle), dpriv) &&
+      dpriv->first_config != 0) {
     usbi_info (HANDLE_CTX (dev_handle), "no interface found; setting configuration: %d", dpriv->first_config);
 
     /* set the configuration */
@@ -1239,14 +1392,142 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
     return darwin_to_libusb (kresult);
   }
 
-  /* add the cfSource to the async thread's run loop */
-  CFRunLoopAddSource(libusb_darwin_acfl, cInterface->cfSource, kCFRunLoopDefaultMode);
+  /* add the cfSource to the device's async run loop */
+  CFRunLoopAddSource(DARWIN_CACHED_DEVICE(dev_handle->dev)->async_runloop, cInterface->cfSource,
+                     kCFRunLoopDefaultMode);
 
   usbi_dbg ("interface opened");
 
   return 0;
 }
 
+/* find the device memory block holding [buffer, buffer + length). called with dev_mem_lock held */
+static struct darwin_dev_mem *darwin_find_dev_mem (struct darwin_device_handle_priv *priv, unsigned char *buffer,
+                                                   size_t length) {
+  struct darwin_dev_mem *mem;
+
+  list_for_each_entry (mem, &priv->dev_mem, list, struct darwin_dev_mem) {
+    if (buffer >= mem->buffer && buffer + length <= mem->buffer + mem->length)
+      return mem;
+  }
+
+  return NULL;
+}
+
+/* low-latency buffers belong to the interface they were created on and go away when it is closed */
+static void darwin_destroy_ll_buffers (struct libusb_device_handle *dev_handle, int iface) {
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
+  struct darwin_interface *cInterface = &priv->interfaces[iface];
+  struct darwin_dev_mem *mem, *next;
+  struct darwin_ll_framelist *framelist;
+
+  usbi_mutex_lock (&priv->dev_mem_lock);
+
+  list_for_each_entry_safe (mem, next, &priv->dev_mem, list, struct darwin_dev_mem) {
+    if (mem->iface != iface)
+      continue;
+
+    usbi_warn (HANDLE_CTX (dev_handle), "device memory %p still allocated while releasing interface %d", mem->buffer, iface);
+
+    (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, mem->buffer);
+    list_del (&mem->list);
+    free (mem);
+  }
+
+  while (NULL != (framelist = cInterface->ll_framelists)) {
+    cInterface->ll_framelists = framelist->next;
+    (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, framelist->frames);
+    free (framelist);
+  }
+
+  usbi_mutex_unlock (&priv->dev_mem_lock);
+}
+
+static unsigned char *darwin_dev_mem_alloc (struct libusb_device_handle *dev_handle, size_t len) {
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
+  struct darwin_interface *cInterface = NULL;
+  UInt32 buffer_type = kUSBLowLatencyWriteBuffer;
+  struct darwin_dev_mem *mem;
+  void *buffer = NULL;
+  IOReturn kresult;
+  int iface, i;
+
+  /* low-latency buffers are created by an interface. use the first one claimed */
+  for (iface = 0 ; iface < USB_MAXINTERFACES ; iface++) {
+    if ((dev_handle->claimed_interfaces & (1 << iface)) && priv->interfaces[iface].interface) {
+      cInterface = &priv->interfaces[iface];
+      break;
+    }
+  }
+
+  if (NULL == cInterface) {
+    usbi_dbg ("device memory needs a claimed interface");
+    return NULL;
+  }
+
+  /* the memory is wired for one direction. use IN if the interface has an IN endpoint */
+  for (i = 0 ; i < cInterface->num_endpoints ; i++) {
+    if (cInterface->endpoint_addrs[i] & LIBUSB_ENDPOINT_IN) {
+      buffer_type = kUSBLowLatencyReadBuffer;
+      break;
+    }
+  }
+
+  mem = calloc (1, sizeof (*mem));
+  if (NULL == mem)
+    return NULL;
+
+  kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, &buffer, len, buffer_type);
+  if (kresult != kIOReturnSuccess) {
+    usbi_warn (HANDLE_CTX (dev_handle), "LowLatencyCreateBuffer: %s", darwin_error_str(kresult));
+    free (mem);
+    return NULL;
+  }
+
+  mem->buffer = buffer;
+  mem->length = len;
+  mem->iface = iface;
+  mem->buffer_type = buffer_type;
+
+  usbi_mutex_lock (&priv->dev_mem_lock);
+  list_add_tail (&mem->list, &priv->dev_mem);
+  usbi_mutex_unlock (&priv->dev_mem_lock);
+
+  usbi_dbg ("%lu bytes of %s device memory on interface %d", (unsigned long) len,
+            kUSBLowLatencyReadBuffer == buffer_type ? "IN" : "OUT", iface);
+
+  return mem->buffer;
+}
+
+static int darwin_dev_mem_free (struct libusb_device_handle *dev_handle, unsigned char *buffer, size_t len) {
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
+  struct darwin_interface *cInterface;
+  struct darwin_dev_mem *mem;
+  IOReturn kresult;
+
+  usbi_mutex_lock (&priv->dev_mem_lock);
+
+  mem = darwin_find_dev_mem (priv, buffer, len);
+  if (NULL == mem || mem->buffer != buffer) {
+    usbi_mutex_unlock (&priv->dev_mem_lock);
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  list_del (&mem->list);
+
+  cInterface = &priv->interfaces[mem->iface];
+  kresult = (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, mem->buffer);
+
+  usbi_mutex_unlock (&priv->dev_mem_lock);
+
+  free (mem);
+
+  if (kresult != kIOReturnSuccess)
+    usbi_warn (HANDLE_CTX (dev_handle), "LowLatencyDestroyBuffer: %s", darwin_error_str(kresult));
+
+  return darwin_to_libusb (kresult);
+}
+
 static int darwin_release_interface(struct libusb_device_handle *dev_handle, int iface) {
   struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
   IOReturn kresult;
@@ -1258,12 +1539,15 @@ static int darwin_release_interface(struct libusb_device_handle *dev_handle, int
   if (!cInterface->interface)
     return LIBUSB_SUCCESS;
 
+  darwin_destroy_ll_buffers (dev_handle, iface);
+
   /* clean up endpoint data */
   cInterface->num_endpoints = 0;
 
   /* delete the interface's async event source */
   if (cInterface->cfSource) {
-    CFRunLoopRemoveSource (libusb_darwin_acfl, cInterface->cfSource, kCFRunLoopDefaultMode);
+    CFRunLoopRemoveSource (DARWIN_CACHED_DEVICE(dev_handle->dev)->async_runloop, cInterface->cfSource,
+                           kCFRunLoopDefaultMode);
     CFRelease (cInterface->cfSource);
   }
 
@@ -1438,6 +1722,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer) {
   /* None of the values below are used in libusbx for bulk transfers */
   uint8_t                direction, number, interval, pipeRef;
   uint16_t               maxPacketSize;
+  UInt32                 timeout = usbi_transfer_timeout_ms(transfer);
 
   struct darwin_interface *cInterface;
 
@@ -1471,15 +1756,15 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer) {
       ret = (*(cInterface->interface))->WritePipeAsync(cInterface->interface, pipeRef, transfer->buffer,
                                                        transfer->length, darwin_async_io_callback, itransfer);
   } else {
-    itransfer->flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
+    usbi_atomic_or(&itransfer->flags, USBI_TRANSFER_OS_HANDLES_TIMEOUT);
 
     if (IS_XFERIN(transfer))
       ret = (*(cInterface->interface))->ReadPipeAsyncTO(cInterface->interface, pipeRef, transfer->buffer,
-                                                        transfer->length, transfer->timeout, transfer->timeout,
+                                                        transfer->length, timeout, timeout,
                                                         darwin_async_io_callback, (void *)itransfer);
     else
       ret = (*(cInterface->interface))->WritePipeAsyncTO(cInterface->interface, pipeRef, transfer->buffer,
-                                                         transfer->length, transfer->timeout, transfer->timeout,
+                                                         transfer->length, timeout, timeout,
                                                          darwin_async_io_callback, (void *)itransfer);
   }
 
@@ -1494,6 +1779,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer) {
 static int submit_stream_transfer(struct usbi_transfer *itransfer) {
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_interface *cInterface;
+  UInt32 timeout = usbi_transfer_timeout_ms(transfer);
   uint8_t pipeRef;
   IOReturn ret;
 
@@ -1503,16 +1789,16 @@ static int submit_stream_transfer(struct usbi_transfer *itransfer) {
     return LIBUSB_ERROR_NOT_FOUND;
   }
 
-  itransfer->flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
+  usbi_atomic_or(&itransfer->flags, USBI_TRANSFER_OS_HANDLES_TIMEOUT);
 
   if (IS_XFERIN(transfer))
     ret = (*(cInterface->interface))->ReadStreamsPipeAsyncTO(cInterface->interface, pipeRef, itransfer->stream_id,
-                                                             transfer->buffer, transfer->length, transfer->timeout,
-                                                             transfer->timeout, darwin_async_io_callback, (void *)itransfer);
+                                                             transfer->buffer, transfer->length, timeout,
+                                                             timeout, darwin_async_io_callback, (void *)itransfer);
   else
     ret = (*(cInterface->interface))->WriteStreamsPipeAsyncTO(cInterface->interface, pipeRef, itransfer->stream_id,
-                                                              transfer->buffer, transfer->length, transfer->timeout,
-                                                              transfer->timeout, darwin_async_io_callback, (void *)itransfer);
+                                                              transfer->buffer, transfer->length, timeout,
+                                                              timeout, darwin_async_io_callback, (void *)itransfer);
 
   if (ret)
     usbi_err (TRANSFER_CTX (transfer), "bulk stream transfer failed (dir = %s): %s (code = 0x%08x)", IS_XFERIN(transfer) ? "In" : "Out",
@@ -1522,6 +1808,94 @@ static int submit_stream_transfer(struct usbi_transfer *itransfer) {
 }
 #endif
 
+/* a transfer whose buffer is device memory of its interface gets a wired frame list, so the
+ * low-latency calls can skip the memory preparation done for every ReadIsochPipeAsync */
+static void darwin_get_ll_framelist (struct usbi_transfer *itransfer, struct darwin_interface *cInterface) {
+  struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+  struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)transfer->dev_handle->os_priv;
+  struct darwin_ll_framelist *framelist, **prev;
+  struct darwin_dev_mem *mem;
+  void *frames = NULL;
+  IOReturn kresult;
+
+  tpriv->ll_framelist = NULL;
+
+  usbi_mutex_lock (&priv->dev_mem_lock);
+
+  mem = darwin_find_dev_mem (priv, transfer->buffer, transfer->length);
+  if (NULL == mem || &priv->interfaces[mem->iface] != cInterface ||
+      mem->buffer_type != (IS_XFERIN(transfer) ? kUSBLowLatencyReadBuffer : kUSBLowLatencyWriteBuffer)) {
+    usbi_mutex_unlock (&priv->dev_mem_lock);
+    return;
+  }
+
+  for (prev = &cInterface->ll_framelists ; NULL != (framelist = *prev) ; prev = &framelist->next) {
+    if (framelist->num_frames >= transfer->num_iso_packets) {
+      *prev = framelist->next;
+      break;
+    }
+  }
+
+  usbi_mutex_unlock (&priv->dev_mem_lock);
+
+  if (NULL == framelist) {
+    framelist = calloc (1, sizeof (*framelist));
+    if (NULL == framelist)
+      return;
+
+    kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, &frames,
+                                                                  transfer->num_iso_packets * sizeof (IOUSBLowLatencyIsocFrame),
+                                                                  kUSBLowLatencyFrameListBuffer);
+    if (kresult != kIOReturnSuccess) {
+      /* fall back on the regular calls */
+      usbi_dbg ("LowLatencyCreateBuffer: %s", darwin_error_str(kresult));
+      free (framelist);
+      return;
+    }
+
+    framelist->interface = cInterface->interface;
+    framelist->frames = frames;
+    framelist->num_frames = transfer->num_iso_packets;
+  }
+
+  tpriv->ll_framelist = framelist;
+}
+
+static void darwin_put_ll_framelist (struct usbi_transfer *itransfer) {
+  struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+  struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)transfer->dev_handle->os_priv;
+  struct darwin_ll_framelist *framelist = tpriv->ll_framelist;
+  struct darwin_interface *cInterface = NULL;
+  int iface;
+
+  if (NULL == framelist)
+    return;
+
+  tpriv->ll_framelist = NULL;
+
+  usbi_mutex_lock (&priv->dev_mem_lock);
+
+  for (iface = 0 ; iface < USB_MAXINTERFACES ; iface++) {
+    if (priv->interfaces[iface].interface == framelist->interface) {
+      cInterface = &priv->interfaces[iface];
+      break;
+    }
+  }
+
+  if (cInterface) {
+    framelist->next = cInterface->ll_framelists;
+    cInterface->ll_framelists = framelist;
+    framelist = NULL;
+  }
+
+  usbi_mutex_unlock (&priv->dev_mem_lock);
+
+  /* the interface was released while the transfer was in flight and took the frame list with it */
+  free (framelist);
+}
+
 static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
@@ -1535,23 +1909,6 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
 
   struct darwin_interface *cInterface;
 
-  /* construct an array of IOUSBIsocFrames, reuse the old one if possible */
-  if (tpriv->isoc_framelist && tpriv->num_iso_packets != transfer->num_iso_packets) {
-    free(tpriv->isoc_framelist);
-    tpriv->isoc_framelist = NULL;
-  }
-
-  if (!tpriv->isoc_framelist) {
-    tpriv->num_iso_packets = transfer->num_iso_packets;
-    tpriv->isoc_framelist = (IOUSBIsocFrame*) calloc (transfer->num_iso_packets, sizeof(IOUSBIsocFrame));
-    if (!tpriv->isoc_framelist)
-      return LIBUSB_ERROR_NO_MEM;
-  }
-
-  /* copy the frame list from the libusb descriptor (the structures differ only is member order) */
-  for (i = 0 ; i < transfer->num_iso_packets ; i++)
-    tpriv->isoc_framelist[i].frReqCount = transfer->iso_packet_desc[i].length;
-
   /* determine the interface/endpoint to use */
   if (ep_to_pipeRef (transfer->dev_handle, transfer->endpoint, &pipeRef, NULL, &cInterface) != 0) {
     usbi_err (TRANSFER_CTX (transfer), "endpoint not found on any open interface");
@@ -1559,6 +1916,32 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
     return LIBUSB_ERROR_NOT_FOUND;
   }
 
+  darwin_get_ll_framelist (itransfer, cInterface);
+
+  if (tpriv->ll_framelist) {
+    for (i = 0 ; i < transfer->num_iso_packets ; i++) {
+      tpriv->ll_framelist->frames[i].frReqCount = transfer->iso_packet_desc[i].length;
+      tpriv->ll_framelist->frames[i].frActCount = 0;
+    }
+  } else {
+    /* construct an array of IOUSBIsocFrames, reuse the old one if possible */
+    if (tpriv->isoc_framelist && tpriv->num_iso_packets != transfer->num_iso_packets) {
+      free(tpriv->isoc_framelist);
+      tpriv->isoc_framelist = NULL;
+    }
+
+    if (!tpriv->isoc_framelist) {
+      tpriv->num_iso_packets = transfer->num_iso_packets;
+      tpriv->isoc_framelist = (IOUSBIsocFrame*) calloc (transfer->num_iso_packets, sizeof(IOUSBIsocFrame));
+      if (!tpriv->isoc_framelist)
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    /* copy the frame list from the libusb descriptor (the structures differ only is member order) */
+    for (i = 0 ; i < transfer->num_iso_packets ; i++)
+      tpriv->isoc_framelist[i].frReqCount = transfer->iso_packet_desc[i].length;
+  }
+
   /* determine the properties of this endpoint and the speed of the device */
   (*(cInterface->interface))->GetPipeProperties (cInterface->interface, pipeRef, &direction, &number,
                                                  &transferType, &maxPacketSize, &interval);
@@ -1569,13 +1952,11 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
     usbi_err (TRANSFER_CTX (transfer), "failed to get bus frame number: %d", kresult);
     free(tpriv->isoc_framelist);
     tpriv->isoc_framelist = NULL;
+    darwin_put_ll_framelist (itransfer);
 
     return darwin_to_libusb (kresult);
   }
 
-  (*(cInterface->interface))->GetPipeProperties (cInterface->interface, pipeRef, &direction, &number,
-                                                 &transferType, &maxPacketSize, &interval);
-
   /* schedule for a frame a little in the future */
   frame += 4;
 
@@ -1583,7 +1964,15 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
     frame = cInterface->frames[transfer->endpoint];
 
   /* submit the request */
-  if (IS_XFERIN(transfer))
+  if (tpriv->ll_framelist && IS_XFERIN(transfer))
+    kresult = (*(cInterface->interface))->LowLatencyReadIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
+                                                                       transfer->num_iso_packets, 0, tpriv->ll_framelist->frames,
+                                                                       darwin_async_io_callback, itransfer);
+  else if (tpriv->ll_framelist)
+    kresult = (*(cInterface->interface))->LowLatencyWriteIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
+                                                                        transfer->num_iso_packets, 0, tpriv->ll_framelist->frames,
+                                                                        darwin_async_io_callback, itransfer);
+  else if (IS_XFERIN(transfer))
     kresult = (*(cInterface->interface))->ReadIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
                                                              transfer->num_iso_packets, tpriv->isoc_framelist, darwin_async_io_callback,
                                                              itransfer);
@@ -1604,6 +1993,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
                darwin_error_str(kresult));
     free (tpriv->isoc_framelist);
     tpriv->isoc_framelist = NULL;
+    darwin_put_ll_framelist (itransfer);
   }
 
   return darwin_to_libusb (kresult);
@@ -1628,10 +2018,10 @@ static int submit_control_transfer(struct usbi_transfer *itransfer) {
   tpriv->req.wLength           = OSSwapLittleToHostInt16 (setup->wLength);
   /* data is stored after the libusb control block */
   tpriv->req.pData             = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
-  tpriv->req.completionTimeout = transfer->timeout;
-  tpriv->req.noDataTimeout     = transfer->timeout;
+  tpriv->req.completionTimeout = usbi_transfer_timeout_ms(transfer);
+  tpriv->req.noDataTimeout     = usbi_transfer_timeout_ms(transfer);
 
-  itransfer->flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
+  usbi_atomic_or(&itransfer->flags, USBI_TRANSFER_OS_HANDLES_TIMEOUT);
 
   /* all transfers in libusb-1.0 are async */
 
@@ -1715,11 +2105,14 @@ static int darwin_abort_transfers (struct usbi_transfer *itransfer) {
 
   /* abort transactions */
 #if InterfaceVersion >= 550
-  if (LIBUSB_TRANSFER_TYPE_BULK_STREAM == transfer->type)
-    (*(cInterface->interface))->AbortStreamsPipe (cInterface->interface, pipeRef, itransfer->stream_id);
-  else
+  if (LIBUSB_TRANSFER_TYPE_BULK_STREAM == transfer->type) {
+    /* only this stream is aborted, the pipe and its other streams keep running */
+    kresult = (*(cInterface->interface))->AbortStreamsPipe (cInterface->interface, pipeRef, itransfer->stream_id);
+
+    return darwin_to_libusb (kresult);
+  }
 #endif
-    (*(cInterface->interface))->AbortPipe (cInterface->interface, pipeRef);
+  (*(cInterface->interface))->AbortPipe (cInterface->interface, pipeRef);
 
   usbi_dbg ("calling clear pipe stall to clear the data toggle bit");
 
@@ -1738,6 +2131,9 @@ static int darwin_cancel_transfer(struct usbi_transfer *itransfer) {
   case LIBUSB_TRANSFER_TYPE_BULK:
   case LIBUSB_TRANSFER_TYPE_INTERRUPT:
   case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+#if InterfaceVersion >= 550
+  case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+#endif
     return darwin_abort_transfers (itransfer);
   default:
     usbi_err (TRANSFER_CTX(transfer), "unknown endpoint type %d", transfer->type);
@@ -1753,6 +2149,8 @@ static void darwin_clear_transfer_priv (struct usbi_transfer *itransfer) {
     free (tpriv->isoc_framelist);
     tpriv->isoc_framelist = NULL;
   }
+
+  darwin_put_ll_framelist (itransfer);
 }
 
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0) {
@@ -1780,7 +2178,7 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
 }
 
 static int darwin_transfer_status (struct usbi_transfer *itransfer, kern_return_t result) {
-  if (itransfer->flags & USBI_TRANSFER_TIMED_OUT)
+  if (usbi_atomic_load(&itransfer->flags) & USBI_TRANSFER_TIMED_OUT)
     result = kIOUSBTransactionTimeout;
 
   switch (result) {
@@ -1797,7 +2195,7 @@ static int darwin_transfer_status (struct usbi_transfer *itransfer, kern_return_
     return LIBUSB_TRANSFER_OVERFLOW;
   case kIOUSBTransactionTimeout:
     usbi_warn (ITRANSFER_CTX (itransfer), "transfer error: timed out");
-    itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
+    usbi_atomic_or(&itransfer->flags, USBI_TRANSFER_TIMED_OUT);
     return LIBUSB_TRANSFER_TIMED_OUT;
   default:
     usbi_warn (ITRANSFER_CTX (itransfer), "transfer error: %s (value = 0x%08x)", darwin_error_str (result), result);
@@ -1823,7 +2221,15 @@ static int darwin_handle_transfer_completion (struct usbi_transfer *itransfer) {
              isControl ? "control" : isBulk ? "bulk" : isIsoc ? "isoc" : "interrupt", tpriv->result);
 
   if (kIOReturnSuccess == tpriv->result || kIOReturnUnderrun == tpriv->result) {
-    if (isIsoc && tpriv->isoc_framelist) {
+    if (isIsoc && tpriv->ll_framelist) {
+      /* copy isochronous results back */
+
+      for (i = 0; i < transfer->num_iso_packets ; i++) {
+        struct libusb_iso_packet_descriptor *lib_desc = &transfer->iso_packet_desc[i];
+        lib_desc->status = darwin_to_libusb (tpriv->ll_framelist->frames[i].frStatus);
+        lib_desc->actual_length = tpriv->ll_framelist->frames[i].frActCount;
+      }
+    } else if (isIsoc && tpriv->isoc_framelist) {
       /* copy isochronous results back */
 
       for (i = 0; i < transfer->num_iso_packets ; i++) {
@@ -1839,29 +2245,28 @@ static int darwin_handle_transfer_completion (struct usbi_transfer *itransfer) {
   return usbi_handle_transfer_completion (itransfer, darwin_transfer_status (itransfer, tpriv->result));
 }
 
+/* both clocks are read in user space. clock_get_time() on a clock service
+ * port is a Mach message round trip to the kernel */
 static int darwin_clock_gettime(int clk_id, struct timespec *tp) {
-  mach_timespec_t sys_time;
-  clock_serv_t clock_ref;
+  struct timeval tv;
+  uint64_t ns;
 
   switch (clk_id) {
   case USBI_CLOCK_REALTIME:
     /* CLOCK_REALTIME represents time since the epoch */
-    clock_ref = clock_realtime;
-    break;
+    gettimeofday (&tv, NULL);
+    tp->tv_sec  = tv.tv_sec;
+    tp->tv_nsec = tv.tv_usec * 1000;
+    return 0;
   case USBI_CLOCK_MONOTONIC:
     /* use system boot time as reference for the monotonic clock */
-    clock_ref = clock_monotonic;
-    break;
+    ns = mach_absolute_time () * darwin_timebase.numer / darwin_timebase.denom;
+    tp->tv_sec  = (time_t)(ns / 1000000000);
+    tp->tv_nsec = (long)(ns % 1000000000);
+    return 0;
   default:
     return LIBUSB_ERROR_INVALID_PARAM;
   }
-
-  clock_get_time (clock_ref, &sys_time);
-
-  tp->tv_sec  = sys_time.tv_sec;
-  tp->tv_nsec = sys_time.tv_nsec;
-
-  return 0;
 }
 
 #if InterfaceVersion >= 550
@@ -1949,6 +2354,9 @@ const struct usbi_os_backend darwin_backend = {
         .free_streams = darwin_free_streams,
 #endif
 
+        .dev_mem_alloc = darwin_dev_mem_alloc,
+        .dev_mem_free = darwin_dev_mem_free,
+
         .kernel_driver_active = darwin_kernel_driver_active,
         .detach_kernel_driver = darwin_detach_kernel_driver,
         .attach_kernel_driver = darwin_attach_kernel_driver,
@@ -1957,6 +2365,8 @@ const struct usbi_os_backend darwin_backend = {
 
         .submit_transfer = darwin_submit_transfer,
         .cancel_transfer = darwin_cancel_transfer,
+        /* AbortPipe ends every transaction on the pipe */
+        .cancel_endpoint_transfers = darwin_abort_transfers,
         .clear_transfer_priv = darwin_clear_transfer_priv,
 
         .handle_transfer_completion = darwin_handle_transfer_completion,
@@ -120,23 +120,54 @@ struct darwin_cached_device {
   int                   open_count;
   UInt8                 first_config, active_config, port;  
   int                   can_enumerate;
+  int                   config_cached;
   int                   refcount;
+
+  /* runloop of the thread that completes the device's async I/O, running
+   * while the device is open */
+  CFRunLoopRef          async_runloop;
+  pthread_t             async_thread;
 };
 
 struct darwin_device_priv {
   struct darwin_cached_device *dev;
 };
 
+/* memory returned by libusb_dev_mem_alloc(). it is created with
+ * LowLatencyCreateBuffer() on an interface and stays wired until freed */
+struct darwin_dev_mem {
+  struct list_head     list;
+  unsigned char       *buffer;
+  size_t               length;
+  int                  iface;
+  UInt32               buffer_type;
+};
+
+/* a wired frame list for the low-latency isochronous calls */
+struct darwin_ll_framelist {
+  struct darwin_ll_framelist *next;
+  usb_interface_t          **interface;
+  IOUSBLowLatencyIsocFrame  *frames;
+  int                        num_frames;
+};
+
 struct darwin_device_handle_priv {
   int                  is_open;
   CFRunLoopSourceRef   cfSource;
 
+  /* protects dev_mem and the interfaces' ll_framelists */
+  usbi_mutex_t         dev_mem_lock;
+  struct list_head     dev_mem;
+
   struct darwin_interface {
     usb_interface_t    **interface;
     uint8_t              num_endpoints;
     CFRunLoopSourceRef   cfSource;
     uint64_t             frames[256];
     uint8_t              endpoint_addrs[USB_MAXENDPOINTS];
+
+    /* idle low-latency frame lists, reused across submissions */
+    struct darwin_ll_framelist *ll_framelists;
   } interfaces[USB_MAXINTERFACES];
 };
 
@@ -145,6 +176,9 @@ struct darwin_transfer_priv {
   IOUSBIsocFrame *isoc_framelist;
   int num_iso_packets;
 
+  /* Isoc in device memory */
+  struct darwin_ll_framelist *ll_framelist;
+
   /* Control */
   IOUSBDevRequestTO req;
 
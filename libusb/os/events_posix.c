@@ -29,6 +29,9 @@
 #ifdef USBI_USING_TIMERFD
 #include <sys/timerfd.h>
 #endif
+#ifdef USBI_USING_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "libusbi.h"
 
@@ -40,6 +43,28 @@
 #define EVENT_WRITE_FD(event)	((event)->fd[1])
 #endif
 
+/* Per-context (or per-shard) event data, (re)built by usbi_alloc_event_data()
+ * whenever the list of event sources changes. After each wait, the sources that reported
+ * events are gathered into the ready array so that the backend only ever
+ * has to look at sources that actually need attention. */
+struct usbi_event_data {
+	unsigned int cnt;
+	struct usbi_event_source **ready;
+#ifdef USBI_USING_EPOLL
+	int epoll_fd;
+	struct epoll_event *events;
+	int aggregate_fd;	/* see usbi_get_event_data_fd(), or -1 */
+#else
+	struct pollfd *fds;
+	struct usbi_event_source **sources;
+#endif
+};
+
+#if defined(USBI_USING_EPOLL) && defined(HAVE_EPOLL_PWAIT2)
+/* set once epoll_pwait2() turns out to be missing from the kernel (< 5.11) */
+static int epoll_pwait2_unsupported;
+#endif
+
 
 int usbi_create_event(usbi_event_t *event)
 {
@@ -219,96 +244,455 @@ int usbi_destroy_timer(usbi_timer_t timer)
 #endif
 }
 
-int usbi_alloc_event_data(struct libusb_context *ctx)
+#ifdef USBI_USING_EPOLL
+static int usbi_epoll_rebuild(struct libusb_context *ctx, struct usbi_event_data *data,
+	struct list_head *sources)
 {
 	struct usbi_event_source *event_source;
-	struct pollfd *fds;
-	int i = 0;
+	int epoll_fd;
 
-	if (ctx->event_data) {
-		free(ctx->event_data);
-		ctx->event_data = NULL;
+	/* a fresh epoll instance is cheaper to get right than working out which
+	 * sources came and went since the previous build */
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		usbi_err(ctx, "failed to create epoll instance: %d", errno);
+		return LIBUSB_ERROR_OTHER;
 	}
 
-	fds = calloc(ctx->event_sources_cnt, sizeof(struct pollfd));
-	if (!fds)
-		return LIBUSB_ERROR_NO_MEM;
+	list_for_each_entry(event_source, sources, list, struct usbi_event_source) {
+		struct epoll_event event;
+
+		/* the poll and epoll event bits share the same values on Linux */
+		event.events = (uint32_t)event_source->pollfd.events;
+		event.data.ptr = event_source;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_source->pollfd.fd, &event) == -1) {
+			usbi_err(ctx, "failed to add fd %d to epoll instance: %d",
+				event_source->pollfd.fd, errno);
+			close(epoll_fd);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
 
-	list_for_each_entry(event_source, &ctx->event_sources, list, struct usbi_event_source) {
-		struct libusb_pollfd *pollfd = &event_source->pollfd;
-		fds[i].fd = pollfd->fd;
-		fds[i].events = pollfd->events;
-		i++;
+	/* the previous instance leaves the aggregate when it is closed */
+	if (data->aggregate_fd != -1) {
+		struct epoll_event event;
+
+		event.events = EPOLLIN;
+		event.data.fd = epoll_fd;
+		if (epoll_ctl(data->aggregate_fd, EPOLL_CTL_ADD, epoll_fd, &event) == -1) {
+			usbi_err(ctx, "failed to add epoll instance to aggregate: %d", errno);
+			close(epoll_fd);
+			return LIBUSB_ERROR_OTHER;
+		}
 	}
 
-	ctx->event_data = fds;
+	if (data->epoll_fd != -1)
+		close(data->epoll_fd);
+	data->epoll_fd = epoll_fd;
 	return 0;
 }
+#endif
 
-int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned int cnt,
-	unsigned int internal_cnt, int timeout_ms)
+static int alloc_event_data(struct libusb_context *ctx, void **event_data,
+	struct list_head *sources, unsigned int cnt)
+{
+	struct usbi_event_data *data = (struct usbi_event_data *)*event_data;
+
+	if (!data) {
+		data = calloc(1, sizeof(*data));
+		if (!data)
+			return LIBUSB_ERROR_NO_MEM;
+#ifdef USBI_USING_EPOLL
+		data->epoll_fd = -1;
+		data->aggregate_fd = -1;
+#endif
+		*event_data = data;
+	}
+
+	if (cnt > data->cnt) {
+		struct usbi_event_source **ready;
+
+		/* leave room for sources to be added without a rebuild, see
+		 * usbi_add_event_data_source() */
+		cnt = cnt < 16 ? 16 : cnt * 2;
+
+		ready = realloc(data->ready, cnt * sizeof(*ready));
+		if (!ready)
+			return LIBUSB_ERROR_NO_MEM;
+		data->ready = ready;
+#ifdef USBI_USING_EPOLL
+		{
+			struct epoll_event *events;
+
+			events = realloc(data->events, cnt * sizeof(*events));
+			if (!events)
+				return LIBUSB_ERROR_NO_MEM;
+			data->events = events;
+		}
+#else
+		{
+			struct pollfd *fds;
+			struct usbi_event_source **fd_sources;
+
+			fds = realloc(data->fds, cnt * sizeof(*fds));
+			if (!fds)
+				return LIBUSB_ERROR_NO_MEM;
+			data->fds = fds;
+
+			fd_sources = realloc(data->sources, cnt * sizeof(*fd_sources));
+			if (!fd_sources)
+				return LIBUSB_ERROR_NO_MEM;
+			data->sources = fd_sources;
+		}
+#endif
+		data->cnt = cnt;
+	}
+
+#ifdef USBI_USING_EPOLL
+	return usbi_epoll_rebuild(ctx, data, sources);
+#else
+	{
+		struct usbi_event_source *event_source;
+		unsigned int i = 0;
+
+		UNUSED(ctx);
+		list_for_each_entry(event_source, sources, list, struct usbi_event_source) {
+			data->fds[i].fd = event_source->pollfd.fd;
+			data->fds[i].events = event_source->pollfd.events;
+			data->sources[i] = event_source;
+			i++;
+		}
+	}
+
+	return 0;
+#endif
+}
+
+static void free_event_data(void **event_data)
+{
+	struct usbi_event_data *data = (struct usbi_event_data *)*event_data;
+
+	if (!data)
+		return;
+
+#ifdef USBI_USING_EPOLL
+	if (data->aggregate_fd != -1)
+		close(data->aggregate_fd);
+	if (data->epoll_fd != -1)
+		close(data->epoll_fd);
+	free(data->events);
+#else
+	free(data->fds);
+	free(data->sources);
+#endif
+	free(data->ready);
+	free(data);
+	*event_data = NULL;
+}
+
+int usbi_alloc_event_data(struct libusb_context *ctx)
+{
+	return alloc_event_data(ctx, &ctx->event_data, &ctx->event_sources,
+		ctx->event_sources_cnt);
+}
+
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	free_event_data(&ctx->event_data);
+}
+
+/* Return a single fd that becomes readable whenever any source of the
+ * context event data does. The epoll instance is replaced on every rebuild,
+ * so it is nested in a second instance that lives as long as the event
+ * data. The caller holds event_data_lock. Returns LIBUSB_ERROR_BUSY if the
+ * event data has not been built yet. */
+int usbi_get_event_data_fd(struct libusb_context *ctx, int *fd)
+{
+#ifdef USBI_USING_EPOLL
+	struct usbi_event_data *data = (struct usbi_event_data *)ctx->event_data;
+
+	if (!data || data->epoll_fd == -1)
+		return LIBUSB_ERROR_BUSY;
+
+	if (data->aggregate_fd == -1) {
+		struct epoll_event event;
+		int aggregate_fd;
+
+		aggregate_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (aggregate_fd == -1) {
+			usbi_err(ctx, "failed to create epoll instance: %d", errno);
+			return LIBUSB_ERROR_OTHER;
+		}
+
+		event.events = EPOLLIN;
+		event.data.fd = data->epoll_fd;
+		if (epoll_ctl(aggregate_fd, EPOLL_CTL_ADD, data->epoll_fd, &event) == -1) {
+			usbi_err(ctx, "failed to add epoll instance to aggregate: %d", errno);
+			close(aggregate_fd);
+			return LIBUSB_ERROR_OTHER;
+		}
+
+		data->aggregate_fd = aggregate_fd;
+	}
+
+	*fd = data->aggregate_fd;
+	return 0;
+#else
+	UNUSED(ctx);
+	UNUSED(fd);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* Register a source that was just added with event data that is in use,
+ * so that the event data does not have to be rebuilt. cnt is the number of
+ * sources including the new one. This is safe while another thread waits
+ * on the event data. Returns 0 on success, or LIBUSB_ERROR_NOT_SUPPORTED if
+ * the event data has to be rebuilt instead. */
+int usbi_add_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source, unsigned int cnt)
+{
+#ifdef USBI_USING_EPOLL
+	struct usbi_event_data *data = (struct usbi_event_data *)event_data;
+	struct epoll_event event;
+
+	/* the ready and events arrays must have room for every source */
+	if (!data || data->epoll_fd == -1 || cnt > data->cnt)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	event.events = (uint32_t)event_source->pollfd.events;
+	event.data.ptr = event_source;
+	if (epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, event_source->pollfd.fd, &event) == -1) {
+		usbi_dbg("failed to add fd %d to epoll instance: %d",
+			event_source->pollfd.fd, errno);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	return 0;
+#else
+	/* a poll() in progress uses the fds array */
+	UNUSED(ctx);
+	UNUSED(event_data);
+	UNUSED(event_source);
+	UNUSED(cnt);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* Unregister a source that was just removed, the counterpart of
+ * usbi_add_event_data_source(). The source itself must not be freed until
+ * the thread waiting on the event data has finished with it. */
+int usbi_remove_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source)
+{
+#ifdef USBI_USING_EPOLL
+	struct usbi_event_data *data = (struct usbi_event_data *)event_data;
+
+	UNUSED(ctx);
+	if (!data || data->epoll_fd == -1)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	/* fails if the source was never registered in place, in which case the
+	 * pending rebuild leaves it out */
+	if (epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, event_source->pollfd.fd, NULL) == -1)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return 0;
+#else
+	UNUSED(ctx);
+	UNUSED(event_data);
+	UNUSED(event_source);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int usbi_alloc_shard_event_data(struct usbi_event_shard *shard)
 {
-	struct pollfd *fds = (struct pollfd *)event_data;
+	return alloc_event_data(shard->ctx, &shard->event_data,
+		&shard->event_sources, shard->event_sources_cnt);
+}
+
+void usbi_free_shard_event_data(struct usbi_event_shard *shard)
+{
+	free_event_data(&shard->event_data);
+}
+
+/* Wait for events on the sources in event_data and collect the ones that
+ * reported events into the ready array. Returns the number of ready
+ * sources, 0 on timeout or a LIBUSB_ERROR code on failure. */
+static int usbi_wait_for_events(struct libusb_context *ctx,
+	struct usbi_event_data *data, unsigned int cnt, const struct timeval *tv)
+{
+#ifdef USBI_USING_EPOLL
+	int i, r;
+
+#ifdef HAVE_EPOLL_PWAIT2
+	if (!epoll_pwait2_unsupported) {
+		struct timespec ts = { tv->tv_sec, tv->tv_usec * 1000 };
+
+		usbi_dbg("epoll_pwait2() %u fds with timeout in %d.%06ds", cnt,
+			(int)tv->tv_sec, (int)tv->tv_usec);
+		r = epoll_pwait2(data->epoll_fd, data->events, (int)cnt, &ts, NULL);
+		if (r == -1 && errno == ENOSYS) {
+			usbi_dbg("epoll_pwait2() not supported, using epoll_wait()");
+			epoll_pwait2_unsupported = 1;
+		} else {
+			goto waited;
+		}
+	}
+#endif
+	usbi_dbg("epoll_wait() %u fds with timeout in %dms", cnt, usbi_timeval_to_ms(tv));
+	r = epoll_wait(data->epoll_fd, data->events, (int)cnt, usbi_timeval_to_ms(tv));
+#ifdef HAVE_EPOLL_PWAIT2
+waited:
+#endif
+	usbi_dbg("epoll_wait() returned %d", r);
+	if (r == -1 && errno == EINTR)
+		return LIBUSB_ERROR_INTERRUPTED;
+	else if (r < 0) {
+		usbi_err(ctx, "epoll_wait failed %d err=%d", r, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	for (i = 0; i < r; i++) {
+		struct usbi_event_source *event_source = data->events[i].data.ptr;
+
+		event_source->revents = (short)data->events[i].events;
+		data->ready[i] = event_source;
+	}
+
+	return r;
+#else
 	POLL_NFDS_TYPE nfds = (POLL_NFDS_TYPE)cnt;
-	int special_event;
+	unsigned int n;
+	int nready = 0;
 	int r;
 
-redo_poll:
-	usbi_dbg("poll() %u fds with timeout in %dms", cnt, timeout_ms);
-	r = poll(fds, nfds, timeout_ms);
+#ifdef HAVE_PPOLL
+	struct timespec ts = { tv->tv_sec, tv->tv_usec * 1000 };
+
+	usbi_dbg("ppoll() %u fds with timeout in %d.%06ds", cnt,
+		(int)tv->tv_sec, (int)tv->tv_usec);
+	r = ppoll(data->fds, nfds, &ts, NULL);
+#else
+	usbi_dbg("poll() %u fds with timeout in %dms", cnt, usbi_timeval_to_ms(tv));
+	r = poll(data->fds, nfds, usbi_timeval_to_ms(tv));
+#endif
 	usbi_dbg("poll() returned %d", r);
-	if (r == 0)
-		return usbi_using_timer(ctx) ? 0 : LIBUSB_ERROR_TIMEOUT;
-	else if (r == -1 && errno == EINTR)
+	if (r == -1 && errno == EINTR)
 		return LIBUSB_ERROR_INTERRUPTED;
 	else if (r < 0) {
 		usbi_err(ctx, "poll failed %d err=%d", r, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
-	special_event = 0;
+	for (n = 0; n < cnt && nready < r; n++) {
+		if (!data->fds[n].revents)
+			continue;
+		data->sources[n]->revents = data->fds[n].revents;
+		data->ready[nready++] = data->sources[n];
+	}
 
-	/* fds[0] is always the event */
-	if (fds[0].revents) {
-		int ret = usbi_handle_event_trigger(ctx);
-		if (ret < 0) {
-			/* return error code */
-			r = ret;
-			goto handled;
-		}
-		else if (ret) {
-			/* special event occurred */
-			special_event = 1;
-		}
+	return nready;
+#endif
+}
+
+/* Wait for events on the sources of a shard. On success, *ready is set to
+ * the array of sources that reported events. */
+int usbi_wait_for_shard_events(struct usbi_event_shard *shard,
+	unsigned int cnt, const struct timeval *tv,
+	struct usbi_event_source ***ready)
+{
+	struct usbi_event_data *data = (struct usbi_event_data *)shard->event_data;
 
-		if (0 == --r)
-			goto handled;
+	*ready = data->ready;
+	return usbi_wait_for_events(shard->ctx, data, cnt, tv);
+}
+
+static int poll_events(struct libusb_context *ctx, void *event_data,
+	unsigned int cnt)
+{
+	struct timeval zero = { 0, 0 };
+
+	return usbi_wait_for_events(ctx, event_data, cnt, &zero);
+}
+
+int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned int cnt,
+	unsigned int internal_cnt, const struct timeval *tv)
+{
+	struct usbi_event_data *data = (struct usbi_event_data *)event_data;
+	struct usbi_event_source **ready = data->ready;
+	struct timeval timeout = *tv;
+	struct timespec mark;
+	int special_event;
+	int i, nready, r;
+
+	UNUSED(internal_cnt);
+
+	/* events found while spinning are not counted as wakeups */
+	nready = usbi_busy_poll(ctx, poll_events, data, cnt, &timeout);
+	if (nready) {
+		usbi_stats_wait_begin(ctx, &mark);
+		goto polled;
 	}
 
-	/* on timer configurations, fds[1] is the timer */
-	if (usbi_using_timer(ctx) && fds[1].revents) {
-		/* timer indicates that a timeout has expired */
-		int ret = usbi_handle_timer_trigger(ctx);
-		if (ret < 0) {
-			/* return error code */
-			r = ret;
-			goto handled;
-		}
+redo_wait:
+	usbi_stats_wait_begin(ctx, &mark);
+	nready = usbi_wait_for_events(ctx, data, cnt, &timeout);
+	usbi_stats_waited(ctx, &mark);
+polled:
+	if (nready == 0)
+		return usbi_using_timer(ctx) ? 0 : LIBUSB_ERROR_TIMEOUT;
+	else if (nready < 0)
+		return nready;
+
+	special_event = 0;
+	r = 0;
+
+	/* pull the internal event sources out of the ready array, leaving only
+	 * the sources that belong to the backend */
+	for (i = 0; i < nready; i++) {
+		libusb_os_handle fd = ready[i]->pollfd.fd;
+		int ret;
+
+		if (fd == USBI_EVENT_GET_SOURCE(ctx->event)) {
+			ret = usbi_handle_event_trigger(ctx);
+			if (ret < 0) {
+				/* return error code */
+				r = ret;
+				goto handled;
+			} else if (ret) {
+				/* special event occurred */
+				special_event = 1;
+			}
+		} else if (usbi_using_timer(ctx) && fd == ctx->timer) {
+			/* timer indicates that a timeout has expired */
+			ret = usbi_handle_timer_trigger(ctx);
+			if (ret < 0) {
+				/* return error code */
+				r = ret;
+				goto handled;
+			}
 
-		special_event = 1;
+			special_event = 1;
+		} else {
+			continue;
+		}
 
-		if (0 == --r)
-			goto handled;
+		ready[i--] = ready[--nready];
 	}
 
-	r = usbi_backend->handle_events(ctx, fds + internal_cnt, cnt - internal_cnt, r);
-	if (r)
-		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	if (nready) {
+		r = usbi_backend->handle_events(ctx, ready, (unsigned int)nready, nready);
+		if (r)
+			usbi_err(ctx, "backend handle_events failed with error %d", r);
+	}
 
 handled:
+	usbi_stats_dispatched(ctx, &mark);
 	if (r == 0 && special_event) {
-		timeout_ms = 0;
-		goto redo_poll;
+		timerclear(&timeout);
+		goto redo_wait;
 	}
 
 	return r;
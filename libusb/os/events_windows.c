@@ -24,6 +24,93 @@
 
 #include "libusbi.h"
 
+#ifdef USBI_USING_IOCP
+typedef BOOL (WINAPI *get_queued_completion_status_ex_t)(HANDLE, LPOVERLAPPED_ENTRY,
+	ULONG, PULONG, DWORD, BOOL);
+
+typedef HANDLE (WINAPI *create_waitable_timer_ex_w_t)(LPSECURITY_ATTRIBUTES,
+	LPCWSTR, DWORD, DWORD);
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION	0x00000002
+#endif
+
+/* GetQueuedCompletionStatusEx() is only available on Vista and later */
+static get_queued_completion_status_ex_t pGetQueuedCompletionStatusEx = NULL;
+static create_waitable_timer_ex_w_t pCreateWaitableTimerExW = NULL;
+static int iocp_dll_loaded = 0;
+
+/* Completion port waits take milliseconds and expire on the system timer
+ * tick, every 15.6ms by default. For timeouts under a second, a high
+ * resolution waitable timer (Windows 10 1803 and later) queues an APC to the
+ * waiting thread at the exact deadline, which ends the alertable wait. */
+struct usbi_event_data {
+	OVERLAPPED_ENTRY entries[USBI_MAX_COMPLETIONS];
+	HANDLE hires_timer;
+};
+
+int usbi_create_event(usbi_event_t *event)
+{
+	HANDLE port;
+
+	if (!iocp_dll_loaded) {
+		HMODULE hKernel32 = GetModuleHandleA("KERNEL32");
+		if (hKernel32 != NULL) {
+			pGetQueuedCompletionStatusEx = (get_queued_completion_status_ex_t)
+				GetProcAddress(hKernel32, "GetQueuedCompletionStatusEx");
+			pCreateWaitableTimerExW = (create_waitable_timer_ex_w_t)
+				GetProcAddress(hKernel32, "CreateWaitableTimerExW");
+		}
+		iocp_dll_loaded = 1;
+	}
+
+	port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (!port) {
+		usbi_warn(NULL, "failed to create I/O completion port: %d", GetLastError());
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	event->port = port;
+	event->signalled = 0;
+	return 0;
+}
+
+static int post_event_packet(usbi_event_t *event)
+{
+	if (!PostQueuedCompletionStatus(event->port, 0, 0, NULL)) {
+		usbi_warn(NULL, "failed to post completion packet: %d", GetLastError());
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+int usbi_signal_event(usbi_event_t *event)
+{
+	/* only one packet is needed no matter how many times the event is
+	 * signalled before it is cleared */
+	if (InterlockedExchange(&event->signalled, 1) == 0)
+		return post_event_packet(event);
+
+	return 0;
+}
+
+int usbi_clear_event(usbi_event_t *event)
+{
+	InterlockedExchange(&event->signalled, 0);
+	return 0;
+}
+
+int usbi_destroy_event(usbi_event_t *event)
+{
+	if (!CloseHandle(event->port)) {
+		usbi_warn(NULL, "failed to close I/O completion port: %d", GetLastError());
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+#else
 int usbi_create_event(usbi_event_t *event)
 {
 	HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
@@ -65,10 +152,11 @@ int usbi_destroy_event(usbi_event_t *event)
 
 	return 0;
 }
+#endif
 
 usbi_timer_t usbi_create_timer(void)
 {
-#if !defined(_WIN32_WCE)
+#if !defined(_WIN32_WCE) && !defined(USBI_USING_IOCP)
 	HANDLE hTimer = CreateWaitableTimer(NULL, TRUE, NULL);
 	if (!hTimer) {
 		usbi_warn(NULL, "failed to create waitable timer: %d", GetLastError());
@@ -138,6 +226,254 @@ int usbi_destroy_timer(usbi_timer_t timer)
 #endif
 }
 
+#ifdef USBI_USING_IOCP
+int usbi_alloc_event_data(struct libusb_context *ctx)
+{
+	/* the completion port does not care how many event sources there are,
+	 * so the array of completion entries only needs to be allocated once */
+	struct usbi_event_data *data;
+
+	if (!ctx->event_data) {
+		data = malloc(sizeof(*data));
+		if (!data)
+			return LIBUSB_ERROR_NO_MEM;
+
+		/* the flag is rejected before Windows 10 1803, which leaves
+		 * millisecond waits */
+		data->hires_timer = NULL;
+		if (pCreateWaitableTimerExW && pGetQueuedCompletionStatusEx)
+			data->hires_timer = pCreateWaitableTimerExW(NULL, NULL,
+				CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		usbi_dbg("high resolution timer %savailable", data->hires_timer ? "" : "not ");
+		ctx->event_data = data;
+	}
+
+	return 0;
+}
+
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	struct usbi_event_data *data = ctx->event_data;
+
+	if (data && data->hires_timer)
+		CloseHandle(data->hires_timer);
+	free(data);
+	ctx->event_data = NULL;
+}
+
+/* nothing waits on the event sources themselves */
+int usbi_add_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source, unsigned int cnt)
+{
+	UNUSED(ctx);
+	UNUSED(event_data);
+	UNUSED(event_source);
+	UNUSED(cnt);
+	return 0;
+}
+
+int usbi_remove_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source)
+{
+	UNUSED(ctx);
+	UNUSED(event_data);
+	UNUSED(event_source);
+	return 0;
+}
+
+static VOID CALLBACK hires_timer_apc(LPVOID arg, DWORD low, DWORD high)
+{
+	/* delivering the APC is what ends the wait */
+	UNUSED(arg);
+	UNUSED(low);
+	UNUSED(high);
+}
+
+/* CancelWaitableTimer() does not withdraw an APC that is already queued, so
+ * the APC of a timer that expired as it was disarmed ends the next alertable
+ * wait instead, as do APCs queued by the application. Before treating the
+ * wait as expired, check the deadline it was armed for and, if it has not
+ * passed, update the backstop timeout to the time that is left. */
+static int hires_wait_expired(const struct timespec *deadline, DWORD *timeout)
+{
+	struct timespec now;
+	long long left_us;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now))
+		return 1;
+
+	left_us = (deadline->tv_sec - now.tv_sec) * 1000000LL +
+		(deadline->tv_nsec - now.tv_nsec) / 1000;
+	if (left_us <= 0)
+		return 1;
+
+	*timeout = (DWORD)((left_us + 999) / 1000);
+	return 0;
+}
+
+static int dequeue_completions(struct libusb_context *ctx,
+	struct usbi_event_data *data, const struct timeval *tv)
+{
+	OVERLAPPED_ENTRY *entries = data->entries;
+	HANDLE port = ctx->event.port;
+	DWORD timeout = (DWORD)usbi_timeval_to_ms(tv);
+	BOOL alertable = FALSE;
+	ULONG n = 0;
+
+	if (pGetQueuedCompletionStatusEx) {
+		struct timespec deadline = { 0, 0 };
+
+		if (data->hires_timer && tv->tv_sec == 0 && tv->tv_usec &&
+				usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &deadline) == 0) {
+			LARGE_INTEGER due;
+
+			deadline.tv_nsec += tv->tv_usec * 1000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+
+			/* 100ns units, negative means relative. the millisecond
+			 * timeout stays as a backstop */
+			due.QuadPart = (tv->tv_sec * -10000000LL) + (tv->tv_usec * -10LL);
+			alertable = SetWaitableTimer(data->hires_timer, &due, 0,
+				hires_timer_apc, NULL, FALSE);
+		}
+
+		usbi_dbg("GetQueuedCompletionStatusEx() with timeout in %d.%06ds",
+			(int)tv->tv_sec, (int)tv->tv_usec);
+		while (!pGetQueuedCompletionStatusEx(port, entries, USBI_MAX_COMPLETIONS, &n, timeout, alertable)) {
+			DWORD err = GetLastError();
+			if (err == WAIT_IO_COMPLETION && alertable &&
+					!hires_wait_expired(&deadline, &timeout))
+				continue;
+			if (alertable)
+				CancelWaitableTimer(data->hires_timer);
+			if (err == WAIT_TIMEOUT || err == WAIT_IO_COMPLETION)
+				return 0;
+			usbi_err(ctx, "GetQueuedCompletionStatusEx() failed err=%d", err);
+			return LIBUSB_ERROR_IO;
+		}
+		if (alertable)
+			CancelWaitableTimer(data->hires_timer);
+		usbi_dbg("GetQueuedCompletionStatusEx() returned %lu packets", n);
+		return (int)n;
+	}
+
+	/* pre-Vista: block for the first packet, then pick up whatever else
+	 * is already queued without waiting */
+	usbi_dbg("GetQueuedCompletionStatus() with timeout in %lums", timeout);
+	while (n < USBI_MAX_COMPLETIONS) {
+		OVERLAPPED_ENTRY *entry = &entries[n];
+
+		entry->lpOverlapped = NULL;
+		if (!GetQueuedCompletionStatus(port, &entry->dwNumberOfBytesTransferred,
+				&entry->lpCompletionKey, &entry->lpOverlapped, timeout)) {
+			/* a failed I/O operation still dequeues its packet */
+			if (entry->lpOverlapped == NULL) {
+				DWORD err = GetLastError();
+				if (err == WAIT_TIMEOUT)
+					break;
+				usbi_err(ctx, "GetQueuedCompletionStatus() failed err=%d", err);
+				return n ? (int)n : LIBUSB_ERROR_IO;
+			}
+		}
+		n++;
+		timeout = 0;
+	}
+	usbi_dbg("GetQueuedCompletionStatus() returned %lu packets", n);
+
+	return (int)n;
+}
+
+static int poll_completions(struct libusb_context *ctx, void *event_data,
+	unsigned int cnt)
+{
+	struct timeval zero = { 0, 0 };
+
+	UNUSED(cnt);
+	return dequeue_completions(ctx, (struct usbi_event_data *)event_data, &zero);
+}
+
+int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned int cnt,
+	unsigned int internal_cnt, const struct timeval *tv)
+{
+	struct usbi_event_data *data = (struct usbi_event_data *)event_data;
+	OVERLAPPED_ENTRY *entries = data->entries;
+	struct timeval timeout = *tv;
+	struct timespec mark;
+	int special_event;
+	int i, n, r;
+
+	UNUSED(cnt);
+	UNUSED(internal_cnt);
+
+	/* completions found while spinning are not counted as wakeups */
+	n = usbi_busy_poll(ctx, poll_completions, data, 0, &timeout);
+	if (n) {
+		usbi_stats_wait_begin(ctx, &mark);
+		goto polled;
+	}
+
+redo_wait:
+	usbi_stats_wait_begin(ctx, &mark);
+	n = dequeue_completions(ctx, data, &timeout);
+	usbi_stats_waited(ctx, &mark);
+polled:
+	if (n == 0)
+		return LIBUSB_ERROR_TIMEOUT;
+	else if (n < 0)
+		return n;
+
+	special_event = 0;
+	r = 0;
+
+	/* packets without an OVERLAPPED come from usbi_signal_event(). take
+	 * them out of the array, leaving only transfer completions */
+	for (i = 0; i < n; i++) {
+		int ret;
+
+		if (entries[i].lpOverlapped != NULL)
+			continue;
+
+		entries[i--] = entries[--n];
+
+		/* the event may have been cleared since the packet was posted */
+		if (!ctx->event.signalled)
+			continue;
+
+		ret = usbi_handle_event_trigger(ctx);
+		if (ret < 0) {
+			/* return error code */
+			r = ret;
+			goto handled;
+		} else if (ret) {
+			/* special event occurred */
+			special_event = 1;
+		}
+
+		/* an event that has not been cleared stays signalled, so queue
+		 * another packet to be picked up by the next wait */
+		if (ctx->event.signalled)
+			post_event_packet(&ctx->event);
+	}
+
+	if (n) {
+		r = usbi_backend->handle_events(ctx, entries, (unsigned int)n, n);
+		if (r)
+			usbi_err(ctx, "backend handle_events failed with error %d", r);
+	}
+
+handled:
+	usbi_stats_dispatched(ctx, &mark);
+	if (r == 0 && special_event) {
+		timerclear(&timeout);
+		goto redo_wait;
+	}
+
+	return r;
+}
+#else
 int usbi_alloc_event_data(struct libusb_context *ctx)
 {
 	struct usbi_event_source *event_source;
@@ -168,10 +504,38 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 	return 0;
 }
 
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	free(ctx->event_data);
+	ctx->event_data = NULL;
+}
+
+/* the HANDLE array is in use by WaitForMultipleObjects() */
+int usbi_add_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source, unsigned int cnt)
+{
+	UNUSED(ctx);
+	UNUSED(event_data);
+	UNUSED(event_source);
+	UNUSED(cnt);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int usbi_remove_event_data_source(struct libusb_context *ctx, void *event_data,
+	struct usbi_event_source *event_source)
+{
+	UNUSED(ctx);
+	UNUSED(event_data);
+	UNUSED(event_source);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned int cnt,
-	unsigned int internal_cnt, int timeout_ms)
+	unsigned int internal_cnt, const struct timeval *tv)
 {
 	HANDLE *handles = (HANDLE *)event_data;
+	int timeout_ms = usbi_timeval_to_ms(tv);
+	struct timespec mark;
 	DWORD result;
 	int r;
 
@@ -180,7 +544,9 @@ int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned in
 	assert(internal_cnt <= cnt);
 
 	usbi_dbg("WaitForMultipleObjects() for %u HANDLEs with timeout in %dms", cnt, timeout_ms);
+	usbi_stats_wait_begin(ctx, &mark);
 	result = WaitForMultipleObjects((DWORD)cnt, handles, FALSE, (DWORD)timeout_ms);
+	usbi_stats_waited(ctx, &mark);
 	usbi_dbg("WaitForMultipleObjects() returned %d", result);
 	if (result == WAIT_TIMEOUT)
 		return usbi_using_timer(ctx) ? 0 : LIBUSB_ERROR_TIMEOUT;
@@ -212,6 +578,8 @@ int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned in
 	r = usbi_backend->handle_events(ctx, handles + internal_cnt, cnt - internal_cnt, cnt - internal_cnt);
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	usbi_stats_dispatched(ctx, &mark);
 
 	return r;
 }
+#endif
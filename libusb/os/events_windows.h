@@ -5,11 +5,37 @@
 #define USBI_OS_HANDLE_FORMAT_SPECIFIER	"%x"
 #define USBI_EVENT_MASK			0
 
+/* Desktop Windows waits on an I/O completion port instead of an array of
+ * event HANDLEs, which removes the MAXIMUM_WAIT_OBJECTS limit on the number
+ * of transfers in flight. Windows CE does not have completion ports. */
+#if !defined(_WIN32_WCE)
+#define USBI_USING_IOCP
+#endif
+
+#ifdef USBI_USING_IOCP
+/* The internal event is the completion port itself. Signalling the event
+ * posts a completion packet with no OVERLAPPED, which is how the event loop
+ * tells it apart from transfer completions. signalled tracks the state of
+ * the event so that it behaves like the manual-reset event it replaces. */
+typedef struct {
+	HANDLE port;
+	volatile LONG signalled;
+} usbi_event_t;
+
+#define USBI_EVENT_GET_SOURCE(event)	((event).port)
+#define USBI_INVALID_EVENT		{ INVALID_HANDLE_VALUE, 0 }
+
+/* maximum number of completion packets dequeued by a single wait */
+#define USBI_MAX_COMPLETIONS		64
+#else
 typedef HANDLE usbi_event_t;
-typedef HANDLE usbi_timer_t;
 
 #define USBI_EVENT_GET_SOURCE(event)	(event)
 #define USBI_INVALID_EVENT		INVALID_HANDLE_VALUE
+#endif
+
+typedef HANDLE usbi_timer_t;
+
 #define USBI_INVALID_TIMER		INVALID_HANDLE_VALUE
 
 #endif /* LIBUSB_EVENTS_WINDOWS_H */
@@ -61,9 +61,30 @@ private:
 	bool					fInitCheck;
 };
 
+// Transfers of one endpoint, run by as many workers as the queue depth so
+// that that many usb_raw requests are outstanding at once
+class USBEndpointQueue {
+public:
+				USBEndpointQueue(int fd, int depth);
+	virtual			~USBEndpointQueue();
+	void			AddTransfer(USBTransfer*);
+	bool			RemoveTransfer(USBTransfer*);
+	bool			InitCheck();
+private:
+	static status_t		TransfersThread(void *);
+	void 			TransfersWorker();
+	int 			fRawFD;
+	int			fDepth;
+	BList 			fTransfers;
+	BLocker 		fTransfersLock;
+	sem_id 			fTransfersSem;
+	thread_id*		fTransfersThreads;
+	bool			fInitCheck;
+};
+
 class USBDeviceHandle {
 public:
-				USBDeviceHandle(USBDevice* dev);
+				USBDeviceHandle(USBDevice* dev, int depth);
 	virtual			~USBDeviceHandle();
 	int 			ClaimInterface(int);
 	int 			ReleaseInterface(int);
@@ -73,15 +94,13 @@ public:
 	status_t		CancelTransfer(USBTransfer*);
 	bool			InitCheck();
 private:
+	USBEndpointQueue*	EndpointQueue(struct libusb_transfer*, bool create);
 	int 			fRawFD;
-	static status_t		TransfersThread(void *);
-	void 			TransfersWorker();
 	USBDevice*		fUSBDevice;
 	unsigned int		fClaimedInterfaces;
-	BList 			fTransfers;
-	BLocker 		fTransfersLock;
-	sem_id 			fTransfersSem;
-	thread_id 		fTransfersThread;
+	int			fQueueDepth;
+	USBEndpointQueue*	fEndpointQueues[32];	// endpoint number plus direction
+	BLocker			fEndpointQueuesLock;
 	bool			fInitCheck;
 };
 
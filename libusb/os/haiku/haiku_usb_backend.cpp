@@ -185,16 +185,57 @@ USBDeviceHandle::InitCheck()
 	return fInitCheck;
 }
 
+USBEndpointQueue::USBEndpointQueue(int fd, int depth)
+	:
+	fRawFD(fd),
+	fDepth(depth),
+	fTransfersThreads(NULL),
+	fInitCheck(false)
+{
+	fTransfersSem = create_sem(0, "Transfers Queue Sem");
+	if(fTransfersSem < B_OK)
+		return;
+	fTransfersThreads = new(std::nothrow) thread_id[fDepth];
+	if(fTransfersThreads == NULL)
+		return;
+	for(int i=0; i<fDepth; i++)
+	{
+		fTransfersThreads[i] = spawn_thread(TransfersThread,"Transfer Worker",B_NORMAL_PRIORITY, this);
+		resume_thread(fTransfersThreads[i]);
+	}
+	fInitCheck = true;
+}
+
+USBEndpointQueue::~USBEndpointQueue()
+{
+	if(fTransfersSem >= B_OK)
+		delete_sem(fTransfersSem);
+	if(fTransfersThreads == NULL)
+		return;
+	for(int i=0; i<fDepth; i++)
+	{
+		if(fTransfersThreads[i]>0)
+			wait_for_thread(fTransfersThreads[i], NULL);
+	}
+	delete[] fTransfersThreads;
+}
+
+bool
+USBEndpointQueue::InitCheck()
+{
+	return fInitCheck;
+}
+
 status_t
-USBDeviceHandle::TransfersThread(void* self)
+USBEndpointQueue::TransfersThread(void* self)
 {
-	USBDeviceHandle* handle = (USBDeviceHandle*)self;
-	handle->TransfersWorker();
+	USBEndpointQueue* queue = (USBEndpointQueue*)self;
+	queue->TransfersWorker();
 	return B_OK;
 }
 
 void
-USBDeviceHandle::TransfersWorker()
+USBEndpointQueue::TransfersWorker()
 {
 	while(true)
 	{
@@ -206,57 +247,107 @@ USBDeviceHandle::TransfersWorker()
 		fTransfersLock.Lock();
 		USBTransfer* fPendingTransfer= (USBTransfer*) fTransfers.RemoveItem((int32)0);
 		fTransfersLock.Unlock();
+		// a cancelled transfer takes its item but leaves the count behind
+		if(fPendingTransfer == NULL)
+			continue;
 		fPendingTransfer->Do(fRawFD);
+		// completions from all workers are collected by the core and
+		// handled together by the next event handling pass
 		usbi_signal_transfer_completion(fPendingTransfer->UsbiTransfer());
 	}
 }
 
-status_t
-USBDeviceHandle::SubmitTransfer(struct usbi_transfer* itransfer)
+void
+USBEndpointQueue::AddTransfer(USBTransfer* transfer)
 {
-	USBTransfer* transfer = new USBTransfer(itransfer,fUSBDevice);
-	*((USBTransfer**)usbi_transfer_get_os_priv(itransfer))=transfer;
 	BAutolock locker(fTransfersLock);
 	fTransfers.AddItem(transfer);
 	release_sem(fTransfersSem);
+}
+
+bool
+USBEndpointQueue::RemoveTransfer(USBTransfer* transfer)
+{
+	BAutolock locker(fTransfersLock);
+	return fTransfers.RemoveItem(transfer);
+}
+
+USBEndpointQueue*
+USBDeviceHandle::EndpointQueue(struct libusb_transfer* transfer, bool create)
+{
+	int index = 0;
+	if(transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL)
+		index = (transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK)
+			| (IS_XFERIN(transfer) ? 0x10 : 0);
+	BAutolock locker(fEndpointQueuesLock);
+	// queues are created by the first transfer on their endpoint
+	if(fEndpointQueues[index] == NULL && create)
+	{
+		USBEndpointQueue* queue = new(std::nothrow) USBEndpointQueue(fRawFD, fQueueDepth);
+		if(queue == NULL)
+			return NULL;
+		if(queue->InitCheck() == false)
+		{
+			delete queue;
+			return NULL;
+		}
+		fEndpointQueues[index] = queue;
+	}
+	return fEndpointQueues[index];
+}
+
+status_t
+USBDeviceHandle::SubmitTransfer(struct usbi_transfer* itransfer)
+{
+	USBEndpointQueue* queue = EndpointQueue(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer), true);
+	if(queue == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	USBTransfer* transfer = new(std::nothrow) USBTransfer(itransfer,fUSBDevice);
+	if(transfer == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	*((USBTransfer**)usbi_transfer_get_os_priv(itransfer))=transfer;
+	queue->AddTransfer(transfer);
 	return LIBUSB_SUCCESS;
 }
 
 status_t
 USBDeviceHandle::CancelTransfer(USBTransfer* transfer)
 {
+	// a cancel never creates a queue, without one nothing was submitted
+	USBEndpointQueue* queue = EndpointQueue(USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer->UsbiTransfer()), false);
+	if(queue == NULL)
+		return LIBUSB_ERROR_NOT_FOUND;
 	transfer->SetCancelled();
-	fTransfersLock.Lock();
-	bool removed = fTransfers.RemoveItem(transfer);
-	fTransfersLock.Unlock();
-	if(removed)
+	if(queue->RemoveTransfer(transfer))
 	{
 		usbi_signal_transfer_completion(transfer->UsbiTransfer());
 	}
 	return LIBUSB_SUCCESS;
 }
 
-USBDeviceHandle::USBDeviceHandle(USBDevice* dev)
+USBDeviceHandle::USBDeviceHandle(USBDevice* dev, int depth)
 	:
-	fTransfersThread(-1),
 	fUSBDevice(dev),
 	fClaimedInterfaces(0),
+	fQueueDepth(depth > 0 ? depth : 1),
 	fInitCheck(false)
 {
+	for(int i=0; i<32; i++)
+		fEndpointQueues[i]=NULL;
 	fRawFD=open(dev->Location(), O_RDWR | O_CLOEXEC);
 	if(fRawFD < 0)
 	{
 		usbi_err(NULL,"failed to open device");
 		return;
 	}
-	fTransfersSem = create_sem(0, "Transfers Queue Sem");
-	fTransfersThread = spawn_thread(TransfersThread,"Transfer Worker",B_NORMAL_PRIORITY, this);
-	resume_thread(fTransfersThread);
 	fInitCheck = true;
 }
 
 USBDeviceHandle::~USBDeviceHandle()
 {
+	// the workers finish the transfers in flight before the fd goes away
+	for(int i=0; i<32; i++)
+		delete fEndpointQueues[i];
 	if(fRawFD>0)
 		close(fRawFD);
 	for(int i=0; i<32; i++)
@@ -264,9 +355,6 @@ USBDeviceHandle::~USBDeviceHandle()
 		if(fClaimedInterfaces&(1<<i))
 			ReleaseInterface(i);
 	}
-	delete_sem(fTransfersSem);
-	if(fTransfersThread>0)
-		wait_for_thread(fTransfersThread, NULL);
 }
 
 int
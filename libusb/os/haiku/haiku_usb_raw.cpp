@@ -50,7 +50,8 @@ static int
 haiku_open(struct libusb_device_handle *dev_handle)
 {
 	USBDevice* dev=*((USBDevice**)dev_handle->dev->os_priv);
-	USBDeviceHandle *handle=new(std::nothrow) USBDeviceHandle(dev);
+	USBDeviceHandle *handle=new(std::nothrow) USBDeviceHandle(dev,
+		HANDLE_CTX(dev_handle)->endpoint_queue_depth);
 	if (handle == NULL)
 		return LIBUSB_ERROR_NO_MEM;
 	if (handle->InitCheck() == false)
@@ -210,7 +211,10 @@ const struct usbi_os_backend haiku_usb_raw_backend = {
 	/*.exit =*/ haiku_exit,
 	/*.get_device_list =*/ NULL,
 	/*.hotplug_poll =*/ NULL,
+	/*.get_device_list_generation =*/ NULL,
+	/*.scan_devices =*/ NULL,
 	/*.open =*/ haiku_open,
+	/*.wrap_sys_device =*/ NULL,
 	/*.close =*/ haiku_close,
 	/*.get_device_descriptor =*/ haiku_get_device_descriptor,
 	/*.get_active_config_descriptor =*/ haiku_get_active_config_descriptor,
@@ -230,6 +234,13 @@ const struct usbi_os_backend haiku_usb_raw_backend = {
 	/*.alloc_streams =*/ NULL,
 	/*.free_streams =*/ NULL,
 
+	/*.dev_mem_alloc =*/ NULL,
+	/*.dev_mem_free =*/ NULL,
+
+	/*.set_pipe_policy =*/ NULL,
+	/*.get_pipe_policy =*/ NULL,
+	/*.get_numa_node =*/ NULL,
+
 	/*.kernel_driver_active =*/ NULL,
 	/*.detach_kernel_driver =*/ NULL,
 	/*.attach_kernel_driver =*/ NULL,
@@ -238,7 +249,9 @@ const struct usbi_os_backend haiku_usb_raw_backend = {
 
 	/*.submit_transfer =*/ haiku_submit_transfer,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
+	/*.cancel_endpoint_transfers =*/ NULL,
 	/*.clear_transfer_priv =*/ haiku_clear_transfer_priv,
+	/*.destroy_transfer_priv =*/ NULL,
 
 	/*.handle_events =*/ NULL,
 	/*.handle_transfer_completion =*/ haiku_handle_transfer_completion,
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #ifdef HAVE_ASM_TYPES_H
 #include <asm/types.h>
@@ -55,6 +56,16 @@
 
 #define KERNEL 1
 
+/* the kernel never sends uevents larger than its UEVENT_BUFFER_SIZE */
+#define NL_MSG_SIZE 2048
+
+/* number of messages read by a single recvmmsg() */
+#define NL_MSG_BATCH 16
+
+/* requested socket receive buffer size, so that a burst of uevents is not
+ * dropped before the monitor thread gets to it */
+#define NL_RCVBUF_SIZE (1024 * 1024)
+
 static int linux_netlink_socket = -1;
 static usbi_event_t netlink_control_event = USBI_INVALID_EVENT;
 static pthread_t libusb_linux_event_thread;
@@ -90,6 +101,53 @@ static int set_fd_cloexec_nb (int fd)
 	return 0;
 }
 
+/* keep the monitor thread from waking for the uevents it ignores. kernel
+ * uevents start with "<action>@<devpath>". only the add and remove actions
+ * are of interest. the keys, such as SUBSYSTEM, are not at fixed offsets,
+ * so they are left to linux_netlink_parse() */
+static void set_socket_filter (int fd)
+{
+#if defined(SO_ATTACH_FILTER)
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440 /* "add@" */, 4, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f /* "remo" */, 0, 2),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 3),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x6f766540 /* "ove@" */, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(filter) / sizeof(filter[0]),
+		.filter = filter,
+	};
+
+	if (0 != setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+		usbi_dbg("failed to attach netlink socket filter (errno %d)", errno);
+	}
+#else
+	(void) fd;
+#endif
+}
+
+static void set_socket_options (int fd)
+{
+	int rcvbuf = NL_RCVBUF_SIZE;
+
+	/* SO_RCVBUFFORCE may exceed rmem_max but needs CAP_NET_ADMIN */
+#if defined(SO_RCVBUFFORCE)
+	if (0 == setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf))) {
+		set_socket_filter (fd);
+		return;
+	}
+#endif
+	if (0 != setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))) {
+		usbi_dbg("failed to set netlink receive buffer size (errno %d)", errno);
+	}
+
+	set_socket_filter (fd);
+}
+
 int linux_netlink_start_event_monitor(void)
 {
 	int socktype = SOCK_RAW;
@@ -129,6 +187,8 @@ int linux_netlink_start_event_monitor(void)
 	/* TODO -- add authentication */
 	/* setsockopt(linux_netlink_socket, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)); */
 
+	set_socket_options (linux_netlink_socket);
+
 	ret = usbi_create_event(&netlink_control_event);
 	if (ret) {
 		usbi_err(NULL, "could not create netlink control event");
@@ -172,25 +232,20 @@ int linux_netlink_stop_event_monitor(void)
 	return LIBUSB_SUCCESS;
 }
 
-static const char *netlink_message_parse (const char *buffer, size_t len, const char *key)
+/* find the value of key in a "key=value" entry of a uevent, or return NULL.
+ * key includes the '=' */
+static const char *netlink_entry_value (const char *entry, const char *key, size_t keylen)
 {
-	size_t keylen = strlen(key);
-	size_t offset;
-
-	for (offset = 0 ; offset < len && '\0' != buffer[offset] ; offset += strlen(buffer + offset) + 1) {
-		if (0 == strncmp(buffer + offset, key, keylen) &&
-		    '=' == buffer[offset + keylen]) {
-			return buffer + offset + keylen + 1;
-		}
-	}
-
-	return NULL;
+	return (0 == strncmp(entry, key, keylen)) ? entry + keylen : NULL;
 }
 
 /* parse parts of netlink message common to both libudev and the kernel */
 static int linux_netlink_parse(char *buffer, size_t len, int *detached, const char **sys_name,
 			       uint8_t *busnum, uint8_t *devaddr) {
+	const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+	const char *busnum_str = NULL, *devnum_str = NULL, *devpath = NULL, *device = NULL;
 	const char *tmp;
+	size_t offset;
 	int i;
 
 	errno = 0;
@@ -200,34 +255,65 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 	*busnum   = 0;
 	*devaddr  = 0;
 
-	tmp = netlink_message_parse((const char *) buffer, len, "ACTION");
-	if (tmp == NULL)
+	/* collect the entries of interest in a single pass over the message */
+	for (offset = 0 ; offset < len && '\0' != buffer[offset] ; offset += strlen(buffer + offset) + 1) {
+		const char *entry = buffer + offset;
+
+		switch (entry[0]) {
+		case 'A':
+			if ((tmp = netlink_entry_value(entry, "ACTION=", 7)))
+				action = tmp;
+			break;
+		case 'B':
+			if ((tmp = netlink_entry_value(entry, "BUSNUM=", 7)))
+				busnum_str = tmp;
+			break;
+		case 'D':
+			if ((tmp = netlink_entry_value(entry, "DEVNUM=", 7)))
+				devnum_str = tmp;
+			else if ((tmp = netlink_entry_value(entry, "DEVPATH=", 8)))
+				devpath = tmp;
+			else if ((tmp = netlink_entry_value(entry, "DEVTYPE=", 8)))
+				devtype = tmp;
+			else if ((tmp = netlink_entry_value(entry, "DEVICE=", 7)))
+				device = tmp;
+			break;
+		case 'S':
+			if ((tmp = netlink_entry_value(entry, "SUBSYSTEM=", 10)))
+				subsystem = tmp;
+			break;
+		}
+	}
+
+	if (action == NULL)
 		return -1;
-	if (0 == strcmp(tmp, "remove")) {
+	if (0 == strcmp(action, "remove")) {
 		*detached = 1;
-	} else if (0 != strcmp(tmp, "add")) {
-		usbi_dbg("unknown device action %s", tmp);
+	} else if (0 != strcmp(action, "add")) {
+		usbi_dbg("unknown device action %s", action);
 		return -1;
 	}
 
 	/* check that this is a usb message */
-	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
-	if (NULL == tmp || 0 != strcmp(tmp, "usb")) {
+	if (NULL == subsystem || 0 != strcmp(subsystem, "usb")) {
 		/* not usb. ignore */
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "BUSNUM");
-	if (NULL == tmp) {
+	/* interfaces share the usb subsystem with devices */
+	if (NULL != devtype && 0 != strcmp(devtype, "usb_device")) {
+		return -1;
+	}
+
+	if (NULL == busnum_str) {
 		/* no bus number. try "DEVICE" */
-		tmp = netlink_message_parse(buffer, len, "DEVICE");
-		if (NULL == tmp) {
+		if (NULL == device) {
 			/* not usb. ignore */
 			return -1;
 		}
-		
+
 		/* Parse a device path such as /dev/bus/usb/003/004 */
-		char *pLastSlash = (char*)strrchr(tmp,'/');
+		char *pLastSlash = (char*)strrchr(device,'/');
 		if(NULL == pLastSlash) {
 			return -1;
 		}
@@ -237,41 +323,39 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 			errno = 0;
 			return -1;
 		}
-		
+
 		*busnum = strtoul(pLastSlash - 3, NULL, 10);
 		if (errno) {
 			errno = 0;
 			return -1;
 		}
-		
+
 		return 0;
 	}
 
-	*busnum = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+	*busnum = (uint8_t)(strtoul(busnum_str, NULL, 10) & 0xff);
 	if (errno) {
 		errno = 0;
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "DEVNUM");
-	if (NULL == tmp) {
+	if (NULL == devnum_str) {
 		return -1;
 	}
 
-	*devaddr = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+	*devaddr = (uint8_t)(strtoul(devnum_str, NULL, 10) & 0xff);
 	if (errno) {
 		errno = 0;
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "DEVPATH");
-	if (NULL == tmp) {
+	if (NULL == devpath) {
 		return -1;
 	}
 
-	for (i = strlen(tmp) - 1 ; i ; --i) {
-		if ('/' ==tmp[i]) {
-			*sys_name = tmp + i + 1;
+	for (i = strlen(devpath) - 1 ; i ; --i) {
+		if ('/' ==devpath[i]) {
+			*sys_name = devpath + i + 1;
 			break;
 		}
 	}
@@ -280,32 +364,28 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 	return 0;
 }
 
-static int linux_netlink_read_message(void)
+/* message buffers, only used with linux_hotplug_lock held. the spare byte
+ * terminates the last entry of a full-sized message */
+static unsigned char netlink_buffers[NL_MSG_BATCH][NL_MSG_SIZE + 1];
+
+static void linux_netlink_handle_message(unsigned char *buffer, size_t len)
 {
-	unsigned char buffer[1024];
-	struct iovec iov = {.iov_base = buffer, .iov_len = sizeof(buffer)};
-	struct msghdr meh = { .msg_iov=&iov, .msg_iovlen=1,
-			     .msg_name=&snl, .msg_namelen=sizeof(snl) };
 	const char *sys_name = NULL;
 	uint8_t busnum, devaddr;
 	int detached, r;
-	size_t len;
 
-	/* read netlink message */
-	memset(buffer, 0, sizeof(buffer));
-	len = recvmsg(linux_netlink_socket, &meh, 0);
 	if (len < 32) {
-		if (errno != EAGAIN)
-			usbi_dbg("error recieving message from netlink");
-		return -1;
+		usbi_dbg("ignoring short netlink message");
+		return;
 	}
+	buffer[len] = '\0';
 
 	/* TODO -- authenticate this message is from the kernel or udevd */
 
-	r = linux_netlink_parse(buffer, len, &detached, &sys_name,
+	r = linux_netlink_parse((char *) buffer, len, &detached, &sys_name,
 				&busnum, &devaddr);
 	if (r)
-		return r;
+		return;
 
 	usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
 		 busnum, devaddr, sys_name, detached ? "yes" : "no");
@@ -315,8 +395,55 @@ static int linux_netlink_read_message(void)
 		linux_device_disconnected(busnum, devaddr, sys_name);
 	else
 		linux_hotplug_enumerate(busnum, devaddr, sys_name);
+}
 
-	return 0;
+/* read and handle the pending netlink messages, up to NL_MSG_BATCH of them.
+ * returns the number of messages read, or -1 if there were none */
+static int linux_netlink_read_messages(void)
+{
+	struct iovec iov[NL_MSG_BATCH];
+	int count;
+#if defined(HAVE_RECVMMSG)
+	struct mmsghdr msgs[NL_MSG_BATCH];
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0 ; i < NL_MSG_BATCH ; i++) {
+		iov[i].iov_base = netlink_buffers[i];
+		iov[i].iov_len = NL_MSG_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	count = recvmmsg(linux_netlink_socket, msgs, NL_MSG_BATCH, MSG_DONTWAIT, NULL);
+	if (count <= 0) {
+		if (errno != EAGAIN)
+			usbi_dbg("error recieving message from netlink");
+		return -1;
+	}
+
+	for (i = 0 ; i < count ; i++)
+		linux_netlink_handle_message(netlink_buffers[i], msgs[i].msg_len);
+#else
+	struct msghdr meh = { .msg_iov=iov, .msg_iovlen=1 };
+	ssize_t len;
+
+	iov[0].iov_base = netlink_buffers[0];
+	iov[0].iov_len = NL_MSG_SIZE;
+
+	/* read netlink message */
+	len = recvmsg(linux_netlink_socket, &meh, 0);
+	if (len < 0) {
+		if (errno != EAGAIN)
+			usbi_dbg("error recieving message from netlink");
+		return -1;
+	}
+
+	linux_netlink_handle_message(netlink_buffers[0], len);
+	count = 1;
+#endif
+
+	return count;
 }
 
 static void *linux_netlink_event_thread_main(void *arg)
@@ -343,7 +470,7 @@ static void *linux_netlink_event_thread_main(void *arg)
 		}
 		if (fds[1].revents & POLLIN) {
         		usbi_mutex_static_lock(&linux_hotplug_lock);
-	        	linux_netlink_read_message();
+	        	linux_netlink_read_messages();
 	        	usbi_mutex_static_unlock(&linux_hotplug_lock);
 		}
 	}
@@ -357,7 +484,7 @@ void linux_netlink_hotplug_poll(void)
 
 	usbi_mutex_static_lock(&linux_hotplug_lock);
 	do {
-		r = linux_netlink_read_message();
-	} while (r == 0);
+		r = linux_netlink_read_messages();
+	} while (r > 0);
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
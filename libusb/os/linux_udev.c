@@ -193,7 +193,7 @@ static void *linux_udev_event_thread_main(void *arg)
 static int udev_device_info(struct libusb_context *ctx, int detached,
 			    struct udev_device *udev_dev, uint8_t *busnum,
 			    uint8_t *devaddr, const char **sys_name) {
-	const char *dev_node;
+	const char *dev_node, *busnum_str, *devnum_str;
 
 	dev_node = udev_device_get_devnode(udev_dev);
 	if (!dev_node) {
@@ -205,6 +205,25 @@ static int udev_device_info(struct libusb_context *ctx, int detached,
 		return LIBUSB_ERROR_OTHER;
 	}
 
+	/* udev has already read the bus and device numbers from the uevent, so
+	 * use them instead of going back to sysfs */
+	busnum_str = udev_device_get_property_value(udev_dev, "BUSNUM");
+	devnum_str = udev_device_get_property_value(udev_dev, "DEVNUM");
+	if (busnum_str && devnum_str) {
+		char *endptr;
+		long bus, dev;
+
+		bus = strtol(busnum_str, &endptr, 10);
+		if (endptr != busnum_str && *endptr == '\0' && bus >= 0 && bus <= 255) {
+			dev = strtol(devnum_str, &endptr, 10);
+			if (endptr != devnum_str && *endptr == '\0' && dev >= 0 && dev <= 255) {
+				*busnum = (uint8_t) bus;
+				*devaddr = (uint8_t) dev;
+				return LIBUSB_SUCCESS;
+			}
+		}
+	}
+
 	return linux_get_device_address(ctx, detached, busnum, devaddr,
 					dev_node, *sys_name);
 }
@@ -28,11 +28,13 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -117,9 +119,18 @@ static int sysfs_can_relate_devices = -1;
  * descriptors file, so from then on we can use them. */
 static int sysfs_has_descriptors = -1;
 
+/* Directory fd for SYSFS_DEVICE_PATH while the backend is initialized. sysfs
+ * attributes are opened relative to it, or to a per-device directory fd
+ * obtained from it, so the kernel does not walk the full path each time. */
+static int sysfs_dir_fd = -1;
+
 /* how many times have we initted (and not exited) ? */
 static int init_count = 0;
 
+/* set while the hotplug monitor runs, which contexts of weak authority do
+ * not need */
+static int event_monitor_running = 0;
+
 /* Serialize hotplug start/stop */
 usbi_mutex_static_t linux_hotplug_startstop_lock = USBI_MUTEX_INITIALIZER;
 /* Serialize scan-devices, event-thread, and poll */
@@ -140,10 +151,20 @@ struct linux_device_priv {
 	unsigned char *descriptors;
 	int descriptors_len;
 	int active_config; /* cache val for !sysfs_can_relate_devices  */
+
+	/* created by op_wrap_sys_device(), everything about the device comes
+	 * from usbfs rather than sysfs */
+	int wrapped;
+
+	/* usbfs capabilities, read by the first open. caps is only valid once
+	 * caps_valid is set */
+	uint32_t caps;
+	usbi_atomic_t caps_valid;
 };
 
 struct linux_device_handle_priv {
 	int fd;
+	int fd_keep;	/* fd belongs to the application, see op_wrap_sys_device() */
 	uint32_t caps;
 };
 
@@ -176,6 +197,19 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* storage backing urbs/iso_urbs. it is kept across submissions so
+	 * that resubmitting a transfer does not need a new allocation */
+	void *urb_storage;
+	size_t urb_storage_size;
+
+	/* iso URBs laid out in urb_storage by the last submission: the number
+	 * of packets (0 if there is no such layout), URBs and the buffer they
+	 * point into. a transfer resubmitted with the same packet lengths, as
+	 * when streaming, reuses the layout */
+	int iso_layout_packets;
+	int iso_layout_urbs;
+	unsigned char *iso_layout_buffer;
 };
 
 static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
@@ -363,13 +397,23 @@ static int kernel_version_ge(int major, int minor, int sublevel)
 	return ksublevel >= sublevel;
 }
 
-static int op_init(struct libusb_context *ctx)
+/* probe the kernel and its filesystems. done by the first successful init
+ * only, later contexts of the process reuse the results. Callers must hold
+ * linux_hotplug_startstop_lock */
+static int linux_probe(struct libusb_context *ctx)
 {
 	struct stat statbuf;
+	const char *path;
 	int r;
 
-	usbfs_path = find_usbfs_path();
-	if (!usbfs_path) {
+	if (usbfs_path)
+		return LIBUSB_SUCCESS;
+
+	/* contexts of weak authority only use wrapped fds and get by
+	 * without, usbfs_path stays unset so that the next context looks
+	 * again */
+	path = find_usbfs_path();
+	if (!path && !ctx->weak_authority) {
 		usbi_err(ctx, "could not find usbfs");
 		return LIBUSB_ERROR_OTHER;
 	}
@@ -434,20 +478,63 @@ static int op_init(struct libusb_context *ctx)
 	if (sysfs_has_descriptors)
 		usbi_dbg("sysfs has complete descriptors");
 
+	usbfs_path = path;
+	return LIBUSB_SUCCESS;
+}
+
+static int op_init(struct libusb_context *ctx)
+{
+	int r;
+
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
-	r = LIBUSB_SUCCESS;
-	if (init_count == 0) {
+	r = linux_probe(ctx);
+	if (r != LIBUSB_SUCCESS) {
+		usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+		return r;
+	}
+
+	/* no sysfs, no hotplug monitor and no devices, only what
+	 * libusb_wrap_sys_device() brings in */
+	if (ctx->weak_authority) {
+		init_count++;
+		usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+		return LIBUSB_SUCCESS;
+	}
+
+	/* the first context that is not of weak authority starts the
+	 * monitor, the last context to exit stops it */
+	if (!event_monitor_running) {
+		if (sysfs_can_relate_devices || sysfs_has_descriptors) {
+			sysfs_dir_fd = open(SYSFS_DEVICE_PATH, O_RDONLY | O_DIRECTORY);
+			if (sysfs_dir_fd < 0) {
+				usbi_warn(ctx, "could not open %s errno=%d",
+					SYSFS_DEVICE_PATH, errno);
+				sysfs_can_relate_devices = 0;
+				sysfs_has_descriptors = 0;
+			}
+		}
+
 		/* start up hotplug event handler */
 		r = linux_start_event_monitor();
+		if (r == LIBUSB_SUCCESS)
+			event_monitor_running = 1;
 	}
 	if (r == LIBUSB_SUCCESS) {
-		r = linux_scan_devices(ctx);
-		if (r == LIBUSB_SUCCESS)
+		/* the event monitor is shared, the devices are the context's */
+		if (!ctx->device_scan_deferred)
+			r = linux_scan_devices(ctx);
+		if (r == LIBUSB_SUCCESS) {
 			init_count++;
-		else if (init_count == 0)
+		} else if (init_count == 0) {
 			linux_stop_event_monitor();
+			event_monitor_running = 0;
+		}
 	} else
 		usbi_err(ctx, "error starting hotplug event monitor");
+	if (!event_monitor_running && sysfs_dir_fd >= 0) {
+		close(sysfs_dir_fd);
+		sysfs_dir_fd = -1;
+	}
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 
 	return r;
@@ -457,9 +544,14 @@ static void op_exit(void)
 {
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	assert(init_count != 0);
-	if (!--init_count) {
+	if (!--init_count && event_monitor_running) {
 		/* tear down event handler */
 		(void)linux_stop_event_monitor();
+		event_monitor_running = 0;
+		if (sysfs_dir_fd >= 0) {
+			close(sysfs_dir_fd);
+			sysfs_dir_fd = -1;
+		}
 	}
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 }
@@ -501,6 +593,9 @@ static int linux_scan_devices(struct libusb_context *ctx)
 
 static void op_hotplug_poll(void)
 {
+	if (!event_monitor_running)
+		return;
+
 #if defined(USE_UDEV)
 	linux_udev_hotplug_poll();
 #else
@@ -508,57 +603,109 @@ static void op_hotplug_poll(void)
 #endif
 }
 
-static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
+/* open the sysfs directory of a device */
+static int sysfs_open_device_dir(struct libusb_context *ctx,
+	const char *devname)
 {
-	struct linux_device_priv *priv = _device_priv(dev);
-	char filename[PATH_MAX];
 	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s",
-		SYSFS_DEVICE_PATH, priv->sysfs_dir, attr);
-	fd = open(filename, O_RDONLY);
+	fd = openat(sysfs_dir_fd, devname, O_RDONLY | O_DIRECTORY);
 	if (fd < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"open %s failed ret=%d errno=%d", filename, fd, errno);
+		if (errno == ENOENT) {
+			/* Directory doesn't exist. Assume the device has been
+			   disconnected (see trac ticket #70). */
+			return LIBUSB_ERROR_NO_DEVICE;
+		}
+		usbi_err(ctx, "open %s/%s failed errno=%d", SYSFS_DEVICE_PATH,
+			devname, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
 	return fd;
 }
 
-/* Note only suitable for attributes which always read >= 0, < 0 is error */
-static int __read_sysfs_attr(struct libusb_context *ctx,
-	const char *devname, const char *attr)
+/* open a sysfs attribute of the device devname. dir_fd is the directory fd
+ * of the device, or -1 to open the attribute relative to sysfs_dir_fd. */
+static int sysfs_open_attr(struct libusb_context *ctx, const char *devname,
+	int dir_fd, const char *attr)
 {
 	char filename[PATH_MAX];
-	FILE *f;
-	int r, value;
+	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH,
-		 devname, attr);
-	f = fopen(filename, "r");
-	if (f == NULL) {
+	if (dir_fd < 0) {
+		snprintf(filename, PATH_MAX, "%s/%s", devname, attr);
+		fd = openat(sysfs_dir_fd, filename, O_RDONLY);
+	} else {
+		fd = openat(dir_fd, attr, O_RDONLY);
+	}
+	if (fd < 0) {
 		if (errno == ENOENT) {
 			/* File doesn't exist. Assume the device has been
 			   disconnected (see trac ticket #70). */
 			return LIBUSB_ERROR_NO_DEVICE;
 		}
-		usbi_err(ctx, "open %s failed errno=%d", filename, errno);
+		usbi_err(ctx, "open %s/%s/%s failed errno=%d", SYSFS_DEVICE_PATH,
+			devname, attr, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
-	r = fscanf(f, "%d", &value);
-	fclose(f);
-	if (r != 1) {
-		usbi_err(ctx, "fscanf %s returned %d, errno=%d", attr, r, errno);
+	return fd;
+}
+
+static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+
+	return sysfs_open_attr(DEVICE_CTX(dev), priv->sysfs_dir, -1, attr);
+}
+
+/* Note only suitable for attributes which always read >= 0, < 0 is error */
+static int sysfs_read_attr(struct libusb_context *ctx, const char *devname,
+	int dir_fd, const char *attr)
+{
+	char tmp[20], *endptr;
+	long value;
+	ssize_t r;
+	int fd;
+
+	fd = sysfs_open_attr(ctx, devname, dir_fd, attr);
+	if (fd < 0)
+		return fd;
+
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+	if (r <= 0) {
+		usbi_err(ctx, "read %s/%s/%s returned %d, errno=%d",
+			SYSFS_DEVICE_PATH, devname, attr, (int)r, errno);
+		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
+	}
+	tmp[r] = '\0';
+
+	value = strtol(tmp, &endptr, 10);
+	if (endptr == tmp) {
+		usbi_err(ctx, "error converting %s/%s/%s '%s' to integer",
+			SYSFS_DEVICE_PATH, devname, attr, tmp);
 		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
 	}
-	if (value < 0) {
-		usbi_err(ctx, "%s contains a negative value", filename);
+	if (value < 0 || value > INT_MAX) {
+		usbi_err(ctx, "%s/%s/%s contains an invalid value",
+			SYSFS_DEVICE_PATH, devname, attr);
 		return LIBUSB_ERROR_IO;
 	}
 
-	return value;
+	return (int)value;
+}
+
+/* whether the descriptors and the active configuration of a device are
+ * taken from sysfs */
+static int device_has_sysfs_descriptors(struct libusb_device *dev)
+{
+	return sysfs_has_descriptors && !_device_priv(dev)->wrapped;
+}
+
+static int device_can_relate_sysfs(struct libusb_device *dev)
+{
+	return sysfs_can_relate_devices && !_device_priv(dev)->wrapped;
 }
 
 static int op_get_device_descriptor(struct libusb_device *dev,
@@ -566,7 +713,7 @@ static int op_get_device_descriptor(struct libusb_device *dev,
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 
-	*host_endian = sysfs_has_descriptors ? 0 : 1;
+	*host_endian = device_has_sysfs_descriptors(dev) ? 0 : 1;
 	memcpy(buffer, priv->descriptors, DEVICE_DESC_LENGTH);
 
 	return 0;
@@ -619,7 +766,7 @@ int linux_get_device_address (struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr,const char *dev_node,
 	const char *sys_name)
 {
-	int sysfs_attr;
+	int dir_fd, sysfs_attr;
 
 	usbi_dbg("getting address for device: %s detached: %d", sys_name, detached);
 	/* can't use sysfs to read the bus and device number if the
@@ -641,14 +788,16 @@ int linux_get_device_address (struct libusb_context *ctx, int detached,
 
 	usbi_dbg("scan %s", sys_name);
 
-	sysfs_attr = __read_sysfs_attr(ctx, sys_name, "busnum");
-	if (0 > sysfs_attr)
-		return sysfs_attr;
-	if (sysfs_attr > 255)
-		return LIBUSB_ERROR_INVALID_PARAM;
-	*busnum = (uint8_t) sysfs_attr;
+	dir_fd = sysfs_open_device_dir(ctx, sys_name);
+	if (dir_fd < 0)
+		return dir_fd;
 
-	sysfs_attr = __read_sysfs_attr(ctx, sys_name, "devnum");
+	sysfs_attr = sysfs_read_attr(ctx, sys_name, dir_fd, "busnum");
+	if (0 <= sysfs_attr && sysfs_attr <= 255) {
+		*busnum = (uint8_t) sysfs_attr;
+		sysfs_attr = sysfs_read_attr(ctx, sys_name, dir_fd, "devnum");
+	}
+	close(dir_fd);
 	if (0 > sysfs_attr)
 		return sysfs_attr;
 	if (sysfs_attr > 255)
@@ -686,9 +835,10 @@ static int seek_to_next_descriptor(struct libusb_context *ctx,
 }
 
 /* Return offset to next config */
-static int seek_to_next_config(struct libusb_context *ctx,
+static int seek_to_next_config(struct libusb_device *dev,
 	unsigned char *buffer, int size)
 {
+	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct libusb_config_descriptor config;
 
 	if (size == 0)
@@ -715,7 +865,7 @@ static int seek_to_next_config(struct libusb_context *ctx,
 	 * config descriptor with verified bLength fields, with descriptors
 	 * with an invalid bLength removed.
 	 */
-	if (sysfs_has_descriptors) {
+	if (device_has_sysfs_descriptors(dev)) {
 		int next = seek_to_next_descriptor(ctx, LIBUSB_DT_CONFIG,
 						   buffer, size);
 		if (next == LIBUSB_ERROR_NOT_FOUND)
@@ -744,7 +894,6 @@ static int seek_to_next_config(struct libusb_context *ctx,
 static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 	uint8_t value, unsigned char **buffer, int *host_endian)
 {
-	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct linux_device_priv *priv = _device_priv(dev);
 	unsigned char *descriptors = priv->descriptors;
 	int size = priv->descriptors_len;
@@ -760,7 +909,7 @@ static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 
 	/* Seek till the config is found, or till "EOF" */
 	while (1) {
-		int next = seek_to_next_config(ctx, descriptors, size);
+		int next = seek_to_next_config(dev, descriptors, size);
 		if (next < 0)
 			return next;
 		config = (struct libusb_config_descriptor *)descriptors;
@@ -779,7 +928,7 @@ static int op_get_active_config_descriptor(struct libusb_device *dev,
 	int r, config;
 	unsigned char *config_desc;
 
-	if (sysfs_can_relate_devices) {
+	if (device_can_relate_sysfs(dev)) {
 		r = sysfs_get_active_config(dev, &config);
 		if (r < 0)
 			return r;
@@ -817,7 +966,7 @@ static int op_get_config_descriptor(struct libusb_device *dev,
 
 	/* Seek till the config is found, or till "EOF" */
 	for (i = 0; ; i++) {
-		r = seek_to_next_config(DEVICE_CTX(dev), descriptors, size);
+		r = seek_to_next_config(dev, descriptors, size);
 		if (r < 0)
 			return r;
 		if (i == config_index)
@@ -861,13 +1010,90 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return active_config;
 }
 
+/* parse a sysfs device name ("usb<bus>" for a root hub, otherwise
+ * "<bus>-<port>[.<port>]...") into a bus number and port path. Returns the
+ * number of ports, or -1 if the name has an unexpected format. */
+static int parse_sysfs_port_path(const char *sysfs_dir, uint8_t *bus_number,
+	uint8_t *port_numbers)
+{
+	const char *p = sysfs_dir;
+	char *end;
+	long val;
+	int num_ports = 0;
+
+	if (0 == strncmp(p, "usb", 3)) {
+		val = strtol(p + 3, &end, 10);
+		if (end == p + 3 || *end || val < 0 || val > 255)
+			return -1;
+		*bus_number = (uint8_t)val;
+		return 0;
+	}
+
+	val = strtol(p, &end, 10);
+	if (end == p || *end != '-' || val < 0 || val > 255)
+		return -1;
+	*bus_number = (uint8_t)val;
+
+	do {
+		p = end + 1;
+		val = strtol(p, &end, 10);
+		if (end == p || val <= 0 || val > 255 ||
+		    num_ports == USBI_MAX_PORT_DEPTH)
+			return -1;
+		port_numbers[num_ports++] = (uint8_t)val;
+	} while (*end == '.');
+
+	return *end ? -1 : num_ports;
+}
+
+/* look the device up in the snapshot loaded by libusb_init(), and take its
+ * speed and descriptors from there. sysfs creates the device directory when
+ * the device is enumerated, so its mtime tells whether the device has been
+ * enumerated again since the snapshot was taken. Returns 1 if the device
+ * was found. */
+static int initialize_from_snapshot(struct libusb_device *dev, uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	uint8_t bus_number, port_numbers[USBI_MAX_PORT_DEPTH];
+	const unsigned char *descriptors;
+	enum libusb_speed speed;
+	struct stat statbuf;
+	size_t len;
+	int num_ports;
+
+	if (fstatat(sysfs_dir_fd, sysfs_dir, &statbuf, 0) != 0)
+		return 0;
+	dev->snapshot_stamp = (uint64_t)statbuf.st_mtim.tv_sec * 1000000000
+		+ (uint64_t)statbuf.st_mtim.tv_nsec;
+
+	num_ports = parse_sysfs_port_path(sysfs_dir, &bus_number, port_numbers);
+	if (num_ports < 0 || bus_number != busnum)
+		return 0;
+
+	descriptors = usbi_snapshot_find_device(DEVICE_CTX(dev), busnum, devaddr,
+		port_numbers, num_ports, dev->snapshot_stamp, &speed, &len);
+	if (!descriptors)
+		return 0;
+
+	priv->descriptors = malloc(len);
+	if (!priv->descriptors)
+		return 0;
+	memcpy(priv->descriptors, descriptors, len);
+	priv->descriptors_len = (int)len;
+	dev->speed = speed;
+
+	usbi_dbg("%s: using snapshot descriptors", sysfs_dir);
+	return 1;
+}
+
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	uint8_t devaddr, const char *sysfs_dir)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
-	int fd, speed;
+	int fd, dir_fd = -1, speed;
 	ssize_t r;
 
 	dev->bus_number = busnum;
@@ -879,9 +1105,20 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 			return LIBUSB_ERROR_NO_MEM;
 		strcpy(priv->sysfs_dir, sysfs_dir);
 
-		/* Note speed can contain 1.5, in this case __read_sysfs_attr
+		/* a matching device snapshot entry holds the descriptors in
+		 * the same layout as the sysfs descriptors file */
+		if (sysfs_has_descriptors &&
+		    initialize_from_snapshot(dev, busnum, devaddr, sysfs_dir))
+			goto descriptors_cached;
+
+		/* the remaining attributes are read through the device directory */
+		dir_fd = sysfs_open_device_dir(ctx, sysfs_dir);
+		if (dir_fd < 0)
+			return dir_fd;
+
+		/* Note speed can contain 1.5, in this case sysfs_read_attr
 		   will stop parsing at the '.' and return 1 */
-		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
+		speed = sysfs_read_attr(ctx, sysfs_dir, dir_fd, "speed");
 		if (speed >= 0) {
 			switch (speed) {
 			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
@@ -896,9 +1133,11 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 
 	/* cache descriptors in memory */
 	if (sysfs_has_descriptors)
-		fd = _open_sysfs_attr(dev, "descriptors");
+		fd = sysfs_open_attr(ctx, sysfs_dir, dir_fd, "descriptors");
 	else
 		fd = _get_usbfs_fd(dev, O_RDONLY, 0);
+	if (dir_fd >= 0)
+		close(dir_fd);
 	if (fd < 0)
 		return fd;
 
@@ -928,6 +1167,7 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 
 	close(fd);
 
+descriptors_cached:
 	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
 		usbi_err(ctx, "short descriptor read (%d)",
 			 priv->descriptors_len);
@@ -988,7 +1228,8 @@ static int linux_get_parent_info(struct libusb_device *dev, const char *sysfs_di
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct libusb_device *it;
 	char *parent_sysfs_dir, *tmp;
-	int ret, add_parent = 1;
+	uint8_t bus_number, port_numbers[USBI_MAX_PORT_DEPTH];
+	int ret, num_ports, add_parent = 1;
 
 	/* XXX -- can we figure out the topology when using usbfs? */
 	if (NULL == sysfs_dir || 0 == strncmp(sysfs_dir, "usb", 3)) {
@@ -1018,17 +1259,32 @@ static int linux_get_parent_info(struct libusb_device *dev, const char *sysfs_di
 		}
 	}
 
+	num_ports = parse_sysfs_port_path(parent_sysfs_dir, &bus_number, port_numbers);
+
 retry:
-	/* find the parent in the context */
-	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(it, &ctx->usb_devs, list, struct libusb_device) {
-		struct linux_device_priv *priv = _device_priv(it);
-		if (0 == strcmp (priv->sysfs_dir, parent_sysfs_dir)) {
-			dev->parent_dev = libusb_ref_device(it);
-			break;
+	/* find the parent in the context, using the port path index when the
+	 * sysfs name could be parsed */
+	if (num_ports >= 0) {
+		it = usbi_get_device_by_port_path(ctx, bus_number, port_numbers, num_ports);
+		if (it && 0 == strcmp(_device_priv(it)->sysfs_dir, parent_sysfs_dir))
+			dev->parent_dev = it;
+		else
+			libusb_unref_device(it);
+	}
+
+	/* only a sysfs name that is not a port path needs the scan over every
+	 * device, a missing parent is found with one lookup in the index */
+	if (!dev->parent_dev && num_ports < 0) {
+		usbi_mutex_lock(&ctx->usb_devs_lock);
+		list_for_each_entry(it, &ctx->usb_devs, list, struct libusb_device) {
+			struct linux_device_priv *priv = _device_priv(it);
+			if (0 == strcmp (priv->sysfs_dir, parent_sysfs_dir)) {
+				dev->parent_dev = libusb_ref_device(it);
+				break;
+			}
 		}
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
 	}
-	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
 	if (!dev->parent_dev && add_parent) {
 		usbi_dbg("parent_dev %s not enumerated yet, enumerating now",
@@ -1274,11 +1530,43 @@ static int linux_default_scan_devices (struct libusb_context *ctx)
 }
 #endif
 
-static int op_open(struct libusb_device_handle *handle)
+/* set up a handle whose usbfs fd is open */
+static int initialize_handle(struct libusb_device_handle *handle)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_device_priv *dpriv = _device_priv(handle->dev);
 	int r;
 
+	/* the capabilities do not change while the device stays connected, so
+	 * opening it again does not have to ask usbfs */
+	if (usbi_atomic_load(&dpriv->caps_valid)) {
+		hpriv->caps = dpriv->caps;
+		return usbi_add_handle_event_source(handle, hpriv->fd, POLLOUT);
+	}
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
+	if (r < 0) {
+		if (errno == ENOTTY)
+			usbi_dbg("getcap not available");
+		else
+			usbi_err(HANDLE_CTX(handle), "getcap failed (%d)", errno);
+		hpriv->caps = 0;
+		if (supports_flag_zero_packet)
+			hpriv->caps |= USBFS_CAP_ZERO_PACKET;
+		if (supports_flag_bulk_continuation)
+			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
+	}
+	/* concurrent first opens store the same value */
+	dpriv->caps = hpriv->caps;
+	usbi_atomic_or(&dpriv->caps_valid, 1);
+
+	return usbi_add_handle_event_source(handle, hpriv->fd, POLLOUT);
+}
+
+static int op_open(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
 	hpriv->fd = _get_usbfs_fd(handle->dev, O_RDWR, 0);
 	if (hpriv->fd < 0) {
 		if (hpriv->fd == LIBUSB_ERROR_NO_DEVICE) {
@@ -1295,27 +1583,126 @@ static int op_open(struct libusb_device_handle *handle)
 		return hpriv->fd;
 	}
 
-	r = ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
+	return initialize_handle(handle);
+}
+
+/* read the descriptors and the active configuration of a wrapped device
+ * through its usbfs fd */
+static int initialize_wrapped_device(struct libusb_device *dev, int fd)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	int descriptors_size = 512;
+	ssize_t r;
+
+	priv->wrapped = 1;
+
+	/* the fd was opened elsewhere, so its file offset is unknown */
+	do {
+		descriptors_size *= 2;
+		priv->descriptors = usbi_reallocf(priv->descriptors,
+						  descriptors_size);
+		if (!priv->descriptors)
+			return LIBUSB_ERROR_NO_MEM;
+		/* usbfs has holes in the file */
+		memset(priv->descriptors + priv->descriptors_len,
+		       0, descriptors_size - priv->descriptors_len);
+		r = pread(fd, priv->descriptors + priv->descriptors_len,
+			  descriptors_size - priv->descriptors_len,
+			  priv->descriptors_len);
+		if (r < 0) {
+			usbi_err(ctx, "read descriptor failed errno=%d", errno);
+			return LIBUSB_ERROR_IO;
+		}
+		priv->descriptors_len += r;
+	} while (priv->descriptors_len == descriptors_size);
+
+	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
+		usbi_err(ctx, "short descriptor read (%d)",
+			 priv->descriptors_len);
+		return LIBUSB_ERROR_IO;
+	}
+
+	r = usbfs_get_active_config(dev, fd);
+	if (r > 0) {
+		priv->active_config = (int)r;
+	} else if (r == 0 || r == LIBUSB_ERROR_IO) {
+		/* as for initialize_device() */
+		usbi_dbg("no active configuration, assuming unconfigured device");
+		priv->active_config = -1;
+	} else {
+		return (int)r;
+	}
+
+	return usbi_sanitize_device(dev);
+}
+
+/* wrap a usbfs fd opened by the application, as handed out by the USB
+ * manager of Android. sysfs and usbfs directories need not be accessible */
+static int op_wrap_sys_device(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, intptr_t sys_dev)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct usbfs_connectinfo ci;
+	struct libusb_device *dev;
+	char proc_path[32], dev_node[PATH_MAX];
+	uint8_t busnum = 0, devaddr = 0;
+	int fd = (int)sys_dev;
+	ssize_t len;
+	int r;
+
+	if (ioctl(fd, IOCTL_USBFS_CONNECTINFO, &ci) < 0) {
+		r = errno;
+		usbi_err(ctx, "connectinfo failed (%d)", r);
+		if (r == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+		return r == EBADF || r == ENOTTY ?
+			LIBUSB_ERROR_INVALID_PARAM : LIBUSB_ERROR_IO;
+	}
+
+	/* only the path of the device node tells the bus number */
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	len = readlink(proc_path, dev_node, sizeof(dev_node) - 1);
+	if (len > 0) {
+		dev_node[len] = '\0';
+		linux_get_device_address(ctx, 1, &busnum, &devaddr, dev_node, NULL);
+	}
+	devaddr = (uint8_t)ci.devnum;
+	usbi_dbg("wrap fd %d as %d.%d", fd, busnum, devaddr);
+
+	/* not in the device list of the context, so no session id is needed */
+	dev = usbi_alloc_device(ctx, 0);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+	dev->bus_number = busnum;
+	dev->device_address = devaddr;
+
+	r = initialize_wrapped_device(dev, fd);
 	if (r < 0) {
-		if (errno == ENOTTY)
-			usbi_dbg("getcap not available");
-		else
-			usbi_err(HANDLE_CTX(handle), "getcap failed (%d)", errno);
-		hpriv->caps = 0;
-		if (supports_flag_zero_packet)
-			hpriv->caps |= USBFS_CAP_ZERO_PACKET;
-		if (supports_flag_bulk_continuation)
-			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
+		libusb_unref_device(dev);
+		return r;
+	}
+	dev->attached = 1;
+
+	handle->dev = dev;
+	hpriv->fd = fd;
+	hpriv->fd_keep = 1;
+	r = initialize_handle(handle);
+	if (r < 0) {
+		handle->dev = NULL;
+		libusb_unref_device(dev);
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	return r;
 }
 
 static void op_close(struct libusb_device_handle *dev_handle)
 {
-	int fd = _device_handle_priv(dev_handle)->fd;
-	usbi_remove_event_source(HANDLE_CTX(dev_handle), fd);
-	close(fd);
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(dev_handle);
+
+	usbi_remove_handle_event_source(dev_handle, hpriv->fd);
+	if (!hpriv->fd_keep)
+		close(hpriv->fd);
 }
 
 static int op_get_configuration(struct libusb_device_handle *handle,
@@ -1323,7 +1710,7 @@ static int op_get_configuration(struct libusb_device_handle *handle,
 {
 	int r;
 
-	if (sysfs_can_relate_devices) {
+	if (device_can_relate_sysfs(handle->dev)) {
 		r = sysfs_get_active_config(handle->dev, config);
 	} else {
 		r = usbfs_get_active_config(handle->dev,
@@ -1544,6 +1931,65 @@ static int op_free_streams(struct libusb_device_handle *handle,
 				endpoints, num_endpoints);
 }
 
+/* memory mapped from the usbfs fd is used by the kernel directly as the
+ * URB buffer, so transfers using it avoid a copy (Linux 4.6 and newer) */
+static unsigned char *op_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	unsigned char *buffer;
+
+	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, hpriv->fd, 0);
+	if (buffer == MAP_FAILED) {
+		usbi_err(HANDLE_CTX(handle), "alloc dev mem failed errno %d", errno);
+		return NULL;
+	}
+	return buffer;
+}
+
+static int op_dev_mem_free(struct libusb_device_handle *handle,
+	unsigned char *buffer, size_t len)
+{
+	if (munmap(buffer, len) != 0) {
+		usbi_err(HANDLE_CTX(handle), "free dev mem failed errno %d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+static int op_get_numa_node(struct libusb_device *dev)
+{
+	char attr[32], tmp[20], *endptr;
+	long node;
+	ssize_t r;
+	int fd;
+
+	if (sysfs_dir_fd < 0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	/* the root hub of the bus is a child of the host controller */
+	snprintf(attr, sizeof(attr), "usb%u/../numa_node", dev->bus_number);
+	fd = openat(sysfs_dir_fd, attr, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? LIBUSB_ERROR_NOT_FOUND : LIBUSB_ERROR_IO;
+
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+	if (r <= 0)
+		return LIBUSB_ERROR_IO;
+	tmp[r] = '\0';
+
+	node = strtol(tmp, &endptr, 10);
+	if (endptr == tmp)
+		return LIBUSB_ERROR_IO;
+
+	/* -1 on systems without NUMA */
+	if (node < 0 || node > INT_MAX)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return (int)node;
+}
+
 static int op_kernel_driver_active(struct libusb_device_handle *handle,
 	int interface)
 {
@@ -1737,18 +2183,64 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+/* round up to the alignment needed to place URBs back to back */
+#define URB_ALIGN(size) \
+	(((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/* returns zeroed URB storage of at least the given size, reusing the storage
+ * of a previous submission of the same transfer when it is large enough */
+static void *get_urb_storage(struct linux_transfer_priv *tpriv, size_t size)
 {
-	int i;
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
-		if (!urb)
-			break;
-		free(urb);
+	if (size > tpriv->urb_storage_size) {
+		void *storage = malloc(size);
+		if (!storage)
+			return NULL;
+		free(tpriv->urb_storage);
+		tpriv->urb_storage = storage;
+		tpriv->urb_storage_size = size;
+	}
+
+	memset(tpriv->urb_storage, 0, size);
+	tpriv->iso_layout_packets = 0;
+	return tpriv->urb_storage;
+}
+
+/* if the iso URBs of the previous submission have the packet lengths of
+ * this one, point them at the new buffer and return them */
+static struct usbfs_urb **reuse_iso_urbs(struct linux_transfer_priv *tpriv,
+	struct libusb_transfer *transfer)
+{
+	struct usbfs_urb **urbs = tpriv->urb_storage;
+	int i, j, k = 0;
+
+	if (tpriv->iso_layout_packets != transfer->num_iso_packets)
+		return NULL;
+
+	for (i = 0; i < tpriv->iso_layout_urbs; i++) {
+		struct usbfs_urb *urb = urbs[i];
+
+		if (urb->endpoint != transfer->endpoint)
+			return NULL;
+		for (j = 0; j < urb->number_of_packets; j++, k++) {
+			if (urb->iso_frame_desc[j].length !=
+					transfer->iso_packet_desc[k].length)
+				return NULL;
+		}
 	}
 
-	free(tpriv->iso_urbs);
-	tpriv->iso_urbs = NULL;
+	for (i = 0; i < tpriv->iso_layout_urbs; i++) {
+		struct usbfs_urb *urb = urbs[i];
+
+		urb->buffer = transfer->buffer +
+			((unsigned char *)urb->buffer - tpriv->iso_layout_buffer);
+		urb->status = 0;
+		urb->actual_length = 0;
+		urb->error_count = 0;
+		urb->start_frame = 0;
+	}
+	tpriv->iso_layout_buffer = transfer->buffer;
+
+	return urbs;
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
@@ -1815,7 +2307,15 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	int num_urbs = transfer->length / bulk_buffer_len;
 	int last_urb_partial = 0;
 
-	if (transfer->length == 0) {
+	if (itransfer->iov) {
+		/* one or more URBs per buffer segment */
+		num_urbs = 0;
+		for (i = 0; i < itransfer->num_iov; i++)
+			num_urbs += (itransfer->iov[i].length + bulk_buffer_len - 1)
+				/ bulk_buffer_len;
+		if (num_urbs == 0)
+			num_urbs = 1;
+	} else if (transfer->length == 0) {
 		num_urbs = 1;
 	} else if ((transfer->length % bulk_buffer_len) > 0) {
 		last_urb_partial = 1;
@@ -1824,7 +2324,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
 		transfer->length);
 	alloc_size = num_urbs * sizeof(struct usbfs_urb);
-	urbs = calloc(1, alloc_size);
+	urbs = get_urb_storage(tpriv, alloc_size);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urbs;
@@ -1833,6 +2333,37 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
+	if (itransfer->iov) {
+		int urb_idx = 0;
+		int j;
+
+		for (j = 0; j < itransfer->num_iov; j++) {
+			unsigned char *buffer = itransfer->iov[j].buffer;
+			int remaining = itransfer->iov[j].length;
+
+			while (remaining > 0) {
+				int len = MIN(remaining, bulk_buffer_len);
+
+				urbs[urb_idx].buffer = buffer;
+				urbs[urb_idx].buffer_length = len;
+				urb_idx++;
+				buffer += len;
+				remaining -= len;
+			}
+		}
+	} else {
+		for (i = 0; i < num_urbs; i++) {
+			struct usbfs_urb *urb = &urbs[i];
+			urb->buffer = transfer->buffer + (i * bulk_buffer_len);
+			if (i == num_urbs - 1 && last_urb_partial)
+				urb->buffer_length = transfer->length % bulk_buffer_len;
+			else if (transfer->length == 0)
+				urb->buffer_length = 0;
+			else
+				urb->buffer_length = bulk_buffer_len;
+		}
+	}
+
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb = &urbs[i];
 		urb->usercontext = itransfer;
@@ -1850,16 +2381,9 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			break;
 		}
 		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
 		/* don't set the short not ok flag for the last URB */
 		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
 			urb->flags = USBFS_URB_SHORT_NOT_OK;
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
 
 		if (i > 0 && use_bulk_continuation)
 			urb->flags |= USBFS_URB_BULK_CONTINUATION;
@@ -1883,10 +2407,10 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
 				tpriv->urbs = NULL;
 				return r;
 			}
+			usbi_stats_urbs(TRANSFER_CTX(transfer), i);
 
 			/* if it's not the first URB that failed, the situation is a bit
 			 * tricky. we may need to discard all previous URBs. there are
@@ -1922,6 +2446,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		}
 	}
 
+	usbi_stats_urbs(TRANSFER_CTX(transfer), num_urbs);
 	return 0;
 }
 
@@ -1933,6 +2458,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb **urbs;
+	unsigned char *urb_storage;
 	size_t alloc_size;
 	int num_packets = transfer->num_iso_packets;
 	int i;
@@ -1942,6 +2468,12 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	unsigned int packet_len;
 	unsigned char *urb_buffer = transfer->buffer;
 
+	urbs = reuse_iso_urbs(tpriv, transfer);
+	if (urbs) {
+		num_urbs = tpriv->iso_layout_urbs;
+		goto submit;
+	}
+
 	/* usbfs places arbitrary limits on iso URBs. this limit has changed
 	 * at least three times, and it's difficult to accurately detect which
 	 * limit this running kernel might impose. so we attempt to submit
@@ -1966,16 +2498,16 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	}
 	usbi_dbg("need %d %dk URBs for transfer", num_urbs, MAX_ISO_BUFFER_LENGTH / 1024);
 
-	alloc_size = num_urbs * sizeof(*urbs);
-	urbs = calloc(1, alloc_size);
+	/* the URB pointer array and all the URBs share one allocation. this is
+	 * an upper bound on the space they take up once packed, each URB with
+	 * its packet descriptors is padded by up to sizeof(void *) - 1 bytes */
+	alloc_size = URB_ALIGN(num_urbs * sizeof(*urbs))
+		+ num_urbs * (sizeof(struct usbfs_urb) + sizeof(void *) - 1)
+		+ num_packets * sizeof(struct usbfs_iso_packet_desc);
+	urbs = get_urb_storage(tpriv, alloc_size);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
-
-	tpriv->iso_urbs = urbs;
-	tpriv->num_urbs = num_urbs;
-	tpriv->num_retired = 0;
-	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
+	urb_storage = (unsigned char *)urbs + URB_ALIGN(num_urbs * sizeof(*urbs));
 
 	/* allocate + initialize each URB with the correct number of packets */
 	for (i = 0; i < num_urbs; i++) {
@@ -2001,13 +2533,9 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			}
 		}
 
-		alloc_size = sizeof(*urb)
-			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
+		urb = (struct usbfs_urb *)urb_storage;
+		urb_storage += URB_ALIGN(sizeof(*urb)
+			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc)));
 		urbs[i] = urb;
 
 		/* populate packet lengths */
@@ -2026,6 +2554,17 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		urb->buffer = urb_buffer_orig;
 	}
 
+	tpriv->iso_layout_packets = num_packets;
+	tpriv->iso_layout_urbs = num_urbs;
+	tpriv->iso_layout_buffer = transfer->buffer;
+
+submit:
+	tpriv->iso_urbs = urbs;
+	tpriv->num_urbs = num_urbs;
+	tpriv->num_retired = 0;
+	tpriv->reap_action = NORMAL;
+	tpriv->iso_packet_offset = 0;
+
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
 		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
@@ -2046,9 +2585,10 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free_iso_urbs(tpriv);
+				tpriv->iso_urbs = NULL;
 				return r;
 			}
+			usbi_stats_urbs(TRANSFER_CTX(transfer), i);
 
 			/* if it's not the first URB that failed, the situation is a bit
 			 * tricky. we must discard all previous URBs. there are
@@ -2076,6 +2616,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		}
 	}
 
+	usbi_stats_urbs(TRANSFER_CTX(transfer), num_urbs);
 	return 0;
 }
 
@@ -2089,10 +2630,13 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	struct usbfs_urb *urb;
 	int r;
 
-	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
+	/* kernels without URB size limit take any data stage that wLength
+	 * can describe, in a single URB */
+	if (!(dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) &&
+	    transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(struct usbfs_urb));
+	urb = get_urb_storage(tpriv, sizeof(struct usbfs_urb));
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2107,7 +2651,6 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -2116,6 +2659,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 			"submiturb failed error %d errno=%d", r, errno);
 		return LIBUSB_ERROR_IO;
 	}
+	usbi_stats_urbs(TRANSFER_CTX(transfer), 1);
 	return 0;
 }
 
@@ -2176,22 +2720,16 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 
-	/* urbs can be freed also in submit_transfer so lock mutex first */
+	/* the URB storage itself is kept for the next submission */
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		if (tpriv->urbs) {
-			free(tpriv->urbs);
-			tpriv->urbs = NULL;
-		}
+		tpriv->urbs = NULL;
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		if (tpriv->iso_urbs) {
-			free_iso_urbs(tpriv);
-			tpriv->iso_urbs = NULL;
-		}
+		tpriv->iso_urbs = NULL;
 		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer),
@@ -2199,6 +2737,13 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	}
 }
 
+static void op_destroy_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	free(tpriv->urb_storage);
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
@@ -2235,7 +2780,9 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		if (urb->actual_length > 0) {
 			unsigned char *target = transfer->buffer + itransfer->transferred;
 			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
-			if (urb->buffer != target) {
+			/* buffer segments are only used on OUT endpoints, where
+			 * there is nothing to move */
+			if (!itransfer->iov && urb->buffer != target) {
 				usbi_dbg("moving surplus data from offset %d to offset %d",
 					(unsigned char *) urb->buffer - transfer->buffer,
 					target - transfer->buffer);
@@ -2324,10 +2871,9 @@ cancel_remaining:
 
 out_unlock:
 	usbi_mutex_unlock(&itransfer->lock);
-	return 0;
+	return 2;
 
 completed:
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return CANCELLED == tpriv->reap_action ?
@@ -2341,6 +2887,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct libusb_iso_packet_info *info;
 	int num_urbs = tpriv->num_urbs;
 	int urb_idx = 0;
 	int i;
@@ -2362,12 +2909,16 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg("handling completion status %d of iso urb %d/%d", urb->status,
 		urb_idx, num_urbs);
 
-	/* copy isochronous results back in */
+	/* copy isochronous results back in, filling the packet info array
+	 * at the same time if the application uses it */
+	info = itransfer->iso_packet_info;
+	if (info)
+		itransfer->iso_packet_info_done = 1;
 
 	for (i = 0; i < urb->number_of_packets; i++) {
 		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
 		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
+			&transfer->iso_packet_desc[tpriv->iso_packet_offset];
 		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
 		switch (urb_desc->status) {
 		case 0:
@@ -2404,6 +2955,11 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 			break;
 		}
 		lib_desc->actual_length = urb_desc->actual_length;
+		if (info) {
+			info[tpriv->iso_packet_offset].actual_length = lib_desc->actual_length;
+			info[tpriv->iso_packet_offset].status = lib_desc->status;
+		}
+		tpriv->iso_packet_offset++;
 	}
 
 	tpriv->num_retired++;
@@ -2413,7 +2969,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg("CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
+			tpriv->iso_urbs = NULL;
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
 				return usbi_handle_transfer_cancellation(itransfer);
@@ -2446,14 +3002,14 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we're the last urb then we're done */
 	if (urb_idx == num_urbs) {
 		usbi_dbg("last URB in transfer --> complete!");
-		free_iso_urbs(tpriv);
+		tpriv->iso_urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
 
 out:
 	usbi_mutex_unlock(&itransfer->lock);
-	return 0;
+	return 2;
 }
 
 static int handle_control_completion(struct usbi_transfer *itransfer,
@@ -2471,7 +3027,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
@@ -2512,12 +3067,14 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
+/* reap one URB. returns 0 when it completed its transfer, 2 when the
+ * transfer still has URBs outstanding, 1 when there was nothing to reap, or
+ * a LIBUSB_ERROR code */
 static int reap_for_handle(struct libusb_device_handle *handle)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
@@ -2543,6 +3100,7 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
+	usbi_trace_transfer(reap, transfer, urb->actual_length, urb->status);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
@@ -2563,58 +3121,90 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 static int op_handle_events(struct libusb_context *ctx,
 	void *event_data, unsigned int cnt, int num_ready)
 {
-	struct pollfd *fds = (struct pollfd *)event_data;
+	struct usbi_event_source **ready = (struct usbi_event_source **)event_data;
+	unsigned int budget = ctx->event_budget;
+	unsigned int reaped = 0;
+	unsigned int active = 0;
+	unsigned int i;
 	int r;
-	unsigned int i = 0;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
-	for (i = 0; i < cnt && num_ready > 0; i++) {
-		struct pollfd *pollfd = &fds[i];
-		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
+	UNUSED(num_ready);
 
-		if (!pollfd->revents)
-			continue;
+	/* deal with disconnections first, and compact the sources that have
+	 * URBs to reap at the front of the array */
+	for (i = 0; i < cnt; i++) {
+		struct usbi_event_source *event_source = ready[i];
+		struct libusb_device_handle *handle = event_source->user_data;
+		struct linux_device_handle_priv *hpriv;
 
-		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-			hpriv = _device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
+		/* the handle may have been closed by a callback run for an
+		 * earlier source in this batch */
+		if (event_source->removed)
+			continue;
 
-		if (!hpriv || hpriv->fd != pollfd->fd) {
-			usbi_err(ctx, "cannot find handle for fd %d",
-				 pollfd->fd);
+		if (!handle) {
+			usbi_err(ctx, "no handle for fd %d", event_source->pollfd.fd);
 			continue;
 		}
+		hpriv = _device_handle_priv(handle);
 
-		if (pollfd->revents & POLLERR) {
-			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
+		if (event_source->revents & POLLERR) {
+			usbi_remove_handle_event_source(handle, hpriv->fd);
 			usbi_handle_disconnect(handle);
 			/* device will still be marked as attached if hotplug monitor thread
 			 * hasn't processed remove event yet */
 			usbi_mutex_static_lock(&linux_hotplug_lock);
-			if (handle->dev->attached)
+			if (_device_priv(handle->dev)->wrapped) {
+				usbi_mutex_lock(&handle->dev->lock);
+				handle->dev->attached = 0;
+				usbi_mutex_unlock(&handle->dev->lock);
+			} else if (handle->dev->attached)
 				linux_device_disconnected(handle->dev->bus_number,
 						handle->dev->device_address, NULL);
 			usbi_mutex_static_unlock(&linux_hotplug_lock);
 			continue;
 		}
 
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0);
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
-			continue;
-		else if (r < 0)
-			goto out;
+		ready[active++] = event_source;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	/* reap one URB from each handle per pass so that a busy device cannot
+	 * starve the others. only URBs that complete a transfer count against
+	 * the budget. a pass is always completed, so every ready handle gets
+	 * at least one URB reaped even with a small budget. handles that still
+	 * have URBs pending when the budget runs out are reported ready again
+	 * by the next wait */
+	while (active) {
+		unsigned int still_active = 0;
+
+		for (i = 0; i < active; i++) {
+			struct usbi_event_source *event_source = ready[i];
+
+			/* a completion callback may have closed the handle */
+			if (event_source->removed)
+				continue;
+
+			r = reap_for_handle(event_source->user_data);
+			if (r == 0 || r == 2) {
+				if (r == 0)
+					reaped++;
+				ready[still_active++] = event_source;
+			} else if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE) {
+				continue;
+			} else if (r < 0) {
+				return r;
+			}
+		}
+
+		active = still_active;
+		if (budget && reaped >= budget) {
+			usbi_dbg("reap budget of %u exhausted, %u handles pending",
+				budget, active);
+			break;
+		}
+	}
+
+	return 0;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -2631,11 +3221,13 @@ static int op_clock_gettime(int clk_id, struct timespec *tp)
 
 const struct usbi_os_backend linux_usbfs_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_HAS_BULK_IOVEC,
 	.init = op_init,
 	.exit = op_exit,
 	.get_device_list = NULL,
 	.hotplug_poll = op_hotplug_poll,
+	.scan_devices = linux_scan_devices,
+	.wrap_sys_device = op_wrap_sys_device,
 	.get_device_descriptor = op_get_device_descriptor,
 	.get_active_config_descriptor = op_get_active_config_descriptor,
 	.get_config_descriptor = op_get_config_descriptor,
@@ -2655,6 +3247,10 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.alloc_streams = op_alloc_streams,
 	.free_streams = op_free_streams,
 
+	.dev_mem_alloc = op_dev_mem_alloc,
+	.dev_mem_free = op_dev_mem_free,
+	.get_numa_node = op_get_numa_node,
+
 	.kernel_driver_active = op_kernel_driver_active,
 	.detach_kernel_driver = op_detach_kernel_driver,
 	.attach_kernel_driver = op_attach_kernel_driver,
@@ -2664,6 +3260,7 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.destroy_transfer_priv = op_destroy_transfer_priv,
 
 	.handle_events = op_handle_events,
 
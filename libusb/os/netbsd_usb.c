@@ -31,6 +31,7 @@
 #include <dev/usb/usb.h>
 
 #include "libusbi.h"
+#include "bsd_async.h"
 
 struct device_priv {
 	char devnode[16];
@@ -42,6 +43,7 @@ struct device_priv {
 
 struct handle_priv {
 	int endpoints[USB_MAX_ENDPOINTS];
+	struct bsd_async_handle async;		/* endpoint workers */
 };
 
 /*
@@ -82,55 +84,37 @@ static int netbsd_clock_gettime(int, struct timespec *);
  */
 static int _errno_to_libusb(int);
 static int _cache_active_config_descriptor(struct libusb_device *, int);
-static int _sync_control_transfer(struct usbi_transfer *);
-static int _sync_gen_transfer(struct usbi_transfer *);
-static int _access_endpoint(struct libusb_transfer *);
+static int _sync_control_transfer(struct usbi_transfer *,
+    struct libusb_device_handle *);
+static int _sync_gen_transfer(struct usbi_transfer *,
+    struct libusb_device_handle *);
+static int _access_endpoint(struct libusb_device_handle *,
+    struct libusb_transfer *);
 
 const struct usbi_os_backend netbsd_backend = {
-	"Synchronous NetBSD backend",
-	0,
-	NULL,				/* init() */
-	NULL,				/* exit() */
-	netbsd_get_device_list,
-	NULL,				/* hotplug_poll */
-	netbsd_open,
-	netbsd_close,
-
-	netbsd_get_device_descriptor,
-	netbsd_get_active_config_descriptor,
-	netbsd_get_config_descriptor,
-	NULL,				/* get_config_descriptor_by_value() */
-
-	netbsd_get_configuration,
-	netbsd_set_configuration,
-
-	netbsd_claim_interface,
-	netbsd_release_interface,
-
-	netbsd_set_interface_altsetting,
-	netbsd_clear_halt,
-	netbsd_reset_device,
-
-	NULL,				/* alloc_streams */
-	NULL,				/* free_streams */
-
-	NULL,				/* kernel_driver_active() */
-	NULL,				/* detach_kernel_driver() */
-	NULL,				/* attach_kernel_driver() */
-
-	netbsd_destroy_device,
-
-	netbsd_submit_transfer,
-	netbsd_cancel_transfer,
-	netbsd_clear_transfer_priv,
-
-	NULL,				/* handle_events() */
-	netbsd_handle_transfer_completion,
-
-	netbsd_clock_gettime,
-	sizeof(struct device_priv),
-	sizeof(struct handle_priv),
-	0,				/* transfer_priv_size */
+	.name = "NetBSD backend",
+	.get_device_list = netbsd_get_device_list,
+	.open = netbsd_open,
+	.close = netbsd_close,
+	.get_device_descriptor = netbsd_get_device_descriptor,
+	.get_active_config_descriptor = netbsd_get_active_config_descriptor,
+	.get_config_descriptor = netbsd_get_config_descriptor,
+	.get_configuration = netbsd_get_configuration,
+	.set_configuration = netbsd_set_configuration,
+	.claim_interface = netbsd_claim_interface,
+	.release_interface = netbsd_release_interface,
+	.set_interface_altsetting = netbsd_set_interface_altsetting,
+	.clear_halt = netbsd_clear_halt,
+	.reset_device = netbsd_reset_device,
+	.destroy_device = netbsd_destroy_device,
+	.submit_transfer = netbsd_submit_transfer,
+	.cancel_transfer = netbsd_cancel_transfer,
+	.clear_transfer_priv = netbsd_clear_transfer_priv,
+	.handle_transfer_completion = netbsd_handle_transfer_completion,
+	.clock_gettime = netbsd_clock_gettime,
+	.device_priv_size = sizeof(struct device_priv),
+	.device_handle_priv_size = sizeof(struct handle_priv),
+	.transfer_priv_size = sizeof(struct bsd_async_transfer),
 };
 
 int
@@ -221,6 +205,12 @@ netbsd_open(struct libusb_device_handle *handle)
 
 	usbi_dbg("open %s: fd %d", dpriv->devnode, dpriv->fd);
 
+	if (bsd_async_init(&hpriv->async)) {
+		close(dpriv->fd);
+		dpriv->fd = -1;
+		return (LIBUSB_ERROR_OTHER);
+	}
+
 	return (LIBUSB_SUCCESS);
 }
 
@@ -230,6 +220,9 @@ netbsd_close(struct libusb_device_handle *handle)
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
 
+	/* the workers finish the transfers still queued */
+	bsd_async_exit(&hpriv->async);
+
 	usbi_dbg("close: fd %d", dpriv->fd);
 
 	close(dpriv->fd);
@@ -424,7 +417,9 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
 	struct handle_priv *hpriv;
-	int err = 0;
+	int (*run)(struct usbi_transfer *, struct libusb_device_handle *) =
+	    _sync_gen_transfer;
+	int err = 0, fd;
 
 	usbi_dbg("");
 
@@ -433,7 +428,7 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		err = _sync_control_transfer(itransfer);
+		run = _sync_control_transfer;
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (IS_XFEROUT(transfer)) {
@@ -441,7 +436,6 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
@@ -450,7 +444,6 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		err = LIBUSB_ERROR_NOT_SUPPORTED;
@@ -460,17 +453,36 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 	if (err)
 		return (err);
 
-	usbi_signal_transfer_completion(itransfer);
+	if (run == _sync_gen_transfer) {
+		/*
+		 * Open the endpoint node now, the workers of both directions
+		 * of an endpoint share it.
+		 */
+		usbi_mutex_lock(&transfer->dev_handle->lock);
+		fd = _access_endpoint(transfer->dev_handle, transfer);
+		err = errno;
+		usbi_mutex_unlock(&transfer->dev_handle->lock);
+
+		if (fd < 0)
+			return _errno_to_libusb(err);
+	}
 
-	return (LIBUSB_SUCCESS);
+	/* the transfer runs on the worker of its endpoint */
+	return bsd_async_submit(&hpriv->async, itransfer, run);
 }
 
 int
 netbsd_cancel_transfer(struct usbi_transfer *itransfer)
 {
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+
 	usbi_dbg("");
 
-	return (LIBUSB_ERROR_NOT_SUPPORTED);
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+
+	return bsd_async_cancel(&hpriv->async, itransfer);
 }
 
 void
@@ -484,7 +496,7 @@ netbsd_clear_transfer_priv(struct usbi_transfer *itransfer)
 int
 netbsd_handle_transfer_completion(struct usbi_transfer *itransfer)
 {
-	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_COMPLETED);
+	return bsd_async_handle_completion(itransfer);
 }
 
 int
@@ -562,22 +574,25 @@ _cache_active_config_descriptor(struct libusb_device *dev, int fd)
 }
 
 int
-_sync_control_transfer(struct usbi_transfer *itransfer)
+_sync_control_transfer(struct usbi_transfer *itransfer,
+    struct libusb_device_handle *handle)
 {
 	struct libusb_transfer *transfer;
 	struct libusb_control_setup *setup;
 	struct device_priv *dpriv;
 	struct usb_ctl_request req;
+	int timeout;
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
+	timeout = (int)usbi_transfer_timeout_ms(transfer);
+	dpriv = (struct device_priv *)handle->dev->os_priv;
 	setup = (struct libusb_control_setup *)transfer->buffer;
 
 	usbi_dbg("type %d request %d value %d index %d length %d timeout %d",
 	    setup->bmRequestType, setup->bRequest,
 	    libusb_le16_to_cpu(setup->wValue),
 	    libusb_le16_to_cpu(setup->wIndex),
-	    libusb_le16_to_cpu(setup->wLength), transfer->timeout);
+	    libusb_le16_to_cpu(setup->wLength), timeout);
 
 	req.ucr_request.bmRequestType = setup->bmRequestType;
 	req.ucr_request.bRequest = setup->bRequest;
@@ -590,7 +605,7 @@ _sync_control_transfer(struct usbi_transfer *itransfer)
 	if ((transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) == 0)
 		req.ucr_flags = USBD_SHORT_XFER_OK;
 
-	if ((ioctl(dpriv->fd, USB_SET_TIMEOUT, &transfer->timeout)) < 0)
+	if ((ioctl(dpriv->fd, USB_SET_TIMEOUT, &timeout)) < 0)
 		return _errno_to_libusb(errno);
 
 	if ((ioctl(dpriv->fd, USB_DO_REQUEST, &req)) < 0)
@@ -604,7 +619,8 @@ _sync_control_transfer(struct usbi_transfer *itransfer)
 }
 
 int
-_access_endpoint(struct libusb_transfer *transfer)
+_access_endpoint(struct libusb_device_handle *handle,
+    struct libusb_transfer *transfer)
 {
 	struct handle_priv *hpriv;
 	struct device_priv *dpriv;
@@ -612,8 +628,8 @@ _access_endpoint(struct libusb_transfer *transfer)
 	int fd, endpt;
 	mode_t mode;
 
-	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
-	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
+	hpriv = (struct handle_priv *)handle->os_priv;
+	dpriv = (struct device_priv *)handle->dev->os_priv;
 
 	endpt = UE_GET_ADDR(transfer->endpoint);
 	mode = IS_XFERIN(transfer) ? O_RDONLY : O_WRONLY;
@@ -638,21 +654,24 @@ _access_endpoint(struct libusb_transfer *transfer)
 }
 
 int
-_sync_gen_transfer(struct usbi_transfer *itransfer)
+_sync_gen_transfer(struct usbi_transfer *itransfer,
+    struct libusb_device_handle *handle)
 {
 	struct libusb_transfer *transfer;
 	int fd, nr = 1;
+	int timeout;
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	timeout = (int)usbi_transfer_timeout_ms(transfer);
 
 	/*
 	 * Bulk, Interrupt or Isochronous transfer depends on the
 	 * endpoint and thus the node to open.
 	 */
-	if ((fd = _access_endpoint(transfer)) < 0)
+	if ((fd = _access_endpoint(handle, transfer)) < 0)
 		return _errno_to_libusb(errno);
 
-	if ((ioctl(fd, USB_SET_TIMEOUT, &transfer->timeout)) < 0)
+	if ((ioctl(fd, USB_SET_TIMEOUT, &timeout)) < 0)
 		return _errno_to_libusb(errno);
 
 	if (IS_XFERIN(transfer)) {
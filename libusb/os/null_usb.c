@@ -0,0 +1,1008 @@
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * Null backend for libusb, simulating devices without any hardware
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusbi.h"
+
+/* The null backend (configure --enable-null-backend) simulates devices in
+ * process, so that the cost of the library itself can be measured and
+ * tested without the noise of a real bus. Transfers complete through
+ * usbi_signal_transfer_completion(), the path the Windows and Darwin
+ * backends use. It is configured from the environment when the first
+ * context is initialized:
+ *
+ *   LIBUSB_NULL_DEVICES     number of simulated devices [1]
+ *   LIBUSB_NULL_ID          vid:pid of the devices in hex [1d6b:0104]
+ *   LIBUSB_NULL_LATENCY_US  completion latency in microseconds [0]
+ *   LIBUSB_NULL_JITTER_US   random extra latency of up to this value [0]
+ *   LIBUSB_NULL_HOTPLUG_MS  period at which the last device is detached
+ *                           or attached again, 0 for never [0]
+ *   LIBUSB_NULL_CONFIG      configuration descriptor of the devices, as
+ *                           hex bytes, which may be separated by spaces
+ *   LIBUSB_NULL_BOS         BOS descriptor of the devices, as hex bytes.
+ *                           Without it, requests for the BOS stall
+ *
+ * Each device has one configuration. Unless LIBUSB_NULL_CONFIG replaces
+ * it, interface 0 has a bulk IN (0x81), a bulk OUT (0x01) and an interrupt
+ * IN (0x82) endpoint in alternate setting 0 and an iso IN (0x83) endpoint
+ * in alternate setting 1. The bulk endpoints support streams. The sys_dev
+ * of libusb_wrap_sys_device() is the index of a device. Transfers always
+ * move their full length, IN data is left in the buffer as it is. Without
+ * latency or hotplug, transfers complete as soon as they are submitted
+ * and no thread is started. Like an usbfs handle, each handle adds an
+ * event source of its own, which is never signalled. Like the Linux
+ * backend, the devices take their speed and device descriptor from a
+ * matching entry of a device snapshot. Their snapshot stamp counts how
+ * often the hotplug simulation attached them again. */
+
+#define NULL_DEVS_PER_BUS	127
+#define NULL_MAX_DEVICES	(NULL_DEVS_PER_BUS * 255)
+
+#define NULL_CONFIG_DESC_SIZE	55
+
+struct null_device_priv {
+	unsigned int index;
+	uint8_t active_config;
+	unsigned char device_desc[LIBUSB_DT_DEVICE_SIZE];
+};
+
+struct null_device_handle_priv {
+	usbi_event_t event;
+};
+
+struct null_transfer_priv {
+	struct usbi_transfer *itransfer;
+	/* on null_queue while queued is set, both protected by null_queue_lock */
+	struct list_head list;
+	struct timespec due;
+	int queued;
+	enum libusb_transfer_status status;
+};
+
+static struct {
+	unsigned int num_devices;
+	uint16_t vid;
+	uint16_t pid;
+	unsigned long latency_us;
+	unsigned long jitter_us;
+	unsigned long hotplug_ms;
+	/* null_config_desc, or a copy of LIBUSB_NULL_CONFIG */
+	const unsigned char *config_desc;
+	int config_len;
+	unsigned char *bos_desc;
+	int bos_len;
+} null_config;
+
+static usbi_mutex_static_t null_init_lock = USBI_MUTEX_INITIALIZER;
+static int null_init_count;
+
+/* transfers waiting for their completion time, sorted by due time. only
+ * used when null_thread_running is set */
+static usbi_mutex_t null_queue_lock;
+static usbi_cond_t null_queue_cond;
+static struct list_head null_queue;
+static usbi_thread_t null_thread;
+static int null_thread_running;
+static int null_thread_stop;
+static int null_hotplug_detached;
+static unsigned long null_hotplug_attaches;
+
+static const unsigned char null_device_desc[LIBUSB_DT_DEVICE_SIZE] = {
+	LIBUSB_DT_DEVICE_SIZE, LIBUSB_DT_DEVICE, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+	0x00, 0x00, 0x00, 0x00,	/* idVendor and idProduct, see null_config */
+	0x00, 0x01, 1, 2, 0, 1
+};
+
+static const unsigned char null_config_desc[NULL_CONFIG_DESC_SIZE] = {
+	LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG, NULL_CONFIG_DESC_SIZE, 0x00,
+	1, 1, 0, 0x80, 50,
+	/* interface 0, alternate setting 0 */
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 0, 3,
+	LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x81,
+	LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x01,
+	LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x82,
+	LIBUSB_TRANSFER_TYPE_INTERRUPT, 0x40, 0x00, 1,
+	/* interface 0, alternate setting 1 */
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 1, 1,
+	LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x83,
+	LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x04, 1,
+};
+
+static const char * const null_strings[] = { NULL, "libusb", "Null device" };
+
+static struct null_device_priv *_device_priv(struct libusb_device *dev)
+{
+	return (struct null_device_priv *) dev->os_priv;
+}
+
+static struct null_device_handle_priv *_device_handle_priv(
+	struct libusb_device_handle *handle)
+{
+	return (struct null_device_handle_priv *) handle->os_priv;
+}
+
+static int op_clock_gettime(int clk_id, struct timespec *tp)
+{
+	switch (clk_id) {
+	case USBI_CLOCK_MONOTONIC:
+		return clock_gettime(CLOCK_MONOTONIC, tp);
+	case USBI_CLOCK_REALTIME:
+		return clock_gettime(CLOCK_REALTIME, tp);
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+static void timespec_add_us(struct timespec *ts, unsigned long us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (long)(us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static unsigned long null_getenv(const char *name, unsigned long def)
+{
+	const char *value = getenv(name);
+	char *end;
+	unsigned long l;
+
+	if (!value || !*value)
+		return def;
+	l = strtoul(value, &end, 0);
+	return *end ? def : l;
+}
+
+/* read a descriptor given as hex bytes, it must span exactly its
+ * wTotalLength and hold at least the min_len bytes of its header. returns
+ * the length or 0 if unset or invalid */
+static int null_getenv_descriptor(const char *name, uint8_t type,
+	int min_len, unsigned char **desc)
+{
+	const char *value = getenv(name);
+	unsigned char *buf;
+	unsigned int byte;
+	int len = 0, n;
+
+	*desc = NULL;
+	if (!value || !*value)
+		return 0;
+
+	buf = malloc(strlen(value) / 2 + 1);
+	if (!buf)
+		return 0;
+	while (sscanf(value, " %2x%n", &byte, &n) == 1) {
+		buf[len++] = (unsigned char)byte;
+		value += n;
+	}
+
+	if (len < min_len || buf[0] < min_len || buf[1] != type || (buf[2] | buf[3] << 8) != len) {
+		usbi_warn(NULL, "ignoring malformed %s", name);
+		free(buf);
+		return 0;
+	}
+
+	*desc = buf;
+	return len;
+}
+
+static void null_read_config(void)
+{
+	unsigned char *desc;
+	const char *id = getenv("LIBUSB_NULL_ID");
+	unsigned int vid, pid;
+
+	null_config.num_devices = (unsigned int)null_getenv("LIBUSB_NULL_DEVICES", 1);
+	if (null_config.num_devices > NULL_MAX_DEVICES)
+		null_config.num_devices = NULL_MAX_DEVICES;
+	null_config.vid = 0x1d6b;
+	null_config.pid = 0x0104;
+	if (id && sscanf(id, "%x:%x", &vid, &pid) == 2) {
+		null_config.vid = (uint16_t)vid;
+		null_config.pid = (uint16_t)pid;
+	}
+	null_config.latency_us = null_getenv("LIBUSB_NULL_LATENCY_US", 0);
+	null_config.jitter_us = null_getenv("LIBUSB_NULL_JITTER_US", 0);
+	null_config.hotplug_ms = null_getenv("LIBUSB_NULL_HOTPLUG_MS", 0);
+
+	null_config.config_len = null_getenv_descriptor("LIBUSB_NULL_CONFIG",
+		LIBUSB_DT_CONFIG, LIBUSB_DT_CONFIG_SIZE, &desc);
+	if (null_config.config_len) {
+		null_config.config_desc = desc;
+	} else {
+		null_config.config_desc = null_config_desc;
+		null_config.config_len = NULL_CONFIG_DESC_SIZE;
+	}
+	null_config.bos_len = null_getenv_descriptor("LIBUSB_NULL_BOS",
+		LIBUSB_DT_BOS, LIBUSB_DT_BOS_SIZE, &null_config.bos_desc);
+
+	usbi_dbg("%u devices %04x:%04x, latency %luus + %luus, hotplug every %lums",
+		null_config.num_devices, null_config.vid, null_config.pid,
+		null_config.latency_us, null_config.jitter_us, null_config.hotplug_ms);
+}
+
+static unsigned long null_session_id(unsigned int index, uint8_t *busnum,
+	uint8_t *devaddr)
+{
+	*busnum = (uint8_t)(index / NULL_DEVS_PER_BUS + 1);
+	*devaddr = (uint8_t)(index % NULL_DEVS_PER_BUS + 1);
+	return (unsigned long)*busnum << 8 | *devaddr;
+}
+
+static void null_build_device_desc(unsigned char *buffer)
+{
+	memcpy(buffer, null_device_desc, LIBUSB_DT_DEVICE_SIZE);
+	buffer[8] = (unsigned char)(null_config.vid & 0xff);
+	buffer[9] = (unsigned char)(null_config.vid >> 8);
+	buffer[10] = (unsigned char)(null_config.pid & 0xff);
+	buffer[11] = (unsigned char)(null_config.pid >> 8);
+	/* a BOS descriptor requires bcdUSB 2.01 or later */
+	if (null_config.bos_desc)
+		buffer[2] = 0x10;
+}
+
+/* only the last device is ever attached again */
+static uint64_t null_snapshot_stamp(unsigned int index)
+{
+	uint64_t stamp = 0;
+
+	if (null_thread_running && index == null_config.num_devices - 1) {
+		usbi_mutex_lock(&null_queue_lock);
+		stamp = null_hotplug_attaches;
+		usbi_mutex_unlock(&null_queue_lock);
+	}
+	return stamp;
+}
+
+static int null_init_device(struct libusb_device *dev, unsigned int index,
+	uint8_t busnum, uint8_t devaddr)
+{
+	struct null_device_priv *priv = _device_priv(dev);
+	const unsigned char *descriptors;
+	enum libusb_speed speed;
+	size_t len;
+
+	priv->index = index;
+	priv->active_config = null_config.config_desc[5];
+	dev->bus_number = busnum;
+	dev->device_address = devaddr;
+	dev->speed = LIBUSB_SPEED_HIGH;
+	dev->snapshot_stamp = null_snapshot_stamp(index);
+	null_build_device_desc(priv->device_desc);
+
+	descriptors = usbi_snapshot_find_device(DEVICE_CTX(dev), busnum, devaddr,
+		NULL, 0, dev->snapshot_stamp, &speed, &len);
+	if (descriptors && len >= LIBUSB_DT_DEVICE_SIZE) {
+		usbi_dbg("device %d.%d: using snapshot descriptors", busnum, devaddr);
+		memcpy(priv->device_desc, descriptors, LIBUSB_DT_DEVICE_SIZE);
+		dev->speed = speed;
+	}
+
+	return usbi_sanitize_device(dev);
+}
+
+static int null_enumerate_device(struct libusb_context *ctx, unsigned int index)
+{
+	struct libusb_device *dev;
+	unsigned long session_id;
+	uint8_t busnum, devaddr;
+	int r;
+
+	session_id = null_session_id(index, &busnum, &devaddr);
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (dev) {
+		libusb_unref_device(dev);
+		return LIBUSB_SUCCESS;
+	}
+
+	dev = usbi_alloc_device(ctx, session_id);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = null_init_device(dev, index, busnum, devaddr);
+	if (r < 0) {
+		libusb_unref_device(dev);
+		return r;
+	}
+
+	usbi_connect_device(dev);
+	return LIBUSB_SUCCESS;
+}
+
+/* detach or attach the last device in all contexts */
+static void null_hotplug_toggle(int detach)
+{
+	struct libusb_context *ctx;
+	struct libusb_device *dev;
+	unsigned int index = null_config.num_devices - 1;
+	uint8_t busnum, devaddr;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+		if (!detach) {
+			null_enumerate_device(ctx, index);
+			continue;
+		}
+		dev = usbi_get_device_by_session_id(ctx,
+			null_session_id(index, &busnum, &devaddr));
+		if (dev) {
+			usbi_disconnect_device(dev);
+			libusb_unref_device(dev);
+		}
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+}
+
+static usbi_thread_ret_t USBI_THREAD_CALL null_thread_main(void *arg)
+{
+	struct null_transfer_priv *tpriv;
+	struct timespec now, next_hotplug, wake;
+	int have_wake;
+
+	UNUSED(arg);
+
+	op_clock_gettime(USBI_CLOCK_REALTIME, &next_hotplug);
+	timespec_add_us(&next_hotplug, null_config.hotplug_ms * 1000);
+
+	usbi_mutex_lock(&null_queue_lock);
+	while (!null_thread_stop) {
+		op_clock_gettime(USBI_CLOCK_REALTIME, &now);
+
+		/* complete the transfers that are due */
+		while (!list_empty(&null_queue)) {
+			tpriv = list_first_entry(&null_queue, struct null_transfer_priv, list);
+			if (timespec_before(&now, &tpriv->due))
+				break;
+			list_del(&tpriv->list);
+			tpriv->queued = 0;
+			usbi_signal_transfer_completion(tpriv->itransfer);
+		}
+
+		if (null_config.hotplug_ms && null_config.num_devices &&
+				!timespec_before(&now, &next_hotplug)) {
+			null_hotplug_detached = !null_hotplug_detached;
+			if (!null_hotplug_detached)
+				null_hotplug_attaches++;
+			usbi_mutex_unlock(&null_queue_lock);
+			null_hotplug_toggle(null_hotplug_detached);
+			usbi_mutex_lock(&null_queue_lock);
+			next_hotplug = now;
+			timespec_add_us(&next_hotplug, null_config.hotplug_ms * 1000);
+			continue;
+		}
+
+		/* sleep until the next transfer or hotplug event is due */
+		have_wake = 0;
+		if (!list_empty(&null_queue)) {
+			wake = list_first_entry(&null_queue, struct null_transfer_priv, list)->due;
+			have_wake = 1;
+		}
+		if (null_config.hotplug_ms && (!have_wake || timespec_before(&next_hotplug, &wake))) {
+			wake = next_hotplug;
+			have_wake = 1;
+		}
+		if (have_wake)
+			usbi_cond_timedwait(&null_queue_cond, &null_queue_lock, &wake);
+		else
+			usbi_cond_wait(&null_queue_cond, &null_queue_lock);
+	}
+	usbi_mutex_unlock(&null_queue_lock);
+
+	return (usbi_thread_ret_t)0;
+}
+
+static int null_start_thread(void)
+{
+	list_init(&null_queue);
+	null_thread_stop = 0;
+	null_hotplug_detached = 0;
+	null_hotplug_attaches = 0;
+
+	if (usbi_mutex_init(&null_queue_lock, NULL))
+		return LIBUSB_ERROR_OTHER;
+	if (usbi_cond_init(&null_queue_cond, NULL)) {
+		usbi_mutex_destroy(&null_queue_lock);
+		return LIBUSB_ERROR_OTHER;
+	}
+	if (usbi_thread_create(&null_thread, null_thread_main, NULL)) {
+		usbi_cond_destroy(&null_queue_cond);
+		usbi_mutex_destroy(&null_queue_lock);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	null_thread_running = 1;
+	return LIBUSB_SUCCESS;
+}
+
+static void null_stop_thread(void)
+{
+	usbi_mutex_lock(&null_queue_lock);
+	null_thread_stop = 1;
+	usbi_cond_signal(&null_queue_cond);
+	usbi_mutex_unlock(&null_queue_lock);
+
+	usbi_thread_join(null_thread);
+	usbi_cond_destroy(&null_queue_cond);
+	usbi_mutex_destroy(&null_queue_lock);
+	null_thread_running = 0;
+}
+
+static void null_free_config(void)
+{
+	if (null_config.config_desc != null_config_desc)
+		free((unsigned char *)null_config.config_desc);
+	null_config.config_desc = NULL;
+	free(null_config.bos_desc);
+	null_config.bos_desc = NULL;
+}
+
+static void op_exit(void)
+{
+	usbi_mutex_static_lock(&null_init_lock);
+	if (--null_init_count == 0) {
+		if (null_thread_running)
+			null_stop_thread();
+		null_free_config();
+	}
+	usbi_mutex_static_unlock(&null_init_lock);
+}
+
+static int op_scan_devices(struct libusb_context *ctx)
+{
+	unsigned int num_devices;
+	unsigned int i;
+	int r;
+
+	/* leave out the last device while the hotplug simulation has it
+	 * detached */
+	num_devices = null_config.num_devices;
+	if (null_thread_running) {
+		usbi_mutex_lock(&null_queue_lock);
+		if (null_hotplug_detached)
+			num_devices--;
+		usbi_mutex_unlock(&null_queue_lock);
+	}
+
+	for (i = 0; i < num_devices; i++) {
+		r = null_enumerate_device(ctx, i);
+		if (r < 0)
+			return r;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static int op_init(struct libusb_context *ctx)
+{
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&null_init_lock);
+	if (null_init_count == 0) {
+		null_read_config();
+		if (null_config.latency_us || null_config.jitter_us ||
+				null_config.hotplug_ms)
+			r = null_start_thread();
+		if (r != LIBUSB_SUCCESS)
+			null_free_config();
+	}
+	if (r == LIBUSB_SUCCESS)
+		null_init_count++;
+	usbi_mutex_static_unlock(&null_init_lock);
+	if (r != LIBUSB_SUCCESS || ctx->device_scan_deferred ||
+			ctx->weak_authority)
+		return r;
+
+	r = op_scan_devices(ctx);
+	if (r < 0)
+		op_exit();
+	return r;
+}
+
+static int op_get_device_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, int *host_endian)
+{
+	memcpy(buffer, _device_priv(dev)->device_desc, LIBUSB_DT_DEVICE_SIZE);
+	*host_endian = 0;
+	return 0;
+}
+
+static int op_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
+{
+	UNUSED(dev);
+
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	len = MIN(len, (size_t)null_config.config_len);
+	memcpy(buffer, null_config.config_desc, len);
+	*host_endian = 0;
+	return (int)len;
+}
+
+static int op_get_active_config_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, size_t len, int *host_endian)
+{
+	if (!_device_priv(dev)->active_config)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return op_get_config_descriptor(dev, 0, buffer, len, host_endian);
+}
+
+static int op_get_config_descriptor_by_value(struct libusb_device *dev,
+	uint8_t value, unsigned char **buffer, int *host_endian)
+{
+	UNUSED(dev);
+
+	if (value != null_config.config_desc[5])
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	*buffer = (unsigned char *)null_config.config_desc;
+	*host_endian = 0;
+	return null_config.config_len;
+}
+
+static int op_open(struct libusb_device_handle *handle)
+{
+	struct null_device_handle_priv *hpriv = _device_handle_priv(handle);
+	int r;
+
+	r = usbi_create_event(&hpriv->event);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	r = usbi_add_handle_event_source(handle,
+		USBI_EVENT_GET_SOURCE(hpriv->event), USBI_EVENT_MASK);
+	if (r < 0)
+		usbi_destroy_event(&hpriv->event);
+	return r;
+}
+
+/* sys_dev is the index of a simulated device */
+static int op_wrap_sys_device(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, intptr_t sys_dev)
+{
+	struct libusb_device *dev;
+	uint8_t busnum, devaddr;
+	int r;
+
+	if (sys_dev < 0 || (uintptr_t)sys_dev >= null_config.num_devices)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	dev = usbi_alloc_device(ctx, 0);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	(void)null_session_id((unsigned int)sys_dev, &busnum, &devaddr);
+	r = null_init_device(dev, (unsigned int)sys_dev, busnum, devaddr);
+	if (r < 0) {
+		libusb_unref_device(dev);
+		return r;
+	}
+	dev->attached = 1;
+
+	handle->dev = dev;
+	r = op_open(handle);
+	if (r < 0) {
+		handle->dev = NULL;
+		libusb_unref_device(dev);
+	}
+	return r;
+}
+
+static void op_close(struct libusb_device_handle *handle)
+{
+	struct null_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+	usbi_remove_handle_event_source(handle,
+		USBI_EVENT_GET_SOURCE(hpriv->event));
+	usbi_destroy_event(&hpriv->event);
+}
+
+static int op_get_configuration(struct libusb_device_handle *handle, int *config)
+{
+	*config = _device_priv(handle->dev)->active_config;
+	return LIBUSB_SUCCESS;
+}
+
+static int op_set_configuration(struct libusb_device_handle *handle, int config)
+{
+	uint8_t value = null_config.config_desc[5];
+
+	if (config != -1 && config != 0 && config != value)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	_device_priv(handle->dev)->active_config = config == value ? value : 0;
+	return LIBUSB_SUCCESS;
+}
+
+static int op_claim_interface(struct libusb_device_handle *handle, int iface)
+{
+	UNUSED(handle);
+
+	return iface == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int op_release_interface(struct libusb_device_handle *handle, int iface)
+{
+	UNUSED(handle);
+	UNUSED(iface);
+	return LIBUSB_SUCCESS;
+}
+
+static int op_set_interface(struct libusb_device_handle *handle, int iface,
+	int altsetting)
+{
+	UNUSED(handle);
+	UNUSED(iface);
+
+	return (altsetting == 0 || altsetting == 1) ?
+		LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int op_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	UNUSED(handle);
+	UNUSED(endpoint);
+	return LIBUSB_SUCCESS;
+}
+
+/* a bus reset leaves a device unconfigured, and there is no kernel here to
+ * restore its configuration */
+static int op_reset_device(struct libusb_device_handle *handle)
+{
+	_device_priv(handle->dev)->active_config = 0;
+	return LIBUSB_SUCCESS;
+}
+
+/* the bulk endpoints take as many streams as asked for, up to the USB 3
+ * maximum. stream transfers behave like bulk transfers */
+static int op_alloc_streams(struct libusb_device_handle *handle,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	int i;
+
+	UNUSED(handle);
+	for (i = 0; i < num_endpoints; i++) {
+		if ((endpoints[i] & LIBUSB_ENDPOINT_ADDRESS_MASK) != 1)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	return num_streams > 65533 ? 65533 : (int)num_streams;
+}
+
+static int op_free_streams(struct libusb_device_handle *handle,
+	unsigned char *endpoints, int num_endpoints)
+{
+	UNUSED(handle);
+	UNUSED(endpoints);
+	UNUSED(num_endpoints);
+	return LIBUSB_SUCCESS;
+}
+
+/* fill a standard descriptor for a GET_DESCRIPTOR request, returns its
+ * length or -1 to stall */
+static int null_get_descriptor(struct libusb_device *dev, uint8_t type,
+	uint8_t index, unsigned char *data, int length)
+{
+	unsigned char buf[64];
+	const unsigned char *desc = buf;
+	int desc_len, host_endian, i;
+	const char *s;
+
+	switch (type) {
+	case LIBUSB_DT_DEVICE:
+		op_get_device_descriptor(dev, buf, &host_endian);
+		desc_len = LIBUSB_DT_DEVICE_SIZE;
+		break;
+	case LIBUSB_DT_CONFIG:
+		if (index != 0)
+			return -1;
+		desc = null_config.config_desc;
+		desc_len = null_config.config_len;
+		break;
+	case LIBUSB_DT_BOS:
+		if (index != 0 || !null_config.bos_desc)
+			return -1;
+		desc = null_config.bos_desc;
+		desc_len = null_config.bos_len;
+		break;
+	case LIBUSB_DT_STRING:
+		if (index == 0) {
+			/* US English only */
+			buf[2] = 0x09;
+			buf[3] = 0x04;
+			desc_len = 4;
+		} else if (index < sizeof(null_strings) / sizeof(null_strings[0])) {
+			s = null_strings[index];
+			for (i = 0; s[i]; i++) {
+				buf[2 + 2 * i] = (unsigned char)s[i];
+				buf[3 + 2 * i] = 0;
+			}
+			desc_len = 2 + 2 * i;
+		} else {
+			return -1;
+		}
+		buf[0] = (unsigned char)desc_len;
+		buf[1] = LIBUSB_DT_STRING;
+		break;
+	default:
+		return -1;
+	}
+
+	desc_len = MIN(desc_len, length);
+	memcpy(data, desc, desc_len);
+	return desc_len;
+}
+
+static void null_control_request(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct null_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+	unsigned char *data = libusb_control_transfer_get_data(transfer);
+	uint16_t wValue = libusb_le16_to_cpu(setup->wValue);
+	int length = MIN(libusb_le16_to_cpu(setup->wLength),
+		transfer->length - LIBUSB_CONTROL_SETUP_SIZE);
+	int r = length;
+
+	if (setup->bmRequestType == (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+			LIBUSB_RECIPIENT_DEVICE) &&
+			setup->bRequest == LIBUSB_REQUEST_GET_DESCRIPTOR)
+		r = null_get_descriptor(transfer->dev_handle->dev,
+			(uint8_t)(wValue >> 8), (uint8_t)(wValue & 0xff), data, length);
+	else if (setup->bmRequestType & LIBUSB_ENDPOINT_IN)
+		memset(data, 0, length);
+
+	if (r < 0) {
+		itransfer->transferred = 0;
+		tpriv->status = LIBUSB_TRANSFER_STALL;
+	} else {
+		itransfer->transferred = r;
+		tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+	}
+}
+
+/* hand a transfer to the completion thread, or complete it right away */
+static void null_complete_transfer(struct usbi_transfer *itransfer)
+{
+	struct null_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct null_transfer_priv *cur;
+	struct list_head *pos;
+	unsigned long delay_us;
+
+	if (!null_thread_running) {
+		usbi_signal_transfer_completion(itransfer);
+		return;
+	}
+
+	usbi_mutex_lock(&null_queue_lock);
+	delay_us = null_config.latency_us;
+	if (null_config.jitter_us)
+		delay_us += (unsigned long)rand() % (null_config.jitter_us + 1);
+	op_clock_gettime(USBI_CLOCK_REALTIME, &tpriv->due);
+	timespec_add_us(&tpriv->due, delay_us);
+
+	/* keep the queue sorted, searching from the tail where most transfers
+	 * belong */
+	for (pos = null_queue.prev; pos != &null_queue; pos = pos->prev) {
+		cur = list_entry(pos, struct null_transfer_priv, list);
+		if (!timespec_before(&tpriv->due, &cur->due))
+			break;
+	}
+	list_add(&tpriv->list, pos);
+	tpriv->queued = 1;
+	if (null_queue.next == &tpriv->list)
+		usbi_cond_signal(&null_queue_cond);
+	usbi_mutex_unlock(&null_queue_lock);
+}
+
+static int op_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct null_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int i;
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		null_control_request(itransfer);
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		itransfer->transferred = transfer->length;
+		tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		itransfer->transferred = 0;
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pack =
+				&transfer->iso_packet_desc[i];
+
+			pack->actual_length = pack->length;
+			pack->status = LIBUSB_TRANSFER_COMPLETED;
+			itransfer->transferred += pack->length;
+		}
+		tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+		break;
+	default:
+		usbi_err(TRANSFER_CTX(transfer),
+			"unsupported transfer type %d", transfer->type);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	tpriv->itransfer = itransfer;
+	null_complete_transfer(itransfer);
+	return LIBUSB_SUCCESS;
+}
+
+static int op_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct null_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	if (!null_thread_running)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&null_queue_lock);
+	if (!tpriv->queued) {
+		usbi_mutex_unlock(&null_queue_lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	list_del(&tpriv->list);
+	tpriv->queued = 0;
+	tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+	itransfer->transferred = 0;
+	usbi_signal_transfer_completion(itransfer);
+	usbi_mutex_unlock(&null_queue_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int op_cancel_endpoint_transfers(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct null_transfer_priv *tpriv, *tmp;
+	struct libusb_transfer *queued;
+
+	if (!null_thread_running)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* like a pipe abort, every queued transfer of the endpoint ends */
+	usbi_mutex_lock(&null_queue_lock);
+	list_for_each_entry_safe(tpriv, tmp, &null_queue, list, struct null_transfer_priv) {
+		queued = USBI_TRANSFER_TO_LIBUSB_TRANSFER(tpriv->itransfer);
+		if (queued->dev_handle != transfer->dev_handle
+				|| queued->endpoint != transfer->endpoint
+				|| queued->type != transfer->type)
+			continue;
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+		tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+		tpriv->itransfer->transferred = 0;
+		usbi_signal_transfer_completion(tpriv->itransfer);
+	}
+	usbi_mutex_unlock(&null_queue_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+}
+
+static int op_handle_events(struct libusb_context *ctx,
+	void *event_data, unsigned int cnt, int num_ready)
+{
+	/* the event sources of the handles are never signalled */
+	UNUSED(ctx);
+	UNUSED(event_data);
+	UNUSED(cnt);
+	UNUSED(num_ready);
+	return LIBUSB_SUCCESS;
+}
+
+static int op_handle_transfer_completion(struct usbi_transfer *itransfer)
+{
+	struct null_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	enum libusb_transfer_status status;
+
+	/* the transfer may complete before libusb_submit_transfer() returns,
+	 * wait for it to release the transfer */
+	usbi_mutex_lock(&itransfer->lock);
+	status = tpriv->status;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (status == LIBUSB_TRANSFER_CANCELLED)
+		return usbi_handle_transfer_cancellation(itransfer);
+	return usbi_handle_transfer_completion(itransfer, status);
+}
+
+const struct usbi_os_backend null_backend = {
+	.name = "Null",
+	.caps = 0,
+	.init = op_init,
+	.exit = op_exit,
+	.get_device_list = NULL,
+	.hotplug_poll = NULL,
+	.scan_devices = op_scan_devices,
+	.get_device_descriptor = op_get_device_descriptor,
+	.get_active_config_descriptor = op_get_active_config_descriptor,
+	.get_config_descriptor = op_get_config_descriptor,
+	.get_config_descriptor_by_value = op_get_config_descriptor_by_value,
+
+	.open = op_open,
+	.wrap_sys_device = op_wrap_sys_device,
+	.close = op_close,
+	.get_configuration = op_get_configuration,
+	.set_configuration = op_set_configuration,
+	.claim_interface = op_claim_interface,
+	.release_interface = op_release_interface,
+
+	.set_interface_altsetting = op_set_interface,
+	.clear_halt = op_clear_halt,
+	.reset_device = op_reset_device,
+
+	.alloc_streams = op_alloc_streams,
+	.free_streams = op_free_streams,
+
+	.dev_mem_alloc = NULL,
+	.dev_mem_free = NULL,
+
+	.kernel_driver_active = NULL,
+	.detach_kernel_driver = NULL,
+	.attach_kernel_driver = NULL,
+
+	.destroy_device = NULL,
+
+	.submit_transfer = op_submit_transfer,
+	.cancel_transfer = op_cancel_transfer,
+	.cancel_endpoint_transfers = op_cancel_endpoint_transfers,
+	.clear_transfer_priv = op_clear_transfer_priv,
+
+	.handle_events = op_handle_events,
+	.handle_transfer_completion = op_handle_transfer_completion,
+
+	.clock_gettime = op_clock_gettime,
+
+	.device_priv_size = sizeof(struct null_device_priv),
+	.device_handle_priv_size = sizeof(struct null_device_handle_priv),
+	.transfer_priv_size = sizeof(struct null_transfer_priv),
+};
@@ -31,6 +31,7 @@
 #include <dev/usb/usb.h>
 
 #include "libusbi.h"
+#include "bsd_async.h"
 
 struct device_priv {
 	char *devname;				/* name of the ugen(4) node */
@@ -42,6 +43,7 @@ struct device_priv {
 
 struct handle_priv {
 	int endpoints[USB_MAX_ENDPOINTS];
+	struct bsd_async_handle async;		/* endpoint workers */
 };
 
 /*
@@ -82,58 +84,40 @@ static int obsd_clock_gettime(int, struct timespec *);
  */
 static int _errno_to_libusb(int);
 static int _cache_active_config_descriptor(struct libusb_device *);
-static int _sync_control_transfer(struct usbi_transfer *);
-static int _sync_gen_transfer(struct usbi_transfer *);
-static int _access_endpoint(struct libusb_transfer *);
+static int _sync_control_transfer(struct usbi_transfer *,
+    struct libusb_device_handle *);
+static int _sync_gen_transfer(struct usbi_transfer *,
+    struct libusb_device_handle *);
+static int _access_endpoint(struct libusb_device_handle *,
+    struct libusb_transfer *);
 
 static int _bus_open(int);
 
 
 const struct usbi_os_backend openbsd_backend = {
-	"Synchronous OpenBSD backend",
-	0,
-	NULL,				/* init() */
-	NULL,				/* exit() */
-	obsd_get_device_list,
-	NULL,				/* hotplug_poll */
-	obsd_open,
-	obsd_close,
-
-	obsd_get_device_descriptor,
-	obsd_get_active_config_descriptor,
-	obsd_get_config_descriptor,
-	NULL,				/* get_config_descriptor_by_value() */
-
-	obsd_get_configuration,
-	obsd_set_configuration,
-
-	obsd_claim_interface,
-	obsd_release_interface,
-
-	obsd_set_interface_altsetting,
-	obsd_clear_halt,
-	obsd_reset_device,
-
-	NULL,				/* alloc_streams */
-	NULL,				/* free_streams */
-
-	NULL,				/* kernel_driver_active() */
-	NULL,				/* detach_kernel_driver() */
-	NULL,				/* attach_kernel_driver() */
-
-	obsd_destroy_device,
-
-	obsd_submit_transfer,
-	obsd_cancel_transfer,
-	obsd_clear_transfer_priv,
-
-	NULL,				/* handle_events() */
-	obsd_handle_transfer_completion,
-
-	obsd_clock_gettime,
-	sizeof(struct device_priv),
-	sizeof(struct handle_priv),
-	0,				/* transfer_priv_size */
+	.name = "OpenBSD backend",
+	.get_device_list = obsd_get_device_list,
+	.open = obsd_open,
+	.close = obsd_close,
+	.get_device_descriptor = obsd_get_device_descriptor,
+	.get_active_config_descriptor = obsd_get_active_config_descriptor,
+	.get_config_descriptor = obsd_get_config_descriptor,
+	.get_configuration = obsd_get_configuration,
+	.set_configuration = obsd_set_configuration,
+	.claim_interface = obsd_claim_interface,
+	.release_interface = obsd_release_interface,
+	.set_interface_altsetting = obsd_set_interface_altsetting,
+	.clear_halt = obsd_clear_halt,
+	.reset_device = obsd_reset_device,
+	.destroy_device = obsd_destroy_device,
+	.submit_transfer = obsd_submit_transfer,
+	.cancel_transfer = obsd_cancel_transfer,
+	.clear_transfer_priv = obsd_clear_transfer_priv,
+	.handle_transfer_completion = obsd_handle_transfer_completion,
+	.clock_gettime = obsd_clock_gettime,
+	.device_priv_size = sizeof(struct device_priv),
+	.device_handle_priv_size = sizeof(struct handle_priv),
+	.transfer_priv_size = sizeof(struct bsd_async_transfer),
 };
 
 #define DEVPATH	"/dev/"
@@ -261,6 +245,14 @@ obsd_open(struct libusb_device_handle *handle)
 		usbi_dbg("open %s: fd %d", devnode, dpriv->fd);
 	}
 
+	if (bsd_async_init(&hpriv->async)) {
+		if (dpriv->devname) {
+			close(dpriv->fd);
+			dpriv->fd = -1;
+		}
+		return (LIBUSB_ERROR_OTHER);
+	}
+
 	return (LIBUSB_SUCCESS);
 }
 
@@ -270,6 +262,9 @@ obsd_close(struct libusb_device_handle *handle)
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
 
+	/* the workers finish the transfers still queued */
+	bsd_async_exit(&hpriv->async);
+
 	if (dpriv->devname) {
 		usbi_dbg("close: fd %d", dpriv->fd);
 
@@ -470,16 +465,24 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
 	struct handle_priv *hpriv;
-	int err = 0;
+	struct device_priv *dpriv;
+	int (*run)(struct usbi_transfer *, struct libusb_device_handle *) =
+	    _sync_gen_transfer;
+	int err = 0, fd;
 
 	usbi_dbg("");
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL &&
+	    dpriv->devname == NULL)
+		return (LIBUSB_ERROR_NOT_SUPPORTED);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		err = _sync_control_transfer(itransfer);
+		run = _sync_control_transfer;
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (IS_XFEROUT(transfer)) {
@@ -487,7 +490,6 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
@@ -496,7 +498,6 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		err = LIBUSB_ERROR_NOT_SUPPORTED;
@@ -506,17 +507,36 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 	if (err)
 		return (err);
 
-	usbi_signal_transfer_completion(itransfer);
+	if (run == _sync_gen_transfer) {
+		/*
+		 * Open the endpoint node now, the workers of both directions
+		 * of an endpoint share it.
+		 */
+		usbi_mutex_lock(&transfer->dev_handle->lock);
+		fd = _access_endpoint(transfer->dev_handle, transfer);
+		err = errno;
+		usbi_mutex_unlock(&transfer->dev_handle->lock);
 
-	return (LIBUSB_SUCCESS);
+		if (fd < 0)
+			return _errno_to_libusb(err);
+	}
+
+	/* the transfer runs on the worker of its endpoint */
+	return bsd_async_submit(&hpriv->async, itransfer, run);
 }
 
 int
 obsd_cancel_transfer(struct usbi_transfer *itransfer)
 {
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+
 	usbi_dbg("");
 
-	return (LIBUSB_ERROR_NOT_SUPPORTED);
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+
+	return bsd_async_cancel(&hpriv->async, itransfer);
 }
 
 void
@@ -530,7 +550,7 @@ obsd_clear_transfer_priv(struct usbi_transfer *itransfer)
 int
 obsd_handle_transfer_completion(struct usbi_transfer *itransfer)
 {
-	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_COMPLETED);
+	return bsd_async_handle_completion(itransfer);
 }
 
 int
@@ -622,24 +642,27 @@ _cache_active_config_descriptor(struct libusb_device *dev)
 }
 
 int
-_sync_control_transfer(struct usbi_transfer *itransfer)
+_sync_control_transfer(struct usbi_transfer *itransfer,
+    struct libusb_device_handle *handle)
 {
 	struct libusb_transfer *transfer;
 	struct libusb_control_setup *setup;
 	struct device_priv *dpriv;
 	struct usb_ctl_request req;
+	int timeout;
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
+	timeout = (int)usbi_transfer_timeout_ms(transfer);
+	dpriv = (struct device_priv *)handle->dev->os_priv;
 	setup = (struct libusb_control_setup *)transfer->buffer;
 
 	usbi_dbg("type %x request %x value %x index %d length %d timeout %d",
 	    setup->bmRequestType, setup->bRequest,
 	    libusb_le16_to_cpu(setup->wValue),
 	    libusb_le16_to_cpu(setup->wIndex),
-	    libusb_le16_to_cpu(setup->wLength), transfer->timeout);
+	    libusb_le16_to_cpu(setup->wLength), timeout);
 
-	req.ucr_addr = transfer->dev_handle->dev->device_address;
+	req.ucr_addr = handle->dev->device_address;
 	req.ucr_request.bmRequestType = setup->bmRequestType;
 	req.ucr_request.bRequest = setup->bRequest;
 	/* Don't use USETW, libusb already deals with the endianness */
@@ -659,7 +682,7 @@ _sync_control_transfer(struct usbi_transfer *itransfer)
 		 */
 		int fd, err;
 
-		if ((fd = _bus_open(transfer->dev_handle->dev->bus_number)) < 0)
+		if ((fd = _bus_open(handle->dev->bus_number)) < 0)
 			return _errno_to_libusb(errno);
 
 		if ((ioctl(fd, USB_REQUEST, &req)) < 0) {
@@ -669,7 +692,7 @@ _sync_control_transfer(struct usbi_transfer *itransfer)
 		}
 		close(fd);
 	} else {
-		if ((ioctl(dpriv->fd, USB_SET_TIMEOUT, &transfer->timeout)) < 0)
+		if ((ioctl(dpriv->fd, USB_SET_TIMEOUT, &timeout)) < 0)
 			return _errno_to_libusb(errno);
 
 		if ((ioctl(dpriv->fd, USB_DO_REQUEST, &req)) < 0)
@@ -684,7 +707,8 @@ _sync_control_transfer(struct usbi_transfer *itransfer)
 }
 
 int
-_access_endpoint(struct libusb_transfer *transfer)
+_access_endpoint(struct libusb_device_handle *handle,
+    struct libusb_transfer *transfer)
 {
 	struct handle_priv *hpriv;
 	struct device_priv *dpriv;
@@ -692,8 +716,8 @@ _access_endpoint(struct libusb_transfer *transfer)
 	int fd, endpt;
 	mode_t mode;
 
-	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
-	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
+	hpriv = (struct handle_priv *)handle->os_priv;
+	dpriv = (struct device_priv *)handle->dev->os_priv;
 
 	endpt = UE_GET_ADDR(transfer->endpoint);
 	mode = IS_XFERIN(transfer) ? O_RDONLY : O_WRONLY;
@@ -717,14 +741,17 @@ _access_endpoint(struct libusb_transfer *transfer)
 }
 
 int
-_sync_gen_transfer(struct usbi_transfer *itransfer)
+_sync_gen_transfer(struct usbi_transfer *itransfer,
+    struct libusb_device_handle *handle)
 {
 	struct libusb_transfer *transfer;
 	struct device_priv *dpriv;
 	int fd, nr = 1;
+	int timeout;
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
+	timeout = (int)usbi_transfer_timeout_ms(transfer);
+	dpriv = (struct device_priv *)handle->dev->os_priv;
 
 	if (dpriv->devname == NULL)
 		return (LIBUSB_ERROR_NOT_SUPPORTED);
@@ -733,10 +760,10 @@ _sync_gen_transfer(struct usbi_transfer *itransfer)
 	 * Bulk, Interrupt or Isochronous transfer depends on the
 	 * endpoint and thus the node to open.
 	 */
-	if ((fd = _access_endpoint(transfer)) < 0)
+	if ((fd = _access_endpoint(handle, transfer)) < 0)
 		return _errno_to_libusb(errno);
 
-	if ((ioctl(fd, USB_SET_TIMEOUT, &transfer->timeout)) < 0)
+	if ((ioctl(fd, USB_SET_TIMEOUT, &timeout)) < 0)
 		return _errno_to_libusb(errno);
 
 	if (IS_XFERIN(transfer)) {
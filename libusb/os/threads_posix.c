@@ -27,13 +27,22 @@
 # endif
 # include <unistd.h>
 # include <sys/syscall.h>
+#endif
+#if defined(__linux__)
+# include <errno.h>
+# include <fcntl.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
 #elif defined(__APPLE__)
 # include <mach/mach.h>
 #elif defined(__CYGWIN__)
 # include <windows.h>
 #endif
 
-#include "threads_posix.h"
+#include <sched.h>
+
+#include "libusbi.h"
 
 int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
 {
@@ -60,6 +69,148 @@ finish:
 	return err;
 }
 
+int usbi_thread_create(usbi_thread_t *thread, usbi_thread_fn_t fn, void *arg)
+{
+	return pthread_create(thread, NULL, fn, arg);
+}
+
+int usbi_thread_join(usbi_thread_t thread)
+{
+	return pthread_join(thread, NULL);
+}
+
+/* pin the calling thread to one CPU */
+int usbi_thread_set_affinity(int cpu)
+{
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_SET)
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return LIBUSB_ERROR_OTHER;
+	return 0;
+#else
+	(void)cpu;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* pin the calling thread to the CPUs of one NUMA node */
+int usbi_thread_set_node_affinity(int node)
+{
+#if defined(__linux__) && defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_SET)
+	char path[64], list[1024], *p, *endptr;
+	cpu_set_t set;
+	ssize_t r;
+	int fd;
+
+	if (node < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? LIBUSB_ERROR_NOT_FOUND : LIBUSB_ERROR_IO;
+	r = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (r <= 0)
+		return LIBUSB_ERROR_IO;
+	list[r] = '\0';
+
+	/* a list of ranges such as "0-7,16-23" */
+	CPU_ZERO(&set);
+	for (p = list; *p != '\0' && *p != '\n'; ) {
+		long first, last;
+
+		first = strtol(p, &endptr, 10);
+		if (endptr == p)
+			return LIBUSB_ERROR_IO;
+		last = first;
+		p = endptr;
+		if (*p == '-') {
+			last = strtol(p + 1, &endptr, 10);
+			if (endptr == p + 1)
+				return LIBUSB_ERROR_IO;
+			p = endptr;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET((int)first, &set);
+		if (*p == ',')
+			p++;
+	}
+
+	/* nodes with memory only */
+	if (CPU_COUNT(&set) == 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return LIBUSB_ERROR_OTHER;
+	return 0;
+#else
+	(void)node;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* prefer a NUMA node for the pages of a mapping that are not populated yet.
+ * the allocation falls back to other nodes when the node runs out */
+int usbi_bind_memory(void *addr, size_t len, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	/* MPOL_PREFERRED of <linux/mempolicy.h> */
+	const int mpol_preferred = 1;
+	const unsigned int bits = 8 * sizeof(unsigned long);
+	unsigned long nodemask[1024 / (8 * sizeof(unsigned long))];
+
+	if (node < 0 || node >= 1024)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / bits] |= 1UL << (node % bits);
+
+	/* the kernel reads one bit less than maxnode */
+	if (syscall(SYS_mbind, addr, len, mpol_preferred, nodemask,
+			8 * sizeof(nodemask) + 1, 0) != 0)
+		return LIBUSB_ERROR_OTHER;
+	return 0;
+#else
+	(void)addr;
+	(void)len;
+	(void)node;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* the size of the pages of MAP_HUGETLB mappings, 0 if it is unknown */
+size_t usbi_huge_page_size(void)
+{
+#if defined(__linux__)
+	char info[4096], *p;
+	unsigned long kb;
+	ssize_t r;
+	int fd;
+
+	fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	r = read(fd, info, sizeof(info) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+	info[r] = '\0';
+
+	p = strstr(info, "Hugepagesize:");
+	if (!p || sscanf(p, "Hugepagesize: %lu kB", &kb) != 1)
+		return 0;
+	return (size_t)kb * 1024;
+#else
+	return 0;
+#endif
+}
+
 int usbi_get_tid(void)
 {
 	int ret = -1;
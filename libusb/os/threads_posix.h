@@ -43,6 +43,89 @@
 #define usbi_cond_destroy		pthread_cond_destroy
 #define usbi_cond_signal		pthread_cond_signal
 
+#define usbi_thread_t			pthread_t
+typedef void *usbi_thread_ret_t;
+#define USBI_THREAD_CALL
+typedef usbi_thread_ret_t (USBI_THREAD_CALL *usbi_thread_fn_t)(void *arg);
+
+/* word sized values updated without a lock. usbi_atomic_cas() replaces the
+ * value with new if it still equals old, and otherwise loads the current
+ * value into old. the __atomic builtins are provided by gcc 4.7 and clang */
+typedef long usbi_atomic_t;
+#if defined(__ATOMIC_ACQ_REL)
+#define usbi_atomic_load(a)		__atomic_load_n((a), __ATOMIC_ACQUIRE)
+#define usbi_atomic_or(a, v)		__atomic_fetch_or((a), (v), __ATOMIC_ACQ_REL)
+#define usbi_atomic_and(a, v)		__atomic_fetch_and((a), (v), __ATOMIC_ACQ_REL)
+#define usbi_atomic_add(a, v)		__atomic_fetch_add((a), (v), __ATOMIC_ACQ_REL)
+#define usbi_atomic_cas(a, old, new)	\
+	__atomic_compare_exchange_n((a), &(old), (new), 0, \
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+#define usbi_atomic_load(a)		__sync_fetch_and_or((a), 0)
+#define usbi_atomic_or(a, v)		__sync_fetch_and_or((a), (v))
+#define usbi_atomic_and(a, v)		__sync_fetch_and_and((a), (v))
+#define usbi_atomic_add(a, v)		__sync_fetch_and_add((a), (v))
+#define usbi_atomic_cas(a, old, new)	usbi_atomic_cas_sync((a), &(old), (new))
+static inline int usbi_atomic_cas_sync(usbi_atomic_t *a, long *old, long new_)
+{
+	long prev = __sync_val_compare_and_swap(a, *old, new_);
+
+	if (prev == *old)
+		return 1;
+	*old = prev;
+	return 0;
+}
+#endif
+
+/* 64 bit counters updated without a lock, on platforms where long is
+ * narrower as well */
+typedef uint64_t usbi_atomic64_t;
+#if defined(__ATOMIC_ACQ_REL)
+#define usbi_atomic64_load(a)		__atomic_load_n((a), __ATOMIC_RELAXED)
+#define usbi_atomic64_add(a, v)		__atomic_fetch_add((a), (v), __ATOMIC_RELAXED)
+#else
+#define usbi_atomic64_load(a)		__sync_fetch_and_add((a), 0)
+#define usbi_atomic64_add(a, v)		__sync_fetch_and_add((a), (v))
+#endif
+
+/* the same for pointers, which need not be word sized */
+#if defined(__ATOMIC_ACQ_REL)
+#define usbi_atomic_load_ptr(a)		__atomic_load_n((a), __ATOMIC_ACQUIRE)
+#define usbi_atomic_xchg_ptr(a, v)	__atomic_exchange_n((a), (v), __ATOMIC_ACQ_REL)
+#define usbi_atomic_cas_ptr(a, old, new)	\
+	__atomic_compare_exchange_n((a), &(old), (new), 0, \
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+#define usbi_atomic_load_ptr(a)		__sync_val_compare_and_swap((a), NULL, NULL)
+#define usbi_atomic_xchg_ptr(a, v)	usbi_atomic_xchg_ptr_sync((void **)(a), (v))
+#define usbi_atomic_cas_ptr(a, old, new)	\
+	usbi_atomic_cas_ptr_sync((void **)(a), (void **)&(old), (new))
+static inline int usbi_atomic_cas_ptr_sync(void **a, void **old, void *new_)
+{
+	void *prev = __sync_val_compare_and_swap(a, *old, new_);
+
+	if (prev == *old)
+		return 1;
+	*old = prev;
+	return 0;
+}
+static inline void *usbi_atomic_xchg_ptr_sync(void **a, void *v)
+{
+	void *prev = *a;
+
+	while (!usbi_atomic_cas_ptr_sync(a, &prev, v))
+		;
+	return prev;
+}
+#endif
+
+int usbi_thread_create(usbi_thread_t *thread, usbi_thread_fn_t fn, void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+int usbi_thread_set_affinity(int cpu);
+int usbi_thread_set_node_affinity(int node);
+int usbi_bind_memory(void *addr, size_t len, int node);
+size_t usbi_huge_page_size(void);
+
 extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
 
 int usbi_get_tid(void);
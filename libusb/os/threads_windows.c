@@ -23,6 +23,9 @@
 #include <objbase.h>
 #include <errno.h>
 #include <stdarg.h>
+#if !defined(_WIN32_WCE)
+#include <process.h>
+#endif
 
 #include "libusbi.h"
 
@@ -209,6 +212,21 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 	return usbi_cond_intwait(cond, mutex, millis);
 }
 
+int usbi_thread_create(usbi_thread_t *thread, usbi_thread_fn_t fn, void *arg) {
+#if defined(_WIN32_WCE)
+	*thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)fn, arg, 0, NULL);
+#else
+	*thread = (HANDLE)_beginthreadex(NULL, 0, fn, arg, 0, NULL);
+#endif
+	if (!*thread) return ((errno=EAGAIN));
+	return 0;
+}
+int usbi_thread_join(usbi_thread_t thread) {
+	if (WaitForSingleObject(thread, INFINITE) != WAIT_OBJECT_0) return ((errno=EINVAL));
+	CloseHandle(thread);
+	return 0;
+}
+
 int usbi_get_tid(void) {
 	return GetCurrentThreadId();
 }
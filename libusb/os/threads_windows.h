@@ -82,6 +82,69 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_cond_broadcast(usbi_cond_t *cond);
 int usbi_cond_signal(usbi_cond_t *cond);
 
+// word sized values updated without a lock, see threads_posix.h
+typedef volatile LONG usbi_atomic_t;
+// InterlockedOr() and InterlockedAnd() are missing from older MinGW headers
+#define usbi_atomic_load(a)		InterlockedCompareExchange((a), 0, 0)
+#define usbi_atomic_or(a, v)		usbi_atomic_or_interlocked((a), (v))
+#define usbi_atomic_and(a, v)		usbi_atomic_and_interlocked((a), (v))
+#define usbi_atomic_add(a, v)		InterlockedExchangeAdd((a), (v))
+static inline LONG usbi_atomic_or_interlocked(usbi_atomic_t *a, LONG v)
+{
+	LONG prev = *a, cur;
+
+	while ((cur = InterlockedCompareExchange(a, prev | v, prev)) != prev)
+		prev = cur;
+	return prev;
+}
+
+static inline LONG usbi_atomic_and_interlocked(usbi_atomic_t *a, LONG v)
+{
+	LONG prev = *a, cur;
+
+	while ((cur = InterlockedCompareExchange(a, prev & v, prev)) != prev)
+		prev = cur;
+	return prev;
+}
+
+#define usbi_atomic_cas(a, old, new)	usbi_atomic_cas_interlocked((a), &(old), (new))
+static inline int usbi_atomic_cas_interlocked(usbi_atomic_t *a, long *old, long new_)
+{
+	LONG prev = InterlockedCompareExchange(a, new_, *old);
+
+	if (prev == *old)
+		return 1;
+	*old = prev;
+	return 0;
+}
+
+// 64 bit counters updated without a lock
+typedef volatile LONGLONG usbi_atomic64_t;
+#define usbi_atomic64_load(a)		InterlockedCompareExchange64((a), 0, 0)
+#define usbi_atomic64_add(a, v)		InterlockedExchangeAdd64((a), (LONGLONG)(v))
+
+#define usbi_atomic_load_ptr(a)		InterlockedCompareExchangePointer((PVOID volatile *)(a), NULL, NULL)
+#define usbi_atomic_xchg_ptr(a, v)	InterlockedExchangePointer((PVOID volatile *)(a), (v))
+#define usbi_atomic_cas_ptr(a, old, new)	\
+	usbi_atomic_cas_ptr_interlocked((PVOID volatile *)(a), (PVOID *)&(old), (new))
+static inline int usbi_atomic_cas_ptr_interlocked(PVOID volatile *a, PVOID *old, PVOID new_)
+{
+	PVOID prev = InterlockedCompareExchangePointer(a, new_, *old);
+
+	if (prev == *old)
+		return 1;
+	*old = prev;
+	return 0;
+}
+
+#define usbi_thread_t		HANDLE
+typedef unsigned usbi_thread_ret_t;
+#define USBI_THREAD_CALL	__stdcall
+typedef usbi_thread_ret_t (USBI_THREAD_CALL *usbi_thread_fn_t)(void *arg);
+
+int usbi_thread_create(usbi_thread_t *thread, usbi_thread_fn_t fn, void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+
 int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_WINDOWS_H */
@@ -553,7 +553,7 @@ static int wince_submit_control_or_bulk_transfer(struct usbi_transfer *itransfer
 	if (transfer_priv->overlapped.hEvent == NULL) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
-	r = usbi_add_event_source(ctx, transfer_priv->overlapped.hEvent, 0);
+	r = usbi_add_event_source(ctx, transfer_priv->overlapped.hEvent, 0, itransfer);
 	if (r) {
 		CloseHandle(transfer_priv->overlapped.hEvent);
 		transfer_priv->overlapped.hEvent = NULL;
@@ -681,7 +681,7 @@ static void wince_transfer_callback(
 		status = LIBUSB_TRANSFER_TIMED_OUT;
 		break;
 	case ERROR_OPERATION_ABORTED:
-		if (itransfer->flags & USBI_TRANSFER_TIMED_OUT) {
+		if (usbi_atomic_load(&itransfer->flags) & USBI_TRANSFER_TIMED_OUT) {
 			usbi_dbg("detected timeout");
 			status = LIBUSB_TRANSFER_TIMED_OUT;
 		} else {
@@ -727,6 +727,7 @@ static int wince_handle_events(
 	unsigned int cnt, int num_ready)
 {
 	HANDLE *handles = (HANDLE *)event_data;
+	struct libusb_device_handle *handle;
 	struct usbi_transfer *transfer;
 	struct wince_transfer_priv* transfer_priv;
 	unsigned int i;
@@ -737,15 +738,19 @@ static int wince_handle_events(
 	for (i = 0; i < cnt; i++) {
 		transfer_priv = NULL;
 		found = FALSE;
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-			transfer_priv = usbi_transfer_get_os_priv(transfer);
-			if (transfer_priv->overlapped.hEvent == handles[i]) {
-				found = TRUE;
-				break;
+		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+			usbi_mutex_lock(&handle->flying_transfers_lock);
+			list_for_each_entry(transfer, &handle->flying_transfers, handle_list, struct usbi_transfer) {
+				transfer_priv = usbi_transfer_get_os_priv(transfer);
+				if (transfer_priv->overlapped.hEvent == handles[i]) {
+					found = TRUE;
+					break;
+				}
 			}
+			usbi_mutex_unlock(&handle->flying_transfers_lock);
+			if (found)
+				break;
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 		if (found && HasOverlappedIoCompleted(&transfer_priv->overlapped)) {
 			io_result = (DWORD)transfer_priv->overlapped.Internal;
@@ -801,48 +806,32 @@ static int wince_clock_gettime(int clk_id, struct timespec *tp)
 }
 
 const struct usbi_os_backend wince_backend = {
-	"Windows CE",
-	0,
-	wince_init,
-	wince_exit,
-
-	wince_get_device_list,
-	NULL,				/* hotplug_poll */
-	wince_open,
-	wince_close,
-
-	wince_get_device_descriptor,
-	wince_get_active_config_descriptor,
-	wince_get_config_descriptor,
-	NULL,				/* get_config_descriptor_by_value() */
-
-	wince_get_configuration,
-	wince_set_configuration,
-	wince_claim_interface,
-	wince_release_interface,
-
-	wince_set_interface_altsetting,
-	wince_clear_halt,
-	wince_reset_device,
-
-  NULL,				/* alloc_streams */
-  NULL,				/* free_streams */
-
-	wince_kernel_driver_active,
-	wince_detach_kernel_driver,
-	wince_attach_kernel_driver,
-
-	wince_destroy_device,
-
-	wince_submit_transfer,
-	wince_cancel_transfer,
-	wince_clear_transfer_priv,
-
-	wince_handle_events,
-	NULL,				/* handle_transfer_completion() */
-
-	wince_clock_gettime,
-	sizeof(struct wince_device_priv),
-	sizeof(struct wince_device_handle_priv),
-	sizeof(struct wince_transfer_priv),
+	.name = "Windows CE",
+	.init = wince_init,
+	.exit = wince_exit,
+	.get_device_list = wince_get_device_list,
+	.open = wince_open,
+	.close = wince_close,
+	.get_device_descriptor = wince_get_device_descriptor,
+	.get_active_config_descriptor = wince_get_active_config_descriptor,
+	.get_config_descriptor = wince_get_config_descriptor,
+	.get_configuration = wince_get_configuration,
+	.set_configuration = wince_set_configuration,
+	.claim_interface = wince_claim_interface,
+	.release_interface = wince_release_interface,
+	.set_interface_altsetting = wince_set_interface_altsetting,
+	.clear_halt = wince_clear_halt,
+	.reset_device = wince_reset_device,
+	.kernel_driver_active = wince_kernel_driver_active,
+	.detach_kernel_driver = wince_detach_kernel_driver,
+	.attach_kernel_driver = wince_attach_kernel_driver,
+	.destroy_device = wince_destroy_device,
+	.submit_transfer = wince_submit_transfer,
+	.cancel_transfer = wince_cancel_transfer,
+	.clear_transfer_priv = wince_clear_transfer_priv,
+	.handle_events = wince_handle_events,
+	.clock_gettime = wince_clock_gettime,
+	.device_priv_size = sizeof(struct wince_device_priv),
+	.device_handle_priv_size = sizeof(struct wince_device_handle_priv),
+	.transfer_priv_size = sizeof(struct wince_transfer_priv),
 };
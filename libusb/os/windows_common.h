@@ -59,7 +59,6 @@
 #endif
 
 #define ERR_BUFFER_SIZE             256
-#define TIMER_REQUEST_RETRY_MS      100
 #define MAX_TIMER_SEMAPHORES        128
 
 // Handle synchronous completion through the overlapped structure
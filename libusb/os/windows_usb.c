@@ -45,7 +45,6 @@
 // Helper prototypes
 static int windows_get_active_config_descriptor(struct libusb_device *dev, unsigned char *buffer, size_t len, int *host_endian);
 static int windows_clock_gettime(int clk_id, struct timespec *tp);
-unsigned __stdcall windows_clock_gettime_threaded(void* param);
 // Common calls
 static int common_configure_endpoints(int sub_api, struct libusb_device_handle *dev_handle, int iface);
 
@@ -60,7 +59,14 @@ static int winusbx_release_interface(int sub_api, struct libusb_device_handle *d
 static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_set_interface_altsetting(int sub_api, struct libusb_device_handle *dev_handle, int iface, int altsetting);
 static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer);
+static int winusbx_submit_iso_transfer(int sub_api, struct usbi_transfer *itransfer);
+static void winusbx_unregister_isoch_buffers(struct libusb_device_handle *dev_handle, int iface);
+static void winusbx_release_isoch_buffer(struct winusbx_isoch_buffer *isoch_buffer);
 static int winusbx_clear_halt(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint);
+static int winusbx_set_pipe_policy(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	enum libusb_pipe_policy policy, unsigned int value);
+static int winusbx_get_pipe_policy(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	enum libusb_pipe_policy policy, unsigned int *value);
 static int winusbx_abort_transfers(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_abort_control(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_reset_device(int sub_api, struct libusb_device_handle *dev_handle);
@@ -98,20 +104,37 @@ static int composite_copy_transfer_data(int sub_api, struct usbi_transfer *itran
 
 
 // Global variables
-uint64_t hires_frequency, hires_ticks_to_ps;
+uint64_t hires_frequency;
 const uint64_t epoch_time = UINT64_C(116444736000000000);	// 1970.01.01 00:00:000 in MS Filetime
 int windows_version = WINDOWS_UNDEFINED;
 static char windows_version_str[128] = "Windows Undefined";
 // Concurrency
 static int concurrent_usage = -1;
 usbi_mutex_t autoclaim_lock;
-// Timer thread
-HANDLE timer_thread = NULL;
-DWORD timer_thread_id = 0;
+#if defined(ENABLE_ETW_TRACING)
+// ETW provider for the tracepoints of trace.h
+// {7da4c3c3-9370-4838-af9b-6733693534c6}
+TRACELOGGING_DEFINE_PROVIDER(usbi_trace_provider, "libusb",
+	(0x7da4c3c3, 0x9370, 0x4838, 0xaf, 0x9b, 0x67, 0x33, 0x69, 0x35, 0x34, 0xc6));
+#endif
 // API globals
 #define CHECK_WINUSBX_AVAILABLE(sub_api) do { if (sub_api == SUB_API_NOTSET) sub_api = priv->sub_api; \
 	if (!WinUSBX[sub_api].initialized) return LIBUSB_ERROR_ACCESS; } while(0)
 static struct winusb_interface WinUSBX[SUB_API_MAX];
+// A transfer buffer registered with WinUsb_RegisterIsochBuffer(). It is owned
+// by the transfer, and linked on its device handle while registered so that
+// releasing the interface can unregister it. isoch_buffer_lock protects the
+// links and the handle.
+struct winusbx_isoch_buffer {
+	struct list_head list;
+	WINUSB_ISOCH_BUFFER_HANDLE handle; // NULL when not registered
+	int sub_api;
+	uint8_t interface_number;
+	uint8_t endpoint;
+	unsigned char *buffer;
+	int length;
+};
+static usbi_mutex_static_t isoch_buffer_lock = USBI_MUTEX_INITIALIZER;
 const char* sub_api_name[SUB_API_MAX] = WINUSBX_DRV_NAMES;
 bool api_hid_available = false;
 #define CHECK_HID_AVAILABLE do { if (!api_hid_available) return LIBUSB_ERROR_ACCESS; } while (0)
@@ -119,6 +142,18 @@ bool api_hid_available = false;
 // a single transfer (OVERLAPPED) when used. As it may not be part of any of the
 // platform headers, we hook into the Kernel32 system DLL directly to seek it.
 static BOOL(__stdcall *pCancelIoEx)(HANDLE, LPOVERLAPPED) = NULL;
+// SetFileCompletionNotificationModes is also Vista and later only. Without it,
+// handles cannot be associated with the I/O completion port, as requests that
+// complete immediately would be reported twice.
+static BOOL(__stdcall *pSetFileCompletionNotificationModes)(HANDLE, UCHAR) = NULL;
+#ifndef FILE_SKIP_COMPLETION_PORT_ON_SUCCESS
+#define FILE_SKIP_COMPLETION_PORT_ON_SUCCESS	0x1
+#endif
+// Device change notifications, used to tell the core when the device list it
+// cached from the last enumeration is stale. device_list_generation stays at 0
+// (meaning "unknown") when notifications are not available (pre Windows 8).
+static HANDLE device_notify[2] = { NULL, NULL };
+static volatile LONG device_list_generation = 0;
 
 static inline BOOLEAN guid_eq(const GUID *guid1, const GUID *guid2) {
 	if ((guid1 != NULL) && (guid2 != NULL)) {
@@ -247,11 +282,19 @@ static int init_dlls(void)
 	}
 	usbi_dbg("Will use CancelIo%s for I/O cancellation",
 		pCancelIoEx ? "Ex" : "");
+	if (hKernel32 != NULL) {
+		pSetFileCompletionNotificationModes = (BOOL(__stdcall *)(HANDLE, UCHAR))
+			GetProcAddress(hKernel32, "SetFileCompletionNotificationModes");
+	}
+	usbi_dbg("Will use %s for I/O completion",
+		pSetFileCompletionNotificationModes ? "the completion port" : "events");
 
 	DLL_LOAD(Cfgmgr32.dll, CM_Get_Parent, TRUE);
 	DLL_LOAD(Cfgmgr32.dll, CM_Get_Child, TRUE);
 	DLL_LOAD(Cfgmgr32.dll, CM_Get_Sibling, TRUE);
 	DLL_LOAD(Cfgmgr32.dll, CM_Get_Device_IDA, TRUE);
+	DLL_LOAD_PREFIXED(Cfgmgr32.dll, p, CM_Register_Notification, FALSE);
+	DLL_LOAD_PREFIXED(Cfgmgr32.dll, p, CM_Unregister_Notification, FALSE);
 	// Prefixed to avoid conflict with header files
 	DLL_LOAD_PREFIXED(OLE32.dll, p, CLSIDFromString, TRUE);
 	DLL_LOAD_PREFIXED(SetupAPI.dll, p, SetupDiGetClassDevsA, TRUE);
@@ -267,6 +310,71 @@ static int init_dlls(void)
 	return LIBUSB_SUCCESS;
 }
 
+/*
+ * Device change notifications
+ */
+static DWORD CALLBACK device_change_callback(HANDLE notify, PVOID context,
+	DWORD action, PVOID event_data, DWORD event_data_size)
+{
+	UNUSED(notify);
+	UNUSED(context);
+	UNUSED(action);
+	UNUSED(event_data);
+	UNUSED(event_data_size);
+
+	// Any arrival, removal or property change invalidates the cached list.
+	// 0 is reserved for "unknown", so skip over it on wraparound
+	if (InterlockedIncrement(&device_list_generation) == 0)
+		InterlockedIncrement(&device_list_generation);
+	return ERROR_SUCCESS;
+}
+
+static void unregister_device_notifications(void)
+{
+	int i;
+
+	device_list_generation = 0;
+	for (i = 0; i < 2; i++) {
+		if (device_notify[i] != NULL) {
+			pCM_Unregister_Notification(device_notify[i]);
+			device_notify[i] = NULL;
+		}
+	}
+}
+
+static void register_device_notifications(struct libusb_context *ctx)
+{
+	LIBUSB_CM_NOTIFY_FILTER filter;
+	CONFIGRET cr;
+
+	if ((pCM_Register_Notification == NULL) || (pCM_Unregister_Notification == NULL)) {
+		usbi_dbg("device change notifications not available, device list will not be cached");
+		return;
+	}
+
+	// Interface arrivals and removals catch new and departing devices, while
+	// instance events catch driver installs, which change the USB API in use
+	memset(&filter, 0, sizeof(filter));
+	filter.cbSize = sizeof(filter);
+	filter.Flags = LIBUSB_CM_NOTIFY_FILTER_FLAG_ALL_INTERFACE_CLASSES;
+	filter.FilterType = LIBUSB_CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+	cr = pCM_Register_Notification(&filter, NULL, device_change_callback, &device_notify[0]);
+	if (cr == CR_SUCCESS) {
+		memset(&filter, 0, sizeof(filter));
+		filter.cbSize = sizeof(filter);
+		filter.Flags = LIBUSB_CM_NOTIFY_FILTER_FLAG_ALL_DEVICE_INSTANCES;
+		filter.FilterType = LIBUSB_CM_NOTIFY_FILTER_TYPE_DEVICEINSTANCE;
+		cr = pCM_Register_Notification(&filter, NULL, device_change_callback, &device_notify[1]);
+	}
+	if (cr != CR_SUCCESS) {
+		usbi_warn(ctx, "could not register for device change notifications (CR 0x%X)", (unsigned int)cr);
+		unregister_device_notifications();
+		return;
+	}
+
+	device_list_generation = 1;
+}
+
 /*
  * enumerate interfaces for the whole USB class
  *
@@ -466,57 +574,65 @@ err_exit:
 	*dev_info = INVALID_HANDLE_VALUE;
 	return NULL;}
 
-/* Hash table functions - modified From glibc 2.3.2:
-   [Aho,Sethi,Ullman] Compilers: Principles, Techniques and Tools, 1986
-   [Knuth]            The Art of Computer Programming, part 3 (6.4)  */
+/* Session ID map: device paths are mapped to small integer session IDs,
+   assigned in order of first appearance, which remain valid until the
+   backend is deinitialized.
+
+   The map is an open-addressed (linear probing) table of pointers to
+   immutable entries, sized to a power of two. Lookups do not take any lock:
+   they read the current table and the slots through volatile pointers,
+   which are only ever published with interlocked operations. Inserts are
+   serialized by htab_write_mutex. When the table gets 3/4 full, it is
+   replaced by a table twice the size. Readers may still be probing the old
+   table, so it is kept on a retired list until htab_destroy(). As tables
+   double in size, the retired ones take less memory than the live one. */
 typedef struct htab_entry {
-	unsigned long used;
-	char* str;
+	unsigned long hash;
+	unsigned long session_id;
+	char str[1];
 } htab_entry;
-htab_entry* htab_table = NULL;
-usbi_mutex_t htab_write_mutex = NULL;
-unsigned long htab_size, htab_filled;
 
-/* For the used double hash method the table size has to be a prime. To
-   correct the user given table size we need a prime test.  This trivial
-   algorithm is adequate because the code is called only during init and
-   the number is likely to be small  */
-static int isprime(unsigned long number)
-{
-	// no even number will be passed
-	unsigned int divider = 3;
+typedef struct htab_table {
+	unsigned long size;
+	struct htab_table *retired;
+	htab_entry * volatile slots[1];
+} htab_table;
 
-	while((divider * divider < number) && (number % divider != 0))
-		divider += 2;
+static htab_table * volatile htab_current = NULL;
+static usbi_mutex_t htab_write_mutex = NULL;
+static unsigned long htab_filled, htab_next_id;
 
-	return (number % divider != 0);
+static htab_table *htab_alloc_table(unsigned long size)
+{
+	htab_table *table = (htab_table*) calloc(1, sizeof(htab_table) + (size - 1) * sizeof(htab_entry*));
+
+	if (table != NULL)
+		table->size = size;
+	return table;
 }
 
-/* Before using the hash table we must allocate memory for it.
-   We allocate one element more as the found prime number says.
-   This is done for more effective indexing as explained in the
-   comment for the hash function.  */
+/* Before using the hash table we must allocate memory for it. nel is
+   rounded up to a power of two. */
 static int htab_create(struct libusb_context *ctx, unsigned long nel)
 {
-	if (htab_table != NULL) {
+	unsigned long size = 16;
+
+	if (htab_current != NULL) {
 		usbi_err(ctx, "hash table already allocated");
 	}
 
 	// Create a mutex
 	usbi_mutex_init(&htab_write_mutex, NULL);
 
-	// Change nel to the first prime number not smaller as nel.
-	nel |= 1;
-	while(!isprime(nel))
-		nel += 2;
+	while (size < nel)
+		size <<= 1;
 
-	htab_size = nel;
-	usbi_dbg("using %d entries hash table", nel);
+	usbi_dbg("using %d entries hash table", size);
 	htab_filled = 0;
+	htab_next_id = 1;
 
-	// allocate memory and zero out.
-	htab_table = (htab_entry*) calloc(htab_size + 1, sizeof(htab_entry));
-	if (htab_table == NULL) {
+	htab_current = htab_alloc_table(size);
+	if (htab_current == NULL) {
 		usbi_err(ctx, "could not allocate space for hash table");
 		return 0;
 	}
@@ -527,113 +643,134 @@ static int htab_create(struct libusb_context *ctx, unsigned long nel)
 /* After using the hash table it has to be destroyed.  */
 static void htab_destroy(void)
 {
+	htab_table *table, *retired;
 	size_t i;
-	if (htab_table == NULL) {
+
+	if (htab_current == NULL) {
 		return;
 	}
 
-	for (i=0; i<htab_size; i++) {
-		if (htab_table[i].used) {
-			safe_free(htab_table[i].str);
-		}
+	// Entries are shared by all the tables, the live one has them all
+	table = htab_current;
+	for (i=0; i<table->size; i++) {
+		safe_free(table->slots[i]);
+	}
+	while (table != NULL) {
+		retired = table->retired;
+		free(table);
+		table = retired;
 	}
+	htab_current = NULL;
 	usbi_mutex_destroy(&htab_write_mutex);
-	safe_free(htab_table);
 }
 
-/* This is the search function. It uses double hashing with open addressing.
-   We use an trick to speed up the lookup. The table is created with one
-   more element available. This enables us to use the index zero special.
-   This index will never be used because we store the first hash index in
-   the field used where zero means not used. Every other value means used.
-   The used field can be used as a first fast comparison for equality of
-   the stored and the parameter value. This helps to prevent unnecessary
-   expensive calls of strcmp.  */
-static unsigned long htab_hash(char* str)
+// Returns the session ID stored for str in table, or 0 if not found
+static unsigned long htab_lookup(htab_table *table, char* str, unsigned long hash)
 {
-	unsigned long hval, hval2;
-	unsigned long idx;
-	unsigned long r = 5381;
-	int c;
-	char* sz = str;
+	unsigned long mask = table->size - 1;
+	unsigned long idx = hash & mask;
+	htab_entry *entry;
+
+	// The table is never full, so there is always an empty slot to stop at
+	while ((entry = table->slots[idx]) != NULL) {
+		if ((entry->hash == hash) && (strcmp(str, entry->str) == 0)) {
+			return entry->session_id;
+		}
+		idx = (idx + 1) & mask;
+	}
+	return 0;
+}
 
-	if (str == NULL)
-		return 0;
+static void htab_insert(htab_table *table, htab_entry *entry)
+{
+	unsigned long mask = table->size - 1;
+	unsigned long idx = entry->hash & mask;
 
-	// Compute main hash value (algorithm suggested by Nokia)
-	while ((c = *sz++) != 0)
-		r = ((r << 5) + r) + c;
-	if (r == 0)
-		++r;
+	while (table->slots[idx] != NULL)
+		idx = (idx + 1) & mask;
+	InterlockedExchangePointer((PVOID volatile *)&table->slots[idx], entry);
+}
 
-	// compute table hash: simply take the modulus
-	hval = r % htab_size;
-	if (hval == 0)
-		++hval;
+// Replace the live table with one twice the size. Takes htab_write_mutex
+static int htab_grow(void)
+{
+	htab_table *old_table = htab_current;
+	htab_table *new_table = htab_alloc_table(old_table->size * 2);
+	unsigned long i;
 
-	// Try the first index
-	idx = hval;
+	if (new_table == NULL) {
+		return 0;
+	}
 
-	if (htab_table[idx].used) {
-		if ( (htab_table[idx].used == hval)
-		  && (safe_strcmp(str, htab_table[idx].str) == 0) ) {
-			// existing hash
-			return idx;
+	for (i=0; i<old_table->size; i++) {
+		if (old_table->slots[i] != NULL) {
+			htab_insert(new_table, old_table->slots[i]);
 		}
-		usbi_dbg("hash collision ('%s' vs '%s')", str, htab_table[idx].str);
+	}
+	new_table->retired = old_table;
+	InterlockedExchangePointer((PVOID volatile *)&htab_current, new_table);
+	usbi_dbg("hash table grown to %d entries", new_table->size);
+	return 1;
+}
 
-		// Second hash function, as suggested in [Knuth]
-		hval2 = 1 + hval % (htab_size - 2);
+/* Returns the session ID for str, allocating a new one if str has not been
+   seen before, or 0 on error.  */
+static unsigned long htab_hash(char* str)
+{
+	unsigned long hash = 5381;
+	unsigned long session_id;
+	htab_entry *entry;
+	size_t len;
+	int c;
+	char* sz = str;
 
-		do {
-			// Because size is prime this guarantees to step through all available indexes
-			if (idx <= hval2) {
-				idx = htab_size + idx - hval2;
-			} else {
-				idx -= hval2;
-			}
+	if ((str == NULL) || (htab_current == NULL))
+		return 0;
 
-			// If we visited all entries leave the loop unsuccessfully
-			if (idx == hval) {
-				break;
-			}
+	// Compute main hash value (algorithm suggested by Nokia)
+	while ((c = *sz++) != 0)
+		hash = ((hash << 5) + hash) + c;
 
-			// If entry is found use it.
-			if ( (htab_table[idx].used == hval)
-			  && (safe_strcmp(str, htab_table[idx].str) == 0) ) {
-				return idx;
-			}
-		}
-		while (htab_table[idx].used);
-	}
+	// Fast path: existing entry, no lock needed
+	session_id = htab_lookup(htab_current, str, hash);
+	if (session_id != 0)
+		return session_id;
 
-	// Not found => New entry
+	// Not found => New entry. Concurrent threads might be storing the same
+	// entry at the same time (eg. "simultaneous" enums from different threads)
+	// so check again under the mutex
+	usbi_mutex_lock(&htab_write_mutex);
+	session_id = htab_lookup(htab_current, str, hash);
+	if (session_id != 0) {
+		usbi_mutex_unlock(&htab_write_mutex);
+		return session_id;
+	}
 
-	// If the table is full return an error
-	if (htab_filled >= htab_size) {
-		usbi_err(NULL, "hash table is full (%d entries)", htab_size);
-		return 0;
+	if ((htab_filled + 1) * 4 > htab_current->size * 3) {
+		if (!htab_grow()) {
+			usbi_err(NULL, "could not grow hash table (%d entries)", htab_current->size);
+			usbi_mutex_unlock(&htab_write_mutex);
+			return 0;
+		}
 	}
 
-	// Concurrent threads might be storing the same entry at the same time
-	// (eg. "simultaneous" enums from different threads) => use a mutex
-	usbi_mutex_lock(&htab_write_mutex);
-	// Just free any previously allocated string (which should be the same as
-	// new one). The possibility of concurrent threads storing a collision
-	// string (same hash, different string) at the same time is extremely low
-	safe_free(htab_table[idx].str);
-	htab_table[idx].used = hval;
-	htab_table[idx].str = (char*) malloc(safe_strlen(str)+1);
-	if (htab_table[idx].str == NULL) {
+	len = safe_strlen(str);
+	entry = (htab_entry*) malloc(sizeof(htab_entry) + len);
+	if (entry == NULL) {
 		usbi_err(NULL, "could not duplicate string for hash table");
 		usbi_mutex_unlock(&htab_write_mutex);
 		return 0;
 	}
-	memcpy(htab_table[idx].str, str, safe_strlen(str)+1);
+	entry->hash = hash;
+	entry->session_id = htab_next_id++;
+	memcpy(entry->str, str, len + 1);
+
+	htab_insert(htab_current, entry);
 	++htab_filled;
+	session_id = entry->session_id;
 	usbi_mutex_unlock(&htab_write_mutex);
 
-	return idx;
+	return session_id;
 }
 
 /*
@@ -694,29 +831,93 @@ static int get_interface_by_endpoint(struct libusb_config_descriptor *conf_desc,
 	return LIBUSB_ERROR_NOT_FOUND;
 }
 
-static void force_synchronous_completion(OVERLAPPED *overlapped, DWORD size)
+// Completion key of the packets that carry a transfer OVERLAPPED. Anything
+// else dequeued from the port (wakeups, foreign I/O) is not a transfer
+#define TRANSFER_COMPLETION_KEY		((ULONG_PTR)0x6C696275)	// "libu"
+
+/*
+ * Associate a file handle with the I/O completion port of a context, so that
+ * overlapped requests issued on it are picked up by the event loop without
+ * needing an event HANDLE per transfer.
+ */
+static bool associate_completion_port(struct libusb_context *ctx, HANDLE file_handle)
+{
+	if (pSetFileCompletionNotificationModes == NULL)
+		return false;
+
+	// Requests that complete immediately are completed by hand through
+	// force_synchronous_completion(), so the port must not see them
+	if (!pSetFileCompletionNotificationModes(file_handle, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS)) {
+		usbi_dbg("could not set completion notification modes: %s", windows_error_str(0));
+		return false;
+	}
+
+	if (CreateIoCompletionPort(file_handle, USBI_EVENT_GET_SOURCE(ctx->event), TRANSFER_COMPLETION_KEY, 0) == NULL) {
+		usbi_warn(ctx, "could not associate handle with completion port: %s", windows_error_str(0));
+		return false;
+	}
+
+	return true;
+}
+
+// Used for handles that are not associated with the completion port:
+// forward the signalled OVERLAPPED event to the port
+static VOID CALLBACK overlapped_wait_callback(PVOID param, BOOLEAN timed_out)
+{
+	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv *)param;
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer_priv->itransfer);
+
+	UNUSED(timed_out);
+	if (!PostQueuedCompletionStatus(USBI_EVENT_GET_SOURCE(ctx->event),
+		(DWORD)transfer_priv->overlapped.InternalHigh, TRANSFER_COMPLETION_KEY, &transfer_priv->overlapped)) {
+		usbi_err(ctx, "could not post completion: %s", windows_error_str(0));
+	}
+}
+
+static void force_synchronous_completion(struct usbi_transfer *itransfer, DWORD size)
 {
+	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
+	OVERLAPPED *overlapped = &transfer_priv->overlapped;
+
 	overlapped->Internal = STATUS_COMPLETED_SYNCHRONOUSLY;
 	overlapped->InternalHigh = size;
-	SetEvent(overlapped->hEvent);
+	if (overlapped->hEvent != NULL) {
+		SetEvent(overlapped->hEvent);
+	} else if (!PostQueuedCompletionStatus(USBI_EVENT_GET_SOURCE(ITRANSFER_CTX(itransfer)->event),
+		size, TRANSFER_COMPLETION_KEY, overlapped)) {
+		usbi_err(ITRANSFER_CTX(itransfer), "could not post completion: %s", windows_error_str(0));
+	}
 }
 
-static int prepare_transfer_priv(struct usbi_transfer *itransfer, HANDLE handle)
+static int prepare_transfer_priv(struct usbi_transfer *itransfer, struct interface_handle_t *interface_handle)
 {
 	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
-	int r;
+	HANDLE handle = interface_handle->api_handle;
 
 	memset(&transfer_priv->overlapped, 0, sizeof(transfer_priv->overlapped));
-	transfer_priv->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (transfer_priv->overlapped.hEvent == NULL) {
-		return LIBUSB_ERROR_NO_MEM;
-	}
-
-	r = usbi_add_event_source(ITRANSFER_CTX(itransfer), transfer_priv->overlapped.hEvent, 0);
-	if (r) {
-		CloseHandle(transfer_priv->overlapped.hEvent);
-		transfer_priv->overlapped.hEvent = NULL;
-		return r;
+	transfer_priv->itransfer = itransfer;
+	transfer_priv->wait_handle = NULL;
+	if (!interface_handle->uses_iocp) {
+		// The event is created on first use and kept until the transfer is
+		// freed, resubmitting only resets it
+		if (transfer_priv->event == NULL) {
+			transfer_priv->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			if (transfer_priv->event == NULL) {
+				return LIBUSB_ERROR_NO_MEM;
+			}
+		} else {
+			ResetEvent(transfer_priv->event);
+		}
+		transfer_priv->overlapped.hEvent = transfer_priv->event;
+		// The wait has to fire once per submission: the event is also set by I/O
+		// that completes synchronously, on top of force_synchronous_completion()
+		if (!RegisterWaitForSingleObject(&transfer_priv->wait_handle, transfer_priv->event,
+			overlapped_wait_callback, transfer_priv, INFINITE, WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD)) {
+			usbi_err(ITRANSFER_CTX(itransfer), "could not register wait: %s", windows_error_str(0));
+			transfer_priv->overlapped.hEvent = NULL;
+			transfer_priv->wait_handle = NULL;
+			return LIBUSB_ERROR_NO_MEM;
+		}
 	}
 
 	if (pCancelIoEx == NULL && DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(),
@@ -1002,8 +1203,6 @@ static void get_windows_version(void)
 static int windows_init(struct libusb_context *ctx)
 {
 	int i, r = LIBUSB_ERROR_OTHER;
-	DWORD_PTR affinity, dummy;
-	HANDLE event = NULL;
 	HANDLE semaphore;
 	LARGE_INTEGER li_frequency;
 	char sem_name[11+1+8]; // strlen(libusb_init)+'\0'+(32-bit hex PID)
@@ -1026,6 +1225,7 @@ static int windows_init(struct libusb_context *ctx)
 	// NB: concurrent usage supposes that init calls are equally balanced with
 	// exit calls. If init is called more than exit, we will not exit properly
 	if ( ++concurrent_usage == 0 ) {	// First init?
+		usbi_trace_register();
 		get_windows_version();
 		usbi_dbg(windows_version_str);
 		if (windows_version == WINDOWS_UNSUPPORTED) {
@@ -1048,84 +1248,35 @@ static int windows_init(struct libusb_context *ctx)
 			usb_api_backend[i].init(SUB_API_NOTSET, ctx);
 		}
 
+		// QueryPerformanceCounter() is consistent across processors from
+		// Vista on and cheap to read, so it is called directly from any thread
 		if (QueryPerformanceFrequency(&li_frequency)) {
-			// The hires frequency can go as high as 4 GHz, so we'll use a conversion
-			// to picoseconds to compute the tv_nsecs part in clock_gettime
 			hires_frequency = li_frequency.QuadPart;
-			hires_ticks_to_ps = UINT64_C(1000000000000) / hires_frequency;
 			usbi_dbg("hires timer available (Frequency: %"PRIu64" Hz)", hires_frequency);
-
-			// Because QueryPerformanceCounter might report different values when
-			// running on different cores, we create a separate thread for the timer
-			// calls, which we glue to the first available core always to prevent timing discrepancies.
-			if (!GetProcessAffinityMask(GetCurrentProcess(), &affinity, &dummy) || (affinity == 0)) {
-				usbi_err(ctx, "could not get process affinity: %s", windows_error_str(0));
-				goto init_exit;
-			}
-			// The process affinity mask is a bitmask where each set bit represents a core on
-			// which this process is allowed to run, so we find the first set bit
-			for (i = 0; !(affinity & (1 << i)); i++);
-			affinity = (1 << i);
-
-			usbi_dbg("timer thread will run on core #%d", i);
-
-			r = LIBUSB_ERROR_NO_MEM;
-			event = CreateEvent(NULL, FALSE, FALSE, NULL);
-			if (event == NULL) {
-				usbi_err(ctx, "could not create event: %s", windows_error_str(0));
-				goto init_exit;
-			}
-			timer_thread = (HANDLE)_beginthreadex(NULL, 0, windows_clock_gettime_threaded, (void *)event,
-				0, (unsigned int *)&timer_thread_id);
-			if (timer_thread == NULL) {
-				usbi_err(ctx, "unable to create timer thread - aborting");
-				goto init_exit;
-			}
-			if (!SetThreadAffinityMask(timer_thread, affinity)) {
-				usbi_warn(ctx, "unable to set timer thread affinity, timer discrepancies may arise");
-			}
-
-			// Wait for timer thread to init before continuing.
-			if (WaitForSingleObject(event, INFINITE) != WAIT_OBJECT_0) {
-				usbi_err(ctx, "failed to wait for timer thread to become ready - aborting");
-				goto init_exit;
-			}
 		}
 		else {
 			usbi_dbg("no hires timer available on this platform");
 			hires_frequency = 0;
-			hires_ticks_to_ps = UINT64_C(0);
 		}
 
-		// Create a hash table to store session ids. Second parameter is better if prime
+		// Create a hash table to store session ids. It grows as required
 		htab_create(ctx, HTAB_SIZE);
+
+		register_device_notifications(ctx);
 	}
 	// At this stage, either we went through full init successfully, or didn't need to
 	r = LIBUSB_SUCCESS;
 
 init_exit: // Holds semaphore here.
 	if (!concurrent_usage && r != LIBUSB_SUCCESS) { // First init failed?
-		if (timer_thread) {
-			// actually the signal to quit the thread.
-			if (!PostThreadMessage(timer_thread_id, WM_TIMER_EXIT, 0, 0) ||
-				(WaitForSingleObject(timer_thread, INFINITE) != WAIT_OBJECT_0)) {
-				usbi_warn(ctx, "could not wait for timer thread to quit");
-				TerminateThread(timer_thread, 1);
-				// shouldn't happen, but we're destroying
-				// all objects it might have held anyway.
-			}
-			CloseHandle(timer_thread);
-			timer_thread = NULL;
-			timer_thread_id = 0;
-		}
+		unregister_device_notifications();
 		htab_destroy();
+		usbi_trace_unregister();
 	}
 
 	if (r != LIBUSB_SUCCESS)
 		--concurrent_usage; // Not expected to call libusb_exit if we failed.
 
-	if (event)
-		CloseHandle(event);
 	ReleaseSemaphore(semaphore, 1, NULL);	// increase count back to 1
 	CloseHandle(semaphore);
 	return r;
@@ -1544,6 +1695,15 @@ static int set_hid_interface(struct libusb_context* ctx, struct libusb_device* d
 	return LIBUSB_SUCCESS;
 }
 
+/*
+ * get_device_list_generation: lets the core reuse the device list from the
+ * previous enumeration, as a full SetupAPI walk is expensive
+ */
+static unsigned long windows_get_device_list_generation(void)
+{
+	return (unsigned long)device_list_generation;
+}
+
 /*
  * get_device_list: libusb backend device enumeration function
  */
@@ -1931,18 +2091,9 @@ static void windows_exit(void)
 			usb_api_backend[i].exit(SUB_API_NOTSET);
 		}
 
-		if (timer_thread) {
-			// actually the signal to quit the thread.
-			if (!PostThreadMessage(timer_thread_id, WM_TIMER_EXIT, 0, 0) ||
-				(WaitForSingleObject(timer_thread, INFINITE) != WAIT_OBJECT_0)) {
-				usbi_dbg("could not wait for timer thread to quit");
-				TerminateThread(timer_thread, 1);
-			}
-			CloseHandle(timer_thread);
-			timer_thread = NULL;
-			timer_thread_id = 0;
-		}
+		unregister_device_notifications();
 		htab_destroy();
+		usbi_trace_unregister();
 	}
 
 	ReleaseSemaphore(semaphore, 1, NULL);	// increase count back to 1
@@ -1981,6 +2132,33 @@ static int windows_get_config_descriptor(struct libusb_device *dev, uint8_t conf
 	return (int)size;
 }
 
+/*
+ * return a pointer to the cached config descriptor with a given bConfigurationValue
+ */
+static int windows_get_config_descriptor_by_value(struct libusb_device *dev, uint8_t bConfigurationValue,
+	unsigned char **buffer, int *host_endian)
+{
+	struct windows_device_priv *priv = _device_priv(dev);
+	PUSB_CONFIGURATION_DESCRIPTOR config_header;
+	uint8_t index;
+
+	*buffer = NULL;
+	*host_endian = 0;
+
+	if (priv->config_descriptor == NULL)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	for (index = 0; index < dev->num_configurations; index++) {
+		config_header = (PUSB_CONFIGURATION_DESCRIPTOR)priv->config_descriptor[index];
+		if ((config_header != NULL) && (config_header->bConfigurationValue == bConfigurationValue)) {
+			*buffer = priv->config_descriptor[index];
+			return (int)config_header->wTotalLength;
+		}
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
 /*
  * return the cached copy of the active config descriptor
  */
@@ -1998,6 +2176,7 @@ static int windows_get_active_config_descriptor(struct libusb_device *dev, unsig
 static int windows_open(struct libusb_device_handle *dev_handle)
 {
 	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
 	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
 
 	if (priv->apib == NULL) {
@@ -2005,6 +2184,8 @@ static int windows_open(struct libusb_device_handle *dev_handle)
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
 
+	list_init(&handle_priv->isoch_buffers);
+
 	return priv->apib->open(SUB_API_NOTSET, dev_handle);
 }
 
@@ -2101,6 +2282,20 @@ static int windows_clear_halt(struct libusb_device_handle *dev_handle, unsigned
 	return priv->apib->clear_halt(SUB_API_NOTSET, dev_handle, endpoint);
 }
 
+// Pipe policies only exist for the WinUSB and libusbK drivers, whatever the
+// API of the device, so they bypass the apib dispatch
+static int windows_set_pipe_policy(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	enum libusb_pipe_policy policy, unsigned int value)
+{
+	return winusbx_set_pipe_policy(dev_handle, endpoint, policy, value);
+}
+
+static int windows_get_pipe_policy(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	enum libusb_pipe_policy policy, unsigned int *value)
+{
+	return winusbx_get_pipe_policy(dev_handle, endpoint, policy, value);
+}
+
 static int windows_reset_device(struct libusb_device_handle *dev_handle)
 {
 	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
@@ -2140,16 +2335,36 @@ static void windows_clear_transfer_priv(struct usbi_transfer *itransfer)
 		}
 		transfer_priv->handle = NULL;
 	}
-	if (transfer_priv->overlapped.hEvent != NULL) {
-		usbi_remove_event_source(ITRANSFER_CTX(itransfer), transfer_priv->overlapped.hEvent);
-		CloseHandle(transfer_priv->overlapped.hEvent);
-		transfer_priv->overlapped.hEvent = NULL;
+	if (transfer_priv->wait_handle != NULL) {
+		// Blocks until a callback that is already running has returned
+		UnregisterWaitEx(transfer_priv->wait_handle, INVALID_HANDLE_VALUE);
+		transfer_priv->wait_handle = NULL;
 	}
+	// The event itself is kept for the next submission
+	transfer_priv->overlapped.hEvent = NULL;
 	safe_free(transfer_priv->hid_buffer);
 	// When auto claim is in use, attempt to release the auto-claimed interface
 	auto_release(itransfer);
 }
 
+static void windows_destroy_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
+
+	if (transfer_priv->event != NULL) {
+		CloseHandle(transfer_priv->event);
+		transfer_priv->event = NULL;
+	}
+	safe_free(transfer_priv->hid_bounce);
+	transfer_priv->hid_bounce_size = 0;
+	if (transfer_priv->isoch_buffer != NULL) {
+		winusbx_release_isoch_buffer(transfer_priv->isoch_buffer);
+		safe_free(transfer_priv->isoch_buffer);
+	}
+	safe_free(transfer_priv->iso_packets);
+	transfer_priv->iso_packets_size = 0;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
@@ -2232,6 +2447,28 @@ static int windows_cancel_transfer(struct usbi_transfer *itransfer)
 	}
 }
 
+static int windows_cancel_endpoint_transfers(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
+	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
+	struct windows_usb_api_backend const *apib = priv->apib;
+	int current_interface = transfer_priv->interface_number;
+
+	if (apib->id == USB_API_COMPOSITE) {
+		if ((current_interface < 0) || (current_interface >= USB_MAXINTERFACES))
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		apib = priv->usb_interface[current_interface].apib;
+	}
+
+	// WinUSB AbortPipe ends all the requests on the pipe, while the CancelIo
+	// of HID only ends those issued by the calling thread
+	if (apib->id != USB_API_WINUSBX)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return windows_abort_transfers(itransfer);
+}
+
 static void windows_transfer_callback(struct usbi_transfer *itransfer, uint32_t io_result, uint32_t io_size)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
@@ -2257,7 +2494,7 @@ static void windows_transfer_callback(struct usbi_transfer *itransfer, uint32_t
 		if (istatus != LIBUSB_TRANSFER_COMPLETED) {
 			usbi_dbg("Failed to copy partial data in aborted operation: %d", istatus);
 		}
-		if (itransfer->flags & USBI_TRANSFER_TIMED_OUT) {
+		if (usbi_atomic_load(&itransfer->flags) & USBI_TRANSFER_TIMED_OUT) {
 			usbi_dbg("detected timeout");
 			status = LIBUSB_TRANSFER_TIMED_OUT;
 		} else {
@@ -2295,55 +2532,46 @@ static void windows_handle_callback (struct usbi_transfer *itransfer, uint32_t i
 
 static int windows_handle_events(struct libusb_context *ctx, void *event_data, unsigned int cnt, int num_ready)
 {
-	HANDLE *handles = (HANDLE *)event_data;
+	OVERLAPPED_ENTRY *entries = (OVERLAPPED_ENTRY *)event_data;
 	struct usbi_transfer *itransfer;
 	struct windows_transfer_priv *transfer_priv;
-	bool found;
+	OVERLAPPED *overlapped;
 	unsigned int i;
 	DWORD io_size, io_result;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
+	UNUSED(num_ready);
+
+	// Each completion packet carries the OVERLAPPED of the transfer it
+	// belongs to, so there is no need to search the flying transfers
 	for (i = 0; i < cnt; i++) {
-		transfer_priv = NULL;
-		found = false;
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_for_each_entry(itransfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-			transfer_priv = usbi_transfer_get_os_priv(itransfer);
-			if (transfer_priv->overlapped.hEvent == handles[i]) {
-				found = true;
-				break;
-			}
+		if (entries[i].lpCompletionKey != TRANSFER_COMPLETION_KEY) {
+			usbi_dbg("ignoring completion packet with key %p", (void *)entries[i].lpCompletionKey);
+			continue;
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-		if (found) {
-			// Handle async requests that completed synchronously first
-			if (HasOverlappedIoCompletedSync(&transfer_priv->overlapped)) {
-				io_result = NO_ERROR;
-				io_size = (DWORD)transfer_priv->overlapped.InternalHigh;
-			// Regular async overlapped
-			}
-			else if (GetOverlappedResult(transfer_priv->handle,
-				&transfer_priv->overlapped, &io_size, false)) {
-				io_result = NO_ERROR;
-			}
-			else {
-				io_result = GetLastError();
-				if (io_result == ERROR_IO_INCOMPLETE) {
-					// Transfer still in progress, skip
-					continue;
-				}
-			}
-			windows_handle_callback(itransfer, io_result, io_size);
+		overlapped = entries[i].lpOverlapped;
+		transfer_priv = (struct windows_transfer_priv *)((char *)overlapped
+			- offsetof(struct windows_transfer_priv, overlapped));
+		itransfer = transfer_priv->itransfer;
+
+		// Handle async requests that completed synchronously first
+		if (HasOverlappedIoCompletedSync(overlapped)) {
+			io_result = NO_ERROR;
+			io_size = (DWORD)overlapped->InternalHigh;
+		// Regular async overlapped
+		}
+		else if (GetOverlappedResult(transfer_priv->handle, overlapped, &io_size, false)) {
+			io_result = NO_ERROR;
 		}
 		else {
-			// This can occur if the transfer overlapped event was added to the event
-			// sources list but transfer submission failed and it hasn't been removed yet
-			usbi_err(ctx, "could not find a matching transfer for HANDLE %x", handles[i]);
-			continue;
+			io_result = GetLastError();
+			if (io_result == ERROR_IO_INCOMPLETE) {
+				// Should not happen for a dequeued packet, skip
+				usbi_warn(ctx, "completion packet for a transfer still in progress");
+				continue;
+			}
 		}
+		windows_handle_callback(itransfer, io_result, io_size);
 	}
-	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	return LIBUSB_SUCCESS;
 }
@@ -2351,90 +2579,23 @@ static int windows_handle_events(struct libusb_context *ctx, void *event_data, u
 /*
  * Monotonic and real time functions
  */
-unsigned __stdcall windows_clock_gettime_threaded(void* param)
-{
-	struct timer_request *request;
-	LARGE_INTEGER hires_counter;
-	MSG msg;
-
-	// The following call will create this thread's message queue
-	// See https://msdn.microsoft.com/en-us/library/windows/desktop/ms644946.aspx
-	PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
-
-	// Signal windows_init() that we're ready to service requests
-	if (!SetEvent((HANDLE)param)) {
-		usbi_dbg("SetEvent failed for timer init event: %s", windows_error_str(0));
-	}
-	param = NULL;
-
-	// Main loop - wait for requests
-	while (1) {
-		if (GetMessage(&msg, NULL, WM_TIMER_REQUEST, WM_TIMER_EXIT) == -1) {
-			usbi_err(NULL, "GetMessage failed for timer thread: %s", windows_error_str(0));
-			return 1;
-		}
-
-		switch (msg.message) {
-		case WM_TIMER_REQUEST:
-			// Requests to this thread are for hires always
-			// Microsoft says that this function always succeeds on XP and later
-			// See https://msdn.microsoft.com/en-us/library/windows/desktop/ms644904.aspx
-			request = (struct timer_request *)msg.lParam;
-			QueryPerformanceCounter(&hires_counter);
-			request->tp->tv_sec = (long)(hires_counter.QuadPart / hires_frequency);
-			request->tp->tv_nsec = (long)(((hires_counter.QuadPart % hires_frequency) / 1000) * hires_ticks_to_ps);
-			if (!SetEvent(request->event)) {
-				usbi_err(NULL, "SetEvent failed for timer request: %s", windows_error_str(0));
-			}
-			break;
-
-		case WM_TIMER_EXIT:
-			usbi_dbg("timer thread quitting");
-			return 0;
-		}
-	}
-}
-
 static int windows_clock_gettime(int clk_id, struct timespec *tp)
 {
-	struct timer_request request;
+	LARGE_INTEGER hires_counter;
 	FILETIME filetime;
 	ULARGE_INTEGER rtime;
-	DWORD r;
+	uint64_t ticks;
 	switch(clk_id) {
 	case USBI_CLOCK_MONOTONIC:
-		if (timer_thread) {
-			request.tp = tp;
-			request.event = CreateEvent(NULL, FALSE, FALSE, NULL);
-			if (request.event == NULL) {
-				return LIBUSB_ERROR_NO_MEM;
-			}
-
-			if (!PostThreadMessage(timer_thread_id, WM_TIMER_REQUEST, 0, (LPARAM)&request)) {
-				usbi_err(NULL, "PostThreadMessage failed for timer thread: %s", windows_error_str(0));
-				CloseHandle(request.event);
-				return LIBUSB_ERROR_OTHER;
-			}
-
-			do {
-				r = WaitForSingleObject(request.event, TIMER_REQUEST_RETRY_MS);
-				if (r == WAIT_TIMEOUT) {
-					usbi_dbg("could not obtain a timer value within reasonable timeframe - too much load?");
-				}
-				else if (r == WAIT_FAILED) {
-					usbi_err(NULL, "WaitForSingleObject failed: %s", windows_error_str(0));
-				}
-			} while (r == WAIT_TIMEOUT);
-			CloseHandle(request.event);
-
-			if (r == WAIT_OBJECT_0) {
-				return LIBUSB_SUCCESS;
-			}
-			else {
-				return LIBUSB_ERROR_OTHER;
-			}
+		if (hires_frequency != 0 && QueryPerformanceCounter(&hires_counter)) {
+			// the remainder is below the frequency (at most a few GHz), so
+			// scaling it to nanoseconds cannot overflow
+			ticks = (uint64_t)hires_counter.QuadPart;
+			tp->tv_sec = (long)(ticks / hires_frequency);
+			tp->tv_nsec = (long)((ticks % hires_frequency) * UINT64_C(1000000000) / hires_frequency);
+			return LIBUSB_SUCCESS;
 		}
-		// Fall through and return real-time if monotonic was not detected @ timer init
+		// Fall through and return real-time if monotonic read failed or was not detected @ init
 	case USBI_CLOCK_REALTIME:
 		// We follow http://msdn.microsoft.com/en-us/library/ms724928%28VS.85%29.aspx
 		// with a predef epoch_time to have an epoch that starts at 1970.01.01 00:00
@@ -2455,50 +2616,41 @@ static int windows_clock_gettime(int clk_id, struct timespec *tp)
 
 // NB: MSVC6 does not support named initializers.
 const struct usbi_os_backend windows_backend = {
-	"Windows",
-	USBI_CAP_HAS_HID_ACCESS,
-	windows_init,
-	windows_exit,
-
-	windows_get_device_list,
-	NULL,				/* hotplug_poll */
-	windows_open,
-	windows_close,
-
-	windows_get_device_descriptor,
-	windows_get_active_config_descriptor,
-	windows_get_config_descriptor,
-	NULL,				/* get_config_descriptor_by_value() */
-
-	windows_get_configuration,
-	windows_set_configuration,
-	windows_claim_interface,
-	windows_release_interface,
-
-	windows_set_interface_altsetting,
-	windows_clear_halt,
-	windows_reset_device,
-
-	NULL,				/* alloc_streams */
-	NULL,				/* free_streams */
-
-	windows_kernel_driver_active,
-	windows_detach_kernel_driver,
-	windows_attach_kernel_driver,
-
-	windows_destroy_device,
-
-	windows_submit_transfer,
-	windows_cancel_transfer,
-	windows_clear_transfer_priv,
-
-	windows_handle_events,
-	NULL,				/* handle_transfer_completion() */
-
-	windows_clock_gettime,
-	sizeof(struct windows_device_priv),
-	sizeof(struct windows_device_handle_priv),
-	sizeof(struct windows_transfer_priv),
+	.name = "Windows",
+	.caps = USBI_CAP_HAS_HID_ACCESS,
+	.init = windows_init,
+	.exit = windows_exit,
+	.get_device_list = windows_get_device_list,
+	.get_device_list_generation = windows_get_device_list_generation,
+	.open = windows_open,
+	.close = windows_close,
+	.get_device_descriptor = windows_get_device_descriptor,
+	.get_active_config_descriptor = windows_get_active_config_descriptor,
+	.get_config_descriptor = windows_get_config_descriptor,
+	.get_config_descriptor_by_value = windows_get_config_descriptor_by_value,
+	.get_configuration = windows_get_configuration,
+	.set_configuration = windows_set_configuration,
+	.claim_interface = windows_claim_interface,
+	.release_interface = windows_release_interface,
+	.set_interface_altsetting = windows_set_interface_altsetting,
+	.clear_halt = windows_clear_halt,
+	.reset_device = windows_reset_device,
+	.set_pipe_policy = windows_set_pipe_policy,
+	.get_pipe_policy = windows_get_pipe_policy,
+	.kernel_driver_active = windows_kernel_driver_active,
+	.detach_kernel_driver = windows_detach_kernel_driver,
+	.attach_kernel_driver = windows_attach_kernel_driver,
+	.destroy_device = windows_destroy_device,
+	.submit_transfer = windows_submit_transfer,
+	.cancel_transfer = windows_cancel_transfer,
+	.cancel_endpoint_transfers = windows_cancel_endpoint_transfers,
+	.clear_transfer_priv = windows_clear_transfer_priv,
+	.destroy_transfer_priv = windows_destroy_transfer_priv,
+	.handle_events = windows_handle_events,
+	.clock_gettime = windows_clock_gettime,
+	.device_priv_size = sizeof(struct windows_device_priv),
+	.device_handle_priv_size = sizeof(struct windows_device_handle_priv),
+	.transfer_priv_size = sizeof(struct windows_transfer_priv),
 };
 
 
@@ -2641,7 +2793,7 @@ const struct windows_usb_api_backend usb_api_backend[USB_API_MAX] = {
 		winusbx_clear_halt,
 		winusbx_reset_device,
 		winusbx_submit_bulk_transfer,
-		unsupported_submit_iso_transfer,
+		winusbx_submit_iso_transfer,
 		winusbx_submit_control_transfer,
 		winusbx_abort_control,
 		winusbx_abort_transfers,
@@ -2738,6 +2890,12 @@ static int winusbx_init(int sub_api, struct libusb_context *ctx)
 		WinUSBX_Set(WritePipe);
 		if (!native_winusb) {
 			WinUSBX_Set(ResetDevice);
+		} else {
+			// Isochronous transfers, not reachable through libusbK
+			WinUSBX[i].RegisterIsochBuffer = (WinUsb_RegisterIsochBuffer_t) GetProcAddress(h, "WinUsb_RegisterIsochBuffer");
+			WinUSBX[i].UnregisterIsochBuffer = (WinUsb_UnregisterIsochBuffer_t) GetProcAddress(h, "WinUsb_UnregisterIsochBuffer");
+			WinUSBX[i].ReadIsochPipeAsap = (WinUsb_ReadIsochPipeAsap_t) GetProcAddress(h, "WinUsb_ReadIsochPipeAsap");
+			WinUSBX[i].WriteIsochPipeAsap = (WinUsb_WriteIsochPipeAsap_t) GetProcAddress(h, "WinUsb_WriteIsochPipeAsap");
 		}
 		if (WinUSBX[i].Initialize != NULL) {
 			WinUSBX[i].initialized = true;
@@ -2787,6 +2945,7 @@ static int winusbx_open(int sub_api, struct libusb_device_handle *dev_handle)
 				}
 			}
 			handle_priv->interface_handle[i].dev_handle = file_handle;
+			handle_priv->interface_handle[i].iocp_associated = associate_completion_port(ctx, file_handle);
 		}
 	}
 
@@ -2805,6 +2964,8 @@ static void winusbx_close(int sub_api, struct libusb_device_handle *dev_handle)
 	if (!WinUSBX[sub_api].initialized)
 		return;
 
+	winusbx_unregister_isoch_buffers(dev_handle, -1);
+
 	if (priv->apib->id == USB_API_COMPOSITE) {
 		// If this is a composite device, just free and close all WinUSB-like
 		// interfaces directly (each is independent and not associated with another)
@@ -2957,6 +3118,9 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 			}
 		}
 		handle_priv->interface_handle[iface].api_handle = winusb_handle;
+		// The libusb0 filter file handle is not associated with the completion port
+		handle_priv->interface_handle[iface].uses_iocp = !found_filter
+			&& handle_priv->interface_handle[iface].iocp_associated;
 	} else {
 		// For all other interfaces, use GetAssociatedInterface()
 		winusb_handle = handle_priv->interface_handle[0].api_handle;
@@ -2966,6 +3130,7 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 			file_handle = handle_priv->interface_handle[0].dev_handle;
 			if (WinUSBX[sub_api].Initialize(file_handle, &winusb_handle)) {
 				handle_priv->interface_handle[0].api_handle = winusb_handle;
+				handle_priv->interface_handle[0].uses_iocp = handle_priv->interface_handle[0].iocp_associated;
 				usbi_warn(ctx, "auto-claimed interface 0 (required to claim %d with WinUSB)", iface);
 			} else {
 				usbi_warn(ctx, "failed to auto-claim interface 0 (required to claim %d with WinUSB): %s", iface, windows_error_str(0));
@@ -2987,6 +3152,8 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 				return LIBUSB_ERROR_ACCESS;
 			}
 		}
+		// Associated interfaces do their I/O through the interface 0 file handle
+		handle_priv->interface_handle[iface].uses_iocp = handle_priv->interface_handle[0].uses_iocp;
 	}
 	usbi_dbg("claimed interface %d", iface);
 	handle_priv->active_interface = iface;
@@ -3007,6 +3174,7 @@ static int winusbx_release_interface(int sub_api, struct libusb_device_handle *d
 		return LIBUSB_ERROR_NOT_FOUND;
 	}
 
+	winusbx_unregister_isoch_buffers(dev_handle, iface);
 	WinUSBX[sub_api].Free(winusb_handle);
 	handle_priv->interface_handle[iface].api_handle = INVALID_HANDLE_VALUE;
 
@@ -3072,7 +3240,6 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 		transfer->dev_handle);
 	WINUSB_SETUP_PACKET *setup = (WINUSB_SETUP_PACKET *) transfer->buffer;
 	ULONG size;
-	HANDLE winusb_handle;
 	int current_interface;
 	int r;
 
@@ -3091,9 +3258,7 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 	}
 
 	usbi_dbg("will use interface %d", current_interface);
-	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
-
-	r = prepare_transfer_priv(itransfer, winusb_handle);
+	r = prepare_transfer_priv(itransfer, &handle_priv->interface_handle[current_interface]);
 	if (r)
 		return r;
 
@@ -3105,7 +3270,7 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 			windows_clear_transfer_priv(itransfer);
 			return LIBUSB_ERROR_INVALID_PARAM;
 		}
-		force_synchronous_completion(&transfer_priv->overlapped, 0);
+		force_synchronous_completion(itransfer, 0);
 	} else {
 		if (!WinUSBX[sub_api].ControlTransfer(transfer_priv->handle, *setup, transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, size, NULL, &transfer_priv->overlapped)) {
 			if(GetLastError() != ERROR_IO_PENDING) {
@@ -3114,7 +3279,7 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 				return LIBUSB_ERROR_IO;
 			}
 		} else {
-			force_synchronous_completion(&transfer_priv->overlapped, size);
+			force_synchronous_completion(itransfer, size);
 		}
 	}
 
@@ -3157,7 +3322,6 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_handle_priv *handle_priv = _device_handle_priv(transfer->dev_handle);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
-	HANDLE winusb_handle;
 	bool ret;
 	int current_interface;
 	int r;
@@ -3172,9 +3336,7 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 
 	usbi_dbg("matched endpoint %02X with interface %d", transfer->endpoint, current_interface);
 
-	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
-
-	r = prepare_transfer_priv(itransfer, winusb_handle);
+	r = prepare_transfer_priv(itransfer, &handle_priv->interface_handle[current_interface]);
 	if (r)
 		return r;
 
@@ -3192,7 +3354,141 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 			return LIBUSB_ERROR_IO;
 		}
 	} else {
-		force_synchronous_completion(&transfer_priv->overlapped, (DWORD)transfer->length);
+		force_synchronous_completion(itransfer, (DWORD)transfer->length);
+	}
+
+	transfer_priv->interface_number = (uint8_t)current_interface;
+
+	return LIBUSB_SUCCESS;
+}
+
+// Unregister the isochronous buffers of an interface, or of all interfaces if
+// iface is -1. Their transfers register them again when next submitted.
+static void winusbx_unregister_isoch_buffers(struct libusb_device_handle *dev_handle, int iface)
+{
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct winusbx_isoch_buffer *isoch_buffer, *next;
+
+	usbi_mutex_static_lock(&isoch_buffer_lock);
+	list_for_each_entry_safe(isoch_buffer, next, &handle_priv->isoch_buffers, list, struct winusbx_isoch_buffer) {
+		if ((iface != -1) && (isoch_buffer->interface_number != iface))
+			continue;
+		WinUSBX[isoch_buffer->sub_api].UnregisterIsochBuffer(isoch_buffer->handle);
+		isoch_buffer->handle = NULL;
+		list_del(&isoch_buffer->list);
+	}
+	usbi_mutex_static_unlock(&isoch_buffer_lock);
+}
+
+static void winusbx_release_isoch_buffer(struct winusbx_isoch_buffer *isoch_buffer)
+{
+	usbi_mutex_static_lock(&isoch_buffer_lock);
+	if (isoch_buffer->handle != NULL) {
+		WinUSBX[isoch_buffer->sub_api].UnregisterIsochBuffer(isoch_buffer->handle);
+		isoch_buffer->handle = NULL;
+		list_del(&isoch_buffer->list);
+	}
+	usbi_mutex_static_unlock(&isoch_buffer_lock);
+}
+
+static int winusbx_submit_iso_transfer(int sub_api, struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
+	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(transfer->dev_handle);
+	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
+	struct winusbx_isoch_buffer *isoch_buffer;
+	PUSBD_ISO_PACKET_DESCRIPTOR iso_packets;
+	HANDLE winusb_handle;
+	bool ret;
+	int current_interface;
+	int r;
+
+	CHECK_WINUSBX_AVAILABLE(sub_api);
+
+	if ((WinUSBX[sub_api].RegisterIsochBuffer == NULL) || (WinUSBX[sub_api].ReadIsochPipeAsap == NULL)) {
+		usbi_err(ctx, "isochronous transfers require native WinUSB on Windows 8.1 or later");
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	current_interface = interface_by_endpoint(priv, handle_priv, transfer->endpoint);
+	if (current_interface < 0) {
+		usbi_err(ctx, "unable to match endpoint to an open interface - cancelling transfer");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	usbi_dbg("matched endpoint %02X with interface %d", transfer->endpoint, current_interface);
+	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
+
+	// Registering locks the buffer in memory, which is too costly to do for
+	// every transfer. The registration is kept for as long as the transfer is
+	// resubmitted with the same buffer, on the same endpoint.
+	isoch_buffer = transfer_priv->isoch_buffer;
+	if ((isoch_buffer != NULL) && ((isoch_buffer->buffer != transfer->buffer)
+		|| (isoch_buffer->length != transfer->length) || (isoch_buffer->endpoint != transfer->endpoint)
+		|| (isoch_buffer->interface_number != current_interface))) {
+		winusbx_release_isoch_buffer(isoch_buffer);
+	}
+	if (isoch_buffer == NULL) {
+		isoch_buffer = calloc(1, sizeof(*isoch_buffer));
+		if (isoch_buffer == NULL) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		transfer_priv->isoch_buffer = isoch_buffer;
+	}
+	if (isoch_buffer->handle == NULL) {
+		if (!WinUSBX[sub_api].RegisterIsochBuffer(winusb_handle, transfer->endpoint, transfer->buffer,
+			transfer->length, &isoch_buffer->handle)) {
+			usbi_err(ctx, "RegisterIsochBuffer failed: %s", windows_error_str(0));
+			isoch_buffer->handle = NULL;
+			return LIBUSB_ERROR_IO;
+		}
+		usbi_dbg("registered %d bytes for endpoint %02X", transfer->length, transfer->endpoint);
+		isoch_buffer->sub_api = sub_api;
+		isoch_buffer->interface_number = (uint8_t)current_interface;
+		isoch_buffer->endpoint = transfer->endpoint;
+		isoch_buffer->buffer = transfer->buffer;
+		isoch_buffer->length = transfer->length;
+		usbi_mutex_static_lock(&isoch_buffer_lock);
+		list_add_tail(&isoch_buffer->list, &handle_priv->isoch_buffers);
+		usbi_mutex_static_unlock(&isoch_buffer_lock);
+	}
+
+	if (IS_XFERIN(transfer) && (transfer->num_iso_packets > transfer_priv->iso_packets_size)) {
+		iso_packets = realloc(transfer_priv->iso_packets,
+			transfer->num_iso_packets * sizeof(USBD_ISO_PACKET_DESCRIPTOR));
+		if (iso_packets == NULL) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		transfer_priv->iso_packets = iso_packets;
+		transfer_priv->iso_packets_size = transfer->num_iso_packets;
+	}
+
+	r = prepare_transfer_priv(itransfer, &handle_priv->interface_handle[current_interface]);
+	if (r)
+		return r;
+
+	// ASAP transfers already follow the ones pending on the pipe, ContinueStream
+	// would only make them fail when the host controller could not keep up
+	if (IS_XFERIN(transfer)) {
+		usbi_dbg("reading %d bytes in %d packets", transfer->length, transfer->num_iso_packets);
+		ret = WinUSBX[sub_api].ReadIsochPipeAsap(isoch_buffer->handle, 0, transfer->length, FALSE,
+			transfer->num_iso_packets, transfer_priv->iso_packets, &transfer_priv->overlapped);
+	} else {
+		usbi_dbg("writing %d bytes", transfer->length);
+		ret = WinUSBX[sub_api].WriteIsochPipeAsap(isoch_buffer->handle, 0, transfer->length, FALSE,
+			&transfer_priv->overlapped);
+	}
+	if (!ret) {
+		if (GetLastError() != ERROR_IO_PENDING) {
+			r = (GetLastError() == ERROR_INVALID_PARAMETER) ? LIBUSB_ERROR_INVALID_PARAM : LIBUSB_ERROR_IO;
+			usbi_err(ctx, "ReadIsochPipeAsap/WriteIsochPipeAsap failed: %s", windows_error_str(0));
+			windows_clear_transfer_priv(itransfer);
+			return r;
+		}
+	} else {
+		force_synchronous_completion(itransfer, (DWORD)transfer->length);
 	}
 
 	transfer_priv->interface_number = (uint8_t)current_interface;
@@ -3227,6 +3523,132 @@ static int winusbx_clear_halt(int sub_api, struct libusb_device_handle *dev_hand
 	return LIBUSB_SUCCESS;
 }
 
+// Map a libusb pipe policy to the WinUSB one and the size of its value
+static int winusbx_pipe_policy(enum libusb_pipe_policy policy, ULONG *type, ULONG *size)
+{
+	switch (policy) {
+	case LIBUSB_PIPE_POLICY_RAW_IO:
+		*type = RAW_IO;
+		*size = sizeof(UCHAR);
+		break;
+	case LIBUSB_PIPE_POLICY_AUTO_CLEAR_STALL:
+		*type = AUTO_CLEAR_STALL;
+		*size = sizeof(UCHAR);
+		break;
+	case LIBUSB_PIPE_POLICY_TRANSFER_TIMEOUT:
+		*type = PIPE_TRANSFER_TIMEOUT;
+		*size = sizeof(ULONG);
+		break;
+	case LIBUSB_PIPE_POLICY_MAX_TRANSFER_SIZE:
+		*type = MAXIMUM_TRANSFER_SIZE;
+		*size = sizeof(ULONG);
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+// Find the WinUSB handle and sub API of the claimed interface of an endpoint
+static int winusbx_pipe_handle(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	HANDLE *winusb_handle, int *sub_api)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	int current_interface;
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0) {
+		usbi_err(ctx, "unable to match endpoint to an open interface - cannot access pipe policy");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if (priv->usb_interface[current_interface].apib->id != USB_API_WINUSBX) {
+		usbi_dbg("interface %d does not use WinUSB or libusbK - no pipe policies", current_interface);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	*sub_api = priv->usb_interface[current_interface].sub_api;
+	CHECK_WINUSBX_AVAILABLE(*sub_api);
+
+	*winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
+	return LIBUSB_SUCCESS;
+}
+
+static int winusbx_set_pipe_policy(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	enum libusb_pipe_policy policy, unsigned int value)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	HANDLE winusb_handle;
+	ULONG type, size, ulong_value = value;
+	UCHAR uchar_value = (value != 0);
+	DWORD err;
+	int sub_api, r;
+
+	r = winusbx_pipe_policy(policy, &type, &size);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+
+	r = winusbx_pipe_handle(dev_handle, endpoint, &winusb_handle, &sub_api);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+
+	// libusb0.sys only implements PIPE_TRANSFER_TIMEOUT
+	if ((sub_api == SUB_API_LIBUSB0) && (type != PIPE_TRANSFER_TIMEOUT))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (!WinUSBX[sub_api].SetPipePolicy(winusb_handle, endpoint, type, size,
+		(size == sizeof(UCHAR)) ? (PVOID)&uchar_value : (PVOID)&ulong_value)) {
+		err = GetLastError();
+		usbi_err(ctx, "SetPipePolicy %u failed for endpoint %02X: %s", (unsigned int)type,
+			endpoint, windows_error_str(err));
+		switch (err) {
+		case ERROR_INVALID_PARAMETER:
+			return LIBUSB_ERROR_INVALID_PARAM;
+		case ERROR_NOT_SUPPORTED:
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		default:
+			return LIBUSB_ERROR_IO;
+		}
+	}
+
+	usbi_dbg("pipe policy %u of endpoint %02X set to %u", (unsigned int)type, endpoint, value);
+	return LIBUSB_SUCCESS;
+}
+
+static int winusbx_get_pipe_policy(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	enum libusb_pipe_policy policy, unsigned int *value)
+{
+	HANDLE winusb_handle;
+	ULONG type, size, ulong_value = 0;
+	UCHAR uchar_value = 0;
+	DWORD err;
+	int sub_api, r;
+
+	r = winusbx_pipe_policy(policy, &type, &size);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+
+	r = winusbx_pipe_handle(dev_handle, endpoint, &winusb_handle, &sub_api);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+
+	if ((sub_api == SUB_API_LIBUSB0) && (type != PIPE_TRANSFER_TIMEOUT))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (!WinUSBX[sub_api].GetPipePolicy(winusb_handle, endpoint, type, &size,
+		(size == sizeof(UCHAR)) ? (PVOID)&uchar_value : (PVOID)&ulong_value)) {
+		err = GetLastError();
+		usbi_dbg("GetPipePolicy %u failed for endpoint %02X: %s", (unsigned int)type,
+			endpoint, windows_error_str(err));
+		return (err == ERROR_NOT_SUPPORTED) ? LIBUSB_ERROR_NOT_SUPPORTED : LIBUSB_ERROR_IO;
+	}
+
+	*value = (size == sizeof(UCHAR)) ? uchar_value : (unsigned int)ulong_value;
+	return LIBUSB_SUCCESS;
+}
+
 /*
  * from http://www.winvistatips.com/winusb-bugchecks-t335323.html (confirmed
  * through testing as well):
@@ -3321,8 +3743,57 @@ static int winusbx_reset_device(int sub_api, struct libusb_device_handle *dev_ha
 	return LIBUSB_SUCCESS;
 }
 
+// WinUSB places the isochronous IN packets at multiples of the bytes per
+// interval of the endpoint. Move them to the offsets libusb_get_iso_packet_buffer()
+// expects, which only differ when the packet lengths are not that size.
+static void winusbx_copy_iso_packets(struct libusb_transfer *transfer, PUSBD_ISO_PACKET_DESCRIPTOR iso_packets)
+{
+	struct libusb_iso_packet_descriptor *desc;
+	unsigned int offset, length;
+	int i;
+
+	for (i = 0, offset = 0; i < transfer->num_iso_packets; offset += transfer->iso_packet_desc[i++].length) {
+		desc = &transfer->iso_packet_desc[i];
+		length = min(iso_packets[i].Length, desc->length);
+		if (iso_packets[i].Offset > offset) {
+			memmove(transfer->buffer + offset, transfer->buffer + iso_packets[i].Offset, length);
+		}
+		desc->actual_length = length;
+		if (iso_packets[i].Status != 0) {
+			desc->status = LIBUSB_TRANSFER_ERROR;
+		} else if (iso_packets[i].Length > desc->length) {
+			desc->status = LIBUSB_TRANSFER_OVERFLOW;
+		} else {
+			desc->status = LIBUSB_TRANSFER_COMPLETED;
+		}
+	}
+	// Packets moving up are done last to first, so that none overwrites the next
+	for (i = transfer->num_iso_packets - 1; i >= 0; i--) {
+		desc = &transfer->iso_packet_desc[i];
+		offset -= desc->length;
+		if (iso_packets[i].Offset < offset) {
+			memmove(transfer->buffer + offset, transfer->buffer + iso_packets[i].Offset, desc->actual_length);
+		}
+	}
+}
+
 static int winusbx_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer, uint32_t io_size)
 {
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
+	int i;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		if (IS_XFERIN(transfer)) {
+			winusbx_copy_iso_packets(transfer, transfer_priv->iso_packets);
+		} else {
+			for (i = 0; i < transfer->num_iso_packets; i++) {
+				transfer->iso_packet_desc[i].actual_length = transfer->iso_packet_desc[i].length;
+				transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+			}
+		}
+	}
+
 	itransfer->transferred += io_size;
 	return LIBUSB_TRANSFER_COMPLETED;
 }
@@ -3876,6 +4347,8 @@ static int hid_open(int sub_api, struct libusb_device_handle *dev_handle)
 				priv->usb_interface[i].restricted_functionality = true;
 			}
 			handle_priv->interface_handle[i].api_handle = hid_handle;
+			handle_priv->interface_handle[i].iocp_associated = associate_completion_port(ctx, hid_handle);
+			handle_priv->interface_handle[i].uses_iocp = handle_priv->interface_handle[i].iocp_associated;
 		}
 	}
 
@@ -4066,7 +4539,6 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
 	WINUSB_SETUP_PACKET *setup = (WINUSB_SETUP_PACKET *) transfer->buffer;
-	HANDLE hid_handle;
 	int current_interface, config;
 	size_t size;
 	int r;
@@ -4089,9 +4561,7 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 	}
 
 	usbi_dbg("will use interface %d", current_interface);
-	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
-
-	r = prepare_transfer_priv(itransfer, hid_handle);
+	r = prepare_transfer_priv(itransfer, &handle_priv->interface_handle[current_interface]);
 	if (r)
 		return r;
 
@@ -4150,7 +4620,7 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 		// Force request to be completed synchronously. Transferred size has been set by previous call
 		// http://msdn.microsoft.com/en-us/library/ms684342%28VS.85%29.aspx
 		// set InternalHigh to the number of bytes transferred
-		force_synchronous_completion(&transfer_priv->overlapped, (DWORD)size);
+		force_synchronous_completion(itransfer, (DWORD)size);
 		r = LIBUSB_SUCCESS;
 	}
 
@@ -4171,9 +4641,9 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
 	struct windows_device_handle_priv *handle_priv = _device_handle_priv(transfer->dev_handle);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
-	HANDLE hid_handle;
-	bool direction_in, ret;
+	bool direction_in, use_report_ids, ret;
 	int current_interface, length;
+	uint8_t *buffer;
 	DWORD size;
 	int r;
 
@@ -4190,40 +4660,48 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 
 	usbi_dbg("matched endpoint %02X with interface %d", transfer->endpoint, current_interface);
 
-	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
 	direction_in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
 
-	r = prepare_transfer_priv(itransfer, hid_handle);
+	r = prepare_transfer_priv(itransfer, &handle_priv->interface_handle[current_interface]);
 	if (r)
 		return r;
 
-	// If report IDs are not in use, an extra prefix byte must be added
-	if ( ((direction_in) && (!priv->hid->uses_report_ids[0]))
-	  || ((!direction_in) && (!priv->hid->uses_report_ids[1])) ) {
-		length = transfer->length+1;
-	} else {
+	// When report IDs are in use, the report starts with its ID and the transfer
+	// buffer is passed to the HID class driver as is. Otherwise an extra 0x00
+	// prefix byte must be added, which goes through the bounce buffer
+	use_report_ids = priv->hid->uses_report_ids[direction_in ? 0 : 1];
+	if (use_report_ids) {
 		length = transfer->length;
-	}
-	// Add a trailing byte to detect overflows on input
-	transfer_priv->hid_buffer = (uint8_t*)calloc(length+1, 1);
-	if (transfer_priv->hid_buffer == NULL) {
-		return LIBUSB_ERROR_NO_MEM;
+		buffer = transfer->buffer;
+	} else {
+		length = transfer->length+1;
+		// Add a trailing byte to detect overflows on input. The buffer is
+		// kept with the transfer, so resubmitting does not allocate
+		if (transfer_priv->hid_bounce_size < (size_t)length+1) {
+			buffer = (uint8_t*)realloc(transfer_priv->hid_bounce, length+1);
+			if (buffer == NULL) {
+				return LIBUSB_ERROR_NO_MEM;
+			}
+			transfer_priv->hid_bounce = buffer;
+			transfer_priv->hid_bounce_size = length+1;
+		}
+		buffer = transfer_priv->hid_bounce;
+		buffer[0] = 0;
 	}
 	transfer_priv->hid_expected_size = length;
 
 	if (direction_in) {
-		transfer_priv->hid_dest = transfer->buffer;
-		usbi_dbg("reading %d bytes (report ID: 0x00)", length);
-		ret = ReadFile(transfer_priv->handle, transfer_priv->hid_buffer, length + 1, &size, &transfer_priv->overlapped);
+		if (!use_report_ids) {
+			transfer_priv->hid_dest = transfer->buffer;
+		}
+		usbi_dbg("reading %d bytes (report ID: 0x%02X)", length, use_report_ids ? transfer->buffer[0] : 0);
+		ret = ReadFile(transfer_priv->handle, buffer, use_report_ids ? length : length + 1, &size, &transfer_priv->overlapped);
 	} else {
-		if (!priv->hid->uses_report_ids[1]) {
-			memcpy(transfer_priv->hid_buffer+1, transfer->buffer, transfer->length);
-		} else {
-			// We could actually do without the calloc and memcpy in this case
-			memcpy(transfer_priv->hid_buffer, transfer->buffer, transfer->length);
+		if (!use_report_ids) {
+			memcpy(buffer+1, transfer->buffer, transfer->length);
 		}
-		usbi_dbg("writing %d bytes (report ID: 0x%02X)", length, transfer_priv->hid_buffer[0]);
-		ret = WriteFile(transfer_priv->handle, transfer_priv->hid_buffer, length, &size, &transfer_priv->overlapped);
+		usbi_dbg("writing %d bytes (report ID: 0x%02X)", length, buffer[0]);
+		ret = WriteFile(transfer_priv->handle, buffer, length, &size, &transfer_priv->overlapped);
 	}
 	if (!ret) {
 		if (GetLastError() != ERROR_IO_PENDING) {
@@ -4232,11 +4710,7 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 			return LIBUSB_ERROR_IO;
 		}
 	} else {
-		// Only write operations that completed synchronously need to free up
-		// hid_buffer. For reads, copy_transfer_data() handles that process.
-		if (!direction_in) {
-			safe_free(transfer_priv->hid_buffer);
-		}
+		// For reads, copy_transfer_data() strips the prefix
 		if (size == 0) {
 			usbi_err(ctx, "program assertion failed - no data was transferred");
 			size = 1;
@@ -4245,7 +4719,7 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 			usbi_err(ctx, "OVERFLOW!");
 			r = LIBUSB_ERROR_OVERFLOW;
 		}
-		force_synchronous_completion(&transfer_priv->overlapped, size);
+		force_synchronous_completion(itransfer, size);
 	}
 
 	transfer_priv->interface_number = (uint8_t)current_interface;
@@ -4325,31 +4799,31 @@ static int hid_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer,
 	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
 	int r = LIBUSB_TRANSFER_COMPLETED;
 	uint32_t corrected_size = io_size;
+	// Control reports use a hid_buffer of their own, interrupt reads the bounce
+	// buffer, and interrupt transfers with report IDs went to the transfer buffer directly
+	uint8_t *src = (transfer_priv->hid_buffer != NULL) ? transfer_priv->hid_buffer : transfer_priv->hid_bounce;
+
+	if ((transfer_priv->hid_dest != NULL) && (src != NULL)) {	// Data readout
+		if (corrected_size > 0) {
+			// First, check for overflow
+			if (corrected_size > transfer_priv->hid_expected_size) {
+				usbi_err(ctx, "OVERFLOW!");
+				corrected_size = (uint32_t)transfer_priv->hid_expected_size;
+				r = LIBUSB_TRANSFER_OVERFLOW;
+			}
 
-	if (transfer_priv->hid_buffer != NULL) {
-		// If we have a valid hid_buffer, it means the transfer was async
-		if (transfer_priv->hid_dest != NULL) {	// Data readout
-			if (corrected_size > 0) {
-				// First, check for overflow
-				if (corrected_size > transfer_priv->hid_expected_size) {
-					usbi_err(ctx, "OVERFLOW!");
-					corrected_size = (uint32_t)transfer_priv->hid_expected_size;
-					r = LIBUSB_TRANSFER_OVERFLOW;
-				}
-
-				if (transfer_priv->hid_buffer[0] == 0) {
-					// Discard the 1 byte report ID prefix
-					corrected_size--;
-					memcpy(transfer_priv->hid_dest, transfer_priv->hid_buffer+1, corrected_size);
-				} else {
-					memcpy(transfer_priv->hid_dest, transfer_priv->hid_buffer, corrected_size);
-				}
+			if (src[0] == 0) {
+				// Discard the 1 byte report ID prefix
+				corrected_size--;
+				memcpy(transfer_priv->hid_dest, src+1, corrected_size);
+			} else {
+				memcpy(transfer_priv->hid_dest, src, corrected_size);
 			}
-			transfer_priv->hid_dest = NULL;
 		}
-		// For write, we just need to free the hid buffer
-		safe_free(transfer_priv->hid_buffer);
 	}
+	transfer_priv->hid_dest = NULL;
+	// For write, we just need to free the hid buffer
+	safe_free(transfer_priv->hid_buffer);
 	itransfer->transferred += corrected_size;
 	return r;
 }
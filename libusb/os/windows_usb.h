@@ -64,7 +64,7 @@
 #define MAX_PATH_LENGTH             128
 #define MAX_KEY_LENGTH              256
 #define LIST_SEPARATOR              ';'
-#define HTAB_SIZE                   1021
+#define HTAB_SIZE                   1024
 
 // Handle code for HID interface that have been claimed ("dibs")
 #define INTERFACE_CLAIMED           ((HANDLE)(intptr_t)0xD1B5)
@@ -278,12 +278,15 @@ static inline void windows_device_priv_release(libusb_device* dev) {
 struct interface_handle_t {
 	HANDLE dev_handle; // WinUSB needs an extra handle for the file
 	HANDLE api_handle; // used by the API to communicate with the device
+	bool iocp_associated; // the file handle is associated with the context's completion port
+	bool uses_iocp;       // I/O on api_handle completes on the context's completion port
 };
 
 struct windows_device_handle_priv {
 	int active_interface;
 	struct interface_handle_t interface_handle[USB_MAXINTERFACES];
 	int autoclaim_count[USB_MAXINTERFACES]; // For auto-release
+	struct list_head isoch_buffers; // struct winusbx_isoch_buffer registered on the interfaces
 };
 
 static inline struct windows_device_handle_priv *_device_handle_priv(
@@ -293,14 +296,22 @@ static inline struct windows_device_handle_priv *_device_handle_priv(
 }
 
 struct windows_transfer_priv {
+	struct usbi_transfer *itransfer;
 	HANDLE handle;
 	HANDLE original_handle;
 	DWORD thread_id;
 	OVERLAPPED overlapped;
+	HANDLE wait_handle; // used when the handle is not associated with the completion port
+	HANDLE event;       // event of overlapped for such handles, kept across submissions
 	uint8_t interface_number;
 	uint8_t *hid_buffer; // 1 byte extended data buffer, required for HID
 	uint8_t *hid_dest;   // transfer buffer destination, required for HID
 	size_t hid_expected_size;
+	uint8_t *hid_bounce; // HID interrupt buffer for the report ID prefix, kept across submissions
+	size_t hid_bounce_size;
+	struct winusbx_isoch_buffer *isoch_buffer; // WinUSB registration of the buffer, kept across submissions
+	struct _USBD_ISO_PACKET_DESCRIPTOR *iso_packets; // packet results of isochronous IN transfers
+	int iso_packets_size;
 };
 
 // used to match a device driver (including filter drivers) against a supported API
@@ -310,15 +321,6 @@ struct driver_lookup {
 	const char* designation;	// internal designation (for debug output)
 };
 
-#define WM_TIMER_REQUEST	(WM_USER + 1)
-#define WM_TIMER_EXIT		(WM_USER + 2)
-
-// used for monotonic clock_gettime()
-struct timer_request {
-	struct timespec *tp;
-	HANDLE event;
-};
-
 /* OLE32 dependency */
 DLL_DECLARE_PREFIXED(WINAPI, HRESULT, p, CLSIDFromString, (LPCOLESTR, LPCLSID));
 
@@ -351,6 +353,10 @@ typedef RETURN_TYPE CONFIGRET;
 #define CR_SUCCESS                              0x00000000
 #define CR_NO_SUCH_DEVNODE                      0x0000000D
 
+#if !defined(MAX_DEVICE_ID_LEN)
+#define MAX_DEVICE_ID_LEN                       200
+#endif
+
 #define USB_DEVICE_DESCRIPTOR_TYPE              LIBUSB_DT_DEVICE
 #define USB_CONFIGURATION_DESCRIPTOR_TYPE       LIBUSB_DT_CONFIG
 #define USB_STRING_DESCRIPTOR_TYPE              LIBUSB_DT_STRING
@@ -424,6 +430,31 @@ DLL_DECLARE(WINAPI, CONFIGRET, CM_Get_Child, (PDEVINST, DEVINST, ULONG));
 DLL_DECLARE(WINAPI, CONFIGRET, CM_Get_Sibling, (PDEVINST, DEVINST, ULONG));
 DLL_DECLARE(WINAPI, CONFIGRET, CM_Get_Device_IDA, (DEVINST, PCHAR, ULONG, ULONG));
 
+/* Device change notifications (Windows 8 and later). Not all SDKs provide
+ * these, so we use our own definitions, prefixed to avoid conflicts */
+#define LIBUSB_CM_NOTIFY_FILTER_FLAG_ALL_INTERFACE_CLASSES	0x00000001
+#define LIBUSB_CM_NOTIFY_FILTER_FLAG_ALL_DEVICE_INSTANCES	0x00000002
+#define LIBUSB_CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE		0
+#define LIBUSB_CM_NOTIFY_FILTER_TYPE_DEVICEINSTANCE		2
+
+typedef struct libusb_cm_notify_filter {
+	DWORD cbSize;
+	DWORD Flags;
+	DWORD FilterType;
+	DWORD Reserved;
+	union {
+		GUID ClassGuid;
+		HANDLE hTarget;
+		WCHAR InstanceId[MAX_DEVICE_ID_LEN];
+	} u;
+} LIBUSB_CM_NOTIFY_FILTER, *PLIBUSB_CM_NOTIFY_FILTER;
+
+typedef DWORD (CALLBACK *LIBUSB_CM_NOTIFY_CALLBACK)(HANDLE, PVOID, DWORD, PVOID, DWORD);
+
+DLL_DECLARE_PREFIXED(WINAPI, CONFIGRET, p, CM_Register_Notification, (PLIBUSB_CM_NOTIFY_FILTER, PVOID,
+				LIBUSB_CM_NOTIFY_CALLBACK, HANDLE *));
+DLL_DECLARE_PREFIXED(WINAPI, CONFIGRET, p, CM_Unregister_Notification, (HANDLE));
+
 #define IOCTL_USB_GET_HUB_CAPABILITIES_EX \
   CTL_CODE( FILE_DEVICE_USB, USB_GET_HUB_CAPABILITIES_EX, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
@@ -673,6 +704,13 @@ typedef struct {
 #pragma pack()
 
 typedef void *WINUSB_INTERFACE_HANDLE, *PWINUSB_INTERFACE_HANDLE;
+typedef void *WINUSB_ISOCH_BUFFER_HANDLE, *PWINUSB_ISOCH_BUFFER_HANDLE;
+
+typedef struct _USBD_ISO_PACKET_DESCRIPTOR {
+	ULONG Offset;
+	ULONG Length;
+	LONG Status;
+} USBD_ISO_PACKET_DESCRIPTOR, *PUSBD_ISO_PACKET_DESCRIPTOR;
 
 typedef BOOL (WINAPI *WinUsb_AbortPipe_t)(
 	WINUSB_INTERFACE_HANDLE InterfaceHandle,
@@ -791,6 +829,33 @@ typedef BOOL (WINAPI *WinUsb_WritePipe_t)(
 typedef BOOL (WINAPI *WinUsb_ResetDevice_t)(
 	WINUSB_INTERFACE_HANDLE InterfaceHandle
 );
+/* Windows 8.1 and later */
+typedef BOOL (WINAPI *WinUsb_RegisterIsochBuffer_t)(
+	WINUSB_INTERFACE_HANDLE InterfaceHandle,
+	UCHAR PipeID,
+	PUCHAR Buffer,
+	ULONG BufferLength,
+	PWINUSB_ISOCH_BUFFER_HANDLE IsochBufferHandle
+);
+typedef BOOL (WINAPI *WinUsb_UnregisterIsochBuffer_t)(
+	WINUSB_ISOCH_BUFFER_HANDLE IsochBufferHandle
+);
+typedef BOOL (WINAPI *WinUsb_ReadIsochPipeAsap_t)(
+	WINUSB_ISOCH_BUFFER_HANDLE BufferHandle,
+	ULONG Offset,
+	ULONG Length,
+	BOOL ContinueStream,
+	ULONG NumberOfPackets,
+	PUSBD_ISO_PACKET_DESCRIPTOR IsoPacketDescriptors,
+	LPOVERLAPPED Overlapped
+);
+typedef BOOL (WINAPI *WinUsb_WriteIsochPipeAsap_t)(
+	WINUSB_ISOCH_BUFFER_HANDLE BufferHandle,
+	ULONG Offset,
+	ULONG Length,
+	BOOL ContinueStream,
+	LPOVERLAPPED Overlapped
+);
 
 /* /!\ These must match the ones from the official libusbk.h */
 typedef enum _KUSB_FNID
@@ -873,6 +938,11 @@ struct winusb_interface {
 	WinUsb_SetPowerPolicy_t SetPowerPolicy;
 	WinUsb_WritePipe_t WritePipe;
 	WinUsb_ResetDevice_t ResetDevice;
+	// only with native WinUSB, NULL before Windows 8.1
+	WinUsb_RegisterIsochBuffer_t RegisterIsochBuffer;
+	WinUsb_UnregisterIsochBuffer_t UnregisterIsochBuffer;
+	WinUsb_ReadIsochPipeAsap_t ReadIsochPipeAsap;
+	WinUsb_WriteIsochPipeAsap_t WriteIsochPipeAsap;
 };
 
 /* hid.dll interface */
@@ -36,19 +36,71 @@
 
 static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 {
+	struct usbi_transfer_waiter *waiter =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->waiter;
 	int *completed = transfer->user_data;
-	*completed = 1;
+
 	usbi_dbg("actual_length=%d", transfer->actual_length);
+	if (waiter) {
+		/* wake the thread waiting for this transfer only */
+		usbi_mutex_lock(&waiter->lock);
+		*completed = 1;
+		usbi_cond_signal(&waiter->cond);
+		usbi_mutex_unlock(&waiter->lock);
+	} else {
+		*completed = 1;
+	}
 	/* caller interprets result and frees transfer */
 }
 
+/* set the transfer up so that the caller can sleep until it completes,
+ * rather than being woken by every event, whenever it is not the thread
+ * handling events */
+static int sync_transfer_prepare_wait(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct usbi_transfer_waiter *waiter;
+
+	if (itransfer->waiter)
+		return 0;
+
+	waiter = malloc(sizeof(*waiter));
+	if (!waiter)
+		return LIBUSB_ERROR_NO_MEM;
+	if (usbi_mutex_init(&waiter->lock, NULL)) {
+		free(waiter);
+		return LIBUSB_ERROR_OTHER;
+	}
+	if (usbi_cond_init(&waiter->cond, NULL)) {
+		usbi_mutex_destroy(&waiter->lock);
+		free(waiter);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	itransfer->waiter = waiter;
+	return 0;
+}
+
 static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 {
+	struct usbi_transfer_waiter *waiter =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->waiter;
 	int r, *completed = transfer->user_data;
 	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
 
+	if (waiter && ctx->event_thread_running) {
+		usbi_mutex_lock(&waiter->lock);
+		while (!*completed)
+			usbi_cond_wait(&waiter->cond, &waiter->lock);
+		usbi_mutex_unlock(&waiter->lock);
+		return;
+	}
+
 	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+		if (waiter)
+			r = usbi_handle_events_for_waiter(ctx, waiter, completed);
+		else
+			r = libusb_handle_events_completed(ctx, completed);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
@@ -60,6 +112,45 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 	}
 }
 
+static struct libusb_transfer *alloc_sync_transfer(
+	struct libusb_device_handle *dev_handle)
+{
+	struct libusb_transfer *transfer;
+
+	if (dev_handle->sync_pool)
+		transfer = libusb_transfer_pool_alloc(dev_handle->sync_pool);
+	else
+		transfer = libusb_alloc_transfer(0);
+	/* sync_transfer_wait_for_completion() may be handling events itself,
+	 * so the callback must not be deferred */
+	if (transfer)
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->inline_callback = 1;
+	return transfer;
+}
+
+static int sync_transfer_status_to_error(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(HANDLE_CTX(transfer->dev_handle),
+			"unrecognised status code %d", transfer->status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
 /** \ingroup syncio
  * Perform a USB control transfer.
  *
@@ -92,7 +183,7 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer = alloc_sync_transfer(dev_handle);
 	unsigned char *buffer;
 	int completed = 0;
 	int r;
@@ -114,7 +205,9 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
 		sync_transfer_cb, &completed, timeout);
 	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
-	r = libusb_submit_transfer(transfer);
+	r = sync_transfer_prepare_wait(transfer);
+	if (r == 0)
+		r = libusb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		return r;
@@ -126,41 +219,248 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		memcpy(data, libusb_control_transfer_get_data(transfer),
 			transfer->actual_length);
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
+	r = sync_transfer_status_to_error(transfer);
+	if (r == 0)
 		r = transfer->actual_length;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
 
 	libusb_free_transfer(transfer);
 	return r;
 }
 
+/* number of requests of libusb_control_write_vec() and
+ * usbi_control_read_vec() kept in flight */
+#define CONTROL_VEC_DEPTH	8
+
+/** \ingroup syncio
+ * Perform a sequence of USB control requests with OUT data stages, such as
+ * the vendor requests that load firmware into RAM.
+ *
+ * Unlike calling libusb_control_transfer() for each request, the requests are
+ * pipelined: several are submitted ahead, so the device receives the next
+ * one as soon as it completed the previous one. They are still performed in
+ * order. The setup packets and data of all requests are staged into a single
+ * buffer.
+ *
+ * The first request that fails stops the sequence, the ones already
+ * submitted after it are cancelled.
+ *
+ * Merging adjacent requests into fewer, larger ones saves round-trips. On
+ * Linux, data stages of the full 65535 bytes that wLength allows are accepted
+ * if the kernel has no URB size limit, older kernels allow 4096 bytes.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param writes the requests
+ * \param num_writes the number of requests
+ * \param completed output location for the number of requests that
+ * completed, which is num_writes on success. May be NULL
+ * \param timeout timeout (in millseconds) of each request. For an unlimited
+ * timeout, use value 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a request is not an OUT request
+ * \returns LIBUSB_ERROR_TIMEOUT if a request timed out
+ * \returns LIBUSB_ERROR_PIPE if a request was not supported by the device
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failures
+ */
+int API_EXPORTED libusb_control_write_vec(libusb_device_handle *dev_handle,
+	const struct libusb_control_write *writes, int num_writes,
+	int *completed, unsigned int timeout)
+{
+	struct libusb_transfer *transfers[CONTROL_VEC_DEPTH];
+	int done[CONTROL_VEC_DEPTH];
+	unsigned char *buffer, *setup;
+	size_t *offsets;
+	size_t size = 0;
+	int depth, submitted = 0, finished = 0;
+	int i, r = 0;
+
+	if (completed)
+		*completed = 0;
+	if (num_writes < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (num_writes == 0)
+		return 0;
+
+	for (i = 0; i < num_writes; i++) {
+		if ((writes[i].bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) !=
+		    LIBUSB_ENDPOINT_OUT)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		size += LIBUSB_CONTROL_SETUP_SIZE + writes[i].wLength;
+	}
+
+	buffer = malloc(size);
+	offsets = malloc(num_writes * sizeof(*offsets));
+	if (!buffer || !offsets) {
+		free(offsets);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	size = 0;
+	for (i = 0; i < num_writes; i++) {
+		setup = buffer + size;
+		libusb_fill_control_setup(setup, writes[i].bmRequestType,
+			writes[i].bRequest, writes[i].wValue, writes[i].wIndex,
+			writes[i].wLength);
+		/* requests without a data stage may leave data NULL */
+		if (writes[i].wLength)
+			memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, writes[i].data,
+				writes[i].wLength);
+		offsets[i] = size;
+		size += LIBUSB_CONTROL_SETUP_SIZE + writes[i].wLength;
+	}
+
+	depth = num_writes < CONTROL_VEC_DEPTH ?
+		num_writes : CONTROL_VEC_DEPTH;
+	for (i = 0; i < depth; i++) {
+		transfers[i] = alloc_sync_transfer(dev_handle);
+		if (!transfers[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+		r = sync_transfer_prepare_wait(transfers[i]);
+		if (r < 0) {
+			libusb_free_transfer(transfers[i]);
+			break;
+		}
+	}
+	depth = i;
+
+	/* request n uses transfer n % depth, submitted once request
+	 * n - depth has completed */
+	while (r == 0 && finished < num_writes) {
+		while (submitted < num_writes && submitted - finished < depth) {
+			i = submitted % depth;
+			done[i] = 0;
+			libusb_fill_control_transfer(transfers[i], dev_handle,
+				buffer + offsets[submitted], sync_transfer_cb,
+				&done[i], timeout);
+			r = libusb_submit_transfer(transfers[i]);
+			if (r < 0)
+				break;
+			submitted++;
+		}
+		if (r < 0)
+			break;
+
+		i = finished % depth;
+		sync_transfer_wait_for_completion(transfers[i]);
+		r = sync_transfer_status_to_error(transfers[i]);
+		if (r < 0)
+			break;
+		finished++;
+	}
+
+	/* after a failure the requests still in flight are cancelled, and
+	 * waited for as they use the buffer. the one that failed has already
+	 * completed, cancelling it again does nothing */
+	for (i = finished; i < submitted; i++)
+		libusb_cancel_transfer(transfers[i % depth]);
+	for (i = finished; i < submitted; i++)
+		sync_transfer_wait_for_completion(transfers[i % depth]);
+
+	for (i = 0; i < depth; i++)
+		libusb_free_transfer(transfers[i]);
+	free(offsets);
+	free(buffer);
+
+	if (completed)
+		*completed = finished;
+	return r;
+}
+
+/* Perform IN control requests pipelined as libusb_control_write_vec() does.
+ * A request that fails does not stop the others, each gets its own result.
+ * Returns 0 once every request has its result, or a LIBUSB_ERROR code if
+ * none could be performed */
+int usbi_control_read_vec(struct libusb_device_handle *dev_handle,
+	struct usbi_control_read *reads, int num_reads, unsigned int timeout)
+{
+	struct libusb_transfer *transfers[CONTROL_VEC_DEPTH];
+	int done[CONTROL_VEC_DEPTH];
+	unsigned char *buffers, *buffer;
+	size_t stride = 0;
+	int depth, limit = num_reads, submitted = 0, finished = 0;
+	int i, j, r;
+
+	if (num_reads <= 0)
+		return 0;
+
+	for (i = 0; i < num_reads; i++) {
+		if (stride < reads[i].wLength)
+			stride = reads[i].wLength;
+	}
+	stride += LIBUSB_CONTROL_SETUP_SIZE;
+
+	depth = num_reads < CONTROL_VEC_DEPTH ? num_reads : CONTROL_VEC_DEPTH;
+	buffers = malloc(depth * stride);
+	if (!buffers)
+		return LIBUSB_ERROR_NO_MEM;
+	for (i = 0; i < depth; i++) {
+		transfers[i] = alloc_sync_transfer(dev_handle);
+		if (!transfers[i])
+			break;
+		if (sync_transfer_prepare_wait(transfers[i]) < 0) {
+			libusb_free_transfer(transfers[i]);
+			break;
+		}
+	}
+	depth = i;
+	if (depth == 0) {
+		free(buffers);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* request n uses transfer and buffer n % depth, as in
+	 * libusb_control_write_vec(). once a submission fails, the requests
+	 * not submitted yet get its error */
+	while (finished < limit) {
+		while (submitted < limit && submitted - finished < depth) {
+			i = submitted % depth;
+			buffer = buffers + i * stride;
+			libusb_fill_control_setup(buffer, reads[submitted].bmRequestType,
+				reads[submitted].bRequest, reads[submitted].wValue,
+				reads[submitted].wIndex, reads[submitted].wLength);
+			done[i] = 0;
+			libusb_fill_control_transfer(transfers[i], dev_handle,
+				buffer, sync_transfer_cb, &done[i], timeout);
+			r = libusb_submit_transfer(transfers[i]);
+			if (r < 0) {
+				for (j = submitted; j < limit; j++)
+					reads[j].result = r;
+				limit = submitted;
+				break;
+			}
+			submitted++;
+		}
+		if (finished == limit)
+			break;
+
+		i = finished % depth;
+		sync_transfer_wait_for_completion(transfers[i]);
+		r = sync_transfer_status_to_error(transfers[i]);
+		if (r == 0) {
+			r = transfers[i]->actual_length;
+			memcpy(reads[finished].data,
+				libusb_control_transfer_get_data(transfers[i]), r);
+		}
+		reads[finished].result = r;
+		finished++;
+	}
+
+	for (i = 0; i < depth; i++)
+		libusb_free_transfer(transfers[i]);
+	free(buffers);
+	return 0;
+}
+
 static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer = alloc_sync_transfer(dev_handle);
 	int completed = 0;
 	int r;
 
@@ -171,7 +471,9 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		sync_transfer_cb, &completed, timeout);
 	transfer->type = type;
 
-	r = libusb_submit_transfer(transfer);
+	r = sync_transfer_prepare_wait(transfer);
+	if (r == 0)
+		r = libusb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		return r;
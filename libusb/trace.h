@@ -0,0 +1,89 @@
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * Transfer tracepoints for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(USBI_TRACE_H)
+#define USBI_TRACE_H
+
+/* Static tracepoints on the transfer lifecycle. Every probe carries the
+ * same typed arguments: the libusb_transfer pointer, the endpoint address,
+ * a length and a status, so that one script can follow a transfer through
+ * all of them:
+ *
+ *   submit          libusb_submit_transfer(), length requested, status 0
+ *   backend_submit  after the backend submit, length requested, status is
+ *                   the LIBUSB_ERROR code returned by the backend
+ *   reap            per URB reaped on Linux, URB length and URB status
+ *   callback_enter  before the user callback, actual length and
+ *                   libusb_transfer_status
+ *   callback_exit   after the user callback, same arguments. the transfer
+ *                   may have been freed, only compare the pointer. not
+ *                   reported for transfers delivered to a batch callback
+ *   cancel          libusb_cancel_transfer(), length requested, status is
+ *                   the value returned
+ *   timeout         the transfer timed out and is about to be cancelled
+ *
+ * With --enable-usdt they are USDT probes in the "libusb" provider, for
+ * example "bpftrace -e 'usdt:libusb-1.0.so:libusb:submit { ... }'". With
+ * ENABLE_ETW_TRACING (see msvc/config.h) they are TraceLogging events of the
+ * "libusb" ETW provider. Otherwise they compile to nothing. */
+
+#if defined(ENABLE_USDT)
+
+#include <sys/sdt.h>
+
+#define USBI_TRACE(probe, transfer, endpoint, length, status) \
+	DTRACE_PROBE4(libusb, probe, (void *)(transfer), \
+		(unsigned int)(endpoint), (int)(length), (int)(status))
+
+#define usbi_trace_register() do { } while (0)
+#define usbi_trace_unregister() do { } while (0)
+
+#elif defined(ENABLE_ETW_TRACING)
+
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(usbi_trace_provider);
+
+#define USBI_TRACE(probe, transfer, endpoint, length, status) \
+	TraceLoggingWrite(usbi_trace_provider, #probe, \
+		TraceLoggingPointer((const void *)(transfer), "transfer"), \
+		TraceLoggingUInt8((UINT8)(endpoint), "endpoint"), \
+		TraceLoggingInt32((INT32)(length), "length"), \
+		TraceLoggingInt32((INT32)(status), "status"))
+
+/* events written while the provider is not registered are dropped */
+#define usbi_trace_register() TraceLoggingRegister(usbi_trace_provider)
+#define usbi_trace_unregister() TraceLoggingUnregister(usbi_trace_provider)
+
+#else
+
+/* the arguments are still referenced so that their locals do not warn */
+#define USBI_TRACE(probe, transfer, endpoint, length, status) \
+	do { (void)(transfer); (void)(endpoint); (void)(length); \
+		(void)(status); } while (0)
+#define usbi_trace_register() do { } while (0)
+#define usbi_trace_unregister() do { } while (0)
+
+#endif
+
+#define usbi_trace_transfer(probe, transfer, length, status) \
+	USBI_TRACE(probe, transfer, (transfer)->endpoint, length, status)
+
+#endif
@@ -28,6 +28,10 @@
 /* Uncomment to enabling logging to system log */
 // #define USE_SYSTEM_LOGGING_FACILITY
 
+/* Uncomment to emit the transfer tracepoints as ETW events (needs the
+ * TraceLogging headers of the Windows 10 SDK) */
+// #define ENABLE_ETW_TRACING 1
+
 /* Windows/WinCE backend */
 #if defined(_WIN32_WCE)
 #define OS_WINCE 1
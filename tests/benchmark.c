@@ -0,0 +1,1076 @@
+/*
+ * libusb benchmarks measuring transfer throughput and latency
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "descriptor_corpus.h"
+
+#if defined(_MSC_VER)
+#define putenv _putenv
+#endif
+
+/* The transfer benchmarks run against one device with a source/sink or
+ * loopback function, such as the Linux gadget zero (g_zero). They are
+ * configured from the environment:
+ *
+ *   LIBUSB_BENCH_DEVICE     vid:pid of the device in hex, the transfer
+ *                           benchmarks are skipped without it
+ *   LIBUSB_BENCH_INTERFACE  interface to claim [0]
+ *   LIBUSB_BENCH_BULK_IN    bulk IN endpoint [0x81]
+ *   LIBUSB_BENCH_BULK_OUT   bulk OUT endpoint [0x01]
+ *   LIBUSB_BENCH_ISO_IN     iso IN endpoint, iso_loss is skipped without it
+ *   LIBUSB_BENCH_ISO_ALT    alternate setting of the iso endpoint [1]
+ *   LIBUSB_BENCH_INT_IN     interrupt IN endpoint that never has data,
+ *                           timeout_precision is skipped without it
+ *   LIBUSB_BENCH_SECONDS    duration of each throughput measurement [2]
+ *
+ * multi_device opens up to MAX_THREADS devices with the ids of
+ * LIBUSB_BENCH_DEVICE in one context and runs synchronous bulk IN transfers
+ * on each from its own thread, to show how the submit and completion paths
+ * scale with independent devices. With the null backend, set
+ * LIBUSB_NULL_DEVICES to the number of devices to simulate. Set
+ * LIBUSB_BENCH_SHARDS to handle their events on that many event shards
+ * (LIBUSB_OPTION_EVENT_SHARDS) instead of the context's event loop.
+ *
+ * event_loop needs no device, it opens whatever devices it can. Neither do
+ * enumerate and init_exit, which time libusb_get_device_list() and a
+ * libusb_init()/libusb_exit() cycle with the devices that are present.
+ *
+ * descriptor_parse times libusb_get_config_descriptor() and
+ * libusb_get_bos_descriptor() over the blobs of descriptor_corpus.h, which
+ * it hands to the null backend through LIBUSB_NULL_CONFIG and
+ * LIBUSB_NULL_BOS. With any other backend it parses the descriptors of the
+ * devices present instead, and names them by vid:pid.
+ *
+ * With a library configured with --enable-null-backend there is no bus
+ * underneath: set LIBUSB_BENCH_DEVICE=1d6b:0104 and LIBUSB_BENCH_ISO_IN=0x83
+ * to measure the overhead of libusb itself (see libusb/os/null_usb.c).
+ *
+ * Each measurement is logged as one line of space separated key=value
+ * pairs after the word "result", so that runs can be compared by scripts:
+ *
+ *   result bench=bulk_in depth=4 size=16384 transfers=... bytes_per_sec=...
+ */
+
+#define MAX_DEPTH		16
+#define ISO_TRANSFERS		8
+#define ISO_PACKETS		32
+#define CONTROL_ITERATIONS	1000
+#define TIMEOUT_ITERATIONS	200
+#define TIMEOUT_US		125
+#define EVENT_ITERATIONS	10000
+#define MAX_OPEN_DEVICES	128
+#define PARSE_ITERATIONS	10000
+#define ENUM_ITERATIONS		1000
+#define INIT_ITERATIONS		100
+#define MAX_THREADS		8
+#define MULTI_SIZE		512
+
+static const int bulk_depths[] = { 1, 2, 4, 8, 16 };
+static const int bulk_sizes[] = { 512, 4096, 16384, 65536 };
+
+struct bench_device {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	int interface;
+};
+
+/* state shared by the transfers of one throughput measurement */
+struct stream_state {
+	double deadline;
+	int in_flight;
+	int failed;
+	unsigned long transfers;
+	unsigned long long bytes;
+	unsigned long packets;
+	unsigned long lost_packets;
+};
+
+static long env_long(const char *name, long def)
+{
+	const char *value = getenv(name);
+	char *end;
+	long l;
+
+	if (!value || !*value)
+		return def;
+	l = strtol(value, &end, 0);
+	return *end ? def : l;
+}
+
+static double now_us(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart * 1e6 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+#endif
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+#if defined(_WIN32)
+typedef HANDLE bench_thread_t;
+typedef DWORD bench_thread_ret_t;
+#define BENCH_THREAD_CALL	WINAPI
+#else
+typedef pthread_t bench_thread_t;
+typedef void *bench_thread_ret_t;
+#define BENCH_THREAD_CALL
+#endif
+
+static int bench_thread_create(bench_thread_t *thread,
+	bench_thread_ret_t (BENCH_THREAD_CALL *fn)(void *), void *arg)
+{
+#if defined(_WIN32)
+	*thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+	return *thread ? 0 : -1;
+#else
+	return pthread_create(thread, NULL, fn, arg);
+#endif
+}
+
+static void bench_thread_join(bench_thread_t thread)
+{
+#if defined(_WIN32)
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+/* samples must be sorted */
+static double percentile(const double *samples, int count, double p)
+{
+	return samples[(int)(p * (count - 1) + 0.5)];
+}
+
+static libusb_testlib_result open_bench_device(libusb_testlib_ctx *tctx,
+	struct bench_device *bdev)
+{
+	const char *spec = getenv("LIBUSB_BENCH_DEVICE");
+	unsigned int vid, pid;
+	int r;
+
+	if (!spec || sscanf(spec, "%x:%x", &vid, &pid) != 2) {
+		libusb_testlib_logf(tctx,
+			"Set LIBUSB_BENCH_DEVICE=vid:pid to run this benchmark");
+		return TEST_STATUS_SKIP;
+	}
+
+	r = libusb_init(&bdev->ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+	libusb_set_option(bdev->ctx, LIBUSB_OPTION_COLLECT_STATS, 1);
+
+	bdev->handle = libusb_open_device_with_vid_pid(bdev->ctx,
+		(uint16_t)vid, (uint16_t)pid);
+	if (!bdev->handle) {
+		libusb_testlib_logf(tctx, "Device %04x:%04x not found or not accessible",
+			vid, pid);
+		libusb_exit(bdev->ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	bdev->interface = (int)env_long("LIBUSB_BENCH_INTERFACE", 0);
+	libusb_set_auto_detach_kernel_driver(bdev->handle, 1);
+	r = libusb_claim_interface(bdev->handle, bdev->interface);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to claim interface %d: %d",
+			bdev->interface, r);
+		libusb_close(bdev->handle);
+		libusb_exit(bdev->ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static void close_bench_device(struct bench_device *bdev)
+{
+	libusb_release_interface(bdev->handle, bdev->interface);
+	libusb_close(bdev->handle);
+	libusb_exit(bdev->ctx);
+}
+
+static void LIBUSB_CALL stream_cb(struct libusb_transfer *transfer)
+{
+	struct stream_state *state = transfer->user_data;
+	int i;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		state->failed = 1;
+		state->in_flight--;
+		return;
+	}
+
+	state->transfers++;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pack =
+				&transfer->iso_packet_desc[i];
+
+			state->packets++;
+			if (pack->status != LIBUSB_TRANSFER_COMPLETED)
+				state->lost_packets++;
+			state->bytes += pack->actual_length;
+		}
+	} else {
+		state->bytes += transfer->actual_length;
+	}
+
+	if (state->failed || now_us() >= state->deadline) {
+		state->in_flight--;
+		return;
+	}
+	if (libusb_submit_transfer(transfer) < 0) {
+		state->failed = 1;
+		state->in_flight--;
+	}
+}
+
+/* keep the transfers busy until the deadline, then wait until all of them
+ * are back. returns the elapsed time in seconds */
+static double run_stream(struct bench_device *bdev,
+	struct libusb_transfer **transfers, int count,
+	struct stream_state *state, double seconds)
+{
+	double start;
+	int i;
+
+	start = now_us();
+	state->deadline = start + seconds * 1e6;
+	for (i = 0; i < count; i++) {
+		if (libusb_submit_transfer(transfers[i]) < 0) {
+			state->failed = 1;
+			break;
+		}
+		state->in_flight++;
+	}
+
+	while (state->in_flight > 0)
+		libusb_handle_events(bdev->ctx);
+
+	return (now_us() - start) / 1e6;
+}
+
+static void free_transfers(struct libusb_transfer **transfers, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		libusb_free_transfer(transfers[i]);
+}
+
+static int bulk_stream(libusb_testlib_ctx *tctx, struct bench_device *bdev,
+	const char *name, unsigned char endpoint, int depth, int size,
+	double seconds)
+{
+	struct libusb_transfer *transfers[MAX_DEPTH];
+	struct libusb_context_stats before, after;
+	struct stream_state state;
+	double elapsed;
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	for (i = 0; i < depth; i++) {
+		unsigned char *buffer = calloc(1, (size_t)size);
+
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!buffer || !transfers[i]) {
+			libusb_free_transfer(transfers[i]);
+			free(buffer);
+			free_transfers(transfers, i);
+			libusb_testlib_logf(tctx, "Failed to allocate transfers");
+			return -1;
+		}
+		libusb_fill_bulk_transfer(transfers[i], bdev->handle, endpoint,
+			buffer, size, stream_cb, &state, 1000);
+		transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	libusb_get_context_stats(bdev->ctx, &before);
+	elapsed = run_stream(bdev, transfers, depth, &state, seconds);
+	libusb_get_context_stats(bdev->ctx, &after);
+	free_transfers(transfers, depth);
+
+	if (state.failed) {
+		libusb_testlib_logf(tctx, "%s transfers failed at depth %d size %d",
+			name, depth, size);
+		return -1;
+	}
+
+	libusb_testlib_logf(tctx,
+		"result bench=%s depth=%d size=%d transfers=%lu bytes=%llu "
+		"seconds=%.3f bytes_per_sec=%.0f urbs=%llu",
+		name, depth, size, state.transfers, state.bytes, elapsed,
+		(double)state.bytes / elapsed,
+		(unsigned long long)(after.urbs - before.urbs));
+	return 0;
+}
+
+static libusb_testlib_result bulk_throughput(libusb_testlib_ctx *tctx,
+	const char *name, const char *env, long def)
+{
+	struct bench_device bdev;
+	libusb_testlib_result result;
+	unsigned char endpoint = (unsigned char)env_long(env, def);
+	double seconds = (double)env_long("LIBUSB_BENCH_SECONDS", 2);
+	size_t d, s;
+
+	result = open_bench_device(tctx, &bdev);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	for (s = 0; s < sizeof(bulk_sizes) / sizeof(bulk_sizes[0]); s++) {
+		for (d = 0; d < sizeof(bulk_depths) / sizeof(bulk_depths[0]); d++) {
+			if (bulk_stream(tctx, &bdev, name, endpoint, bulk_depths[d],
+					bulk_sizes[s], seconds) < 0) {
+				result = TEST_STATUS_FAILURE;
+				goto out;
+			}
+		}
+	}
+
+out:
+	close_bench_device(&bdev);
+	return result;
+}
+
+/** Bulk IN throughput against queue depth and transfer size. */
+static libusb_testlib_result test_bulk_in(libusb_testlib_ctx *tctx)
+{
+	return bulk_throughput(tctx, "bulk_in", "LIBUSB_BENCH_BULK_IN", 0x81);
+}
+
+/** Bulk OUT throughput against queue depth and transfer size. */
+static libusb_testlib_result test_bulk_out(libusb_testlib_ctx *tctx)
+{
+	return bulk_throughput(tctx, "bulk_out", "LIBUSB_BENCH_BULK_OUT", 0x01);
+}
+
+/** Round trip latency of a device descriptor request. */
+static libusb_testlib_result test_control_latency(libusb_testlib_ctx *tctx)
+{
+	struct bench_device bdev;
+	libusb_testlib_result result;
+	unsigned char desc[LIBUSB_DT_DEVICE_SIZE];
+	double *samples;
+	double start;
+	int i, r;
+
+	result = open_bench_device(tctx, &bdev);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	samples = malloc(CONTROL_ITERATIONS * sizeof(*samples));
+	if (!samples) {
+		close_bench_device(&bdev);
+		return TEST_STATUS_ERROR;
+	}
+
+	for (i = 0; i < CONTROL_ITERATIONS; i++) {
+		start = now_us();
+		r = libusb_control_transfer(bdev.handle, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_DEVICE << 8, 0,
+			desc, sizeof(desc), 1000);
+		samples[i] = now_us() - start;
+		if (r < 0) {
+			libusb_testlib_logf(tctx, "Control transfer %d failed: %d", i, r);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+
+	qsort(samples, CONTROL_ITERATIONS, sizeof(*samples), compare_double);
+	libusb_testlib_logf(tctx,
+		"result bench=control_latency transfers=%d min_us=%.1f p50_us=%.1f "
+		"p90_us=%.1f p99_us=%.1f max_us=%.1f",
+		CONTROL_ITERATIONS, samples[0],
+		percentile(samples, CONTROL_ITERATIONS, 0.50),
+		percentile(samples, CONTROL_ITERATIONS, 0.90),
+		percentile(samples, CONTROL_ITERATIONS, 0.99),
+		samples[CONTROL_ITERATIONS - 1]);
+
+out:
+	free(samples);
+	close_bench_device(&bdev);
+	return result;
+}
+
+static void LIBUSB_CALL timeout_cb(struct libusb_transfer *transfer)
+{
+	double *end = transfer->user_data;
+
+	*end = now_us();
+}
+
+/** How late a transfer with a microsecond timeout times out. */
+static libusb_testlib_result test_timeout_precision(libusb_testlib_ctx *tctx)
+{
+	struct bench_device bdev;
+	struct libusb_transfer *transfer;
+	libusb_testlib_result result;
+	unsigned char endpoint = (unsigned char)env_long("LIBUSB_BENCH_INT_IN", 0);
+	unsigned char buf[64];
+	double *samples;
+	double start, end;
+	int i, r;
+
+	if (!endpoint) {
+		libusb_testlib_logf(tctx,
+			"Set LIBUSB_BENCH_INT_IN to run this benchmark");
+		return TEST_STATUS_SKIP;
+	}
+
+	result = open_bench_device(tctx, &bdev);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	samples = malloc(TIMEOUT_ITERATIONS * sizeof(*samples));
+	transfer = libusb_alloc_transfer(0);
+	if (!samples || !transfer) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	for (i = 0; i < TIMEOUT_ITERATIONS; i++) {
+		libusb_fill_interrupt_transfer(transfer, bdev.handle, endpoint,
+			buf, sizeof(buf), timeout_cb, &end, TIMEOUT_US);
+		transfer->flags = LIBUSB_TRANSFER_TIMEOUT_US;
+		end = 0;
+
+		start = now_us();
+		r = libusb_submit_transfer(transfer);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+		while (end == 0)
+			libusb_handle_events(bdev.ctx);
+
+		if (transfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
+			libusb_testlib_logf(tctx,
+				"Transfer ended with status %d, is the endpoint idle?",
+				transfer->status);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+		samples[i] = end - start - TIMEOUT_US;
+	}
+
+	qsort(samples, TIMEOUT_ITERATIONS, sizeof(*samples), compare_double);
+	libusb_testlib_logf(tctx,
+		"result bench=timeout_precision timeout_us=%d transfers=%d "
+		"min_late_us=%.1f p50_late_us=%.1f p99_late_us=%.1f max_late_us=%.1f",
+		TIMEOUT_US, TIMEOUT_ITERATIONS, samples[0],
+		percentile(samples, TIMEOUT_ITERATIONS, 0.50),
+		percentile(samples, TIMEOUT_ITERATIONS, 0.99),
+		samples[TIMEOUT_ITERATIONS - 1]);
+
+out:
+	libusb_free_transfer(transfer);
+	free(samples);
+	close_bench_device(&bdev);
+	return result;
+}
+
+/** Share of iso IN packets that did not complete. */
+static libusb_testlib_result test_iso_loss(libusb_testlib_ctx *tctx)
+{
+	struct bench_device bdev;
+	struct libusb_transfer *transfers[ISO_TRANSFERS];
+	struct stream_state state;
+	libusb_testlib_result result;
+	unsigned char endpoint = (unsigned char)env_long("LIBUSB_BENCH_ISO_IN", 0);
+	int alt = (int)env_long("LIBUSB_BENCH_ISO_ALT", 1);
+	double seconds = (double)env_long("LIBUSB_BENCH_SECONDS", 2);
+	double elapsed;
+	int packet_size, i, r;
+
+	if (!endpoint) {
+		libusb_testlib_logf(tctx,
+			"Set LIBUSB_BENCH_ISO_IN to run this benchmark");
+		return TEST_STATUS_SKIP;
+	}
+
+	result = open_bench_device(tctx, &bdev);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	r = libusb_set_interface_alt_setting(bdev.handle, bdev.interface, alt);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to select alternate setting %d: %d",
+			alt, r);
+		close_bench_device(&bdev);
+		return TEST_STATUS_ERROR;
+	}
+
+	packet_size = libusb_get_max_iso_packet_size(libusb_get_device(bdev.handle),
+		endpoint);
+	if (packet_size <= 0) {
+		libusb_testlib_logf(tctx, "No iso endpoint 0x%02x: %d", endpoint,
+			packet_size);
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	memset(&state, 0, sizeof(state));
+	for (i = 0; i < ISO_TRANSFERS; i++) {
+		int length = packet_size * ISO_PACKETS;
+		unsigned char *buffer = calloc(1, (size_t)length);
+
+		transfers[i] = libusb_alloc_transfer(ISO_PACKETS);
+		if (!buffer || !transfers[i]) {
+			libusb_free_transfer(transfers[i]);
+			free(buffer);
+			free_transfers(transfers, i);
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+		libusb_fill_iso_transfer(transfers[i], bdev.handle, endpoint,
+			buffer, length, ISO_PACKETS, stream_cb, &state, 1000);
+		libusb_set_iso_packet_lengths(transfers[i], (unsigned int)packet_size);
+		transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	elapsed = run_stream(&bdev, transfers, ISO_TRANSFERS, &state, seconds);
+	free_transfers(transfers, ISO_TRANSFERS);
+
+	if (state.failed || !state.packets) {
+		libusb_testlib_logf(tctx, "iso transfers failed");
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	libusb_testlib_logf(tctx,
+		"result bench=iso_loss packet_size=%d packets=%lu lost=%lu "
+		"loss_rate=%.6f seconds=%.3f bytes_per_sec=%.0f",
+		packet_size, state.packets, state.lost_packets,
+		(double)state.lost_packets / (double)state.packets, elapsed,
+		(double)state.bytes / elapsed);
+
+out:
+	libusb_set_interface_alt_setting(bdev.handle, bdev.interface, 0);
+	close_bench_device(&bdev);
+	return result;
+}
+
+static void event_loop_pass(libusb_testlib_ctx *tctx, libusb_context *ctx,
+	int devices)
+{
+	struct timeval zero = { 0, 0 };
+	double start, elapsed;
+	int i;
+
+	start = now_us();
+	for (i = 0; i < EVENT_ITERATIONS; i++)
+		libusb_handle_events_timeout_completed(ctx, &zero, NULL);
+	elapsed = now_us() - start;
+
+	libusb_testlib_logf(tctx,
+		"result bench=event_loop devices=%d iterations=%d ns_per_call=%.0f",
+		devices, EVENT_ITERATIONS, elapsed * 1e3 / EVENT_ITERATIONS);
+}
+
+/** Cost of an idle event handling pass as devices are opened. */
+static libusb_testlib_result test_event_loop(libusb_testlib_ctx *tctx)
+{
+	libusb_device_handle *handles[MAX_OPEN_DEVICES];
+	libusb_device **devs;
+	libusb_context *ctx = NULL;
+	ssize_t count, i;
+	int opened = 0;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	count = libusb_get_device_list(ctx, &devs);
+	if (count < 0) {
+		libusb_testlib_logf(tctx, "Failed to get device list: %d", (int)count);
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	/* measure with 0, 1, 2, 4... and finally all openable devices */
+	event_loop_pass(tctx, ctx, 0);
+	for (i = 0; i < count && opened < MAX_OPEN_DEVICES; i++) {
+		if (libusb_open(devs[i], &handles[opened]) != LIBUSB_SUCCESS)
+			continue;
+		opened++;
+		if ((opened & (opened - 1)) == 0)
+			event_loop_pass(tctx, ctx, opened);
+	}
+	if (opened & (opened - 1))
+		event_loop_pass(tctx, ctx, opened);
+
+	while (opened > 0)
+		libusb_close(handles[--opened]);
+	libusb_free_device_list(devs, 1);
+	libusb_exit(ctx);
+	return TEST_STATUS_SUCCESS;
+}
+
+/* one device driven by one thread of multi_device */
+struct multi_worker {
+	libusb_device_handle *handle;
+	unsigned char endpoint;
+	double seconds;
+	unsigned long transfers;
+	int error;
+};
+
+static bench_thread_ret_t BENCH_THREAD_CALL multi_worker_main(void *arg)
+{
+	struct multi_worker *worker = arg;
+	unsigned char buffer[MULTI_SIZE];
+	double deadline = now_us() + worker->seconds * 1e6;
+	int transferred;
+
+	while (now_us() < deadline) {
+		worker->error = libusb_bulk_transfer(worker->handle,
+			worker->endpoint, buffer, sizeof(buffer), &transferred, 1000);
+		if (worker->error)
+			break;
+		worker->transfers++;
+	}
+
+	return 0;
+}
+
+static int multi_device_pass(libusb_testlib_ctx *tctx,
+	struct multi_worker *workers, int threads, double *single)
+{
+	bench_thread_t thread_ids[MAX_THREADS];
+	unsigned long transfers = 0;
+	double start, elapsed, rate;
+	int i, started;
+
+	start = now_us();
+	for (started = 0; started < threads; started++) {
+		workers[started].transfers = 0;
+		workers[started].error = 0;
+		if (bench_thread_create(&thread_ids[started], multi_worker_main,
+				&workers[started]) != 0) {
+			libusb_testlib_logf(tctx, "Failed to start thread %d", started);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		bench_thread_join(thread_ids[i]);
+	elapsed = (now_us() - start) / 1e6;
+	if (started < threads)
+		return -1;
+
+	for (i = 0; i < threads; i++) {
+		if (workers[i].error) {
+			libusb_testlib_logf(tctx, "Transfer on device %d failed: %d",
+				i, workers[i].error);
+			return -1;
+		}
+		transfers += workers[i].transfers;
+	}
+
+	/* scaling is the rate relative to that many single device runs */
+	rate = (double)transfers / elapsed;
+	if (threads == 1)
+		*single = rate;
+	libusb_testlib_logf(tctx,
+		"result bench=multi_device threads=%d size=%d transfers=%lu "
+		"transfers_per_sec=%.0f scaling=%.2f",
+		threads, MULTI_SIZE, transfers, rate,
+		*single > 0 ? rate / (*single * threads) : 0.0);
+	return 0;
+}
+
+/** Synchronous bulk IN rate as independent devices are added. */
+static libusb_testlib_result test_multi_device(libusb_testlib_ctx *tctx)
+{
+	const char *spec = getenv("LIBUSB_BENCH_DEVICE");
+	struct multi_worker workers[MAX_THREADS];
+	struct libusb_device_descriptor desc;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	libusb_context *ctx = NULL;
+	libusb_device **devs;
+	unsigned int vid, pid;
+	int interface = (int)env_long("LIBUSB_BENCH_INTERFACE", 0);
+	int shards = (int)env_long("LIBUSB_BENCH_SHARDS", 0);
+	double single = 0;
+	ssize_t count, i;
+	int opened = 0;
+	int threads, r;
+
+	if (!spec || sscanf(spec, "%x:%x", &vid, &pid) != 2) {
+		libusb_testlib_logf(tctx,
+			"Set LIBUSB_BENCH_DEVICE=vid:pid to run this benchmark");
+		return TEST_STATUS_SKIP;
+	}
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	if (shards > 0) {
+		r = libusb_set_option(ctx, LIBUSB_OPTION_EVENT_SHARDS, shards, NULL);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Event shards not available: %s",
+				libusb_error_name(r));
+			libusb_exit(ctx);
+			return TEST_STATUS_SKIP;
+		}
+		libusb_testlib_logf(tctx, "using %d event shards", shards);
+	}
+
+	count = libusb_get_device_list(ctx, &devs);
+	if (count < 0) {
+		libusb_testlib_logf(tctx, "Failed to get device list: %d", (int)count);
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	for (i = 0; i < count && opened < MAX_THREADS; i++) {
+		struct multi_worker *worker = &workers[opened];
+
+		if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS ||
+				desc.idVendor != vid || desc.idProduct != pid)
+			continue;
+		if (libusb_open(devs[i], &worker->handle) != LIBUSB_SUCCESS)
+			continue;
+		libusb_set_auto_detach_kernel_driver(worker->handle, 1);
+		if (libusb_claim_interface(worker->handle, interface) != LIBUSB_SUCCESS) {
+			libusb_close(worker->handle);
+			continue;
+		}
+		worker->endpoint = (unsigned char)env_long("LIBUSB_BENCH_BULK_IN", 0x81);
+		worker->seconds = (double)env_long("LIBUSB_BENCH_SECONDS", 2);
+		opened++;
+	}
+	libusb_free_device_list(devs, 1);
+
+	if (!opened) {
+		libusb_testlib_logf(tctx, "Device %04x:%04x not found or not accessible",
+			vid, pid);
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+
+	/* measure with 1, 2, 4... and finally all opened devices */
+	for (threads = 1; ; threads *= 2) {
+		if (threads > opened)
+			threads = opened;
+		if (multi_device_pass(tctx, workers, threads, &single) < 0) {
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		if (threads == opened)
+			break;
+	}
+
+out:
+	while (opened > 0) {
+		libusb_release_interface(workers[--opened].handle, interface);
+		libusb_close(workers[opened].handle);
+	}
+	libusb_exit(ctx);
+	return result;
+}
+
+/* hand the descriptors of a corpus entry to the null backend, which reads
+ * them when the first context is initialized, or clear them if entry is
+ * NULL. the strings stay in the environment until they are replaced */
+static void set_corpus_env(const struct descriptor_corpus *entry)
+{
+	static const char * const names[2] = {
+		"LIBUSB_NULL_CONFIG", "LIBUSB_NULL_BOS"
+	};
+	static char *strings[2];
+	const unsigned char *data[2] = { NULL, NULL };
+	int len[2] = { 0, 0 };
+	char *s;
+	int i, k, n;
+
+	if (entry) {
+		data[0] = entry->config;
+		len[0] = entry->config_len;
+		data[1] = entry->bos;
+		len[1] = entry->bos_len;
+	}
+
+	for (k = 0; k < 2; k++) {
+		s = malloc(strlen(names[k]) + 2 + 2 * len[k]);
+		if (!s)
+			continue;
+		n = sprintf(s, "%s=", names[k]);
+		for (i = 0; i < len[k]; i++)
+			n += sprintf(s + n, "%02x", data[k][i]);
+		putenv(s);
+		free(strings[k]);
+		strings[k] = s;
+	}
+}
+
+static int parse_pass(libusb_testlib_ctx *tctx, libusb_device *dev,
+	const char *name)
+{
+	struct libusb_config_descriptor *config;
+	struct libusb_bos_descriptor *bos;
+	libusb_device_handle *handle;
+	double start, elapsed;
+	int bytes;
+	int i, r;
+
+	r = libusb_get_config_descriptor(dev, 0, &config);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to get config descriptor of %s: %d",
+			name, r);
+		return r;
+	}
+	bytes = config->wTotalLength;
+	libusb_free_config_descriptor(config);
+
+	start = now_us();
+	for (i = 0; i < PARSE_ITERATIONS; i++) {
+		r = libusb_get_config_descriptor(dev, 0, &config);
+		if (r != LIBUSB_SUCCESS)
+			return r;
+		libusb_free_config_descriptor(config);
+	}
+	elapsed = now_us() - start;
+	libusb_testlib_logf(tctx,
+		"result bench=parse_config corpus=%s bytes=%d iterations=%d ns_per_parse=%.0f",
+		name, bytes, PARSE_ITERATIONS, elapsed * 1e3 / PARSE_ITERATIONS);
+
+	/* the BOS is read from the device on every call, so its time includes
+	 * two control transfers */
+	if (libusb_open(dev, &handle) != LIBUSB_SUCCESS)
+		return LIBUSB_SUCCESS;
+	if (libusb_get_bos_descriptor(handle, &bos) == LIBUSB_SUCCESS) {
+		bytes = bos->wTotalLength;
+		libusb_free_bos_descriptor(bos);
+
+		start = now_us();
+		for (i = 0; i < PARSE_ITERATIONS; i++) {
+			r = libusb_get_bos_descriptor(handle, &bos);
+			if (r != LIBUSB_SUCCESS)
+				break;
+			libusb_free_bos_descriptor(bos);
+		}
+		elapsed = now_us() - start;
+		if (r == LIBUSB_SUCCESS)
+			libusb_testlib_logf(tctx,
+				"result bench=parse_bos corpus=%s bytes=%d iterations=%d ns_per_parse=%.0f",
+				name, bytes, PARSE_ITERATIONS, elapsed * 1e3 / PARSE_ITERATIONS);
+	}
+	libusb_close(handle);
+	return r;
+}
+
+/* find the device serving the configuration descriptor of entry */
+static libusb_device *find_corpus_device(libusb_device **devs, ssize_t count,
+	const struct descriptor_corpus *entry)
+{
+	const unsigned char *raw;
+	ssize_t i;
+
+	for (i = 0; i < count; i++) {
+		if (libusb_get_raw_config_descriptor(devs[i], 0, &raw) == entry->config_len &&
+				memcmp(raw, entry->config, entry->config_len) == 0)
+			return devs[i];
+	}
+	return NULL;
+}
+
+/* parse the descriptors of every device present */
+static libusb_testlib_result parse_system_devices(libusb_testlib_ctx *tctx,
+	libusb_device **devs, ssize_t count)
+{
+	struct libusb_device_descriptor desc;
+	char name[10];
+	ssize_t i;
+
+	for (i = 0; i < count; i++) {
+		if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS ||
+				desc.bNumConfigurations == 0)
+			continue;
+		sprintf(name, "%04x:%04x", desc.idVendor, desc.idProduct);
+		if (parse_pass(tctx, devs[i], name) < 0)
+			return TEST_STATUS_FAILURE;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Cost of parsing configuration and BOS descriptors. */
+static libusb_testlib_result test_descriptor_parse(libusb_testlib_ctx *tctx)
+{
+	const int num_entries = sizeof(descriptor_corpus) / sizeof(descriptor_corpus[0]);
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	libusb_context *ctx;
+	libusb_device **devs;
+	libusb_device *dev;
+	ssize_t count;
+	int i, r;
+
+	for (i = 0; i < num_entries && result == TEST_STATUS_SUCCESS; i++) {
+		set_corpus_env(&descriptor_corpus[i]);
+		ctx = NULL;
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+		count = libusb_get_device_list(ctx, &devs);
+		if (count < 0) {
+			libusb_testlib_logf(tctx, "Failed to get device list: %d", (int)count);
+			libusb_exit(ctx);
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+
+		dev = find_corpus_device(devs, count, &descriptor_corpus[i]);
+		if (dev) {
+			if (parse_pass(tctx, dev, descriptor_corpus[i].name) < 0)
+				result = TEST_STATUS_FAILURE;
+		} else if (i == 0) {
+			/* not the null backend, the corpus can't be used */
+			result = parse_system_devices(tctx, devs, count);
+			i = num_entries;
+		} else {
+			libusb_testlib_logf(tctx, "No device serves corpus %s",
+				descriptor_corpus[i].name);
+			result = TEST_STATUS_FAILURE;
+		}
+
+		libusb_free_device_list(devs, 1);
+		libusb_exit(ctx);
+	}
+
+	set_corpus_env(NULL);
+	return result;
+}
+
+/** Cost of listing the devices of an initialized context. */
+static libusb_testlib_result test_enumerate(libusb_testlib_ctx *tctx)
+{
+	libusb_device **devs;
+	libusb_context *ctx = NULL;
+	double start, elapsed;
+	ssize_t count = 0;
+	int i, r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	start = now_us();
+	for (i = 0; i < ENUM_ITERATIONS; i++) {
+		count = libusb_get_device_list(ctx, &devs);
+		if (count < 0) {
+			libusb_testlib_logf(tctx, "Failed to get device list: %d", (int)count);
+			libusb_exit(ctx);
+			return TEST_STATUS_ERROR;
+		}
+		libusb_free_device_list(devs, 1);
+	}
+	elapsed = now_us() - start;
+
+	libusb_testlib_logf(tctx,
+		"result bench=enumerate devices=%d iterations=%d ns_per_call=%.0f",
+		(int)count, ENUM_ITERATIONS, elapsed * 1e3 / ENUM_ITERATIONS);
+	libusb_exit(ctx);
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Cost of a libusb_init()/libusb_exit() cycle without other contexts. */
+static libusb_testlib_result test_init_exit(libusb_testlib_ctx *tctx)
+{
+	libusb_context *ctx;
+	double start, elapsed;
+	int i, r;
+
+	start = now_us();
+	for (i = 0; i < INIT_ITERATIONS; i++) {
+		ctx = NULL;
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			return TEST_STATUS_ERROR;
+		}
+		libusb_exit(ctx);
+	}
+	elapsed = now_us() - start;
+
+	libusb_testlib_logf(tctx,
+		"result bench=init_exit iterations=%d us_per_cycle=%.1f",
+		INIT_ITERATIONS, elapsed / INIT_ITERATIONS);
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{"bulk_in", &test_bulk_in},
+	{"bulk_out", &test_bulk_out},
+	{"control_latency", &test_control_latency},
+	{"iso_loss", &test_iso_loss},
+	{"timeout_precision", &test_timeout_precision},
+	{"multi_device", &test_multi_device},
+	{"event_loop", &test_event_loop},
+	{"descriptor_parse", &test_descriptor_parse},
+	{"enumerate", &test_enumerate},
+	{"init_exit", &test_init_exit},
+	LIBUSB_NULL_TEST
+};
+
+int main (int argc, char ** argv)
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
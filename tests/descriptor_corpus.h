@@ -0,0 +1,168 @@
+/*
+ * Descriptor corpus for the libusb benchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_DESCRIPTOR_CORPUS_H
+#define LIBUSB_DESCRIPTOR_CORPUS_H
+
+/* Configuration and BOS descriptors laid out like those of common devices,
+ * from the small (hubs) to the large (UVC cameras, whose class specific
+ * descriptors make up most of the bytes the parser walks). */
+
+/* webcam with microphone, UVC 1.0 and UAC 1.0, 895 bytes */
+static const unsigned char corpus_uvc[] = {
+	0x09, 0x02, 0x7f, 0x03, 0x04, 0x01, 0x00, 0x80, 0xfa, 0x08, 0x0b, 0x00,
+	0x02, 0x0e, 0x03, 0x00, 0x05, 0x09, 0x04, 0x00, 0x00, 0x01, 0x0e, 0x01,
+	0x00, 0x05, 0x0d, 0x24, 0x01, 0x00, 0x01, 0x4f, 0x00, 0x00, 0x6c, 0xdc,
+	0x02, 0x01, 0x01, 0x11, 0x24, 0x02, 0x01, 0x01, 0x02, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x03, 0x0a, 0x00, 0x00, 0x0d, 0x24, 0x05, 0x02,
+	0x01, 0x00, 0x00, 0x03, 0x7f, 0x17, 0x00, 0x00, 0x00, 0x1b, 0x24, 0x06,
+	0x04, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a,
+	0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x08, 0x01, 0x02, 0x02, 0xff, 0xff, 0x00,
+	0x09, 0x24, 0x03, 0x03, 0x01, 0x01, 0x00, 0x04, 0x00, 0x07, 0x05, 0x83,
+	0x03, 0x10, 0x00, 0x08, 0x05, 0x25, 0x03, 0x10, 0x00, 0x09, 0x04, 0x01,
+	0x00, 0x00, 0x0e, 0x02, 0x00, 0x00, 0x0f, 0x24, 0x01, 0x02, 0x34, 0x02,
+	0x81, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x0b, 0x24, 0x06,
+	0x01, 0x05, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x32, 0x24, 0x07, 0x01,
+	0x00, 0x80, 0x02, 0xe0, 0x01, 0x00, 0x00, 0x77, 0x01, 0x00, 0x00, 0xca,
+	0x08, 0x00, 0x60, 0x09, 0x00, 0x15, 0x16, 0x05, 0x00, 0x06, 0x15, 0x16,
+	0x05, 0x00, 0x80, 0x1a, 0x06, 0x00, 0x20, 0xa1, 0x07, 0x00, 0x2a, 0x2c,
+	0x0a, 0x00, 0x40, 0x42, 0x0f, 0x00, 0x80, 0x84, 0x1e, 0x00, 0x32, 0x24,
+	0x07, 0x02, 0x00, 0xa0, 0x00, 0x78, 0x00, 0x00, 0x70, 0x17, 0x00, 0x00,
+	0xa0, 0x8c, 0x00, 0x00, 0x96, 0x00, 0x00, 0x15, 0x16, 0x05, 0x00, 0x06,
+	0x15, 0x16, 0x05, 0x00, 0x80, 0x1a, 0x06, 0x00, 0x20, 0xa1, 0x07, 0x00,
+	0x2a, 0x2c, 0x0a, 0x00, 0x40, 0x42, 0x0f, 0x00, 0x80, 0x84, 0x1e, 0x00,
+	0x32, 0x24, 0x07, 0x03, 0x00, 0x40, 0x01, 0xf0, 0x00, 0x00, 0xc0, 0x5d,
+	0x00, 0x00, 0x80, 0x32, 0x02, 0x00, 0x58, 0x02, 0x00, 0x15, 0x16, 0x05,
+	0x00, 0x06, 0x15, 0x16, 0x05, 0x00, 0x80, 0x1a, 0x06, 0x00, 0x20, 0xa1,
+	0x07, 0x00, 0x2a, 0x2c, 0x0a, 0x00, 0x40, 0x42, 0x0f, 0x00, 0x80, 0x84,
+	0x1e, 0x00, 0x32, 0x24, 0x07, 0x04, 0x00, 0x00, 0x05, 0xd0, 0x02, 0x00,
+	0x00, 0x65, 0x04, 0x00, 0x00, 0x5e, 0x1a, 0x00, 0x20, 0x1c, 0x00, 0x15,
+	0x16, 0x05, 0x00, 0x06, 0x15, 0x16, 0x05, 0x00, 0x80, 0x1a, 0x06, 0x00,
+	0x20, 0xa1, 0x07, 0x00, 0x2a, 0x2c, 0x0a, 0x00, 0x40, 0x42, 0x0f, 0x00,
+	0x80, 0x84, 0x1e, 0x00, 0x32, 0x24, 0x07, 0x05, 0x00, 0x80, 0x07, 0x38,
+	0x04, 0x00, 0x40, 0xe3, 0x09, 0x00, 0x80, 0x53, 0x3b, 0x00, 0x48, 0x3f,
+	0x00, 0x15, 0x16, 0x05, 0x00, 0x06, 0x15, 0x16, 0x05, 0x00, 0x80, 0x1a,
+	0x06, 0x00, 0x20, 0xa1, 0x07, 0x00, 0x2a, 0x2c, 0x0a, 0x00, 0x40, 0x42,
+	0x0f, 0x00, 0x80, 0x84, 0x1e, 0x00, 0x06, 0x24, 0x0d, 0x01, 0x01, 0x04,
+	0x1b, 0x24, 0x04, 0x02, 0x05, 0x59, 0x55, 0x59, 0x32, 0x00, 0x00, 0x10,
+	0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71, 0x10, 0x01, 0x00,
+	0x00, 0x00, 0x00, 0x32, 0x24, 0x05, 0x01, 0x00, 0x80, 0x02, 0xe0, 0x01,
+	0x00, 0x00, 0x77, 0x01, 0x00, 0x00, 0xca, 0x08, 0x00, 0x60, 0x09, 0x00,
+	0x15, 0x16, 0x05, 0x00, 0x06, 0x15, 0x16, 0x05, 0x00, 0x80, 0x1a, 0x06,
+	0x00, 0x20, 0xa1, 0x07, 0x00, 0x2a, 0x2c, 0x0a, 0x00, 0x40, 0x42, 0x0f,
+	0x00, 0x80, 0x84, 0x1e, 0x00, 0x32, 0x24, 0x05, 0x02, 0x00, 0xa0, 0x00,
+	0x78, 0x00, 0x00, 0x70, 0x17, 0x00, 0x00, 0xa0, 0x8c, 0x00, 0x00, 0x96,
+	0x00, 0x00, 0x15, 0x16, 0x05, 0x00, 0x06, 0x15, 0x16, 0x05, 0x00, 0x80,
+	0x1a, 0x06, 0x00, 0x20, 0xa1, 0x07, 0x00, 0x2a, 0x2c, 0x0a, 0x00, 0x40,
+	0x42, 0x0f, 0x00, 0x80, 0x84, 0x1e, 0x00, 0x32, 0x24, 0x05, 0x03, 0x00,
+	0x40, 0x01, 0xf0, 0x00, 0x00, 0xc0, 0x5d, 0x00, 0x00, 0x80, 0x32, 0x02,
+	0x00, 0x58, 0x02, 0x00, 0x15, 0x16, 0x05, 0x00, 0x06, 0x15, 0x16, 0x05,
+	0x00, 0x80, 0x1a, 0x06, 0x00, 0x20, 0xa1, 0x07, 0x00, 0x2a, 0x2c, 0x0a,
+	0x00, 0x40, 0x42, 0x0f, 0x00, 0x80, 0x84, 0x1e, 0x00, 0x32, 0x24, 0x05,
+	0x04, 0x00, 0x00, 0x05, 0xd0, 0x02, 0x00, 0x00, 0x65, 0x04, 0x00, 0x00,
+	0x5e, 0x1a, 0x00, 0x20, 0x1c, 0x00, 0x15, 0x16, 0x05, 0x00, 0x06, 0x15,
+	0x16, 0x05, 0x00, 0x80, 0x1a, 0x06, 0x00, 0x20, 0xa1, 0x07, 0x00, 0x2a,
+	0x2c, 0x0a, 0x00, 0x40, 0x42, 0x0f, 0x00, 0x80, 0x84, 0x1e, 0x00, 0x32,
+	0x24, 0x05, 0x05, 0x00, 0x80, 0x07, 0x38, 0x04, 0x00, 0x40, 0xe3, 0x09,
+	0x00, 0x80, 0x53, 0x3b, 0x00, 0x48, 0x3f, 0x00, 0x15, 0x16, 0x05, 0x00,
+	0x06, 0x15, 0x16, 0x05, 0x00, 0x80, 0x1a, 0x06, 0x00, 0x20, 0xa1, 0x07,
+	0x00, 0x2a, 0x2c, 0x0a, 0x00, 0x40, 0x42, 0x0f, 0x00, 0x80, 0x84, 0x1e,
+	0x00, 0x06, 0x24, 0x0d, 0x01, 0x01, 0x04, 0x09, 0x04, 0x01, 0x01, 0x01,
+	0x0e, 0x02, 0x00, 0x00, 0x07, 0x05, 0x81, 0x05, 0x80, 0x00, 0x01, 0x09,
+	0x04, 0x01, 0x02, 0x01, 0x0e, 0x02, 0x00, 0x00, 0x07, 0x05, 0x81, 0x05,
+	0x00, 0x01, 0x01, 0x09, 0x04, 0x01, 0x03, 0x01, 0x0e, 0x02, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x05, 0x20, 0x03, 0x01, 0x09, 0x04, 0x01, 0x04, 0x01,
+	0x0e, 0x02, 0x00, 0x00, 0x07, 0x05, 0x81, 0x05, 0x20, 0x0b, 0x01, 0x09,
+	0x04, 0x01, 0x05, 0x01, 0x0e, 0x02, 0x00, 0x00, 0x07, 0x05, 0x81, 0x05,
+	0x20, 0x13, 0x01, 0x09, 0x04, 0x01, 0x06, 0x01, 0x0e, 0x02, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x05, 0xfc, 0x13, 0x01, 0x08, 0x0b, 0x02, 0x02, 0x01,
+	0x02, 0x00, 0x00, 0x09, 0x04, 0x02, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+	0x09, 0x24, 0x01, 0x00, 0x01, 0x27, 0x00, 0x01, 0x03, 0x0c, 0x24, 0x02,
+	0x01, 0x01, 0x02, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x09, 0x24, 0x06,
+	0x02, 0x01, 0x01, 0x03, 0x00, 0x00, 0x09, 0x24, 0x03, 0x03, 0x01, 0x01,
+	0x00, 0x02, 0x00, 0x09, 0x04, 0x03, 0x00, 0x00, 0x01, 0x02, 0x00, 0x00,
+	0x09, 0x04, 0x03, 0x01, 0x01, 0x01, 0x02, 0x00, 0x00, 0x07, 0x24, 0x01,
+	0x03, 0x01, 0x01, 0x00, 0x0b, 0x24, 0x02, 0x01, 0x01, 0x02, 0x10, 0x01,
+	0x80, 0x3e, 0x00, 0x09, 0x05, 0x84, 0x05, 0x44, 0x00, 0x04, 0x00, 0x00,
+	0x07, 0x25, 0x01, 0x01, 0x00, 0x00, 0x00,
+};
+
+/* composite CDC ACM, mass storage, HID and DFU, 141 bytes */
+static const unsigned char corpus_composite[] = {
+	0x09, 0x02, 0x8d, 0x00, 0x05, 0x01, 0x00, 0xa0, 0x32, 0x08, 0x0b, 0x00,
+	0x02, 0x02, 0x02, 0x01, 0x00, 0x09, 0x04, 0x00, 0x00, 0x01, 0x02, 0x02,
+	0x01, 0x04, 0x05, 0x24, 0x00, 0x10, 0x01, 0x05, 0x24, 0x01, 0x00, 0x01,
+	0x04, 0x24, 0x02, 0x02, 0x05, 0x24, 0x06, 0x00, 0x01, 0x07, 0x05, 0x82,
+	0x03, 0x08, 0x00, 0x10, 0x09, 0x04, 0x01, 0x00, 0x02, 0x0a, 0x00, 0x00,
+	0x00, 0x07, 0x05, 0x01, 0x02, 0x00, 0x02, 0x00, 0x07, 0x05, 0x81, 0x02,
+	0x00, 0x02, 0x00, 0x09, 0x04, 0x02, 0x00, 0x02, 0x08, 0x06, 0x50, 0x06,
+	0x07, 0x05, 0x83, 0x02, 0x00, 0x02, 0x00, 0x07, 0x05, 0x02, 0x02, 0x00,
+	0x02, 0x00, 0x09, 0x04, 0x03, 0x00, 0x01, 0x03, 0x01, 0x01, 0x00, 0x09,
+	0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x3f, 0x00, 0x07, 0x05, 0x84, 0x03,
+	0x08, 0x00, 0x0a, 0x09, 0x04, 0x04, 0x00, 0x00, 0xfe, 0x01, 0x02, 0x07,
+	0x09, 0x21, 0x0b, 0xff, 0x00, 0x00, 0x04, 0x10, 0x01,
+};
+
+/* USB 2.0 hub with single and multi TT settings, 41 bytes */
+static const unsigned char corpus_hub[] = {
+	0x09, 0x02, 0x29, 0x00, 0x01, 0x01, 0x00, 0xe0, 0x00, 0x09, 0x04, 0x00,
+	0x00, 0x01, 0x09, 0x00, 0x01, 0x00, 0x07, 0x05, 0x81, 0x03, 0x01, 0x00,
+	0x0c, 0x09, 0x04, 0x00, 0x01, 0x01, 0x09, 0x00, 0x02, 0x00, 0x07, 0x05,
+	0x81, 0x03, 0x01, 0x00, 0x0c,
+};
+
+/* SuperSpeed disk with BOT and UAS settings, 121 bytes */
+static const unsigned char corpus_ss_storage[] = {
+	0x09, 0x02, 0x79, 0x00, 0x01, 0x01, 0x00, 0x80, 0x70, 0x09, 0x04, 0x00,
+	0x00, 0x02, 0x08, 0x06, 0x50, 0x00, 0x07, 0x05, 0x81, 0x02, 0x00, 0x04,
+	0x00, 0x06, 0x30, 0x0f, 0x00, 0x00, 0x00, 0x07, 0x05, 0x02, 0x02, 0x00,
+	0x04, 0x00, 0x06, 0x30, 0x0f, 0x00, 0x00, 0x00, 0x09, 0x04, 0x00, 0x01,
+	0x04, 0x08, 0x06, 0x62, 0x00, 0x07, 0x05, 0x83, 0x02, 0x00, 0x04, 0x00,
+	0x06, 0x30, 0x00, 0x00, 0x00, 0x00, 0x04, 0x24, 0x01, 0x00, 0x07, 0x05,
+	0x04, 0x02, 0x00, 0x04, 0x00, 0x06, 0x30, 0x00, 0x00, 0x00, 0x00, 0x04,
+	0x24, 0x02, 0x00, 0x07, 0x05, 0x85, 0x02, 0x00, 0x04, 0x00, 0x06, 0x30,
+	0x0f, 0x05, 0x00, 0x00, 0x04, 0x24, 0x03, 0x00, 0x07, 0x05, 0x06, 0x02,
+	0x00, 0x04, 0x00, 0x06, 0x30, 0x0f, 0x05, 0x00, 0x00, 0x04, 0x24, 0x04,
+	0x00,
+};
+
+/* BOS of the SuperSpeed disk, 42 bytes */
+static const unsigned char corpus_ss_bos[] = {
+	0x05, 0x0f, 0x2a, 0x00, 0x03, 0x07, 0x10, 0x02, 0x1e, 0xf4, 0x00, 0x00,
+	0x0a, 0x10, 0x03, 0x00, 0x0e, 0x00, 0x01, 0x0a, 0xff, 0x07, 0x14, 0x10,
+	0x04, 0x00, 0x6e, 0x2c, 0x5f, 0xa0, 0xcc, 0x4c, 0x4c, 0x4f, 0xa1, 0xb8,
+	0xd5, 0xc0, 0xa9, 0xb0, 0x7a, 0xd1,
+};
+
+struct descriptor_corpus {
+	const char *name;
+	const unsigned char *config;
+	int config_len;
+	const unsigned char *bos;
+	int bos_len;
+};
+
+static const struct descriptor_corpus descriptor_corpus[] = {
+	{ "uvc", corpus_uvc, sizeof(corpus_uvc), NULL, 0 },
+	{ "composite", corpus_composite, sizeof(corpus_composite), NULL, 0 },
+	{ "hub", corpus_hub, sizeof(corpus_hub), NULL, 0 },
+	{ "ss_storage", corpus_ss_storage, sizeof(corpus_ss_storage),
+	  corpus_ss_bos, sizeof(corpus_ss_bos) },
+};
+
+#endif
@@ -18,12 +18,26 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <memory.h>
 
 #include "libusb.h"
 #include "libusb_testlib.h"
 
+#if defined(_WIN32)
+#define msleep(msecs) Sleep(msecs)
+#else
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#define msleep(msecs) usleep(1000*msecs)
+#endif
+
+#if defined(_MSC_VER)
+#define putenv _putenv
+#endif
+
 /** Test that creates and destroys a single concurrent context
  * 10000 times. */
 static libusb_testlib_result test_init_and_exit(libusb_testlib_ctx * tctx)
@@ -145,12 +159,1623 @@ static libusb_testlib_result test_default_context_change(libusb_testlib_ctx * tc
 	return TEST_STATUS_SUCCESS;
 }
 
+/** Tests that the internal event thread can be started and stopped, and
+ * that libusb_exit() stops it. */
+static libusb_testlib_result test_event_thread(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	int r, i;
+
+	for (i = 0; i < 100; ++i) {
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			return TEST_STATUS_FAILURE;
+		}
+		r = libusb_set_option(ctx, LIBUSB_OPTION_EVENT_THREAD, 1);
+		if (r == LIBUSB_SUCCESS && (i % 2))
+			r = libusb_set_option(ctx, LIBUSB_OPTION_EVENT_THREAD, 0);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx,
+				"Failed to toggle event thread on iteration %d: %d",
+				i, r);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+		libusb_exit(ctx);
+		ctx = NULL;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Tests that the callback workers can be started and stopped, and that
+ * libusb_exit() stops them. */
+static libusb_testlib_result test_callback_workers(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	int r, i;
+
+	for (i = 0; i < 100; ++i) {
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			return TEST_STATUS_FAILURE;
+		}
+		r = libusb_set_option(ctx, LIBUSB_OPTION_CALLBACK_WORKERS, 1 + i % 4);
+		if (r == LIBUSB_SUCCESS &&
+		    libusb_set_option(ctx, LIBUSB_OPTION_CALLBACK_WORKERS, 1) != LIBUSB_ERROR_BUSY)
+			r = LIBUSB_ERROR_OTHER;
+		if (r == LIBUSB_SUCCESS && (i % 2))
+			r = libusb_set_option(ctx, LIBUSB_OPTION_CALLBACK_WORKERS, 0);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx,
+				"Failed to toggle callback workers on iteration %d: %d",
+				i, r);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+		libusb_exit(ctx);
+		ctx = NULL;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Tests that freed transfers are recycled by a transfer pool. */
+static libusb_testlib_result test_transfer_pool(libusb_testlib_ctx * tctx)
+{
+	libusb_transfer_pool * pool = NULL;
+	struct libusb_transfer * first;
+	struct libusb_transfer * transfer;
+	int r, i;
+
+	r = libusb_transfer_pool_create(4, 1, &pool);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to create transfer pool: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	first = libusb_transfer_pool_alloc(pool);
+	if (!first) {
+		libusb_testlib_logf(tctx, "Failed to allocate from transfer pool");
+		libusb_transfer_pool_destroy(pool);
+		return TEST_STATUS_FAILURE;
+	}
+	libusb_free_transfer(first);
+
+	for (i = 0; i < 10000; ++i) {
+		transfer = libusb_transfer_pool_alloc(pool);
+		if (transfer != first || transfer->num_iso_packets != 0) {
+			libusb_testlib_logf(tctx,
+				"Transfer not recycled on iteration %d", i);
+			libusb_free_transfer(transfer);
+			libusb_transfer_pool_destroy(pool);
+			return TEST_STATUS_FAILURE;
+		}
+		transfer->num_iso_packets = 4;
+		libusb_free_transfer(transfer);
+	}
+
+	/* Transfers outstanding when the pool is destroyed stay valid */
+	transfer = libusb_transfer_pool_alloc(pool);
+	libusb_transfer_pool_destroy(pool);
+	libusb_free_transfer(transfer);
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Tests that a context initialized without device discovery lists the same
+ * devices as one initialized with it. */
+static libusb_testlib_result test_defer_device_discovery(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device ** device_list;
+	ssize_t counts[2];
+	int r, i;
+
+	for (i = 0; i < 2; ++i) {
+		libusb_set_option(NULL, LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY, i);
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			libusb_set_option(NULL, LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY, 0);
+			return TEST_STATUS_FAILURE;
+		}
+		counts[i] = libusb_get_device_list(ctx, &device_list);
+		if (counts[i] >= 0)
+			libusb_free_device_list(device_list, 1);
+		libusb_exit(ctx);
+		ctx = NULL;
+	}
+	libusb_set_option(NULL, LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY, 0);
+
+	if (counts[0] < 0 || counts[1] != counts[0]) {
+		libusb_testlib_logf(tctx, "Listed %d devices, %d without discovery",
+			(int)counts[0], (int)counts[1]);
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* the default is per context: a context initialized without it keeps
+	 * scanning, and clearing it on a deferred context scans right away */
+	libusb_set_option(NULL, LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY, 1);
+	r = libusb_init(&ctx);
+	libusb_set_option(NULL, LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY, 0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_set_option(ctx, LIBUSB_OPTION_DEFER_DEVICE_DISCOVERY, 0);
+	if (r == LIBUSB_SUCCESS) {
+		counts[1] = libusb_get_device_list(ctx, &device_list);
+		if (counts[1] >= 0)
+			libusb_free_device_list(device_list, 1);
+	}
+	libusb_exit(ctx);
+	if (r != LIBUSB_SUCCESS || counts[1] != counts[0]) {
+		libusb_testlib_logf(tctx, "Scan on clearing the option: %d, %d devices",
+			r, (int)counts[1]);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* The null backend reads LIBUSB_NULL_LATENCY_US when the first context is
+ * initialized. Tests that need transfers to stay queued set it around their
+ * context, then put back the value stress was started with. */
+static char null_latency_env[64], null_latency_saved[64];
+
+static void set_null_latency(unsigned long latency_us)
+{
+	const char *value = getenv("LIBUSB_NULL_LATENCY_US");
+	char old[32];
+
+	snprintf(old, sizeof(old), "%s", value ? value : "");
+	snprintf(null_latency_saved, sizeof(null_latency_saved),
+		"LIBUSB_NULL_LATENCY_US=%s", old);
+	snprintf(null_latency_env, sizeof(null_latency_env),
+		"LIBUSB_NULL_LATENCY_US=%lu", latency_us);
+	putenv(null_latency_env);
+}
+
+static void restore_null_latency(void)
+{
+	putenv(null_latency_saved);
+}
+
+/* Initialize a context and open the first device simulated by the null
+ * backend, with a completion latency unless latency_us is 0. Without the
+ * device the test is skipped, or fails in a build with the null backend. */
+static libusb_device_handle * open_null_device(libusb_testlib_ctx * tctx,
+	unsigned long latency_us, libusb_context ** ctx,
+	libusb_testlib_result * result)
+{
+	libusb_device_handle * handle;
+	int r;
+
+	*ctx = NULL;
+	if (latency_us)
+		set_null_latency(latency_us);
+	r = libusb_init(ctx);
+	if (latency_us)
+		restore_null_latency();
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		*result = TEST_STATUS_FAILURE;
+		return NULL;
+	}
+	handle = libusb_open_device_with_vid_pid(*ctx, 0x1d6b, 0x0104);
+	if (!handle) {
+		libusb_exit(*ctx);
+#if defined(LIBUSB_TESTS_NULL_BACKEND)
+		libusb_testlib_logf(tctx, "Failed to open the simulated device");
+		*result = TEST_STATUS_FAILURE;
+#else
+		*result = TEST_STATUS_SKIP;
+#endif
+	}
+	return handle;
+}
+
+static int stream_transfers_done;
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer * transfer)
+{
+	enum libusb_transfer_status * status = transfer->user_data;
+
+	*status = transfer->status;
+	stream_transfers_done++;
+}
+
+/** Tests the accounting and cancellation of bulk stream transfers, on the
+ * device simulated by the null backend. The transfers take 200ms, so that
+ * they are still in flight when stream 1 is cancelled. */
+static libusb_testlib_result test_bulk_streams(libusb_testlib_ctx * tctx)
+{
+	static const uint32_t stream_ids[] = { 1, 1, 2, 3 };
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfers[4];
+	unsigned char endpoint = 0x81;
+	unsigned char buffer[4][64];
+	enum libusb_transfer_status statuses[4];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int submitted = 0;
+	int r, i;
+
+	handle = open_null_device(tctx, 200000, &ctx, &result);
+	if (!handle)
+		return result;
+	r = libusb_alloc_streams(handle, 4, &endpoint, 1);
+	if (r != 4) {
+		libusb_testlib_logf(tctx, "No streams allocated: %d", r);
+		libusb_close(handle);
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	for (i = 0; i < 4; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_stream_transfer(transfers[i], handle, endpoint,
+			stream_ids[i], buffer[i], sizeof(buffer[i]),
+			stream_transfer_cb, &statuses[i], 0);
+		statuses[i] = LIBUSB_TRANSFER_ERROR;
+	}
+
+	stream_transfers_done = 0;
+	r = libusb_submit_transfers(transfers, 4);
+	if (r > 0)
+		submitted = r;
+	if (r != 4) {
+		libusb_testlib_logf(tctx, "Failed to submit transfers: %d", r);
+		goto out;
+	}
+	if (libusb_get_stream_transfer_count(handle, endpoint, 1) != 2 ||
+	    libusb_get_stream_transfer_count(handle, endpoint, 3) != 1 ||
+	    libusb_get_stream_transfer_count(handle, endpoint, 4) != 0) {
+		libusb_testlib_logf(tctx, "Wrong stream transfer counts");
+		goto out;
+	}
+	if (libusb_get_stream_transfer_count(handle, endpoint, 5) != LIBUSB_ERROR_NOT_FOUND ||
+	    libusb_cancel_stream_transfers(handle, endpoint, 0) != LIBUSB_ERROR_NOT_FOUND ||
+	    libusb_cancel_stream_transfers(handle, 0x01, 1) != LIBUSB_ERROR_NOT_FOUND) {
+		libusb_testlib_logf(tctx, "Unallocated stream found");
+		goto out;
+	}
+	r = libusb_cancel_stream_transfers(handle, endpoint, 4);
+	if (r != 0) {
+		libusb_testlib_logf(tctx, "Cancelled %d transfers on an idle stream", r);
+		goto out;
+	}
+	r = libusb_cancel_stream_transfers(handle, endpoint, 1);
+	if (r != 2) {
+		libusb_testlib_logf(tctx, "Cancelled %d transfers of stream 1", r);
+		goto out;
+	}
+
+	while (stream_transfers_done < 4) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	if (libusb_get_stream_transfer_count(handle, endpoint, 1) != 0) {
+		libusb_testlib_logf(tctx, "Completed transfers still counted");
+		goto out;
+	}
+	for (i = 0; i < 4; i++) {
+		if (statuses[i] != (stream_ids[i] == 1 ?
+				LIBUSB_TRANSFER_CANCELLED : LIBUSB_TRANSFER_COMPLETED)) {
+			libusb_testlib_logf(tctx, "Transfer %d of stream %u ended with %d",
+				i, (unsigned)stream_ids[i], statuses[i]);
+			goto out;
+		}
+	}
+
+	r = libusb_free_streams(handle, &endpoint, 1);
+	if (r != LIBUSB_SUCCESS ||
+	    libusb_get_stream_transfer_count(handle, endpoint, 1) != LIBUSB_ERROR_NOT_FOUND) {
+		libusb_testlib_logf(tctx, "Streams not freed: %d", r);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	/* transfers still in flight are finished before they are freed */
+	while (stream_transfers_done < submitted &&
+	       libusb_handle_events(ctx) == LIBUSB_SUCCESS)
+		;
+	for (i = 0; i < 4; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+static void LIBUSB_CALL endpoint_transfer_cb(struct libusb_transfer * transfer)
+{
+	int * done = transfer->user_data;
+
+	(*done)++;
+}
+
+/* submit the transfers, cancel the ones of endpoint, or all of them if it
+ * is 0, and check the number cancelled and how each transfer ended */
+static int cancel_queued_transfers(libusb_testlib_ctx * tctx,
+	libusb_context * ctx, struct libusb_transfer ** transfers,
+	const unsigned char * endpoints, int count, unsigned char endpoint,
+	int * done)
+{
+	libusb_device_handle * handle = transfers[0]->dev_handle;
+	int expected = 0, submitted, i, r;
+
+	for (i = 0; i < count; i++)
+		if (!endpoint || endpoints[i] == endpoint)
+			expected++;
+
+	*done = 0;
+	r = libusb_submit_transfers(transfers, count);
+	submitted = r > 0 ? r : 0;
+	if (r != count) {
+		libusb_testlib_logf(tctx, "Failed to submit transfers: %d", r);
+		goto fail;
+	}
+
+	if (endpoint)
+		r = libusb_cancel_endpoint_transfers(handle, endpoint);
+	else
+		r = libusb_cancel_all_transfers(handle);
+	if (r != expected) {
+		libusb_testlib_logf(tctx, "Cancelled %d transfers of %d", r, expected);
+		goto fail;
+	}
+	r = endpoint ? libusb_cancel_endpoint_transfers(handle, endpoint) :
+		libusb_cancel_all_transfers(handle);
+	if (r != 0) {
+		libusb_testlib_logf(tctx, "Cancelled %d transfers twice", r);
+		goto fail;
+	}
+
+	while (*done < count) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to handle events: %d", r);
+			goto fail;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		enum libusb_transfer_status status = !endpoint ||
+			endpoints[i] == endpoint ? LIBUSB_TRANSFER_CANCELLED :
+			LIBUSB_TRANSFER_COMPLETED;
+
+		if (transfers[i]->status != status) {
+			libusb_testlib_logf(tctx, "Transfer %d on 0x%02x ended with %d",
+				i, endpoints[i], transfers[i]->status);
+			return -1;
+		}
+	}
+	return 0;
+
+fail:
+	while (*done < submitted && libusb_handle_events(ctx) == LIBUSB_SUCCESS)
+		;
+	return -1;
+}
+
+/** Tests cancelling the transfers of an endpoint and of a handle, on the
+ * device simulated by the null backend. Its latency keeps the transfers
+ * queued until they are cancelled. */
+static libusb_testlib_result test_cancel_endpoint_transfers(libusb_testlib_ctx * tctx)
+{
+	static const unsigned char endpoints[] = { 0x81, 0x81, 0x81, 0x81, 0x01 };
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfers[5];
+	unsigned char buffer[5][64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int done = 0;
+	int r, i;
+
+	handle = open_null_device(tctx, 200000, &ctx, &result);
+	if (!handle)
+		return result;
+
+	for (i = 0; i < 5; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, endpoints[i],
+			buffer[i], sizeof(buffer[i]), endpoint_transfer_cb,
+			&done, 0);
+	}
+
+	r = libusb_cancel_all_transfers(handle);
+	if (r != 0) {
+		libusb_testlib_logf(tctx, "Cancelled %d transfers on an idle handle", r);
+		goto out;
+	}
+	if (cancel_queued_transfers(tctx, ctx, transfers, endpoints, 5, 0x81, &done) ||
+	    cancel_queued_transfers(tctx, ctx, transfers, endpoints, 5, 0, &done))
+		goto out;
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	for (i = 0; i < 5; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+static int batch_calls, batch_transfers;
+
+static void LIBUSB_CALL transfer_batch_cb(libusb_device_handle * handle,
+	struct libusb_transfer ** transfers, int count, void * user_data)
+{
+	(void)handle;
+	(void)transfers;
+	(void)user_data;
+	batch_calls++;
+	batch_transfers += count;
+}
+
+/** Tests that the transfers completed in one event handling iteration are
+ * delivered in one batch, on the device simulated by the null backend. The
+ * transfers take 10ms, all of them are complete before events are handled. */
+static libusb_testlib_result test_transfer_batch_callback(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfers[8];
+	unsigned char buffer[8][64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct timeval tv = { 1, 0 };
+	int submitted = 0, done = 0;
+	int r, i;
+
+	handle = open_null_device(tctx, 10000, &ctx, &result);
+	if (!handle)
+		return result;
+	libusb_set_transfer_batch_callback(handle, transfer_batch_cb, NULL);
+
+	/* the per-transfer callback counts transfers that were not batched */
+	for (i = 0; i < 8; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, 0x81, buffer[i],
+			sizeof(buffer[i]), endpoint_transfer_cb, &done, 1000);
+	}
+
+	batch_calls = 0;
+	batch_transfers = 0;
+	r = libusb_submit_transfers(transfers, 8);
+	if (r > 0)
+		submitted = r;
+	if (r != 8) {
+		libusb_testlib_logf(tctx, "Failed to submit transfers: %d", r);
+		goto out;
+	}
+	msleep(100);
+	while (batch_transfers + done < 8) {
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	if (done != 0 || batch_transfers != 8 || batch_calls != 1) {
+		libusb_testlib_logf(tctx, "%d transfers in %d batches, %d alone",
+			batch_transfers, batch_calls, done);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	while (batch_transfers + done < submitted &&
+	       libusb_handle_events_timeout(ctx, &tv) == LIBUSB_SUCCESS)
+		;
+	for (i = 0; i < 8; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests a pipelined sequence of control writes, some of them without a
+ * data stage, on the device simulated by the null backend. */
+static libusb_testlib_result test_control_write_vec(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_control_write writes[20];
+	unsigned char data[20][32];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int completed;
+	int r, i;
+
+	handle = open_null_device(tctx, 0, &ctx, &result);
+	if (!handle)
+		return result;
+
+	/* more requests than are kept in flight, every fifth one without data */
+	for (i = 0; i < 20; i++) {
+		memset(data[i], i, sizeof(data[i]));
+		writes[i].bmRequestType = LIBUSB_ENDPOINT_OUT |
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+		writes[i].bRequest = 0xa0;
+		writes[i].wValue = (uint16_t)(i * sizeof(data[i]));
+		writes[i].wIndex = 0;
+		writes[i].data = i % 5 ? data[i] : NULL;
+		writes[i].wLength = i % 5 ? (uint16_t)(1 + i) : 0;
+	}
+
+	r = libusb_control_write_vec(handle, writes, 20, &completed, 1000);
+	if (r != LIBUSB_SUCCESS || completed != 20) {
+		libusb_testlib_logf(tctx, "Control writes failed: %d, %d completed",
+			r, completed);
+		goto out;
+	}
+	r = libusb_control_write_vec(handle, writes, 0, &completed, 1000);
+	if (r != LIBUSB_SUCCESS || completed != 0) {
+		libusb_testlib_logf(tctx, "Empty sequence failed: %d", r);
+		goto out;
+	}
+
+	/* an IN request is rejected before anything is submitted */
+	writes[7].bmRequestType |= LIBUSB_ENDPOINT_IN;
+	r = libusb_control_write_vec(handle, writes, 20, &completed, 1000);
+	if (r != LIBUSB_ERROR_INVALID_PARAM || completed != 0) {
+		libusb_testlib_logf(tctx, "IN request accepted: %d, %d completed",
+			r, completed);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests that strings read from the cache of
+ * LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS match the ones read from the
+ * device, on the device simulated by the null backend. */
+static libusb_testlib_result test_string_descriptors(libusb_testlib_ctx * tctx)
+{
+	static const uint8_t indexes[] = { 1, 2, 0, 3, 1 };
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	unsigned char uncached[5][64], cached[5][64];
+	unsigned char single[64];
+	int uncached_results[5], cached_results[5];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int r, pass, i;
+
+	handle = open_null_device(tctx, 0, &ctx, &result);
+	if (!handle)
+		return result;
+
+	/* index 0 is the LANGID table and the device has no string 3 */
+	r = libusb_get_string_descriptors_ascii(handle, indexes, 5,
+		&uncached[0][0], sizeof(uncached[0]), uncached_results);
+	if (r != 3 || uncached_results[2] != LIBUSB_ERROR_INVALID_PARAM ||
+	    uncached_results[3] >= 0) {
+		libusb_testlib_logf(tctx, "Read %d strings uncached", r);
+		goto out;
+	}
+	r = libusb_get_string_descriptor_ascii(handle, 2, single, sizeof(single));
+	if (r != uncached_results[1] || strcmp((char *)single, (char *)uncached[1])) {
+		libusb_testlib_logf(tctx, "Strings read alone and together differ");
+		goto out;
+	}
+
+	/* the first pass fills the cache, the second one is served from it */
+	r = libusb_set_option(ctx, LIBUSB_OPTION_CACHE_STRING_DESCRIPTORS, 1);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to enable the cache: %d", r);
+		goto out;
+	}
+	for (pass = 0; pass < 2; pass++) {
+		memset(cached, 0xff, sizeof(cached));
+		r = libusb_get_string_descriptors_ascii(handle, indexes, 5,
+			&cached[0][0], sizeof(cached[0]), cached_results);
+		if (r != 3) {
+			libusb_testlib_logf(tctx, "Read %d strings in pass %d", r, pass);
+			goto out;
+		}
+		for (i = 0; i < 5; i++) {
+			if (cached_results[i] != uncached_results[i] ||
+			    (cached_results[i] >= 0 &&
+			     strcmp((char *)cached[i], (char *)uncached[i]))) {
+				libusb_testlib_logf(tctx, "String %d differs in pass %d",
+					indexes[i], pass);
+				goto out;
+			}
+		}
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests that the aggregated event descriptor stays the same when the event
+ * sources are rebuilt, with 20 more handles than the event data has room for,
+ * and that it becomes readable when a transfer completes. The transfer takes
+ * 10ms on the device simulated by the null backend. */
+static libusb_testlib_result test_event_fd(libusb_testlib_ctx * tctx)
+{
+#if defined(_WIN32)
+	(void)tctx;
+	return TEST_STATUS_SKIP;
+#else
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	libusb_device_handle * handles[20];
+	struct libusb_transfer * transfer = NULL;
+	unsigned char buffer[64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct timeval tv = { 0, 0 };
+	struct pollfd pollfd;
+	int opened = 0, submitted = 0, done = 0;
+	int fds[3];
+	int r, i;
+
+	handle = open_null_device(tctx, 10000, &ctx, &result);
+	if (!handle)
+		return result;
+
+	r = libusb_get_event_fd(ctx, &fds[0]);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+
+	/* each handle adds an event source, closing them removes them */
+	for (i = 0; i < 20 && r == LIBUSB_SUCCESS; i++) {
+		r = libusb_open(libusb_get_device(handle), &handles[i]);
+		if (r == LIBUSB_SUCCESS)
+			opened++;
+	}
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events_timeout(ctx, &tv);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_get_event_fd(ctx, &fds[1]);
+	while (opened > 0)
+		libusb_close(handles[--opened]);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events_timeout(ctx, &tv);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_get_event_fd(ctx, &fds[2]);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to get the event fd: %d", r);
+		goto out;
+	}
+	if (fds[0] < 0 || fds[1] != fds[0] || fds[2] != fds[0]) {
+		libusb_testlib_logf(tctx, "Event fd changed from %d to %d and %d",
+			fds[0], fds[1], fds[2]);
+		goto out;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, buffer,
+		sizeof(buffer), endpoint_transfer_cb, &done, 1000);
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+		goto out;
+	}
+	submitted = 1;
+	pollfd.fd = fds[0];
+	pollfd.events = POLLIN;
+	r = poll(&pollfd, 1, 2000);
+	if (r != 1 || !(pollfd.revents & POLLIN)) {
+		libusb_testlib_logf(tctx, "Event fd not readable: %d", r);
+		goto out;
+	}
+	r = libusb_handle_events_timeout(ctx, &tv);
+	if (r != LIBUSB_SUCCESS || done != 1) {
+		libusb_testlib_logf(tctx, "Transfer not completed: %d", r);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	tv.tv_sec = 1;
+	while (submitted && !done &&
+	       libusb_handle_events_timeout(ctx, &tv) == LIBUSB_SUCCESS)
+		;
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+#endif
+}
+
+/** Tests wrapping a system device in a context of weak authority */
+static libusb_testlib_result test_wrap_sys_device(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device ** device_list;
+	libusb_device_handle * handle;
+	struct libusb_device_descriptor desc;
+	ssize_t count;
+	int r;
+
+	/* set on a context, the option empties its device list */
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_set_option(ctx, LIBUSB_OPTION_WEAK_AUTHORITY, 1);
+	count = libusb_get_device_list(ctx, &device_list);
+	if (count >= 0)
+		libusb_free_device_list(device_list, 1);
+	libusb_exit(ctx);
+	ctx = NULL;
+	if (r != LIBUSB_SUCCESS || count != 0) {
+		libusb_testlib_logf(tctx, "Listed %d devices with weak authority: %d",
+			(int)count, r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	libusb_set_option(NULL, LIBUSB_OPTION_WEAK_AUTHORITY, 1);
+	r = libusb_init(&ctx);
+	libusb_set_option(NULL, LIBUSB_OPTION_WEAK_AUTHORITY, 0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	count = libusb_get_device_list(ctx, &device_list);
+	if (count >= 0)
+		libusb_free_device_list(device_list, 1);
+	if (count != 0) {
+		libusb_testlib_logf(tctx, "Listed %d devices", (int)count);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* the first simulated device of the null backend, elsewhere not a
+	 * system device handle */
+	r = libusb_wrap_sys_device(ctx, 0, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Not wrapped: %s", libusb_error_name(r));
+		libusb_exit(ctx);
+#if defined(LIBUSB_TESTS_NULL_BACKEND)
+		return TEST_STATUS_FAILURE;
+#else
+		return TEST_STATUS_SKIP;
+#endif
+	}
+
+	r = libusb_get_device_descriptor(libusb_get_device(handle), &desc);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_claim_interface(handle, 0);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_release_interface(handle, 0);
+	libusb_close(handle);
+	libusb_exit(ctx);
+
+	if (r != LIBUSB_SUCCESS || desc.bLength != LIBUSB_DT_DEVICE_SIZE) {
+		libusb_testlib_logf(tctx, "Wrapped device unusable: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Tests allocating, using and freeing transfer buffers with
+ * libusb_dev_buffer_alloc(), on the device simulated by the null backend. */
+static libusb_testlib_result test_dev_buffer(libusb_testlib_ctx * tctx)
+{
+	static const uint32_t flags[] = { 0, LIBUSB_DEV_BUFFER_HUGE_PAGES };
+	/* not a multiple of any page size */
+	const size_t length = 3 * 4096 + 100;
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	unsigned char * buffer;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int transferred;
+	int r, i;
+
+	handle = open_null_device(tctx, 0, &ctx, &result);
+	if (!handle)
+		return result;
+
+	if (libusb_dev_buffer_alloc(handle, 0, 0) != NULL) {
+		libusb_testlib_logf(tctx, "Empty buffer allocated");
+		goto out;
+	}
+	for (i = 0; i < 2; i++) {
+		buffer = libusb_dev_buffer_alloc(handle, length, flags[i]);
+		if (!buffer) {
+			libusb_testlib_logf(tctx, "Failed to allocate with flags %u",
+				flags[i]);
+			goto out;
+		}
+		memset(buffer, i, length);
+		r = libusb_bulk_transfer(handle, 0x01, buffer, (int)length,
+			&transferred, 1000);
+		if (r != LIBUSB_SUCCESS || transferred != (int)length) {
+			libusb_testlib_logf(tctx, "Transfer from the buffer failed: %d", r);
+			libusb_dev_buffer_free(handle, buffer, length);
+			goto out;
+		}
+		r = libusb_dev_buffer_free(handle, buffer, length);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to free with flags %u: %d",
+				flags[i], r);
+			goto out;
+		}
+#if !defined(_WIN32)
+		/* the buffer is looked up by its address, not unmapped again */
+		r = libusb_dev_buffer_free(handle, buffer, length);
+		if (r != LIBUSB_ERROR_INVALID_PARAM) {
+			libusb_testlib_logf(tctx, "Freed twice with flags %u: %d",
+				flags[i], r);
+			goto out;
+		}
+#endif
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests that LIBUSB_OPTION_BUSY_POLL catches completions by spinning and
+ * that the spin counts against the event handling timeout, on the device
+ * simulated by the null backend with a completion latency of 100ms. */
+static libusb_testlib_result test_busy_poll(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfer;
+	struct libusb_context_stats before, after;
+	unsigned char buffer[64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct timeval idle = { 0, 10000 };
+	struct timeval tv = { 1, 0 };
+	int submitted = 0, done = 0;
+	int r;
+
+	handle = open_null_device(tctx, 100000, &ctx, &result);
+	if (!handle)
+		return result;
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, buffer,
+		sizeof(buffer), endpoint_transfer_cb, &done, 0);
+
+	r = libusb_set_option(ctx, LIBUSB_OPTION_COLLECT_STATS, 1);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_set_option(ctx, LIBUSB_OPTION_BUSY_POLL, 200000u);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to set options: %d", r);
+		goto out;
+	}
+
+	/* nothing is spun for without transfers in flight */
+	libusb_get_context_stats(ctx, &before);
+	libusb_handle_events_timeout(ctx, &idle);
+	libusb_get_context_stats(ctx, &after);
+	if (after.busy_poll_time_us != before.busy_poll_time_us) {
+		libusb_testlib_logf(tctx, "Spun on an idle context");
+		goto out;
+	}
+
+	/* the spin outlasts the latency and catches the completion */
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+		goto out;
+	}
+	submitted = 1;
+	libusb_get_context_stats(ctx, &before);
+	while (done < 1) {
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	libusb_get_context_stats(ctx, &after);
+	if (after.busy_poll_completions - before.busy_poll_completions != 1 ||
+	    after.event_completions != before.event_completions) {
+		libusb_testlib_logf(tctx, "Completion not caught by spinning");
+		goto out;
+	}
+
+	/* a timeout of 50ms ends the spin before the completion; a spin
+	 * that ignored the timeout would catch it */
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to resubmit transfer: %d", r);
+		goto out;
+	}
+	submitted = 2;
+	tv.tv_sec = 0;
+	tv.tv_usec = 50000;
+	libusb_get_context_stats(ctx, &before);
+	libusb_handle_events_timeout(ctx, &tv);
+	libusb_get_context_stats(ctx, &after);
+	if (done == 2) {
+		libusb_testlib_logf(tctx, "Transfer completed before its latency");
+		goto out;
+	}
+	if (after.busy_poll_completions != before.busy_poll_completions ||
+	    after.event_completions != before.event_completions) {
+		libusb_testlib_logf(tctx, "Counted a completion that did not happen");
+		goto out;
+	}
+
+	/* without spinning the completion is counted against the wait */
+	r = libusb_set_option(ctx, LIBUSB_OPTION_BUSY_POLL, 0u);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to disable busy polling: %d", r);
+		goto out;
+	}
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	while (done < 2) {
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	libusb_get_context_stats(ctx, &after);
+	if (after.busy_poll_completions != before.busy_poll_completions ||
+	    after.event_completions - before.event_completions != 1) {
+		libusb_testlib_logf(tctx, "Completion not counted against the wait");
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	while (done < submitted &&
+	       libusb_handle_events_timeout(ctx, &tv) == LIBUSB_SUCCESS)
+		;
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+static void LIBUSB_CALL slow_deferred_cb(struct libusb_transfer * transfer)
+{
+	/* event handling is back waiting by the time the flag is set */
+	msleep(100);
+	*(int *)transfer->user_data = 1;
+}
+
+/** Tests that a thread in libusb_handle_events_completed() sees the
+ * completed flag set by a callback run on a callback worker, on the device
+ * simulated by the null backend. Without a wakeup it would only return
+ * after its 60s timeout. */
+static libusb_testlib_result test_deferred_callback_wakeup(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfer;
+	struct libusb_context_stats stats;
+	unsigned char buffer[64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int completed = 0;
+	int r;
+
+	handle = open_null_device(tctx, 0, &ctx, &result);
+	if (!handle)
+		return result;
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, buffer,
+		sizeof(buffer), slow_deferred_cb, &completed, 0);
+
+	r = libusb_set_option(ctx, LIBUSB_OPTION_CALLBACK_WORKERS, 1);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_set_option(ctx, LIBUSB_OPTION_COLLECT_STATS, 1);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+		goto out;
+	}
+
+	while (!completed) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to handle events: %d", r);
+			/* the callback still runs on the worker */
+			while (!completed)
+				msleep(10);
+			goto out;
+		}
+	}
+	libusb_get_context_stats(ctx, &stats);
+	if (stats.wait_time_us >= 30000000) {
+		libusb_testlib_logf(tctx, "Not woken by the deferred callback");
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+#if !defined(_WIN32)
+struct shard_transfer_record {
+	int calls;
+	pthread_t thread;
+};
+
+static void LIBUSB_CALL shard_transfer_cb(struct libusb_transfer * transfer)
+{
+	struct shard_transfer_record * record = transfer->user_data;
+
+	record->calls++;
+	record->thread = pthread_self();
+}
+#endif
+
+/** Tests that two event shards complete the transfers of the handles
+ * assigned to them, on the device simulated by the null backend with a
+ * completion latency of 10ms. Every callback has to run exactly once, on the
+ * shard thread of its handle, and the handles have to be spread over both
+ * shards. */
+static libusb_testlib_result test_event_shards(libusb_testlib_ctx * tctx)
+{
+#if defined(_WIN32)
+	(void)tctx;
+	return TEST_STATUS_SKIP;
+#else
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	libusb_device_handle * handles[4];
+	struct libusb_transfer * transfers[4][4];
+	struct shard_transfer_record records[4][4];
+	unsigned char buffer[4][4][64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int opened = 0, submitted = 0, done;
+	int r, i, j, wait;
+
+	handle = open_null_device(tctx, 10000, &ctx, &result);
+	if (!handle)
+		return result;
+	memset(records, 0, sizeof(records));
+
+	r = libusb_set_option(ctx, LIBUSB_OPTION_EVENT_SHARDS, 2, NULL);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to start event shards: %d", r);
+		goto out;
+	}
+
+	/* handles opened now are spread over the shards */
+	for (i = 0; i < 4; i++) {
+		r = libusb_open(libusb_get_device(handle), &handles[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to open handle %d: %d", i, r);
+			goto out;
+		}
+		opened++;
+	}
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 4; j++) {
+			transfers[i][j] = libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(transfers[i][j], handles[i], 0x81,
+				buffer[i][j], sizeof(buffer[i][j]), shard_transfer_cb,
+				&records[i][j], 1000);
+			r = libusb_submit_transfer(transfers[i][j]);
+			if (r != LIBUSB_SUCCESS) {
+				libusb_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+				libusb_free_transfer(transfers[i][j]);
+				goto out;
+			}
+			submitted++;
+		}
+	}
+
+	/* the shards handle the events without help from this thread */
+	for (wait = 0; wait < 200; wait++) {
+		for (i = 0, done = 0; i < 16; i++)
+			if (records[i / 4][i % 4].calls)
+				done++;
+		if (done == 16)
+			break;
+		msleep(10);
+	}
+	/* give a callback run twice the time to show up */
+	msleep(50);
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 4; j++) {
+			if (records[i][j].calls != 1) {
+				libusb_testlib_logf(tctx,
+					"Callback of transfer %d of handle %d ran %d times",
+					j, i, records[i][j].calls);
+				goto out;
+			}
+			if (pthread_equal(records[i][j].thread, pthread_self()) ||
+			    !pthread_equal(records[i][j].thread, records[i][0].thread)) {
+				libusb_testlib_logf(tctx,
+					"Transfers of handle %d completed on different threads", i);
+				goto out;
+			}
+		}
+	}
+	/* each shard takes the handle opened while it had the fewest */
+	if (pthread_equal(records[0][0].thread, records[1][0].thread) ||
+	    !pthread_equal(records[0][0].thread, records[2][0].thread) ||
+	    !pthread_equal(records[1][0].thread, records[3][0].thread)) {
+		libusb_testlib_logf(tctx, "Handles not spread over the shards");
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	/* transfers still in flight complete or time out on their shard */
+	for (wait = 0; wait < 200; wait++) {
+		for (i = 0, done = 0; i < submitted; i++)
+			if (records[i / 4][i % 4].calls)
+				done++;
+		if (done == submitted)
+			break;
+		msleep(10);
+	}
+	for (i = 0; i < submitted; i++)
+		libusb_free_transfer(transfers[i / 4][i % 4]);
+	while (opened > 0)
+		libusb_close(handles[--opened]);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+#endif
+}
+
+static uint64_t latency_count(const struct libusb_transfer_stats * stats)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < LIBUSB_STATS_LATENCY_BUCKETS; i++)
+		count += stats->latency[i];
+	return count;
+}
+
+/** Tests that the endpoint and device handle statistics add up after
+ * transfers on two endpoints of the device simulated by the null backend,
+ * one of them cancelled. The transfers take 10ms, so that the cancelled one
+ * is still in flight. */
+static libusb_testlib_result test_endpoint_stats(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfers[4];
+	struct libusb_transfer_stats in, out, unused, total;
+	unsigned char buffer[4][64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct timeval tv = { 1, 0 };
+	int submitted = 0, done = 0;
+	int r, i, transferred;
+
+	handle = open_null_device(tctx, 10000, &ctx, &result);
+	if (!handle)
+		return result;
+
+	for (i = 0; i < 4; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, 0x81, buffer[i],
+			sizeof(buffer[i]), endpoint_transfer_cb, &done, 0);
+	}
+	r = libusb_set_option(ctx, LIBUSB_OPTION_COLLECT_STATS, 1);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to collect stats: %d", r);
+		goto out;
+	}
+	for (i = 0; i < 4; i++) {
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+			goto out;
+		}
+		submitted++;
+	}
+	r = libusb_cancel_transfer(transfers[3]);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to cancel transfer: %d", r);
+		goto out;
+	}
+	while (done < submitted) {
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	r = libusb_bulk_transfer(handle, 0x01, buffer[0], 32, &transferred, 1000);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to write: %d", r);
+		goto out;
+	}
+
+	r = libusb_get_endpoint_stats(handle, 0x81, &in);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_get_endpoint_stats(handle, 0x01, &out);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_get_endpoint_stats(handle, 0x82, &unused);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_get_device_handle_stats(handle, &total);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to get stats: %d", r);
+		goto out;
+	}
+	if (in.submitted != 4 || in.completed != 3 || in.cancelled != 1 ||
+	    in.failed || in.timed_out || in.bytes != 3 * 64 ||
+	    latency_count(&in) != 4) {
+		libusb_testlib_logf(tctx,
+			"Endpoint 0x81: %d submitted, %d completed, %d cancelled, %d bytes",
+			(int)in.submitted, (int)in.completed, (int)in.cancelled,
+			(int)in.bytes);
+		goto out;
+	}
+	if (out.submitted != 1 || out.completed != 1 || out.bytes != 32 ||
+	    latency_count(&out) != 1) {
+		libusb_testlib_logf(tctx,
+			"Endpoint 0x01: %d submitted, %d completed, %d bytes",
+			(int)out.submitted, (int)out.completed, (int)out.bytes);
+		goto out;
+	}
+	if (unused.submitted || latency_count(&unused)) {
+		libusb_testlib_logf(tctx, "Counted transfers on endpoint 0x82");
+		goto out;
+	}
+	if (total.submitted != 5 || total.completed != 4 ||
+	    total.cancelled != 1 || total.bytes != 3 * 64 + 32 ||
+	    latency_count(&total) != 5) {
+		libusb_testlib_logf(tctx,
+			"Handle: %d submitted, %d completed, %d bytes",
+			(int)total.submitted, (int)total.completed, (int)total.bytes);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	while (done < submitted &&
+	       libusb_handle_events_timeout(ctx, &tv) == LIBUSB_SUCCESS)
+		;
+	for (i = 0; i < 4; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests that the cached active configuration behind
+ * libusb_get_max_packet_size() is dropped when the configuration changes and
+ * when the device is reset, which leaves the device simulated by the null
+ * backend unconfigured. */
+static libusb_testlib_result test_config_cache(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	libusb_device * dev;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int sizes[4];
+	int r;
+
+	handle = open_null_device(tctx, 0, &ctx, &result);
+	if (!handle)
+		return result;
+	dev = libusb_get_device(handle);
+
+	sizes[0] = libusb_get_max_packet_size(dev, 0x81);
+	r = libusb_set_configuration(handle, 0);
+	sizes[1] = libusb_get_max_packet_size(dev, 0x81);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_set_configuration(handle, 1);
+	sizes[2] = libusb_get_max_packet_size(dev, 0x81);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_reset_device(handle);
+	sizes[3] = libusb_get_max_packet_size(dev, 0x81);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to reconfigure: %d", r);
+		goto out;
+	}
+	if (sizes[0] != 512 || sizes[1] >= 0 || sizes[2] != 512 || sizes[3] >= 0) {
+		libusb_testlib_logf(tctx, "Max packet sizes %d, %d, %d, %d",
+			sizes[0], sizes[1], sizes[2], sizes[3]);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/* the idProduct of the first device of ctx, -1 if there is none */
+static int first_device_pid(libusb_context * ctx)
+{
+	libusb_device ** devs;
+	struct libusb_device_descriptor desc;
+	ssize_t num_devs;
+	int pid = -1;
+
+	num_devs = libusb_get_device_list(ctx, &devs);
+	if (num_devs > 0 && libusb_get_device_descriptor(devs[0], &desc) == 0)
+		pid = desc.idProduct;
+	if (num_devs >= 0)
+		libusb_free_device_list(devs, 1);
+	return pid;
+}
+
+/** Tests that the null backend takes the device descriptor from a matching
+ * device snapshot, and that it stops trusting the entry once the hotplug
+ * simulation has attached the device again, which changes its snapshot
+ * stamp as a new sysfs directory would on Linux. The snapshot is altered to
+ * give the device another idProduct, which tells which descriptor is used. */
+static libusb_testlib_result test_device_snapshot(libusb_testlib_ctx * tctx)
+{
+	static char snapshot_env[] = "LIBUSB_DEVICE_SNAPSHOT=stress_snapshot.tmp";
+	static char snapshot_unset[] = "LIBUSB_DEVICE_SNAPSHOT=";
+	static char hotplug_env[] = "LIBUSB_NULL_HOTPLUG_MS=100";
+	static char hotplug_unset[] = "LIBUSB_NULL_HOTPLUG_MS=";
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	unsigned char * snapshot;
+	size_t length, i;
+	FILE * f;
+	int pid, wait;
+	int r;
+
+	handle = open_null_device(tctx, 0, &ctx, &result);
+	if (!handle)
+		return result;
+	libusb_close(handle);
+	r = libusb_export_device_snapshot(ctx, &snapshot, &length);
+	libusb_exit(ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to export snapshot: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* find the device descriptor and change its idProduct */
+	for (i = 0; i + 12 <= length; i++) {
+		if (snapshot[i] == 18 && snapshot[i + 1] == LIBUSB_DT_DEVICE &&
+		    snapshot[i + 8] == 0x6b && snapshot[i + 9] == 0x1d &&
+		    snapshot[i + 10] == 0x04 && snapshot[i + 11] == 0x01)
+			break;
+	}
+	if (i + 12 > length) {
+		libusb_testlib_logf(tctx, "No device descriptor in the snapshot");
+		libusb_free_device_snapshot(snapshot);
+		return TEST_STATUS_FAILURE;
+	}
+	snapshot[i + 10] = 0x05;
+	f = fopen("stress_snapshot.tmp", "wb");
+	if (f) {
+		if (fwrite(snapshot, 1, length, f) != length)
+			r = LIBUSB_ERROR_IO;
+		if (fclose(f) != 0)
+			r = LIBUSB_ERROR_IO;
+	} else {
+		r = LIBUSB_ERROR_IO;
+	}
+	libusb_free_device_snapshot(snapshot);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to write the snapshot");
+		remove("stress_snapshot.tmp");
+		return TEST_STATUS_FAILURE;
+	}
+
+	putenv(snapshot_env);
+	putenv(hotplug_env);
+	r = libusb_init(&ctx);
+	putenv(hotplug_unset);
+	putenv(snapshot_unset);
+	remove("stress_snapshot.tmp");
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	pid = first_device_pid(ctx);
+	if (pid != 0x0105) {
+		libusb_testlib_logf(tctx, "Snapshot not used, idProduct %04x", pid);
+		goto out;
+	}
+	/* detached after 100ms and attached again after 200ms */
+	for (wait = 0; wait < 150 && pid != 0x0104; wait++) {
+		msleep(20);
+		pid = first_device_pid(ctx);
+	}
+	if (pid != 0x0104) {
+		libusb_testlib_logf(tctx, "Stale snapshot used, idProduct %04x", pid);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests walking the raw active configuration of the device simulated by
+ * the null backend with libusb_next_descriptor() and
+ * libusb_find_descriptor(), and a malformed buffer. */
+static libusb_testlib_result test_descriptor_iterator(libusb_testlib_ctx * tctx)
+{
+	static const unsigned char malformed[] = {
+		LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 2, 0, 1, 0xff, 0, 0, 0,
+		5, 0x24, 1, 2, 3,
+		4, LIBUSB_DT_ENDPOINT, 0x81, 2,
+	};
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_descriptor_iterator iter;
+	struct libusb_descriptor_view view;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	const unsigned char * buffer;
+	int counts[3] = { 0, 0, 0 };
+	int length, r;
+
+	handle = open_null_device(tctx, 0, &ctx, &result);
+	if (!handle)
+		return result;
+
+	length = libusb_get_raw_active_config_descriptor(libusb_get_device(handle),
+		&buffer);
+	if (length < LIBUSB_DT_CONFIG_SIZE || buffer[1] != LIBUSB_DT_CONFIG) {
+		libusb_testlib_logf(tctx, "Failed to get the raw config: %d", length);
+		goto out;
+	}
+
+	/* one configuration, two altsettings and four endpoints */
+	libusb_init_descriptor_iterator(&iter, buffer, length);
+	while ((r = libusb_next_descriptor(&iter, &view)) == 1) {
+		if (view.bDescriptorType == LIBUSB_DT_CONFIG)
+			counts[0]++;
+		else if (view.bDescriptorType == LIBUSB_DT_INTERFACE)
+			counts[1]++;
+		else if (view.bDescriptorType == LIBUSB_DT_ENDPOINT)
+			counts[2]++;
+		if (view.bDescriptorType == LIBUSB_DT_ENDPOINT &&
+		    view.data[2] == 0x83 &&
+		    (view.interface_number != 0 || view.altsetting != 1 ||
+		     view.endpoint_address != 0x83)) {
+			libusb_testlib_logf(tctx, "Endpoint 0x83 in %d/%d",
+				view.interface_number, view.altsetting);
+			goto out;
+		}
+	}
+	if (r != 0 || counts[0] != 1 || counts[1] != 2 || counts[2] != 4) {
+		libusb_testlib_logf(tctx, "Walked %d, %d, %d descriptors: %d",
+			counts[0], counts[1], counts[2], r);
+		goto out;
+	}
+
+	libusb_init_descriptor_iterator(&iter, buffer, length);
+	r = libusb_find_descriptor(&iter, LIBUSB_DT_ENDPOINT, &view);
+	if (r != 1 || view.data[2] != 0x81 || view.altsetting != 0) {
+		libusb_testlib_logf(tctx, "First endpoint not found: %d", r);
+		goto out;
+	}
+
+	/* a class-specific descriptor is found with its interface, and a
+	 * truncated endpoint descriptor stops the walk for good */
+	libusb_init_descriptor_iterator(&iter, malformed, sizeof(malformed));
+	r = libusb_find_descriptor(&iter, 0x24, &view);
+	if (r != 1 || view.bLength != 5 || view.interface_number != 2 ||
+	    view.endpoint_address != -1) {
+		libusb_testlib_logf(tctx, "Class-specific descriptor not found: %d", r);
+		goto out;
+	}
+	r = libusb_next_descriptor(&iter, &view);
+	if (r != LIBUSB_ERROR_IO || libusb_next_descriptor(&iter, &view) != r) {
+		libusb_testlib_logf(tctx, "Truncated endpoint accepted: %d", r);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests that libusb_get_device_list_changes() reports a departed device
+ * simulated by the null backend and forgets the changes it returned. */
+static libusb_testlib_result test_device_list_changes(libusb_testlib_ctx * tctx)
+{
+	static char hotplug_env[] = "LIBUSB_NULL_HOTPLUG_MS=50";
+	static char hotplug_unset[] = "LIBUSB_NULL_HOTPLUG_MS=";
+	libusb_context * ctx = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_device_list_change * changes = NULL;
+	uint32_t generation, start;
+	ssize_t count = 0;
+	int wait;
+	int r;
+
+	putenv(hotplug_env);
+	r = libusb_init(&ctx);
+	putenv(hotplug_unset);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	start = generation = libusb_get_device_list_generation(ctx);
+	for (wait = 0; wait < 100 && count == 0; wait++) {
+		msleep(20);
+		count = libusb_get_device_list_changes(ctx, &generation, &changes);
+	}
+	if (count == LIBUSB_ERROR_NOT_SUPPORTED) {
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+	if (count <= 0 || changes[0].event != LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		libusb_testlib_logf(tctx, "Departure not reported: %d", (int)count);
+		goto out;
+	}
+	libusb_free_device_list_changes(changes, count);
+
+	/* the returned changes no longer hold their devices */
+	count = libusb_get_device_list_changes(ctx, &start, &changes);
+	if (count != LIBUSB_ERROR_OVERFLOW) {
+		libusb_testlib_logf(tctx, "Returned changes reported again: %d",
+			(int)count);
+		if (count > 0)
+			libusb_free_device_list_changes(changes, count);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_exit(ctx);
+	return result;
+}
+
 /* Fill in the list of tests. */
 static const libusb_testlib_test tests[] = {
 	{"init_and_exit", &test_init_and_exit},
 	{"get_device_list", &test_get_device_list},
 	{"many_device_lists", &test_many_device_lists},
 	{"default_context_change", &test_default_context_change},
+	{"transfer_pool", &test_transfer_pool},
+	{"event_thread", &test_event_thread},
+	{"callback_workers", &test_callback_workers},
+	{"defer_device_discovery", &test_defer_device_discovery},
+	{"bulk_streams", &test_bulk_streams},
+	{"cancel_endpoint_transfers", &test_cancel_endpoint_transfers},
+	{"transfer_batch_callback", &test_transfer_batch_callback},
+	{"event_fd", &test_event_fd},
+	{"wrap_sys_device", &test_wrap_sys_device},
+	{"control_write_vec", &test_control_write_vec},
+	{"string_descriptors", &test_string_descriptors},
+	{"dev_buffer", &test_dev_buffer},
+	{"busy_poll", &test_busy_poll},
+	{"deferred_callback_wakeup", &test_deferred_callback_wakeup},
+	{"event_shards", &test_event_shards},
+	{"endpoint_stats", &test_endpoint_stats},
+	{"config_cache", &test_config_cache},
+	{"device_snapshot", &test_device_snapshot},
+	{"descriptor_iterator", &test_descriptor_iterator},
+	{"device_list_changes", &test_device_list_changes},
 	LIBUSB_NULL_TEST
 };
 